@@ -3,42 +3,420 @@
 
 #include <glm/glm.hpp>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <string>
-#include <fstream>
-#include <sstream>
 #include <iostream>
 #include <cassert>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
 
 #define LOG_LOCATION_ERRORS 0
 
+// Process wide table of uniform and subroutine names. Handles register their
+// name once (usually at static init) and get a dense id; every CShader resolves
+// all registered ids against its reflected interface right after linking, so
+// setting a uniform through a handle is an array index and a glUniform* call.
+class CUniformRegistry
+{
+public:
+    enum EKind
+    {
+        kUniform,
+        kSubroutineUniform,
+        kSubroutine,
+        kKindsCount
+    };
+
+    struct SEntry
+    {
+        std::string name;
+        GLenum glType; // expected GL type of a kUniform, 0 - don't check
+    };
+
+    static int Register(EKind kind, const std::string& name, GLenum glType = 0)
+    {
+        std::vector<SEntry>& entries = Entries(kind);
+        entries.push_back({name, glType});
+        return (int)entries.size() - 1;
+    }
+
+    static std::vector<SEntry>& Entries(EKind kind)
+    {
+        static std::array<std::vector<SEntry>, kKindsCount> entries;
+        return entries[kind];
+    }
+
+    // string based uniform lookups since the last reset. Hot paths use handles
+    // only, so in steady state it should read zero every frame.
+    static unsigned int& Lookups()
+    {
+        static unsigned int lookups = 0;
+        return lookups;
+    }
+};
+
+// On-disk cache of linked program binaries. A program is keyed by a hash of
+// its final stage sources, defines included, and of the driver strings, so
+// editing a shader or updating the driver misses and compiles from source.
+class CProgramCache
+{
+public:
+    // where binaries go, empty disables the cache
+    static std::string& Directory()
+    {
+        static std::string dir = "shader_cache";
+        return dir;
+    }
+
+    // programs restored from the cache (warm) and compiled (cold) so far
+    struct SStats
+    {
+        unsigned int warm{0};
+        unsigned int cold{0};
+        float warmMs{0.0f};
+        float coldMs{0.0f};
+    };
+
+    static SStats& Stats()
+    {
+        static SStats stats;
+        return stats;
+    }
+
+    static bool Enabled()
+    {
+        static const bool supported = []() {
+            GLint formats = 0;
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+            return formats > 0;
+        }();
+        return supported && !Directory().empty();
+    }
+
+    // FNV-1a, seeded with the driver strings
+    static uint64_t Key(const std::vector<std::pair<GLenum, std::string>>& stages)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](const void* data, size_t size) {
+            const unsigned char* bytes = (const unsigned char*)data;
+            for (size_t i = 0; i < size; ++i)
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+        };
+
+        const GLenum driver[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+        for (GLenum name : driver)
+        {
+            const char* str = (const char*)glGetString(name);
+            if (str)
+                mix(str, strlen(str) + 1);
+        }
+        for (const auto& stage : stages)
+        {
+            mix(&stage.first, sizeof(stage.first));
+            mix(stage.second.data(), stage.second.size() + 1);
+        }
+        return hash;
+    }
+
+    // false if there is no usable binary, program is left unlinked then
+    static bool Load(GLuint program, uint64_t key)
+    {
+        FILE* f = fopen(Path(key).c_str(), "rb");
+        if (!f)
+            return false;
+
+        GLenum format = 0;
+        std::vector<char> binary;
+        fseek(f, 0, SEEK_END);
+        const long size = ftell(f) - (long)sizeof(format);
+        fseek(f, 0, SEEK_SET);
+        bool read = size > 0 && fread(&format, sizeof(format), 1, f) == 1;
+        if (read)
+        {
+            binary.resize(size);
+            read = fread(binary.data(), 1, size, f) == (size_t)size;
+        }
+        fclose(f);
+        if (!read)
+            return false;
+
+        // a driver may still reject its own binary, e.g. after a settings change
+        glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+        GLint linked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        return linked;
+    }
+
+    static void Store(GLuint program, uint64_t key)
+    {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return;
+
+        GLenum format = 0;
+        std::vector<char> binary(length);
+        glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+        mkdir(Directory().c_str(), 0755);
+        // written aside and renamed, an interrupted write leaves no partial file
+        const std::string path = Path(key);
+        const std::string tmpPath = path + ".tmp";
+        FILE* f = fopen(tmpPath.c_str(), "wb");
+        if (!f)
+        {
+            std::cout << "ERROR: can't write program cache to " << Directory() << std::endl;
+            return;
+        }
+        fwrite(&format, sizeof(format), 1, f);
+        fwrite(binary.data(), 1, binary.size(), f);
+        bool written = !ferror(f);
+        written = fclose(f) == 0 && written;
+        if (!written)
+        {
+            std::cout << "ERROR: failed writing program cache " << tmpPath << std::endl;
+            remove(tmpPath.c_str());
+            return;
+        }
+        rename(tmpPath.c_str(), path.c_str());
+    }
+
+private:
+    static std::string Path(uint64_t key)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)key);
+        return Directory() + name;
+    }
+};
+
+// GL_KHR_parallel_shader_compile: compiles and links run on driver threads
+// and their completion can be polled without blocking
+struct SParallelShaderCompile
+{
+    static const GLenum kCompletionStatus = 0x91B1; // GL_COMPLETION_STATUS_KHR
+
+    static bool Supported()
+    {
+        static const bool supported = init();
+        return supported;
+    }
+
+private:
+    static bool init()
+    {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; ++i)
+        {
+            const char* name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+            if (!name || (strcmp(name, "GL_KHR_parallel_shader_compile") && strcmp(name, "GL_ARB_parallel_shader_compile")))
+                continue;
+
+            // not part of the gl3w core profile, so it is fetched here. Let the
+            // driver use as many threads as it wants.
+            using TMaxThreads = void (*)(GLuint);
+            TMaxThreads maxThreads = (TMaxThreads)gl3wGetProcAddress("glMaxShaderCompilerThreadsKHR");
+            if (!maxThreads)
+                maxThreads = (TMaxThreads)gl3wGetProcAddress("glMaxShaderCompilerThreadsARB");
+            if (maxThreads)
+                maxThreads(0xFFFFFFFF);
+            return true;
+        }
+        return false;
+    }
+};
+
+template <typename T> struct SUniformGLType { static const GLenum value = 0; };
+template <> struct SUniformGLType<bool> { static const GLenum value = GL_BOOL; };
+template <> struct SUniformGLType<float> { static const GLenum value = GL_FLOAT; };
+template <> struct SUniformGLType<glm::vec2> { static const GLenum value = GL_FLOAT_VEC2; };
+template <> struct SUniformGLType<glm::vec3> { static const GLenum value = GL_FLOAT_VEC3; };
+template <> struct SUniformGLType<glm::vec4> { static const GLenum value = GL_FLOAT_VEC4; };
+template <> struct SUniformGLType<glm::mat3> { static const GLenum value = GL_FLOAT_MAT3; };
+template <> struct SUniformGLType<glm::mat4> { static const GLenum value = GL_FLOAT_MAT4; };
+// int is left unchecked: it is used both for GL_INT and for every sampler type
+
+// typed handle of a uniform by name, valid for every CShader
+template <typename T>
+class TUniform
+{
+public:
+    explicit TUniform(const char* name)
+        : m_id(CUniformRegistry::Register(CUniformRegistry::kUniform, name, SUniformGLType<T>::value))
+    {}
+
+    int id() const { return m_id; }
+
+private:
+    template <typename> friend class TUniformArray;
+    struct SFromId {};
+    TUniform(SFromId, int id) : m_id(id) {}
+
+    int m_id;
+};
+
+// handles of "fmt" formatted with 0..count-1, e.g. ("pointLights[%d].pos", 6)
+template <typename T>
+class TUniformArray
+{
+public:
+    TUniformArray(const char* fmt, int count) : m_count(count)
+    {
+        char buff[128];
+        for (int i = 0; i < count; ++i)
+        {
+            snprintf(buff, sizeof(buff), fmt, i);
+            const int id = CUniformRegistry::Register(CUniformRegistry::kUniform, buff, SUniformGLType<T>::value);
+            if (i == 0)
+                m_firstId = id;
+            assert(id == m_firstId + i && "array handles should be registered contiguously");
+        }
+    }
+
+    TUniform<T> operator[](int i) const
+    {
+        assert(i >= 0 && i < m_count && "uniform array index out of range");
+        return TUniform<T>(typename TUniform<T>::SFromId(), m_firstId + i);
+    }
+
+    int size() const { return m_count; }
+
+private:
+    int m_firstId{0};
+    int m_count{0};
+};
+
+// subroutine uniform (selector) and subroutine function handles
+template <CUniformRegistry::EKind Kind>
+class TSubroutineHandle
+{
+public:
+    explicit TSubroutineHandle(const char* name)
+        : m_id(CUniformRegistry::Register(Kind, name))
+    {}
+
+    int id() const { return m_id; }
+
+private:
+    int m_id;
+};
+using TSubroutineUniform = TSubroutineHandle<CUniformRegistry::kSubroutineUniform>;
+using TSubroutine = TSubroutineHandle<CUniformRegistry::kSubroutine>;
+
+// subroutine choice for one stage, applied with CShader::setSubroutines()
+struct SSubroutineSelection
+{
+    static const int kMaxSelections = 16;
+
+    void select(const TSubroutineUniform& uniform, const TSubroutine& subroutine)
+    {
+        assert(count < kMaxSelections && "too many subroutine selections");
+        picks[count++] = {uniform.id(), subroutine.id()};
+    }
+
+    std::array<std::pair<int, int>, kMaxSelections> picks;
+    int count{0};
+};
+
+template <typename T> struct TNonDeduced { using type = T; };
+
 class CShader
 {
 public:
     unsigned int ID;
-    CShader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr)
+    // defines are inserted right after the #version line of every stage,
+    // e.g. "#define MULTI_DRAW\n". A deferred program is only submitted to the
+    // driver, finish() has to run before anything else touches it, and the
+    // paths have to outlive that.
+    CShader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr, const char* defines = nullptr, bool deferred = false)
     {
-        unsigned int vertex, fragment, geometry;
-        vertex = loadShader(GL_VERTEX_SHADER, vertexPath);
-        fragment = loadShader(GL_FRAGMENT_SHADER, fragmentPath);
+        std::vector<std::pair<GLenum, const char*>> stages = {{GL_VERTEX_SHADER, vertexPath}, {GL_FRAGMENT_SHADER, fragmentPath}};
+        if (geometryPath)
+            stages.push_back({GL_GEOMETRY_SHADER, geometryPath});
+        submit(stages, defines);
+        if (!deferred)
+            finish();
+    }
 
-        ID = glCreateProgram();
-        glAttachShader(ID, vertex);
-        glAttachShader(ID, fragment);
+    // single stage program, stage has to be GL_COMPUTE_SHADER
+    CShader(GLenum stage, const char* computePath, const char* defines = nullptr, bool deferred = false)
+    {
+        assert(stage == GL_COMPUTE_SHADER && "only compute programs have a single stage");
+        submit({{stage, computePath}}, defines);
+        if (!deferred)
+            finish();
+    }
 
-        if (geometryPath)
+    bool pending() const { return m_pending.active; }
+
+    // whether finish() would return without waiting for the driver. Without
+    // parallel compile there is no way to ask, callers give the driver a
+    // frame before finishing.
+    bool ready() const
+    {
+        if (!m_pending.active || !SParallelShaderCompile::Supported())
+            return true;
+        GLint done = GL_FALSE;
+        glGetProgramiv(ID, SParallelShaderCompile::kCompletionStatus, &done);
+        return done;
+    }
+
+    // finish() once ready(), for callers polling a submission every frame.
+    // Returns whether the program is done.
+    bool finishIfReady()
+    {
+        if (!ready())
+            return false;
+        finish();
+        return true;
+    }
+
+    // checks the link, stores the binary and reflects the interface of a
+    // submitted program; no-op once done
+    void finish()
+    {
+        if (!m_pending.active)
+            return;
+        m_pending.active = false;
+
+        const auto start = std::chrono::steady_clock::now();
+        if (!m_pending.warm)
         {
-            geometry = loadShader(GL_GEOMETRY_SHADER, geometryPath);
-            glAttachShader(ID, geometry);
+            for (size_t i = 0; i < m_pending.shaders.size(); ++i)
+                checkCompileErrors(m_pending.shaders[i].first, shaderTypeToStr(m_pending.shaders[i].second), m_pending.paths[i]);
+            checkCompileErrors(ID, "PROGRAM");
+            // delete the shaders as they're linked into our program now and no longer necessery
+            for (const auto& shader : m_pending.shaders)
+                glDeleteShader(shader.first);
+
+            if (CProgramCache::Enabled())
+                CProgramCache::Store(ID, m_pending.key);
         }
+        reflect();
 
-        glLinkProgram(ID);
-        checkCompileErrors(ID, "PROGRAM");
-        // delete the shaders as they're linked into our program now and no longer necessery
-        glDeleteShader(vertex);
-        glDeleteShader(fragment);
+        // time this thread spent on the program, waiting for the driver
+        // included, but not the frames it compiled in the background
+        const float ms = m_pending.submitMs + std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        CProgramCache::SStats& stats = CProgramCache::Stats();
+        (m_pending.warm ? stats.warm : stats.cold) += 1;
+        (m_pending.warm ? stats.warmMs : stats.coldMs) += ms;
 
-        if (geometryPath)
-            glDeleteShader(geometry);
+        char timing[32];
+        snprintf(timing, sizeof(timing), ": %s %.2f ms", m_pending.warm ? "warm" : "cold", ms);
+        std::cout << "Program";
+        for (const char* path : m_pending.paths)
+            std::cout << " " << path;
+        std::cout << timing << std::endl;
+
+        m_pending = SPending();
     }
 	
     // activate the shader
@@ -105,6 +483,98 @@ public:
     {
         glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE, &mat[0][0]);
     }
+    // ------------------------------------------------------------------------
+    // handle based setters, no string work and no GL queries
+    template <typename T>
+    void set(const TUniform<T>& uniform, const typename TNonDeduced<T>::type& value) const
+    {
+        upload(location(uniform), value);
+    }
+    void set(const TUniform<glm::vec3>& uniform, float x, float y, float z) const
+    {
+        glUniform3f(location(uniform), x, y, z);
+    }
+    template <typename T>
+    GLint location(const TUniform<T>& uniform) const
+    {
+        const int id = uniform.id();
+        if (id >= (int)m_locations.size())
+            resolveLocations(); // handle registered after this program was linked
+        return m_locations[id];
+    }
+    // ------------------------------------------------------------------------
+    // reflected interface
+    struct SUniformInfo
+    {
+        GLint location;
+        GLenum type;
+    };
+    struct SUniformBlockInfo
+    {
+        GLuint index;
+        GLint dataSize;
+    };
+    const std::unordered_map<std::string, SUniformInfo>& uniforms() const { return m_uniforms; }
+    const std::unordered_map<std::string, SUniformBlockInfo>& uniformBlocks() const { return m_blocks; }
+    const std::unordered_map<std::string, SUniformBlockInfo>& storageBlocks() const { return m_storageBlocks; }
+
+    // returns false if the program has no active block with this name
+    bool bindUniformBlock(const std::string& name, GLuint binding) const
+    {
+        auto it = m_blocks.find(name);
+        if (it == m_blocks.end())
+            return false;
+        glUniformBlockBinding(ID, it->second.index, binding);
+        return true;
+    }
+
+    // returns false if the program has no active shader storage block with this name
+    bool bindStorageBlock(const std::string& name, GLuint binding) const
+    {
+        auto it = m_storageBlocks.find(name);
+        if (it == m_storageBlocks.end())
+            return false;
+        glShaderStorageBlockBinding(ID, it->second.index, binding);
+        return true;
+    }
+    // ------------------------------------------------------------------------
+    GLsizei subroutineLocationsCount(GLenum programType) const
+    {
+        return m_subroutines[stageIndex(programType)].locationsCount;
+    }
+
+    // resolves a selection into the array expected by glUniformSubroutinesuiv,
+    // indices has to hold subroutineLocationsCount(programType) entries
+    void subroutineIndices(GLenum programType, const SSubroutineSelection& selection, GLuint* indices) const
+    {
+        const SStageSubroutines& stage = m_subroutines[stageIndex(programType)];
+        if (stage.uniformIds.size() < CUniformRegistry::Entries(CUniformRegistry::kSubroutineUniform).size() ||
+            stage.subroutineIds.size() < CUniformRegistry::Entries(CUniformRegistry::kSubroutine).size())
+            resolveSubroutines();
+
+        assert(stage.locationsCount && "no subroutine uniforms");
+        std::fill(indices, indices + stage.locationsCount, 0);
+        for (int i = 0; i < selection.count; ++i)
+        {
+            const GLint selectorLoc = stage.uniformIds[selection.picks[i].first];
+            const GLuint index = stage.subroutineIds[selection.picks[i].second];
+            assert(selectorLoc > -1 && "bad subroutine uniform location");
+            assert(index != GL_INVALID_INDEX && "bad subroutine index");
+            indices[selectorLoc] = index;
+        }
+    }
+
+    void setSubroutineIndices(GLenum programType, const GLuint* indices) const
+    {
+        glUniformSubroutinesuiv(programType, subroutineLocationsCount(programType), indices);
+    }
+
+    void setSubroutines(GLenum programType, const SSubroutineSelection& selection) const
+    {
+        std::array<GLuint, kMaxSubroutineLocations> indices;
+        subroutineIndices(programType, selection, indices.data());
+        setSubroutineIndices(programType, indices.data());
+    }
     // ------------------------------------------------------------------------
 		
 		using TSubroutineTypeToInstance = std::vector<std::pair<std::string, std::string>>;
@@ -122,6 +592,7 @@ public:
 			{
 				GLint selectorLoc = glGetSubroutineUniformLocation(ID, programType, p.first.c_str());
 				GLuint index = glGetSubroutineIndex(ID, programType, p.second.c_str());
+				CUniformRegistry::Lookups() += 2;
 				if (selectorLoc <= -1)
 				{
 					std::cout << p.first << ":" << selectorLoc << " " << p.second << ":" << index << std::endl;
@@ -138,6 +609,191 @@ public:
 		}
 
 	private:
+		static const int kMaxSubroutineLocations = 32;
+
+		struct SStageSubroutines
+		{
+			GLint locationsCount{0};
+			std::unordered_map<std::string, GLint> uniformLocations;
+			std::unordered_map<std::string, GLuint> subroutineIndices;
+			// resolved registry ids
+			std::vector<GLint> uniformIds;
+			std::vector<GLuint> subroutineIds;
+		};
+
+		std::unordered_map<std::string, SUniformInfo> m_uniforms;
+		std::unordered_map<std::string, SUniformBlockInfo> m_blocks;
+		std::unordered_map<std::string, SUniformBlockInfo> m_storageBlocks;
+		mutable std::array<SStageSubroutines, 3> m_subroutines; // id tables are a lazily grown cache
+		mutable std::vector<GLint> m_locations; // indexed by uniform handle id
+
+		// state between submit() and finish()
+		struct SPending
+		{
+			bool active{false};
+			bool warm{false};
+			uint64_t key{0};
+			float submitMs{0.0f};
+			std::vector<std::pair<GLuint, GLenum>> shaders; // with their stage
+			std::vector<const char*> paths;
+		};
+		SPending m_pending;
+
+		static int stageIndex(GLenum programType)
+		{
+			switch (programType)
+			{
+				case GL_VERTEX_SHADER:
+					return 0;
+				case GL_GEOMETRY_SHADER:
+					return 1;
+				case GL_FRAGMENT_SHADER:
+					return 2;
+				default:
+					assert(0 && "unsupported subroutine stage");
+					return 2;
+			}
+		}
+
+		std::string resourceName(GLenum programInterface, GLuint index, GLint nameLength) const
+		{
+			std::string name(nameLength, '\0');
+			glGetProgramResourceName(ID, programInterface, index, nameLength, nullptr, &name[0]);
+			name.resize(nameLength - 1); // drop terminator
+			return name;
+		}
+
+		// queries the whole active interface once, after linking
+		void reflect()
+		{
+			GLint count = 0;
+			glGetProgramInterfaceiv(ID, GL_UNIFORM, GL_ACTIVE_RESOURCES, &count);
+			for (GLint i = 0; i < count; ++i)
+			{
+				const GLenum props[] = {GL_NAME_LENGTH, GL_TYPE, GL_LOCATION, GL_ARRAY_SIZE, GL_BLOCK_INDEX};
+				GLint values[5];
+				glGetProgramResourceiv(ID, GL_UNIFORM, i, 5, props, 5, nullptr, values);
+				if (values[4] != -1)
+					continue; // member of a uniform block, has no location
+
+				const std::string name = resourceName(GL_UNIFORM, i, values[0]);
+				const GLenum type = values[1];
+				const GLint loc = values[2];
+				const GLint arraySize = values[3];
+
+				m_uniforms[name] = {loc, type};
+
+				// arrays are reported once as "name[0]", expand every element
+				const size_t bracket = name.size() > 3 ? name.rfind("[0]") : std::string::npos;
+				if (bracket != std::string::npos && bracket + 3 == name.size())
+				{
+					const std::string base = name.substr(0, bracket);
+					m_uniforms[base] = {loc, type};
+					for (GLint k = 1; k < arraySize; ++k)
+						m_uniforms[base + "[" + std::to_string(k) + "]"] = {loc + k, type};
+				}
+			}
+
+			glGetProgramInterfaceiv(ID, GL_UNIFORM_BLOCK, GL_ACTIVE_RESOURCES, &count);
+			for (GLint i = 0; i < count; ++i)
+			{
+				const GLenum props[] = {GL_NAME_LENGTH, GL_BUFFER_DATA_SIZE};
+				GLint values[2];
+				glGetProgramResourceiv(ID, GL_UNIFORM_BLOCK, i, 2, props, 2, nullptr, values);
+				m_blocks[resourceName(GL_UNIFORM_BLOCK, i, values[0])] = {(GLuint)i, values[1]};
+			}
+
+			glGetProgramInterfaceiv(ID, GL_SHADER_STORAGE_BLOCK, GL_ACTIVE_RESOURCES, &count);
+			for (GLint i = 0; i < count; ++i)
+			{
+				const GLenum props[] = {GL_NAME_LENGTH, GL_BUFFER_DATA_SIZE};
+				GLint values[2];
+				glGetProgramResourceiv(ID, GL_SHADER_STORAGE_BLOCK, i, 2, props, 2, nullptr, values);
+				m_storageBlocks[resourceName(GL_SHADER_STORAGE_BLOCK, i, values[0])] = {(GLuint)i, values[1]};
+			}
+
+			const GLenum stages[] = {GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER};
+			const GLenum uniformInterfaces[] = {GL_VERTEX_SUBROUTINE_UNIFORM, GL_GEOMETRY_SUBROUTINE_UNIFORM, GL_FRAGMENT_SUBROUTINE_UNIFORM};
+			const GLenum subroutineInterfaces[] = {GL_VERTEX_SUBROUTINE, GL_GEOMETRY_SUBROUTINE, GL_FRAGMENT_SUBROUTINE};
+			for (int s = 0; s < 3; ++s)
+			{
+				SStageSubroutines& stage = m_subroutines[s];
+				glGetProgramStageiv(ID, stages[s], GL_ACTIVE_SUBROUTINE_UNIFORM_LOCATIONS, &stage.locationsCount);
+				assert(stage.locationsCount <= kMaxSubroutineLocations && "too many subroutine uniform locations");
+
+				glGetProgramInterfaceiv(ID, uniformInterfaces[s], GL_ACTIVE_RESOURCES, &count);
+				for (GLint i = 0; i < count; ++i)
+				{
+					const GLenum props[] = {GL_NAME_LENGTH, GL_LOCATION};
+					GLint values[2];
+					glGetProgramResourceiv(ID, uniformInterfaces[s], i, 2, props, 2, nullptr, values);
+					stage.uniformLocations[resourceName(uniformInterfaces[s], i, values[0])] = values[1];
+				}
+
+				// resource index of a subroutine is its subroutine index
+				glGetProgramInterfaceiv(ID, subroutineInterfaces[s], GL_ACTIVE_RESOURCES, &count);
+				for (GLint i = 0; i < count; ++i)
+				{
+					const GLenum props[] = {GL_NAME_LENGTH};
+					GLint nameLength = 0;
+					glGetProgramResourceiv(ID, subroutineInterfaces[s], i, 1, props, 1, nullptr, &nameLength);
+					stage.subroutineIndices[resourceName(subroutineInterfaces[s], i, nameLength)] = (GLuint)i;
+				}
+			}
+
+			resolveLocations();
+			resolveSubroutines();
+		}
+
+		// maps every registered uniform handle to this program's location
+		void resolveLocations() const
+		{
+			const std::vector<CUniformRegistry::SEntry>& entries = CUniformRegistry::Entries(CUniformRegistry::kUniform);
+			for (size_t id = m_locations.size(); id < entries.size(); ++id)
+			{
+				GLint loc = -1;
+				auto it = m_uniforms.find(entries[id].name);
+				if (it != m_uniforms.end())
+				{
+					loc = it->second.location;
+					if (entries[id].glType && entries[id].glType != it->second.type)
+						std::cout << "ERROR: uniform type mismatch: " << entries[id].name << std::endl;
+				}
+				m_locations.push_back(loc);
+				++CUniformRegistry::Lookups();
+			}
+		}
+
+		void resolveSubroutines() const
+		{
+			const std::vector<CUniformRegistry::SEntry>& uniforms = CUniformRegistry::Entries(CUniformRegistry::kSubroutineUniform);
+			const std::vector<CUniformRegistry::SEntry>& subroutines = CUniformRegistry::Entries(CUniformRegistry::kSubroutine);
+			for (SStageSubroutines& stage : m_subroutines)
+			{
+				for (size_t id = stage.uniformIds.size(); id < uniforms.size(); ++id)
+				{
+					auto it = stage.uniformLocations.find(uniforms[id].name);
+					stage.uniformIds.push_back(it != stage.uniformLocations.end() ? it->second : -1);
+					++CUniformRegistry::Lookups();
+				}
+				for (size_t id = stage.subroutineIds.size(); id < subroutines.size(); ++id)
+				{
+					auto it = stage.subroutineIndices.find(subroutines[id].name);
+					stage.subroutineIds.push_back(it != stage.subroutineIndices.end() ? it->second : GL_INVALID_INDEX);
+					++CUniformRegistry::Lookups();
+				}
+			}
+		}
+
+		static void upload(GLint loc, bool value) { glUniform1i(loc, (int)value); }
+		static void upload(GLint loc, int value) { glUniform1i(loc, value); }
+		static void upload(GLint loc, float value) { glUniform1f(loc, value); }
+		static void upload(GLint loc, const glm::vec2& value) { glUniform2fv(loc, 1, &value[0]); }
+		static void upload(GLint loc, const glm::vec3& value) { glUniform3fv(loc, 1, &value[0]); }
+		static void upload(GLint loc, const glm::vec4& value) { glUniform4fv(loc, 1, &value[0]); }
+		static void upload(GLint loc, const glm::mat3& value) { glUniformMatrix3fv(loc, 1, GL_FALSE, &value[0][0]); }
+		static void upload(GLint loc, const glm::mat4& value) { glUniformMatrix4fv(loc, 1, GL_FALSE, &value[0][0]); }
+
 		std::string shaderTypeToStr(GLenum type)
 		{
 			switch (type)
@@ -151,49 +807,84 @@ public:
 				case GL_GEOMETRY_SHADER:
 					return "GEOMETRY";
 					break;
+				case GL_COMPUTE_SHADER:
+					return "COMPUTE";
+					break;
 				default:
 					assert(0 && "no shader type str");
 					break;
 			}
 		}
 
-		GLuint loadShader(GLenum type, const char* path)
+		// restores the program from the cache, or queues compile and link on a
+		// miss. Nothing here waits for the driver, finish() does.
+		void submit(const std::vector<std::pair<GLenum, const char*>>& stages, const char* defines)
 		{
-			GLuint res = 0;
+			const auto start = std::chrono::steady_clock::now();
+			m_pending.active = true;
 
-			// 1. retrieve the source code from filePath
-			std::string code;
-			std::ifstream file;
-			
-			// ensure ifstream objects can throw exceptions:
-			file.exceptions (std::ifstream::failbit | std::ifstream::badbit);
-			try 
+			std::vector<std::pair<GLenum, std::string>> sources;
+			for (const auto& stage : stages)
 			{
-					// open files
-					file.open(path);
-					std::stringstream stream;
-					// read file's buffer contents into streams
-					stream << file.rdbuf();
-					// close file handlers
-					file.close();
-					// convert stream into string
-					code = stream.str();
+				sources.push_back({stage.first, loadSource(stage.second, defines)});
+				m_pending.paths.push_back(stage.second);
 			}
-			catch (std::ifstream::failure e)
+
+			const bool useCache = CProgramCache::Enabled();
+			m_pending.key = useCache ? CProgramCache::Key(sources) : 0;
+
+			ID = glCreateProgram();
+			m_pending.warm = useCache && CProgramCache::Load(ID, m_pending.key);
+			if (!m_pending.warm)
 			{
-					std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
+				// a rejected binary may leave the program in an unknown state
+				if (useCache)
+				{
+					glDeleteProgram(ID);
+					ID = glCreateProgram();
+					glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+				}
+
+				for (const auto& source : sources)
+				{
+					m_pending.shaders.push_back({compileShader(source.first, source.second), source.first});
+					glAttachShader(ID, m_pending.shaders.back().first);
+				}
+				glLinkProgram(ID);
+			}
+
+			m_pending.submitMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		// file text with defines inserted after the #version line
+		std::string loadSource(const char* path, const char* defines)
+		{
+			std::string code;
+			FILE* f = fopen(path, "rb");
+			if (f)
+			{
+				fseek(f, 0, SEEK_END);
+				code.resize(ftell(f));
+				fseek(f, 0, SEEK_SET);
+				code.resize(fread(&code[0], 1, code.size(), f));
+				fclose(f);
 			}
-			const char* code_str = code.c_str();
-			//
-			// 2. compile shaders
-			unsigned int vertex, fragment;
-			int success;
-			char infoLog[512];
-			// vertex shader
-			res = glCreateShader(type);
-			glShaderSource(res, 1, &code_str, NULL);
+			else
+				std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ " << path << std::endl;
+
+			// #version has to stay the first line, defines go right after it
+			if (defines && code.compare(0, 8, "#version") == 0)
+				code.insert(code.find('\n') + 1, defines);
+			return code;
+		}
+
+		// errors are checked by finish()
+		GLuint compileShader(GLenum type, const std::string& code)
+		{
+			const char* source = code.c_str();
+			GLuint res = glCreateShader(type);
+			glShaderSource(res, 1, &source, NULL);
 			glCompileShader(res);
-			checkCompileErrors(res, shaderTypeToStr(type), path);
 
 			return res;
 		}
@@ -230,6 +921,7 @@ public:
 		{
 			GLint res = -1;	
 			res = glGetUniformLocation(ID, name.c_str());
+			++CUniformRegistry::Lookups();
 
 #if LOG_LOCATION_ERRORS
 			if (-1 == res)
@@ -57,6 +57,8 @@ class Camera {
   float Height{DEFAULT_HEIGHT};
 
   bool IsPerspective{true};
+  // half the width and height of the orthographic volume
+  float OrthoHalfSize{20.0f};
 
   Camera() { updateCameraVectors(); }
 
@@ -70,7 +72,8 @@ class Camera {
       return glm::perspective(glm::radians(float(FOV)), Width / Height,
                               NearPlane, FarPlane);
     else
-      return glm::ortho(-20.0f, 20.0f, -20.0f, 20.0f, NearPlane, FarPlane);
+      return glm::ortho(-OrthoHalfSize, OrthoHalfSize, -OrthoHalfSize,
+                        OrthoHalfSize, NearPlane, FarPlane);
   }
 
   // Processes input received from any keyboard-like input system. Accepts input
@@ -0,0 +1,257 @@
+#include "culling.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define CULLING_SSE 1
+#endif
+
+void SAABB::Extend(const glm::vec3& p) {
+  for (int i = 0; i < 3; ++i) {
+    min[i] = std::min(min[i], p[i]);
+    max[i] = std::max(max[i], p[i]);
+  }
+}
+
+void SAABB::Extend(const SAABB& b) {
+  Extend(b.min);
+  Extend(b.max);
+}
+
+SAABB SAABB::Transformed(const glm::mat4& m) const {
+  // Arvo: every output axis is the translation plus the extreme of each
+  // column contribution
+  SAABB res;
+  for (int i = 0; i < 3; ++i) {
+    res.min[i] = res.max[i] = m[3][i];
+    for (int j = 0; j < 3; ++j) {
+      const float a = m[j][i] * min[j];
+      const float b = m[j][i] * max[j];
+      res.min[i] += std::min(a, b);
+      res.max[i] += std::max(a, b);
+    }
+  }
+  return res;
+}
+
+void SFrustum::FromMatrix(const glm::mat4& m) {
+  // Gribb/Hartmann, row 3 +- rows 0..2 of the clip matrix
+  for (int p = 0; p < kPlanesCount; ++p) {
+    const int row = p / 2;
+    const float sign = (p % 2) ? -1.0f : 1.0f;
+    nx[p] = m[0][3] + sign * m[0][row];
+    ny[p] = m[1][3] + sign * m[1][row];
+    nz[p] = m[2][3] + sign * m[2][row];
+    d[p] = m[3][3] + sign * m[3][row];
+    ax[p] = std::fabs(nx[p]);
+    ay[p] = std::fabs(ny[p]);
+    az[p] = std::fabs(nz[p]);
+  }
+}
+
+enum ECullResult { kOutside, kIntersects, kInside };
+
+static ECullResult TestBox(const SFrustum& f, const SAABB& box) {
+  const glm::vec3 c = box.Center();
+  const glm::vec3 e = box.Extents();
+
+  ECullResult res = kInside;
+  for (int p = 0; p < SFrustum::kPlanesCount; ++p) {
+    const float dist =
+        f.nx[p] * c[0] + f.ny[p] * c[1] + f.nz[p] * c[2] + f.d[p];
+    const float radius = f.ax[p] * e[0] + f.ay[p] * e[1] + f.az[p] * e[2];
+    if (dist < -radius) return kOutside;
+    if (dist < radius) res = kIntersects;
+  }
+  return res;
+}
+
+bool SFrustum::Intersects(const SAABB& box) const {
+  return TestBox(*this, box) != kOutside;
+}
+
+void CBVH::Build(const std::vector<SAABB>& bounds) {
+  Clear();
+
+  const uint32_t n = bounds.size();
+  if (!n) return;
+
+  m_items.resize(n);
+  std::vector<glm::vec3> centers(n);
+  for (uint32_t i = 0; i < n; ++i) {
+    m_items[i] = i;
+    centers[i] = bounds[i].Center();
+  }
+
+  m_nodes.reserve(2 * (n / kLeafSize + 1));
+  BuildNode(bounds, centers, 0, n);
+
+  for (std::vector<float>* v : {&m_cx, &m_cy, &m_cz, &m_ex, &m_ey, &m_ez})
+    v->assign(n + 3, 0.0f);
+
+  for (uint32_t slot = 0; slot < n; ++slot)
+    SetSlot(slot, bounds[m_items[slot]]);
+}
+
+void CBVH::SetSlot(uint32_t slot, const SAABB& box) {
+  const glm::vec3 c = box.Center();
+  const glm::vec3 e = box.Extents();
+  m_cx[slot] = c[0];
+  m_cy[slot] = c[1];
+  m_cz[slot] = c[2];
+  m_ex[slot] = e[0];
+  m_ey[slot] = e[1];
+  m_ez[slot] = e[2];
+}
+
+void CBVH::Refit(const std::vector<SAABB>& bounds,
+                 const std::vector<uint8_t>& changed) {
+  // children follow their parent, so a reverse walk visits them first
+  std::vector<uint8_t> dirty(m_nodes.size(), 0);
+  for (size_t i = m_nodes.size(); i-- > 0;) {
+    SNode& node = m_nodes[i];
+    if (node.right) {
+      dirty[i] = dirty[i + 1] || dirty[node.right];
+      if (dirty[i]) {
+        node.bounds = m_nodes[i + 1].bounds;
+        node.bounds.Extend(m_nodes[node.right].bounds);
+      }
+      continue;
+    }
+
+    for (uint32_t slot = node.first; slot < node.first + node.count; ++slot)
+      if (changed[m_items[slot]]) dirty[i] = 1;
+    if (!dirty[i]) continue;
+
+    node.bounds = SAABB();
+    for (uint32_t slot = node.first; slot < node.first + node.count; ++slot) {
+      const SAABB& box = bounds[m_items[slot]];
+      node.bounds.Extend(box);
+      SetSlot(slot, box);
+    }
+  }
+}
+
+void CBVH::Clear() {
+  m_nodes.clear();
+  m_items.clear();
+  for (std::vector<float>* v : {&m_cx, &m_cy, &m_cz, &m_ex, &m_ey, &m_ez})
+    v->clear();
+}
+
+uint32_t CBVH::BuildNode(const std::vector<SAABB>& bounds,
+                         const std::vector<glm::vec3>& centers, uint32_t first,
+                         uint32_t count) {
+  const uint32_t index = m_nodes.size();
+  m_nodes.emplace_back();
+
+  SAABB box;
+  SAABB centersBox;
+  for (uint32_t i = first; i < first + count; ++i) {
+    box.Extend(bounds[m_items[i]]);
+    centersBox.Extend(centers[m_items[i]]);
+  }
+  m_nodes[index].bounds = box;
+  m_nodes[index].first = first;
+  m_nodes[index].count = count;
+
+  if (count <= kLeafSize) return index;
+
+  // median split on the longest axis of the centers
+  const glm::vec3 size = centersBox.max - centersBox.min;
+  int axis = 0;
+  if (size[1] > size[axis]) axis = 1;
+  if (size[2] > size[axis]) axis = 2;
+
+  const uint32_t half = count / 2;
+  std::nth_element(m_items.begin() + first, m_items.begin() + first + half,
+                   m_items.begin() + first + count,
+                   [&centers, axis](uint32_t a, uint32_t b) {
+                     return centers[a][axis] < centers[b][axis];
+                   });
+
+  BuildNode(bounds, centers, first, half);
+  const uint32_t right = BuildNode(bounds, centers, first + half, count - half);
+  m_nodes[index].right = right;
+  return index;
+}
+
+void CBVH::Cull(const SFrustum& frustum, std::vector<uint8_t>& visible) const {
+  if (m_nodes.empty()) return;
+
+  uint32_t stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while (top) {
+    const SNode& node = m_nodes[stack[--top]];
+    const ECullResult res = TestBox(frustum, node.bounds);
+    if (res == kOutside) continue;
+
+    if (res == kInside)
+      MarkAll(node, visible);
+    else if (!node.right)
+      CullLeaf(frustum, node, visible);
+    else {
+      stack[top++] = node.right;
+      stack[top++] = &node - m_nodes.data() + 1;
+    }
+  }
+}
+
+void CBVH::MarkAll(const SNode& node, std::vector<uint8_t>& visible) const {
+  for (uint32_t slot = node.first; slot < node.first + node.count; ++slot)
+    visible[m_items[slot]] = 1;
+}
+
+void CBVH::CullLeaf(const SFrustum& f, const SNode& node,
+                    std::vector<uint8_t>& visible) const {
+  const uint32_t end = node.first + node.count;
+
+#if CULLING_SSE
+  const __m128 zero = _mm_setzero_ps();
+  for (uint32_t slot = node.first; slot < end; slot += 4) {
+    const __m128 cx = _mm_loadu_ps(&m_cx[slot]);
+    const __m128 cy = _mm_loadu_ps(&m_cy[slot]);
+    const __m128 cz = _mm_loadu_ps(&m_cz[slot]);
+    const __m128 ex = _mm_loadu_ps(&m_ex[slot]);
+    const __m128 ey = _mm_loadu_ps(&m_ey[slot]);
+    const __m128 ez = _mm_loadu_ps(&m_ez[slot]);
+
+    // a box is outside if dist + radius < 0 for any plane
+    __m128 outside = zero;
+    for (int p = 0; p < SFrustum::kPlanesCount; ++p) {
+      __m128 dist = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(f.nx[p]), cx),
+                               _mm_mul_ps(_mm_set1_ps(f.ny[p]), cy));
+      dist = _mm_add_ps(dist, _mm_mul_ps(_mm_set1_ps(f.nz[p]), cz));
+      dist = _mm_add_ps(dist, _mm_set1_ps(f.d[p]));
+
+      __m128 radius = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(f.ax[p]), ex),
+                                 _mm_mul_ps(_mm_set1_ps(f.ay[p]), ey));
+      radius = _mm_add_ps(radius, _mm_mul_ps(_mm_set1_ps(f.az[p]), ez));
+
+      outside =
+          _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(dist, radius), zero));
+    }
+
+    const int insideMask = ~_mm_movemask_ps(outside) & 0xF;
+    const uint32_t lanes = std::min(4u, end - slot);
+    for (uint32_t k = 0; k < lanes; ++k)
+      if (insideMask & (1 << k)) visible[m_items[slot + k]] = 1;
+  }
+#else
+  for (uint32_t slot = node.first; slot < end; ++slot) {
+    bool outside = false;
+    for (int p = 0; p < SFrustum::kPlanesCount && !outside; ++p) {
+      const float dist = f.nx[p] * m_cx[slot] + f.ny[p] * m_cy[slot] +
+                         f.nz[p] * m_cz[slot] + f.d[p];
+      const float radius = f.ax[p] * m_ex[slot] + f.ay[p] * m_ey[slot] +
+                           f.az[p] * m_ez[slot];
+      outside = dist + radius < 0.0f;
+    }
+    if (!outside) visible[m_items[slot]] = 1;
+  }
+#endif
+}
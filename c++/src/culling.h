@@ -0,0 +1,79 @@
+#pragma once
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+struct SAABB {
+  glm::vec3 min{FLT_MAX};
+  glm::vec3 max{-FLT_MAX};
+
+  void Extend(const glm::vec3& p);
+  void Extend(const SAABB& b);
+  glm::vec3 Center() const { return (min + max) * 0.5f; }
+  glm::vec3 Extents() const { return (max - min) * 0.5f; }
+  // bounds of the box after an affine transform
+  SAABB Transformed(const glm::mat4& m) const;
+};
+
+// Planes of a view-projection matrix, normals point inside. Kept in SoA form
+// so the SIMD test broadcasts one plane against four boxes at once.
+struct SFrustum {
+  static const int kPlanesCount = 6;
+
+  void FromMatrix(const glm::mat4& viewProj);
+  bool Intersects(const SAABB& box) const;
+
+  float nx[kPlanesCount], ny[kPlanesCount], nz[kPlanesCount];
+  float d[kPlanesCount];
+  // |n|, projects box extents onto the plane normal
+  float ax[kPlanesCount], ay[kPlanesCount], az[kPlanesCount];
+};
+
+// Bounding volume hierarchy over world space item bounds. Nodes are stored
+// depth first, leaves own a contiguous range of items whose bounds are kept
+// in SoA arrays for the SIMD leaf test.
+class CBVH {
+ public:
+  void Build(const std::vector<SAABB>& bounds);
+  void Clear();
+
+  // keeps the topology and refreshes the bounds of items flagged in changed,
+  // plus every node above them
+  void Refit(const std::vector<SAABB>& bounds,
+             const std::vector<uint8_t>& changed);
+
+  // sets visible[item] for every item intersecting the frustum, other entries
+  // are left untouched so several frustums can be merged
+  void Cull(const SFrustum& frustum, std::vector<uint8_t>& visible) const;
+
+ private:
+  static const uint32_t kLeafSize = 8;
+
+  // a subtree covers the contiguous slot range [first, first + count)
+  struct SNode {
+    SAABB bounds;
+    uint32_t first{0};
+    uint32_t count{0};
+    uint32_t right{0};  // right child, 0 for leaves. Left child follows.
+  };
+
+  uint32_t BuildNode(const std::vector<SAABB>& bounds,
+                     const std::vector<glm::vec3>& centers, uint32_t first,
+                     uint32_t count);
+  void CullLeaf(const SFrustum& frustum, const SNode& node,
+                std::vector<uint8_t>& visible) const;
+  void MarkAll(const SNode& node, std::vector<uint8_t>& visible) const;
+  void SetSlot(uint32_t slot, const SAABB& box);
+
+  std::vector<SNode> m_nodes;
+  std::vector<uint32_t> m_items;  // item index of every slot, leaf order
+
+  // box centers and extents per slot, padded by 3 so a 4-wide load starting
+  // at any slot stays in bounds
+  std::vector<float> m_cx, m_cy, m_cz;
+  std::vector<float> m_ex, m_ey, m_ez;
+};
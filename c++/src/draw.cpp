@@ -2,11 +2,15 @@
 #include "cube.h"
 #include "input_handler.h"
 #include "misc.h"
+#include "scene_cache.h"
 
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
 #include "shader.h"
 
@@ -30,6 +34,14 @@ bool MyDrawController::isPBR = false;
 bool MyDrawController::isIBL = false;
 
 bool MyDrawController::debugShadowMaps = false;
+int MyDrawController::shadowFacesPerFrame = 12;
+int MyDrawController::shadowCascades = 3;
+bool MyDrawController::omniShadowPerFace = true;
+std::vector<MyDrawController::SOmniShadowStats>
+    MyDrawController::omniShadowStats;
+size_t MyDrawController::shadowAtlasBytes = 0;
+float MyDrawController::cascadeSplitLambda = 0.75f;
+unsigned int MyDrawController::shadowMapsUpdated = 0;
 std::string MyDrawController::debugOnmiShadowLightName = std::string();
 std::vector<std::string> MyDrawController::pointLightNames =
     std::vector<std::string>();
@@ -40,20 +52,40 @@ bool MyDrawController::HDR = false;
 float MyDrawController::HDR_exposure = 0.0f;
 bool MyDrawController::deferredShading = false;
 bool MyDrawController::debugGBuffer = false;
+bool MyDrawController::tiledLighting = false;
+unsigned int MyDrawController::pointLights = 0;
+float MyDrawController::lightPassMs = 0.0f;
+float MyDrawController::tiledLightPassMs = 0.0f;
+bool MyDrawController::multiDrawIndirect = false;
+unsigned int MyDrawController::drawCalls = 0;
+unsigned int MyDrawController::drawCommands = 0;
+std::array<MyDrawController::SCullStats, kCullPassesCount>
+    MyDrawController::cullStats;
+bool MyDrawController::hiZOcclusion = false;
+unsigned int MyDrawController::occludedMeshes = 0;
+float MyDrawController::geometryPassMs = 0.0f;
+float MyDrawController::geometryPassHiZMs = 0.0f;
+bool MyDrawController::compactVertices = false;
+size_t MyDrawController::vertexFetchBytes = 0;
+size_t MyDrawController::vertexFetchSavedBytes = 0;
+bool MyDrawController::lodSelection = true;
+float MyDrawController::lodPixelError = 1.0f;
+float MyDrawController::lodHysteresis = 0.2f;
+float MyDrawController::shadowLodErrorScale = 4.0f;
+unsigned int MyDrawController::drawTriangles = 0;
+bool MyDrawController::instancing = true;
+bool MyDrawController::shaderPermutations = true;
+float MyDrawController::subroutinesPassMs = 0.0f;
+float MyDrawController::permutationsPassMs = 0.0f;
+float MyDrawController::textureUploadBudgetMB = 8.0f;
+unsigned int MyDrawController::streamingTextures = 0;
+unsigned int MyDrawController::textureArrays = 0;
 
 // glm::vec4 MyDrawController::clearColor(57.f / 255.0f, 57.f / 255.0f,
 //                                       57.f / 255.0f, 1.00f);
 
 glm::vec4 MyDrawController::clearColor(0.f / 255.0f, 0.f / 255.0f, 0.f / 255.0f,
                                        1.00f);
-enum Attrib_IDs {
-  vPosition = 0,
-  vNormals = 1,
-  uvTextCoords = 2,
-  vTangents = 3,
-  vBitangents = 4
-};
-
 std::shared_ptr<CShader> mainShader;
 std::shared_ptr<CShader> lightModelShader;
 std::shared_ptr<CShader> skyboxShader;
@@ -61,6 +93,8 @@ std::shared_ptr<CShader> normalShader;
 std::shared_ptr<CShader> rect2dShader;
 std::shared_ptr<CShader> shadowMapShader;
 std::shared_ptr<CShader> shadowCubeMapShader;
+// renders one cube face without the geometry shader
+std::shared_ptr<CShader> shadowCubeFaceShader;
 std::shared_ptr<CShader> debugShadowCubeMapShader;
 std::shared_ptr<CShader> deferredGeomPathShader;
 std::shared_ptr<CShader> deferredLightPathShader;
@@ -73,12 +107,122 @@ std::shared_ptr<CShader> irradianceShader;
 std::shared_ptr<CShader> prefilterShader;
 std::shared_ptr<CShader> brdfShader;
 
+// MULTI_DRAW variants of the programs drawing the render queue, null if GL 4.3
+// is not available
+std::shared_ptr<CShader> mainMultiDrawShader;
+std::shared_ptr<CShader> deferredGeomPathMultiDrawShader;
+std::shared_ptr<CShader> shadowMapMultiDrawShader;
+std::shared_ptr<CShader> shadowCubeMapMultiDrawShader;
+std::shared_ptr<CShader> shadowCubeFaceMultiDrawShader;
+std::shared_ptr<CShader> mainInstancedShader;
+std::shared_ptr<CShader> deferredGeomPathInstancedShader;
+std::shared_ptr<CShader> shadowMapInstancedShader;
+std::shared_ptr<CShader> shadowCubeMapInstancedShader;
+std::shared_ptr<CShader> shadowCubeFaceInstancedShader;
+std::shared_ptr<CShader> hiZBuildShader;
+std::shared_ptr<CShader> hiZCullShader;
+std::shared_ptr<CShader> tiledLightPathShader;
+
 std::shared_ptr<CShader> currShader;
 
 std::shared_ptr<CShader> nullShader;
 
 static const float kTMPFarPlane = 100.0f;  // TODO: refactor
 
+static const int kMaxShadowCubeFaces = 6;
+static const int kMaxShadowCascades = 4;
+
+// uniform handles, resolved by every program right after linking
+static const TUniform<glm::mat4> uModel("model");
+static const TUniform<glm::mat4> uView("view");
+static const TUniform<glm::mat4> uProj("proj");
+static const TUniform<glm::mat4> uRotFix("rotfix");
+static const TUniform<glm::mat4> uMVP("MVP");
+static const TUniform<glm::vec3> uCamPos("camPos");
+
+static const TUniform<int> uSkybox("skybox");
+static const TUniformArray<int> uPointShadowAtlas("pointShadowAtlas%d",
+                                                  CShadowAtlas::kTiers);
+static const TUniform<int> uDirShadowMap("dirShadowMap");
+static const TUniform<glm::vec3> uLightPos("lightPos");
+static const TUniformArray<glm::mat4> uShadowMatrices("shadowMatrices[%d]",
+                                                      kMaxShadowCubeFaces);
+static const TUniform<float> uFarPlane("farPlane");
+static const TUniform<glm::mat4> uFaceMatrix("faceMatrix");
+static const TUniform<int> uCubeLayer("cubeLayer");
+static const TUniformArray<glm::mat4> uCascadeMatrices("cascadeMatrices[%d]",
+                                                       kMaxShadowCascades);
+static const TUniform<int> uCascadesCount("cascadesCount");
+
+static const TUniform<int> uMaterialIndex("materialIndex");
+static const TUniform<int> uTextureDiffuse("inTexture.diff");
+static const TUniform<int> uTextureSpecular("inTexture.spec");
+static const TUniform<int> uTextureNormals("inTexture.norm");
+static const TUniform<int> uTextureReflection("inTexture.reflection");
+static const TUniform<int> uTextureOpacity("inTexture.opacity");
+static const TUniform<int> uAlbedoMap("albedoMap");
+static const TUniform<int> uNormalMap("normalMap");
+static const TUniform<int> uMetallicMap("metallicMap");
+static const TUniform<int> uRoughnessMap("roughnessMap");
+static const TUniform<int> uAOMap("aoMap");
+static const TUniform<int> uIrradianceMap("irradianceMap");
+static const TUniform<int> uPrefilterMap("prefilterMap");
+static const TUniform<int> uBrdfLUT("brdfLUT");
+
+static const TUniform<int> uGPosition("gPosition");
+static const TUniform<int> uGNormal("gNormal");
+static const TUniform<int> uGAlbedoSpec("gAlbedoSpec");
+static const TUniform<int> uGDepth("gDepth");
+static const TUniform<int> uSSAOTexture("SSAOTxt");
+static const TUniform<int> uPointLightsCount("pointLightsCount");
+static const TUniform<bool> uTiledShadows("tiledShadows");
+static const TUniform<bool> uTiledSSAO("tiledSSAO");
+static const TUniform<glm::vec4> uClearColor("clearColor");
+static const TUniform<int> uOutColor("outColor");
+// matches TILE_SIZE of tiledLightPath.comp
+static const int kLightTileSize = 16;
+static const TUniform<int> uNoiseTexture("noiseTxt");
+static const TUniformArray<glm::vec3> uSSAOSamples("samples[%d]", 64);
+static const TUniform<glm::mat4> uViewMat("viewMat");
+static const TUniform<glm::mat4> uVPMat("vpMat");
+static const TUniform<int> uBlurInTexture("inTexture");
+
+// light models, drawn as one instanced call
+static const TUniform<int> uInTexture("in_texture");
+static const TUniform<bool> uUseColor("useColor");
+static const TUniform<glm::vec3> uColor("color");
+static const TUniform<bool> uOneColorChannel("bOneColorChannel");
+static const TUniform<bool> uDoGammaCorrection("doGammaCorrection");
+static const TUniform<float> uHDRExposure("HDR_exposure");
+
+static const TUniform<int> uEquirectangularMap("equirectangularMap");
+static const TUniform<int> uEnvironmentMap("environmentMap");
+static const TUniform<glm::mat4> uProjection("projection");
+static const TUniform<float> uRoughness("roughness");
+
+// subroutine uniforms and the subroutines they select
+static const TSubroutineUniform suBaseColor("baseColorSelection");
+static const TSubroutine sTextColor("textColor");
+static const TSubroutine sPlainColor("plainColor");
+static const TSubroutine sTextHeightColor("textHeightColor");
+static const TSubroutineUniform suOpacity("opacitySelection");
+static const TSubroutine sMaskOpacity("maskOpacity");
+static const TSubroutine sEmptyOpacity("emptyOpacity");
+static const TSubroutineUniform suReflectionMap("reflectionMapSelection");
+static const TSubroutine sReflectionTexture("reflectionTexture");
+static const TSubroutine sReflectionColor("reflectionColor");
+static const TSubroutine sEmptyReflectionMap("emptyReflectionMap");
+static const TSubroutineUniform suShadowMap("shadowMapSelection");
+static const TSubroutine sGlobalShadowMap("globalShadowMap");
+static const TSubroutine sEmptyShadowMap("emptyShadowMap");
+static const TSubroutineUniform suGetNormal("getNormalSelection");
+static const TSubroutine sGetNormalBumped("getNormalBumped");
+static const TSubroutine sGetNormalFromHeight("getNormalFromHeight");
+static const TSubroutine sGetNormalSimple("getNormalSimple");
+static const TSubroutineUniform suAmbientOcclusion("AmbiantOclusionSelection");
+static const TSubroutine sSSAO("SSAO");
+static const TSubroutine sEmptyAmbientOcclusion("empty");
+
 enum ETextureSlot {
   Empty = 0,
   Diffuse,
@@ -89,73 +233,22 @@ enum ETextureSlot {
   DirShadowMap,
   Opacity,
   SSAO,
-  OmniShadowMapStart = 10,
-  OmniShadowMapEnd = 19
+  OmniShadowAtlas = 10,  // a unit per tier
+  HiZ = 20
 };
 
-inline glm::mat4 aiMatrix4x4ToGlm(const aiMatrix4x4* from) {
-  glm::mat4 to;
-
-  to[0][0] = (GLfloat)from->a1;
-  to[0][1] = (GLfloat)from->b1;
-  to[0][2] = (GLfloat)from->c1;
-  to[0][3] = (GLfloat)from->d1;
-  to[1][0] = (GLfloat)from->a2;
-  to[1][1] = (GLfloat)from->b2;
-  to[1][2] = (GLfloat)from->c2;
-  to[1][3] = (GLfloat)from->d2;
-  to[2][0] = (GLfloat)from->a3;
-  to[2][1] = (GLfloat)from->b3;
-  to[2][2] = (GLfloat)from->c3;
-  to[2][3] = (GLfloat)from->d3;
-  to[3][0] = (GLfloat)from->a4;
-  to[3][1] = (GLfloat)from->b4;
-  to[3][2] = (GLfloat)from->c4;
-  to[3][3] = (GLfloat)from->d4;
-
-  return to;
-}
-
-unsigned int TextureFromFile(const char* path, const std::string& directory) {
-  std::string filename = std::string(path);
-  filename = directory + '/' + filename;
-
-  unsigned int textureID;
-  glGenTextures(1, &textureID);
-
-  int width, height, nrComponents;
-  stbi_set_flip_vertically_on_load(true);
-  unsigned char* data =
-      stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-  if (data) {
-    GLenum format;
-    if (nrComponents == 1) format = GL_RED;
-    if (nrComponents == 2)
-      format = GL_RG;
-    else if (nrComponents == 3)
-      format = GL_RGB;
-    else if (nrComponents == 4)
-      format = GL_RGBA;
-
-    glBindTexture(GL_TEXTURE_2D, textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format,
-                 GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-                    GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    glBindTexture(GL_TEXTURE_2D, 0);
-    stbi_image_free(data);
-  } else {
-    std::cout << "Texture failed to load at path: " << path << std::endl;
-  }
+static const int kMaterialTextureUnits[kMaterialTexturesCount] = {
+    ETextureSlot::Diffuse, ETextureSlot::Specular, ETextureSlot::Reflection,
+    ETextureSlot::Normals, ETextureSlot::Opacity};
 
-  return textureID;
-}
+// what a material samples while its texture streams in. The flat normal is
+// a flat height map too.
+static const TTexel kMaterialTexturePlaceholders[kMaterialTexturesCount] = {
+    {{128, 128, 128, 255}},
+    {{0, 0, 0, 255}},
+    {{0, 0, 0, 255}},
+    {{128, 128, 255, 255}},
+    {{255, 255, 255, 255}}};
 
 unsigned int HDRTextureFromFile(const char* path,
                                 const std::string& directory) {
@@ -165,8 +258,8 @@ unsigned int HDRTextureFromFile(const char* path,
   unsigned int textureID;
   glGenTextures(1, &textureID);
 
+  // decoded flipped, the flag is set once by CTextureStreamer::Init()
   int width, height, nrComponents;
-  stbi_set_flip_vertically_on_load(true);
   float* data = stbi_loadf(filename.c_str(), &width, &height, &nrComponents, 0);
   if (data) {
     glBindTexture(GL_TEXTURE_2D, textureID);
@@ -187,53 +280,6 @@ unsigned int HDRTextureFromFile(const char* path,
   return textureID;
 }
 
-void MergeElements(const aiMesh& mesh, std::vector<unsigned int>& res) {
-  for (int i = 0; i < mesh.mNumFaces; ++i) {
-    assert(mesh.mFaces[i].mNumIndices == 3);
-    res.push_back(mesh.mFaces[i].mIndices[0]);
-    res.push_back(mesh.mFaces[i].mIndices[1]);
-    res.push_back(mesh.mFaces[i].mIndices[2]);
-  }
-}
-
-void MergeUV(const aiMesh& mesh, std::vector<glm::vec2>& res) {
-  if (mesh.mTextureCoords == nullptr || mesh.mNumUVComponents[0] == 0) return;
-
-  assert(mesh.mNumUVComponents[0] == 2);
-  glm::vec2 tmp;
-  for (int i = 0; i < mesh.mNumVertices; ++i) {
-    tmp[0] = mesh.mTextureCoords[0][i][0];
-    tmp[1] = mesh.mTextureCoords[0][i][1];
-    res.push_back(tmp);
-  }
-}
-
-std::string GetUniformTextureName(aiTextureType type) {
-  switch (type) {
-    case aiTextureType_DIFFUSE:
-      return "inTexture.diff";
-      break;
-    case aiTextureType_SPECULAR:
-      return "inTexture.spec";
-      break;
-    case aiTextureType_HEIGHT:
-    case aiTextureType_NORMALS:
-      return "inTexture.norm";
-      break;
-    case aiTextureType_AMBIENT:
-      return "inTexture.reflection";
-      break;
-    case aiTextureType_OPACITY:
-    case aiTextureType_UNKNOWN:
-      return "inTexture.opacity";
-
-      break;
-  }
-
-  assert(false && "provide texture unoform name");
-  return "none";
-}
-
 unsigned int LoadCubemap() {
   static std::string pathToSkyboxFolder =
       "/home/m16a/Documents/github/eduRen/models/skybox/skybox/";
@@ -247,7 +293,6 @@ unsigned int LoadCubemap() {
 
   int width, height, nrChannels;
   for (unsigned int i = 0; i < faces.size(); i++) {
-    stbi_set_flip_vertically_on_load(true);
     unsigned char* data = stbi_load((pathToSkyboxFolder + faces[i]).c_str(),
                                     &width, &height, &nrChannels, 0);
     if (data) {
@@ -276,7 +321,15 @@ unsigned int LoadCubemap() {
 MyDrawController::MyDrawController() : m_inputHandler(*this) {}
 
 MyDrawController::~MyDrawController() {
+  m_textures.Release();
+  m_textureArrays.Release();
   m_resources.Release();
+  m_lights.Release();
+  m_materials.Release();
+  m_instances.Release();
+  m_lightModels.Release();
+  for (CShaderPermutations& permutations : m_permutations)
+    permutations.Release();
   ReleaseShadowMaps();
 }
 
@@ -286,7 +339,15 @@ void MyDrawController::ReleaseShadowMaps() {
       glDeleteTextures(1, &sm.second.textureId);
       sm.second.textureId = 0;
     }
+    if (sm.second.FBO) glDeleteFramebuffers(1, &sm.second.FBO);
+    sm.second.FBO = 0;
+    sm.second.valid = false;
+    sm.second.slot = SShadowAtlasSlot();
   }
+  m_shadowAtlas.Release();
+  shadowAtlasBytes = 0;
+  for (size_t i = 0; i < m_lights.Count(); ++i)
+    if (m_lights.Type(i) == aiLightSource_POINT) m_lights.SetShadow(i, -1, -1);
 }
 
 void MyDrawController::InitLightModel() {
@@ -305,6 +366,10 @@ void MyDrawController::InitLightModel() {
   glVertexAttribPointer(vPosition, 3, GL_FLOAT, GL_FALSE, 0, 0);
   glEnableVertexAttribArray(vPosition);
 
+  // a colour per light model, the MVPs come from m_lightModels. Both are
+  // only enabled while RenderLightModels() draws, the skybox shares the VAO
+  glGenBuffers(1, &m_resources.lightColorsID);
+
   glGenBuffers(1, &m_resources.cubeElemID);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_resources.cubeElemID);
   glBufferData(GL_ELEMENT_ARRAY_BUFFER, cubeIndiciesCount * sizeof(GLint),
@@ -339,89 +404,31 @@ void MyDrawController::RenderFsQuad() {
   glDrawArrays(GL_TRIANGLE_STRIP, 0, 20 /*sizeof(quadVertices)*/);
 }
 
-void MyDrawController::LoadMeshesData() {
-  const unsigned int meshN = GetScene()->mNumMeshes;
-
-  glGenVertexArrays(meshN, m_resources.VAOs.data());
-  glGenBuffers(meshN, m_resources.vertIDs.data());
-  glGenBuffers(meshN, m_resources.elemIDs.data());
-  glGenBuffers(meshN, m_resources.normIDs.data());
-  glGenBuffers(meshN, m_resources.uvIDs.data());
-  glGenBuffers(meshN, m_resources.tangentsIDs.data());
-  glGenBuffers(meshN, m_resources.bitangentsIDs.data());
-
-  for (int i = 0; i < meshN; ++i) {
-    const aiMesh* pMesh = GetScene()->mMeshes[i];
-    assert(pMesh);
-
-    glBindVertexArray(m_resources.VAOs[i]);
-
-    glBindBuffer(GL_ARRAY_BUFFER, m_resources.vertIDs[i]);
-    glBufferData(GL_ARRAY_BUFFER, pMesh->mNumVertices * sizeof(aiVector3D),
-                 pMesh->mVertices, GL_STATIC_DRAW);
-
-    glVertexAttribPointer(vPosition, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(vPosition);
-
-    glBindBuffer(GL_ARRAY_BUFFER, m_resources.normIDs[i]);
-    glBufferData(GL_ARRAY_BUFFER, pMesh->mNumVertices * sizeof(aiVector3D),
-                 pMesh->mNormals, GL_STATIC_DRAW);
-    glVertexAttribPointer(vNormals, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(vNormals);
-
-    // TextCoordBuffers
-    std::vector<glm::vec2> uvTmp;
-    MergeUV(*pMesh, uvTmp);
-    if (!uvTmp.empty()) {
-      glBindBuffer(GL_ARRAY_BUFFER, m_resources.uvIDs[i]);
-      glBufferData(GL_ARRAY_BUFFER, pMesh->mNumVertices * sizeof(glm::vec2),
-                   uvTmp.data(), GL_STATIC_DRAW);
-      glVertexAttribPointer(uvTextCoords, 2, GL_FLOAT, GL_FALSE, 0, 0);
-      glEnableVertexAttribArray(uvTextCoords);
-    }
-
-    std::vector<unsigned int> elms;
-    MergeElements(*pMesh, elms);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_resources.elemIDs[i]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, elms.size() * sizeof(unsigned int),
-                 elms.data(), GL_STATIC_DRAW);
-
-    if (pMesh->mTangents) {
-      glBindBuffer(GL_ARRAY_BUFFER, m_resources.tangentsIDs[i]);
-      glBufferData(GL_ARRAY_BUFFER, pMesh->mNumVertices * sizeof(aiVector3D),
-                   pMesh->mTangents, GL_STATIC_DRAW);
-      glVertexAttribPointer(vTangents, 3, GL_FLOAT, GL_FALSE, 0, 0);
-      glEnableVertexAttribArray(vTangents);
-
-      assert(pMesh->mTangents && "bitangents should exist");
-      glBindBuffer(GL_ARRAY_BUFFER, m_resources.bitangentsIDs[i]);
-      glBufferData(GL_ARRAY_BUFFER, pMesh->mNumVertices * sizeof(aiVector3D),
-                   pMesh->mBitangents, GL_STATIC_DRAW);
-      glVertexAttribPointer(vBitangents, 3, GL_FLOAT, GL_FALSE, 0, 0);
-      glEnableVertexAttribArray(vBitangents);
-    }
-  }
-}
-
 bool MyDrawController::LoadScene(const std::string& path) {
+  const auto start = std::chrono::steady_clock::now();
   bool res = false;
-  if (const aiScene* p =
-          aiImportFile(path.c_str(), aiProcessPreset_TargetRealtime_MaxQuality
+  bool restored = false;
+  CSceneCache cache;
+  if (cache.Open(path, compactVertices)) {
+    // the arena comes in its final layout, assimp is not run at all
+    m_pScene = cache.CreateScene();
+    cache.RestoreGeometry(m_geometry);
+    cache.Close();
+    res = restored = true;
+  } else if (const aiScene* p = aiImportFile(
+                 path.c_str(), aiProcessPreset_TargetRealtime_MaxQuality
 #if 0
                                          | aiProcess_FlipWindingOrder
 #endif
-                       )) {
-    const unsigned int meshN = p->mNumMeshes;
-    if (meshN > kMaxMeshesCount) {
-      std::cout << "[ERROR] Supported meshes overflow. " << meshN << "/"
-                << kMaxMeshesCount << std::endl;
-      return res;
-    } else if (p->mNumTextures) {
+                 )) {
+    if (p->mNumTextures) {
       std::cout
           << "[ERROR][TODO] embeded textures are not handled. Textures count: "
           << p->mNumTextures << std::endl;
     } else {
       m_pScene = p;
+      m_geometry.Build(*m_pScene, compactVertices);
+      CSceneCache::Write(path, compactVertices, *m_pScene, m_geometry);
       res = true;
     }
   } else
@@ -429,17 +436,200 @@ bool MyDrawController::LoadScene(const std::string& path) {
 
   m_dirPath = path.substr(0, path.find_last_of('/'));
 
+  if (res && m_pScene->mNumMaterials > MaxMaterials()) {
+    std::cout << "[ERROR] Supported materials overflow. "
+              << m_pScene->mNumMaterials << "/" << MaxMaterials()
+              << ", the scene is not loaded" << std::endl;
+    res = false;
+  }
+
   if (res) {
     for (int i = 0; i < m_pScene->mNumLights; ++i) {
       const aiLight& light = *m_pScene->mLights[i];
       if (light.mType == aiLightSource_POINT)
         pointLightNames.push_back(light.mName.C_Str());
     }
+
+    const float ms = std::chrono::duration<float, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    std::cout << "Scene: " << (restored ? "restored from cache" : "imported")
+              << " in " << ms << " ms" << std::endl;
   }
 
   return res;
 }
 
+// Lights block binding and shadow map units never change, so they are set once
+static void SetupLightsInterface(const CShader& program) {
+  program.bindUniformBlock("Lights", kLightsBlockBinding);
+
+  program.use();
+  for (int t = 0; t < CShadowAtlas::kTiers; ++t)
+    program.set(uPointShadowAtlas[t], ETextureSlot::OmniShadowAtlas + t);
+  program.set(uDirShadowMap, ETextureSlot::DirShadowMap);
+}
+
+// Materials block binding and texture units never change, so they are set once
+static void SetupMaterialsInterface(const CShader& program) {
+  program.bindUniformBlock("Materials", kMaterialsBlockBinding);
+
+  program.use();
+  program.set(uTextureDiffuse, ETextureSlot::Diffuse);
+  program.set(uTextureSpecular, ETextureSlot::Specular);
+  program.set(uTextureReflection, ETextureSlot::Reflection);
+  program.set(uTextureNormals, ETextureSlot::Normals);
+  program.set(uTextureOpacity, ETextureSlot::Opacity);
+}
+
+// shading features of a material under one combination of render toggles
+static uint32_t MaterialFeatures(uint32_t shaderKey, unsigned int variant) {
+  uint32_t features = 0;
+  const bool textured = shaderKey & kShaderKeyTextured;
+  if (textured) {
+    features |= kShaderFeatureBaseColorTexture;
+    if (shaderKey & kShaderKeyOpacityMask)
+      features |= kShaderFeatureOpacityMask;
+  }
+
+  if (variant & kMaterialVariantSkybox) {
+    if (shaderKey & kShaderKeyReflectionMap)
+      features |= kShaderFeatureReflectionTexture;
+    else if (!textured)
+      features |= kShaderFeatureReflectionColor;
+  }
+
+  if (variant & kMaterialVariantShadows) features |= kShaderFeatureShadowMaps;
+
+  if ((variant & kMaterialVariantBumpMapping) &&
+      (shaderKey & kShaderKeyBumpMap)) {
+    if (variant & kMaterialVariantHeightBump)
+      features |=
+          kShaderFeatureNormalFromHeight | kShaderFeatureBaseColorParallax;
+    else
+      features |= kShaderFeatureNormalMap;
+  }
+  return features;
+}
+
+// the subroutine equivalent of a feature mask
+static void SelectMaterialSubroutines(uint32_t features,
+                                      SSubroutineSelection& data) {
+  if (features & kShaderFeatureBaseColorParallax)
+    data.select(suBaseColor, sTextHeightColor);
+  else if (features & kShaderFeatureBaseColorTexture)
+    data.select(suBaseColor, sTextColor);
+  else
+    data.select(suBaseColor, sPlainColor);
+
+  if (features & kShaderFeatureOpacityMask)
+    data.select(suOpacity, sMaskOpacity);
+  else
+    data.select(suOpacity, sEmptyOpacity);
+
+  if (features & kShaderFeatureReflectionTexture)
+    data.select(suReflectionMap, sReflectionTexture);
+  else if (features & kShaderFeatureReflectionColor)
+    data.select(suReflectionMap, sReflectionColor);
+  else
+    data.select(suReflectionMap, sEmptyReflectionMap);
+
+  if (features & kShaderFeatureShadowMaps)
+    data.select(suShadowMap, sGlobalShadowMap);
+  else
+    data.select(suShadowMap, sEmptyShadowMap);
+
+  if (features & kShaderFeatureNormalFromHeight)
+    data.select(suGetNormal, sGetNormalFromHeight);
+  else if (features & kShaderFeatureNormalMap)
+    data.select(suGetNormal, sGetNormalBumped);
+  else
+    data.select(suGetNormal, sGetNormalSimple);
+}
+
+static void CompileMaterialSubroutines(CMaterialTable& materials,
+                                       EMaterialProgram program,
+                                       const CShader& shader) {
+  materials.AllocateSubroutines(
+      program, shader.subroutineLocationsCount(GL_FRAGMENT_SHADER));
+
+  for (unsigned int m = 0; m < materials.Count(); ++m) {
+    for (unsigned int v = 0; v < kMaterialVariantsCount; ++v) {
+      SSubroutineSelection data;
+      SelectMaterialSubroutines(MaterialFeatures(materials.Get(m).shaderKey, v),
+                                data);
+      shader.subroutineIndices(GL_FRAGMENT_SHADER, data,
+                               materials.Subroutines(program, m, v));
+    }
+  }
+}
+
+static const char* kMultiDrawDefines = "#define MULTI_DRAW\n";
+
+static void SetupMultiDrawInterface(const CShader& program) {
+  program.bindStorageBlock("Draws", kDrawsStorageBinding);
+}
+
+static std::shared_ptr<CShader> MultiDrawVariant(
+    const std::shared_ptr<CShader>& program) {
+  if (program == mainShader) return mainMultiDrawShader;
+  if (program == deferredGeomPathShader) return deferredGeomPathMultiDrawShader;
+  if (program == shadowMapShader) return shadowMapMultiDrawShader;
+  if (program == shadowCubeMapShader) return shadowCubeMapMultiDrawShader;
+  if (program == shadowCubeFaceShader) return shadowCubeFaceMultiDrawShader;
+  return nullptr;
+}
+
+static bool IsMultiDrawProgram(const std::shared_ptr<CShader>& program) {
+  return program && (program == mainMultiDrawShader ||
+                     program == deferredGeomPathMultiDrawShader ||
+                     program == shadowMapMultiDrawShader ||
+                     program == shadowCubeMapMultiDrawShader ||
+                     program == shadowCubeFaceMultiDrawShader);
+}
+
+static const char* kInstancedDefines = "#define INSTANCED\n";
+
+static std::shared_ptr<CShader> InstancedVariant(
+    const std::shared_ptr<CShader>& program) {
+  if (program == mainShader) return mainInstancedShader;
+  if (program == deferredGeomPathShader) return deferredGeomPathInstancedShader;
+  if (program == shadowMapShader) return shadowMapInstancedShader;
+  if (program == shadowCubeMapShader) return shadowCubeMapInstancedShader;
+  if (program == shadowCubeFaceShader) return shadowCubeFaceInstancedShader;
+  return nullptr;
+}
+
+static bool IsInstancedProgram(const std::shared_ptr<CShader>& program) {
+  return program && (program == mainInstancedShader ||
+                     program == deferredGeomPathInstancedShader ||
+                     program == shadowMapInstancedShader ||
+                     program == shadowCubeMapInstancedShader ||
+                     program == shadowCubeFaceInstancedShader);
+}
+
+static unsigned int CurrentMaterialVariant() {
+  return CMaterialTable::Variant(
+      MyDrawController::drawSkybox, MyDrawController::drawShadows,
+      MyDrawController::bumpMapping,
+      MyDrawController::bumpMappingType == Height);
+}
+
+// kMaterialProgramsCount for programs which ignore materials
+static EMaterialProgram MaterialProgram(
+    const std::shared_ptr<CShader>& program) {
+  if (!program) return kMaterialProgramsCount;
+  if (program == mainShader) return kMaterialProgramForward;
+  if (program == deferredGeomPathShader) return kMaterialProgramDeferred;
+  if (program == mainMultiDrawShader) return kMaterialProgramForwardMultiDraw;
+  if (program == deferredGeomPathMultiDrawShader)
+    return kMaterialProgramDeferredMultiDraw;
+  if (program == mainInstancedShader) return kMaterialProgramForwardInstanced;
+  if (program == deferredGeomPathInstancedShader)
+    return kMaterialProgramDeferredInstanced;
+  return kMaterialProgramsCount;
+}
+
 void MyDrawController::Load() {
 #if 1
   bool res = LoadScene(
@@ -496,74 +686,253 @@ void MyDrawController::Load() {
   // LoadScene("/home/m16a/Documents/github/eduRen/models/bunny/reconstruction/bun_zipper_res4.ply");
   assert(res && "cannot load scene");
 
-  LoadMeshesData();
-  mainShader =
-      std::make_shared<CShader>("shaders/main.vert", "shaders/main.frag");
-
-  skyboxShader =
-      std::make_shared<CShader>("shaders/skybox.vert", "shaders/skybox.frag");
-  normalShader = std::make_shared<CShader>(
-      "shaders/normal.vert", "shaders/normal.frag", "shaders/normal.geom");
-  rect2dShader =
-      std::make_shared<CShader>("shaders/rect2d.vert", "shaders/rect2d.frag");
-  shadowMapShader = std::make_shared<CShader>("shaders/shadowMap.vert",
-                                              "shaders/shadowMap.frag");
-  shadowCubeMapShader = std::make_shared<CShader>("shaders/shadowCubeMap.vert",
-                                                  "shaders/shadowCubeMap.frag",
-                                                  "shaders/shadowCubeMap.geom");
-  debugShadowCubeMapShader = std::make_shared<CShader>(
-      "shaders/debugCubeShadowMap.vert", "shaders/debugCubeShadowMap.frag");
-  deferredGeomPathShader = std::make_shared<CShader>(
-      "shaders/deferredGeomPath.vert", "shaders/deferredGeomPath.frag");
-  deferredLightPathShader = std::make_shared<CShader>(
-      "shaders/deferredLightPath.vert", "shaders/deferredLightPath.frag");
-
-  ssaoShader =
-      std::make_shared<CShader>("shaders/ssao.vert", "shaders/ssao.frag");
-
-  blurShader =
-      std::make_shared<CShader>("shaders/blur.vert", "shaders/blur.frag");
-
-  pbrPointShader = std::make_shared<CShader>("shaders/pbrPoint.vert",
-                                             "shaders/pbrPoint.frag");
-
-  pbrIBLShader =
-      std::make_shared<CShader>("shaders/pbrIBL.vert", "shaders/pbrIBL.frag");
-
-  equirectShader = std::make_shared<CShader>("shaders/cubemap.vert",
-                                             "shaders/equirectangularMap.frag");
+  std::cout << "Geometry arena: " << m_geometry.Bytes() / 1024 << " KB";
+  if (m_geometry.Compact())
+    std::cout << ", compact layout saved "
+              << (m_geometry.FullBytes() - m_geometry.Bytes()) / 1024
+              << " KB";
+  std::cout << std::endl;
+  m_transforms.Build(*m_pScene);
+  m_renderQueue.Build(*m_pScene, m_transforms, m_geometry.Ranges());
+
+  // programs reading normals from the arena decode the compact layout
+  const std::string vertexDefines =
+      m_geometry.Compact() ? "#define COMPACT_VERTICES\n" : "";
+  // programs reading the Materials block size it to the scene
+  const std::string materialDefines =
+      vertexDefines + MaterialsDefines(m_pScene->mNumMaterials);
+  const std::string multiDrawDefines = kMultiDrawDefines + materialDefines;
+  const std::string instancedDefines = kInstancedDefines + materialDefines;
+  const std::string faceDefines = "#define SINGLE_FACE\n";
+
+  // every eager program is queued before the first one is checked, so the
+  // driver can compile them side by side
+  mainShader = m_shaders.Submit("shaders/main.vert", "shaders/main.frag",
+                                nullptr, materialDefines);
+  skyboxShader = m_shaders.Submit("shaders/skybox.vert", "shaders/skybox.frag");
+  rect2dShader = m_shaders.Submit("shaders/rect2d.vert", "shaders/rect2d.frag");
+  shadowMapShader =
+      m_shaders.Submit("shaders/shadowMap.vert", "shaders/shadowMap.frag");
+  shadowCubeMapShader = m_shaders.Submit("shaders/shadowCubeMap.vert",
+                                         "shaders/shadowCubeMap.frag",
+                                         "shaders/shadowCubeMap.geom");
+  shadowCubeFaceShader =
+      m_shaders.Submit("shaders/shadowCubeMap.vert",
+                       "shaders/shadowCubeMap.frag", nullptr, faceDefines);
+  deferredGeomPathShader =
+      m_shaders.Submit("shaders/deferredGeomPath.vert",
+                       "shaders/deferredGeomPath.frag", nullptr,
+                       materialDefines);
+  deferredLightPathShader = m_shaders.Submit("shaders/deferredLightPath.vert",
+                                             "shaders/deferredLightPath.frag");
+
+  mainInstancedShader = m_shaders.Submit(
+      "shaders/main.vert", "shaders/main.frag", nullptr, instancedDefines);
+  deferredGeomPathInstancedShader = m_shaders.Submit(
+      "shaders/deferredGeomPath.vert", "shaders/deferredGeomPath.frag", nullptr,
+      instancedDefines);
+  shadowMapInstancedShader =
+      m_shaders.Submit("shaders/shadowMap.vert", "shaders/shadowMap.frag",
+                       nullptr, kInstancedDefines);
+  shadowCubeMapInstancedShader = m_shaders.Submit(
+      "shaders/shadowCubeMap.vert", "shaders/shadowCubeMap.frag",
+      "shaders/shadowCubeMap.geom", kInstancedDefines);
+  shadowCubeFaceInstancedShader = m_shaders.Submit(
+      "shaders/shadowCubeMap.vert", "shaders/shadowCubeMap.frag", nullptr,
+      kInstancedDefines + faceDefines);
+  std::cout << "Instancing: " << m_renderQueue.SharedMeshes()
+            << " meshes shared by " << m_renderQueue.SharedItems()
+            << " nodes" << std::endl;
+
+  if (CMultiDraw::IsSupported()) {
+    mainMultiDrawShader = m_shaders.Submit(
+        "shaders/main.vert", "shaders/main.frag", nullptr, multiDrawDefines);
+    deferredGeomPathMultiDrawShader = m_shaders.Submit(
+        "shaders/deferredGeomPath.vert", "shaders/deferredGeomPath.frag",
+        nullptr, multiDrawDefines);
+    shadowMapMultiDrawShader =
+        m_shaders.Submit("shaders/shadowMap.vert", "shaders/shadowMap.frag",
+                         nullptr, kMultiDrawDefines);
+    shadowCubeMapMultiDrawShader = m_shaders.Submit(
+        "shaders/shadowCubeMap.vert", "shaders/shadowCubeMap.frag",
+        "shaders/shadowCubeMap.geom", kMultiDrawDefines);
+    shadowCubeFaceMultiDrawShader = m_shaders.Submit(
+        "shaders/shadowCubeMap.vert", "shaders/shadowCubeMap.frag", nullptr,
+        kMultiDrawDefines + faceDefines);
+    hiZBuildShader = m_shaders.SubmitCompute("shaders/hiz_build.comp");
+    hiZCullShader = m_shaders.SubmitCompute("shaders/hiz_cull.comp");
+    tiledLightPathShader =
+        m_shaders.SubmitCompute("shaders/tiledLightPath.comp");
+  } else
+    multiDrawIndirect = hiZOcclusion = tiledLighting = false;
+  m_shaders.FinishAll();
+
+  if (CMultiDraw::IsSupported()) {
+    SetupMultiDrawInterface(*mainMultiDrawShader);
+    SetupMultiDrawInterface(*deferredGeomPathMultiDrawShader);
+    SetupMultiDrawInterface(*shadowMapMultiDrawShader);
+    SetupMultiDrawInterface(*shadowCubeMapMultiDrawShader);
+    SetupMultiDrawInterface(*shadowCubeFaceMultiDrawShader);
+  }
 
-  irradianceShader = std::make_shared<CShader>("shaders/cubemap.vert",
-                                               "shaders/ibl_irradiance.frag");
+  // programs of the features off at startup are compiled in the background
+  // on their first toggle, see AcquireOptionalPrograms()
+  m_shaders.Defer(normalShader, "shaders/normal.vert", "shaders/normal.frag",
+                  "shaders/normal.geom", vertexDefines);
+  m_shaders.Defer(debugShadowCubeMapShader, "shaders/debugCubeShadowMap.vert",
+                  "shaders/debugCubeShadowMap.frag");
+  m_shaders.Defer(ssaoShader, "shaders/ssao.vert", "shaders/ssao.frag");
+  m_shaders.Defer(blurShader, "shaders/blur.vert", "shaders/blur.frag");
+  m_shaders.Defer(pbrPointShader, "shaders/pbrPoint.vert",
+                  "shaders/pbrPoint.frag", nullptr, vertexDefines,
+                  SetupLightsInterface);
+  m_shaders.Defer(pbrIBLShader, "shaders/pbrIBL.vert", "shaders/pbrIBL.frag",
+                  nullptr, vertexDefines, SetupLightsInterface);
+  m_shaders.Defer(equirectShader, "shaders/cubemap.vert",
+                  "shaders/equirectangularMap.frag");
+  m_shaders.Defer(irradianceShader, "shaders/cubemap.vert",
+                  "shaders/ibl_irradiance.frag");
+  m_shaders.Defer(prefilterShader, "shaders/cubemap.vert",
+                  "shaders/ibl_prefilter.frag");
+  m_shaders.Defer(brdfShader, "shaders/ibl_brdf.vert", "shaders/ibl_brdf.frag");
+
+  m_lights.Build(*m_pScene, m_transforms);
+  SetupLightsInterface(*mainShader);
+  SetupLightsInterface(*deferredLightPathShader);
+  SetupLightsInterface(*mainInstancedShader);
+  if (mainMultiDrawShader) SetupLightsInterface(*mainMultiDrawShader);
+  if (tiledLightPathShader) {
+    SetupLightsInterface(*tiledLightPathShader);
+    tiledLightPathShader->bindStorageBlock("PointLights",
+                                           kPointLightsStorageBinding);
+  }
+  pointLights = (unsigned int)m_lights.PointLightsCount();
+
+  m_textures.Init();
+  m_materials.Build(*m_pScene, [this](const char* path,
+                                      EMaterialTexture texture) {
+    auto it = m_resources.texturePathToID.find(path);
+    if (it != m_resources.texturePathToID.end()) return it->second;
+
+    // single layer arrays, so the shaders sample them the same way before
+    // and after PackMaterialTextures()
+    const GLuint id = m_textures.Request(
+        m_dirPath + '/' + path, kMaterialTexturePlaceholders[texture],
+        texture == kMaterialTextureNormals ? kTextureCodecNormal
+                                           : kTextureCodecColor,
+        GL_TEXTURE_2D_ARRAY);
+    m_resources.texturePathToID[path] = id;
+    return id;
+  });
+  CompileMaterialSubroutines(m_materials, kMaterialProgramForward, *mainShader);
+  CompileMaterialSubroutines(m_materials, kMaterialProgramDeferred,
+                             *deferredGeomPathShader);
+  CompileMaterialSubroutines(m_materials, kMaterialProgramForwardInstanced,
+                             *mainInstancedShader);
+  CompileMaterialSubroutines(m_materials, kMaterialProgramDeferredInstanced,
+                             *deferredGeomPathInstancedShader);
+  SetupMaterialsInterface(*mainShader);
+  SetupMaterialsInterface(*deferredGeomPathShader);
+  SetupMaterialsInterface(*mainInstancedShader);
+  SetupMaterialsInterface(*deferredGeomPathInstancedShader);
+
+  if (CMultiDraw::IsSupported()) {
+    CompileMaterialSubroutines(m_materials, kMaterialProgramForwardMultiDraw,
+                               *mainMultiDrawShader);
+    CompileMaterialSubroutines(m_materials, kMaterialProgramDeferredMultiDraw,
+                               *deferredGeomPathMultiDrawShader);
+    SetupMaterialsInterface(*mainMultiDrawShader);
+    SetupMaterialsInterface(*deferredGeomPathMultiDrawShader);
+
+    std::vector<int> materialBlockIndex(m_materials.Count());
+    for (unsigned int m = 0; m < m_materials.Count(); ++m)
+      materialBlockIndex[m] = m_materials.Get(m).blockIndex;
+    m_multiDraw.Build(m_renderQueue.Items(), materialBlockIndex,
+                      m_geometry.VAO(), m_geometry.IndexType());
+
+    m_occlusion.Init(hiZBuildShader, hiZCullShader, ETextureSlot::HiZ);
+    m_occlusion.Build(m_renderQueue.Items());
+  }
 
-  prefilterShader = std::make_shared<CShader>("shaders/cubemap.vert",
-                                              "shaders/ibl_prefilter.frag");
+  // the same programs as #define permutations, compiled per feature mask
+  const CShaderPermutations::TSetup forwardSetup = [](const CShader& p) {
+    SetupLightsInterface(p);
+    SetupMaterialsInterface(p);
+  };
+  const CShaderPermutations::TSetup deferredSetup = SetupMaterialsInterface;
+  m_permutations[kMaterialProgramForward].Init(
+      "shaders/main.vert", "shaders/main.frag", materialDefines, forwardSetup);
+  m_permutations[kMaterialProgramDeferred].Init(
+      "shaders/deferredGeomPath.vert", "shaders/deferredGeomPath.frag",
+      materialDefines, deferredSetup);
+  m_permutations[kMaterialProgramForwardInstanced].Init(
+      "shaders/main.vert", "shaders/main.frag", instancedDefines, forwardSetup);
+  m_permutations[kMaterialProgramDeferredInstanced].Init(
+      "shaders/deferredGeomPath.vert", "shaders/deferredGeomPath.frag",
+      instancedDefines, deferredSetup);
+  if (CMultiDraw::IsSupported()) {
+    m_permutations[kMaterialProgramForwardMultiDraw].Init(
+        "shaders/main.vert", "shaders/main.frag", multiDrawDefines,
+        [forwardSetup](const CShader& p) {
+          forwardSetup(p);
+          SetupMultiDrawInterface(p);
+        });
+    m_permutations[kMaterialProgramDeferredMultiDraw].Init(
+        "shaders/deferredGeomPath.vert", "shaders/deferredGeomPath.frag",
+        multiDrawDefines, [](const CShader& p) {
+          SetupMaterialsInterface(p);
+          SetupMultiDrawInterface(p);
+        });
+  }
 
-  brdfShader = std::make_shared<CShader>("shaders/ibl_brdf.vert",
-                                         "shaders/ibl_brdf.frag");
+  // the masks of the startup toggles are compiled now, later toggles submit
+  // theirs on first use and draw with subroutines until they are done
+  if (shaderPermutations) {
+    size_t compiled = 0;
+    for (CShaderPermutations& permutations : m_permutations) {
+      if (!permutations.Initialized()) continue;
+      for (unsigned int m = 0; m < m_materials.Count(); ++m)
+        permutations.Prepare(MaterialFeatures(m_materials.Get(m).shaderKey,
+                                              CurrentMaterialVariant()));
+    }
+    for (CShaderPermutations& permutations : m_permutations) {
+      if (!permutations.Initialized()) continue;
+      for (unsigned int m = 0; m < m_materials.Count(); ++m)
+        permutations.Get(MaterialFeatures(m_materials.Get(m).shaderKey,
+                                          CurrentMaterialVariant()));
+      compiled += permutations.Count();
+    }
+    std::cout << "Shader permutations: " << compiled << " programs"
+              << std::endl;
+  }
 
   InitLightModel();
   InitFsQuad();
   m_resources.skyboxTextID = LoadCubemap();
+
+  const CProgramCache::SStats& programs = CProgramCache::Stats();
+  std::cout << "Programs: " << programs.warm << " from cache in "
+            << programs.warmMs << " ms, " << programs.cold << " compiled in "
+            << programs.coldMs << " ms" << std::endl;
 }
 
-const char* PBRuniformName(ECustomPBRTextureType type) {
+const TUniform<int>& PBRuniform(ECustomPBRTextureType type) {
   switch (type) {
     case Albedo:
-      return "albedoMap";
+      return uAlbedoMap;
     case Norm:
-      return "normalMap";
+      return uNormalMap;
     case Metallic:
-      return "metallicMap";
+      return uMetallicMap;
     case Roughness:
-      return "roughnessMap";
+      return uRoughnessMap;
     case AO:
-      return "aoMap";
+      return uAOMap;
     default:
       assert(0 && "unsupported pbr texture type");
       break;
   }
-  return "";
+  return uAlbedoMap;
 }
 bool MyDrawController::BindPBRTexture(ECustomPBRTextureType type,
                                       const std::string& path) {
@@ -576,161 +945,68 @@ bool MyDrawController::BindPBRTexture(ECustomPBRTextureType type,
   if (sPBRTextures[type]) {
     id = sPBRTextures[type];
   } else {
-    id = TextureFromFile(path.c_str(), m_dirPath);
+    id = m_textures.Request(
+        m_dirPath + '/' + path,
+        kMaterialTexturePlaceholders[type == Norm ? kMaterialTextureNormals
+                                                  : kMaterialTextureDiffuse],
+        type == Norm ? kTextureCodecNormal : kTextureCodecColor);
     sPBRTextures[type] = id;
   }
 
   glActiveTexture(GL_TEXTURE0 + type);
-  currShader->setInt(PBRuniformName(type), type);
+  currShader->set(PBRuniform(type), type);
   glBindTexture(GL_TEXTURE_2D, id);
   res = true;
 
   return res;
 }
 
-bool MyDrawController::BindTexture(const aiMaterial& mat, aiTextureType type,
-                                   int indx) {
-  bool res = false;
-  // lazy loading textures
-  unsigned int texCnt = mat.GetTextureCount(type);
-  // assert(texCnt <= 1 && "multiple textures for one type is not supported");
-
-  if (texCnt) {
-    int i = 0;
-    aiString path;
-    if (!mat.GetTexture(type, i, &path)) {
-      auto it = m_resources.texturePathToID.find(std::string(path.C_Str()));
-      GLuint id = 0;
-
-      if (it == m_resources.texturePathToID.end()) {
-        id = TextureFromFile(path.C_Str(), m_dirPath);
-        m_resources.texturePathToID[std::string(path.C_Str())] = id;
-      } else
-        id = it->second;
-
-      glActiveTexture(GL_TEXTURE0 + indx);
-      currShader->setInt(GetUniformTextureName(type).c_str(), indx);
-      glBindTexture(GL_TEXTURE_2D, id);
-      res = true;
-    } else {
-      std::cout << "Texture reading fail\n";
-    }
-  } else {
-    glActiveTexture(GL_TEXTURE0 + indx);
-    currShader->setInt(GetUniformTextureName(type).c_str(), indx);
-    glBindTexture(GL_TEXTURE_2D, 0);
-  }
-  return res;
-}
-
-void MyDrawController::SetupMaterial(
-    const aiMesh& mesh, std::shared_ptr<CShader>& overrideProgram) {
-  assert(GetScene()->mNumMaterials);
-
-  unsigned int matIndx = mesh.mMaterialIndex;
-  // std::cout << "matIndx: " << matIndx << std::endl;
-  const aiMaterial& material = *m_pScene->mMaterials[matIndx];
-
-  if (MyDrawController::isIBL)
+void MyDrawController::SelectProgram(
+    std::shared_ptr<CShader>& overrideProgram) {
+  if (m_iblReady)
     currShader = pbrIBLShader;
-  else if (MyDrawController::isPBR)
+  else if (m_pbrReady)
     currShader = pbrPointShader;
   else if (overrideProgram)
     currShader = overrideProgram;
   else
     currShader = mainShader;
 
-  currShader->use();
-
-  if (currShader == mainShader || currShader == deferredGeomPathShader) {
-    CShader::TSubroutineTypeToInstance data;
-    if (material.GetTextureCount(aiTextureType_DIFFUSE)) {
-      data.push_back(std::pair<std::string, std::string>("baseColorSelection",
-                                                         "textColor"));
-      BindTexture(material, aiTextureType_DIFFUSE, ETextureSlot::Diffuse);
-      BindTexture(material, aiTextureType_SPECULAR, ETextureSlot::Specular);
-      BindTexture(material, aiTextureType_AMBIENT, ETextureSlot::Reflection);
-
-      // normal map can be placed under different names. can't figure out
-      if (!BindTexture(material, aiTextureType_NORMALS, ETextureSlot::Normals))
-        BindTexture(material, aiTextureType_HEIGHT, ETextureSlot::Normals);
-
-      // if (BindTexture(material, aiTextureType_OPACITY,
-      // ETextureSlot::Opacity)) {
-      if (BindTexture(material, aiTextureType_UNKNOWN, ETextureSlot::Opacity)) {
-        data.push_back(std::pair<std::string, std::string>("opacitySelection",
-                                                           "maskOpacity"));
-      } else {
-        data.push_back(std::pair<std::string, std::string>("opacitySelection",
-                                                           "emptyOpacity"));
-      }
-
-    } else {
-      data.push_back(std::pair<std::string, std::string>("baseColorSelection",
-                                                         "plainColor"));
-
-      aiColor3D col;
-      if (!material.Get(AI_MATKEY_COLOR_AMBIENT, col))
-        currShader->setVec3("material.ambient", col[0], col[1], col[2]);
+  std::shared_ptr<CShader> variant;
+  if (multiDrawIndirect)
+    variant = MultiDrawVariant(currShader);
+  else if (instancing)
+    variant = InstancedVariant(currShader);
+  if (variant) currShader = variant;
+}
 
-      if (!material.Get(AI_MATKEY_COLOR_DIFFUSE, col))
-        currShader->setVec3("material.diffuse", col[0], col[1], col[2]);
+std::shared_ptr<CShader> MyDrawController::MaterialPermutation(
+    EMaterialProgram program, unsigned int matIndx) {
+  return m_permutations[program].Acquire(MaterialFeatures(
+      m_materials.Get(matIndx).shaderKey, CurrentMaterialVariant()));
+}
 
-      if (!material.Get(AI_MATKEY_COLOR_SPECULAR, col))
-        currShader->setVec3("material.specular", col[0], col[1], col[2]);
+void MyDrawController::SetupMaterial(unsigned int matIndx,
+                                     EMaterialProgram program) {
+  assert(GetScene()->mNumMaterials);
 
-      float shininess;
-      if (!material.Get(AI_MATKEY_SHININESS, shininess))
-        currShader->setFloat("material.shininess", shininess);
+  if (program != kMaterialProgramsCount) {
+    const SCompiledMaterial& material = m_materials.Get(matIndx);
 
-      data.push_back(std::pair<std::string, std::string>("opacitySelection",
-                                                         "emptyOpacity"));
+    for (int t = 0; t < kMaterialTexturesCount; ++t) {
+      if (m_boundMaterialTextures[t] == material.textures[t]) continue;
+      glActiveTexture(GL_TEXTURE0 + kMaterialTextureUnits[t]);
+      glBindTexture(GL_TEXTURE_2D_ARRAY, material.textures[t]);
+      m_boundMaterialTextures[t] = material.textures[t];
     }
 
-    if (drawSkybox) {
-      if (material.GetTextureCount(aiTextureType_AMBIENT))
-        data.push_back(std::pair<std::string, std::string>(
-            "reflectionMapSelection", "reflectionTexture"));
-      else if (!material.GetTextureCount(aiTextureType_DIFFUSE))
-        data.push_back(std::pair<std::string, std::string>(
-            "reflectionMapSelection", "reflectionColor"));
-      else
-        data.push_back(std::pair<std::string, std::string>(
-            "reflectionMapSelection", "emptyReflectionMap"));
-    } else
-      data.push_back(std::pair<std::string, std::string>(
-          "reflectionMapSelection", "emptyReflectionMap"));
-
-    if (drawShadows)
-      data.push_back(std::pair<std::string, std::string>("shadowMapSelection",
-                                                         "globalShadowMap"));
-    else
-      data.push_back(std::pair<std::string, std::string>("shadowMapSelection",
-                                                         "emptyShadowMap"));
-
-    if (bumpMapping && (material.GetTextureCount(aiTextureType_HEIGHT) ||
-                        material.GetTextureCount(aiTextureType_NORMALS))) {
-      if (bumpMappingType == Normal) {
-        data.push_back(std::pair<std::string, std::string>("getNormalSelection",
-                                                           "getNormalBumped"));
-        // data.push_back(std::pair<std::string,
-        // std::string>("getHeightSelection", "getHeightEmpty"));
-      } else if (bumpMappingType == Height) {
-        // data.push_back(std::pair<std::string,
-        // std::string>("getHeightlSelection", "getHeightBumped"));
-
-        data.push_back(std::pair<std::string, std::string>(
-            "getNormalSelection", "getNormalFromHeight"));
-
-        data.push_back(std::pair<std::string, std::string>("baseColorSelection",
-                                                           "textHeightColor"));
-      } else
-        assert(0);
-    } else {
-      data.push_back(std::pair<std::string, std::string>("getNormalSelection",
-                                                         "getNormalSimple"));
-    }
-    currShader->setSubroutine(GL_FRAGMENT_SHADER, data);
+    currShader->set(uMaterialIndex, material.blockIndex);
+
+    // a permutation has the selection compiled in
+    if (MaterialProgram(currShader) == program)
+      currShader->setSubroutineIndices(
+          GL_FRAGMENT_SHADER,
+          m_materials.Subroutines(program, matIndx, CurrentMaterialVariant()));
   } else if (currShader == pbrPointShader || currShader == pbrIBLShader) {
     BindPBRTexture(Albedo, "rustediron2_basecolor.png");
     BindPBRTexture(Norm, "rustediron2_normal.png");
@@ -740,355 +1016,673 @@ void MyDrawController::SetupMaterial(
 
     if (currShader == pbrIBLShader) {
       glActiveTexture(GL_TEXTURE0 + 19);
-      currShader->setInt("irradianceMap", 19);
+      currShader->set(uIrradianceMap, 19);
       glBindTexture(GL_TEXTURE_CUBE_MAP, m_resources.envProbe.irradianceMap);
 
       glActiveTexture(GL_TEXTURE0 + 20);
-      currShader->setInt("prefilterMap", 20);
+      currShader->set(uPrefilterMap, 20);
       glBindTexture(GL_TEXTURE_CUBE_MAP, m_resources.envProbe.prefilterdMap);
 
       glActiveTexture(GL_TEXTURE0 + 21);
-      currShader->setInt("brdfLUT", 21);
+      currShader->set(uBrdfLUT, 21);
       glBindTexture(GL_TEXTURE_2D, m_resources.envProbe.brdfLUT);
     }
   }
 }
 
 void MyDrawController::SetupProgramTransforms(const Camera& cam,
-                                              const glm::mat4& model,
                                               const glm::mat4& view,
                                               const glm::mat4& proj) {
-  currShader->setMat4("model", model);
-  currShader->setMat4("view", view);
-  currShader->setMat4("proj", proj);
-  currShader->setVec3("camPos", cam.Position);
+  currShader->set(uView, view);
+  currShader->set(uProj, proj);
+  currShader->set(uCamPos, cam.Position);
 
-  if (drawSkybox || MyDrawController::isIBL) {
+  if (drawSkybox || m_iblReady) {
     glm::mat4 rot =
         glm::rotate(glm::mat4(1.0f), (float)M_PI / 2.0f, glm::vec3(1, 0, 0));
-    currShader->setMat4("rotfix", rot);
+    currShader->set(uRotFix, rot);
   }
 }
 
-void MyDrawController::RecursiveRender(
-    const aiScene& scene, const aiNode* nd, const Camera& cam,
-    std::shared_ptr<CShader>& overrideProgram,
-    const std::string& shadowMapForLight) {
-  aiMatrix4x4 m = nd->mTransformation;
-  glm::mat4 model = aiMatrix4x4ToGlm(&m);
-  glm::mat4 view = cam.GetViewMatrix();
-  glm::mat4 proj = cam.GetProjMatrix();
-
-  for (int i = 0; i < nd->mNumMeshes; ++i) {
-    const aiMesh* pMesh = scene.mMeshes[nd->mMeshes[i]];
-    assert(pMesh);
-
-    SetupMaterial(*pMesh, overrideProgram);
-    SetupLights(shadowMapForLight);
-    SetupProgramTransforms(cam, model, view, proj);
-
-    GLint size = 0;
-    glBindVertexArray(m_resources.VAOs[nd->mMeshes[i]]);
-    glGetBufferParameteriv(GL_ELEMENT_ARRAY_BUFFER, GL_BUFFER_SIZE, &size);
-    glDrawElements(GL_TRIANGLES, size, GL_UNSIGNED_INT, 0);
+void MyDrawController::RenderQueue(const Camera& cam,
+                                   std::shared_ptr<CShader>& overrideProgram,
+                                   const std::string& shadowMapForLight,
+                                   int cubeFace) {
+  SelectProgram(overrideProgram);
+
+  const glm::mat4 view = cam.GetViewMatrix();
+  const glm::mat4 proj = cam.GetProjMatrix();
+
+  // omni shadows render every cube face in one pass unless a face is given,
+  // so an item survives if any face sees it
+  SFrustum frustums[6];
+  int frustumsCount = 1;
+  ECullPass pass = kCullPassCamera;
+  const int light =
+      shadowMapForLight.empty() ? -1 : m_lights.Find(shadowMapForLight);
+  const bool omni = light >= 0 && m_lights.Type(light) == aiLightSource_POINT;
+  if (omni) {
+    pass = kCullPassPointShadow;
+    const SShadowMap& shadowMap = m_shadowMaps[shadowMapForLight];
+    if (cubeFace >= 0) {
+      frustums[0].FromMatrix(shadowMap.transforms[cubeFace]);
+    } else {
+      frustumsCount = shadowMap.transforms.size();
+      for (int i = 0; i < frustumsCount; ++i)
+        frustums[i].FromMatrix(shadowMap.transforms[i]);
+    }
+  } else {
+    if (light >= 0) pass = kCullPassDirShadow;
+    frustums[0].FromMatrix(proj * view);
   }
 
-  for (int i = 0; i < nd->mNumChildren; ++i) {
-    RecursiveRender(scene, nd->mChildren[i], cam, overrideProgram,
-                    shadowMapForLight);
-  }
-}
+  m_renderQueue.Cull(frustums, frustumsCount);
+  // the faces reach the corners of the cube, the light only its range
+  if (omni)
+    m_renderQueue.CullOutside(glm::vec3(m_lights.Transform(light)[3]),
+                              kTMPFarPlane);
+  cullStats[pass].visible += m_renderQueue.Sorted().size();
+  cullStats[pass].culled +=
+      m_renderQueue.Items().size() - m_renderQueue.Sorted().size();
+
+  const Camera& lodCam = pass == kCullPassCamera ? cam : m_cam;
+  SLodSelection lodSelect;
+  lodSelect.eye = lodCam.Position;
+  lodSelect.pixelsPerUnit =
+      lodCam.Height / (2.0f * std::tan(glm::radians(float(lodCam.FOV)) / 2.0f));
+  lodSelect.hysteresis = lodHysteresis;
+  if (lodSelection)
+    lodSelect.maxPixelError =
+        lodPixelError * (pass == kCullPassCamera ? 1.0f : shadowLodErrorScale);
+  m_renderQueue.SelectLods(m_geometry.Ranges(), lodSelect, m_itemLods[pass]);
+
+  const EMaterialProgram materialProgram = MaterialProgram(currShader);
+  const bool usesMaterials = materialProgram != kMaterialProgramsCount;
+  const bool permuted = usesMaterials && shaderPermutations;
+  m_renderQueue.Sort(cam.Position, cam.FarPlane,
+                     usesMaterials ? kSortByState : kSortByDepth,
+                     IsInstancedProgram(currShader));
+
+  // lights and camera go up once per program. Without permutations the
+  // program is fixed for the whole pass; subroutine selection is reset by
+  // glUseProgram and is restored by the first SetupMaterial below.
+  auto useProgram = [&](const std::shared_ptr<CShader>& program) {
+    currShader = program;
+    currShader->use();
+    SetupLights(shadowMapForLight);
+    SetupProgramTransforms(cam, view, proj);
+    if (cubeFace >= 0)
+      currShader->set(uFaceMatrix,
+                      m_shadowMaps[shadowMapForLight].transforms[cubeFace]);
+  };
+  const std::shared_ptr<CShader> subroutineProgram = currShader;
+  if (!permuted) useProgram(currShader);
+
+  const std::vector<SDrawItem>& items = m_renderQueue.Items();
+  unsigned int boundMaterial = ~0u;
+  m_boundMaterialTextures.fill(~0u);
+
+  // with permutations the material picks the program. The queue is sorted by
+  // shader key first, so the program changes once per feature mask. Masks
+  // new to a toggle compile in the background, their materials draw with
+  // subroutines meanwhile.
+  auto bindMaterial = [&](unsigned int material) {
+    if (permuted) {
+      std::shared_ptr<CShader> program =
+          MaterialPermutation(materialProgram, material);
+      if (!program) program = subroutineProgram;
+      if (program != currShader) {
+        useProgram(program);
+        boundMaterial = ~0u;
+      }
+    }
+    if (material == boundMaterial) return;
+    SetupMaterial(material, materialProgram);
+    boundMaterial = material;
+  };
 
-void MyDrawController::SetupLights(const std::string& onlyLight) {
-  if (drawSkybox) {
-    glActiveTexture(GL_TEXTURE0 + ETextureSlot::SkyBox);
-    currShader->setInt("skybox", ETextureSlot::SkyBox);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, m_resources.skyboxTextID);
+  // every mesh lives in the arena, one VAO serves the whole queue
+  glBindVertexArray(m_geometry.VAO());
+
+  const std::vector<uint32_t>& order = m_renderQueue.Sorted();
+  drawCommands += order.size();
+
+  // charged at the vertices of the LOD picked for the pass
+  const std::vector<SMeshRange>& ranges = m_geometry.Ranges();
+  for (uint32_t indx : order) {
+    const SDrawItem& item = items[indx];
+    const SMeshLod& lod = ranges[item.meshId].lods[m_itemLods[pass][indx]];
+    const size_t fetched = lod.vertexCount * m_geometry.VertexSize() +
+                           item.indexCount * m_geometry.IndexSize();
+    vertexFetchBytes += fetched;
+    vertexFetchSavedBytes += lod.vertexCount * sizeof(SVertex) +
+                             item.indexCount * sizeof(GLuint) - fetched;
+    drawTriangles += item.indexCount / 3;
   }
 
-  int pointLightIndx = 0;
-  int dirLightIndx = 0;
-
-  for (int i = 0; i < m_pScene->mNumLights; ++i) {
-    const aiLight& light = *m_pScene->mLights[i];
-
-    assert(light.mType == aiLightSource_POINT ||
-           light.mType == aiLightSource_DIRECTIONAL);
-    aiNode* pLightNode = m_pScene->mRootNode->FindNode(light.mName.data);
-    assert(pLightNode);
-
-    if (onlyLight != "" && onlyLight != light.mName.C_Str()) continue;
-
-    aiMatrix4x4 m = pLightNode->mTransformation;
-    glm::mat4 t = aiMatrix4x4ToGlm(&m);
-
-    char buff[100];
-    std::string lightI;
-    if (light.mType == aiLightSource_POINT) {
-      snprintf(buff, sizeof(buff), "pointLights[%d].", pointLightIndx++);
-      lightI = buff;
-      currShader->setVec3(lightI + "pos", glm::vec3(t[3]));
-      currShader->setFloat(lightI + "constant", light.mAttenuationConstant);
-      currShader->setFloat(lightI + "linear", light.mAttenuationLinear);
-      currShader->setFloat(lightI + "quadratic", light.mAttenuationQuadratic);
-      currShader->setFloat(lightI + "farPlane", kTMPFarPlane);
-
-      currShader->setVec3("lightPos", glm::vec3(t[3]));  // TODO: refactor
-
-      if (drawShadows) {
-        SShadowMap& sm = m_shadowMaps[light.mName.C_Str()];
-
-        //	currShader->setMat4(lightI + "lightSpaceMatrix", proj*view);
-
-        glActiveTexture(GL_TEXTURE0 + ETextureSlot::OmniShadowMapStart +
-                        pointLightIndx - 1);
-        currShader->setInt(
-            lightI + "shadowMapTexture",
-            ETextureSlot::OmniShadowMapStart + pointLightIndx - 1);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, sm.textureId);
-
-        char buff2[100];
-        std::string tmp2;
-        for (int i = 0; i < sm.transforms.size(); ++i) {
-          snprintf(buff2, sizeof(buff2), "shadowMatrices[%d]", i);
-          tmp2 = buff2;
-          currShader->setMat4(tmp2, sm.transforms[i]);
-        }
-
-        currShader->setFloat("farPlane", kTMPFarPlane);
-      } else {
-        // TODO:ugly!!!
-        glActiveTexture(GL_TEXTURE0 + ETextureSlot::OmniShadowMapStart +
-                        pointLightIndx - 1);
-        currShader->setInt(
-            lightI + "shadowMapTexture",
-            ETextureSlot::OmniShadowMapStart + pointLightIndx - 1);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-        // glBindTexture(GL_TEXTURE_CUBE_MAP, m_resources.skyboxTextID);
-        // currShader->setInt(lightI + "shadowMapTexture", 0);
+  if (IsMultiDrawProgram(currShader)) {
+    // the material index comes from the Draws block, so a run only breaks
+    // where the texture arrays or the shading path change. The sorted queue
+    // is submitted as one indirect call per run.
+    auto drawRuns = [&]() {
+      m_multiDraw.Bind();
+      size_t first = 0;
+      while (first < order.size()) {
+        const unsigned int material = items[order[first]].materialId;
+        size_t last = usesMaterials ? first + 1 : order.size();
+        while (last < order.size() &&
+               m_materials.SameState(items[order[last]].materialId, material))
+          ++last;
+
+        if (usesMaterials) bindMaterial(material);
+        m_multiDraw.Draw(first, last - first);
+        ++drawCalls;
+        first = last;
       }
+    };
 
-      /*
-      std::cout << "----" << std::endl;
-      std::cout << light.mAttenuationConstant << std::endl;
-      std::cout << light.mAttenuationLinear << std::endl;
-      std::cout << light.mAttenuationQuadratic << std::endl;
-      */
-    } else if (light.mType == aiLightSource_DIRECTIONAL) {
-      snprintf(buff, sizeof(buff), "dirLights[%d].", dirLightIndx++);
-      lightI = buff;
-      currShader->setVec3(lightI + "dir", glm::vec3(t[2]));
-
-      if (drawShadows) {
-        SShadowMap& sm = m_shadowMaps[light.mName.C_Str()];
-
-        const glm::mat4& view = sm.frustum.GetViewMatrix();
-        const glm::mat4& proj = sm.frustum.GetProjMatrix();
-        currShader->setMat4("lightSpaceMatrix", proj * view);
-
-        glActiveTexture(GL_TEXTURE0 + ETextureSlot::DirShadowMap);
-        currShader->setInt(lightI + "shadowMapTexture",
-                           ETextureSlot::DirShadowMap);
-        glBindTexture(GL_TEXTURE_2D, sm.textureId);
-      } else {
-        glActiveTexture(GL_TEXTURE0 + ETextureSlot::DirShadowMap);
-        currShader->setInt(lightI + "shadowMapTexture",
-                           ETextureSlot::DirShadowMap);
-        glBindTexture(GL_TEXTURE_2D, 0);
-      }
+    m_multiDraw.Upload(items, order);
+    if (!hiZOcclusion || currShader != deferredGeomPathMultiDrawShader) {
+      drawRuns();
+      return;
     }
 
-    aiColor3D tmp = light.mColorAmbient;
-
-    if (isAmbient)
-      // mainShader->setVec3(lightI + "ambient", tmp[0], tmp[1], tmp[2]);
-      currShader->setVec3(lightI + "ambient", 0.2, 0.2, 0.2);
-    else
-      currShader->setVec3(lightI + "ambient", glm::vec3());
-
-    tmp = light.mColorDiffuse;
-    if (isDiffuse)
-      currShader->setVec3(lightI + "diffuse", tmp[0], tmp[1], tmp[2]);
-    else
-      currShader->setVec3(lightI + "diffuse", glm::vec3());
-    // printf("%.1f %.1f %.1f\n", diffCol[0], diffCol[1], diffCol[2] );
-
-    tmp = light.mColorSpecular;
-    if (isSpecular)
-      currShader->setVec3(lightI + "specular", tmp[0], tmp[1], tmp[2]);
-    else
-      currShader->setVec3(lightI + "specular", glm::vec3());
-    // printf("%.1f %.1f %.1f\n", diffCol[0], diffCol[1], diffCol[2] );
+    // the G-buffer is bound: draw what last frame's depth does not hide, then
+    // test the rejects against the depth just written and draw the ones
+    // which became visible
+    const GLuint commands = m_multiDraw.CommandBuffer();
+    m_occlusion.CullPrevious(commands, order.size());
+    currShader->use();
+    boundMaterial = ~0u;
+    drawRuns();
+
+    m_occlusion.CullDisoccluded(m_resources.GBuffer.depth, (int)cam.Width,
+                                (int)cam.Height, proj * view, commands,
+                                order.size());
+    currShader->use();
+    boundMaterial = ~0u;
+    drawRuns();
+
+    occludedMeshes = m_occlusion.Occluded();
+    return;
   }
 
-  assert(
-      dirLightIndx < 2 &&
-      "more than one dir light is not supported now due to one dir shadowmap.");
-  currShader->setInt("nDirLights", dirLightIndx);
-  currShader->setInt("nPointLights", pointLightIndx);
-}
-
-void MyDrawController::BuildShadowMaps() {
-  const Camera& currCam = GetCam();
-  for (int i = 0; i < m_pScene->mNumLights; ++i) {
-    const aiLight& light = *m_pScene->mLights[i];
-    assert(light.mType == aiLightSource_POINT ||
-           light.mType == aiLightSource_DIRECTIONAL);
-
-    aiNode* pLightNode = m_pScene->mRootNode->FindNode(light.mName.data);
-    assert(pLightNode);
-
-    aiMatrix4x4 m = pLightNode->mTransformation;
-    glm::mat4 t = aiMatrix4x4ToGlm(&m);
+  if (IsInstancedProgram(currShader)) {
+    // matrices of the whole pass go up at once, each batch of adjacent items
+    // sharing mesh and LOD points the instance attribute at its slice
+    m_instanceMatrices.clear();
+    for (uint32_t indx : order) m_instanceMatrices.push_back(items[indx].model);
+    m_instances.Upload(m_instanceMatrices);
+
+    size_t first = 0;
+    while (first < order.size()) {
+      const SDrawItem& item = items[order[first]];
+      size_t last = first + 1;
+      while (last < order.size() && items[order[last]].meshId == item.meshId &&
+             items[order[last]].firstIndex == item.firstIndex)
+        ++last;
+
+      bindMaterial(item.materialId);
+
+      m_instances.Bind(vInstanceModel, first);
+      glDrawElementsInstancedBaseVertex(
+          GL_TRIANGLES, item.indexCount, m_geometry.IndexType(),
+          (void*)(item.firstIndex * m_geometry.IndexSize()), last - first,
+          item.baseVertex);
+      ++drawCalls;
+      first = last;
+    }
+    return;
+  }
 
-    if (m_shadowMaps.find(light.mName.C_Str()) == m_shadowMaps.end())
-      m_shadowMaps.emplace(light.mName.C_Str(), SShadowMap());
+  for (uint32_t indx : order) {
+    const SDrawItem& item = items[indx];
 
-    SShadowMap& shadowMap = m_shadowMaps[light.mName.C_Str()];
+    bindMaterial(item.materialId);
 
-    if (light.mType == aiLightSource_DIRECTIONAL) {
-      const float SHADOW_WIDTH = 1024.0f;
-      const float SHADOW_HEIGHT = 1024.0f;
+    currShader->set(uModel, item.model);
 
-      GLuint depthMapFBO;
-      glGenFramebuffers(1, &depthMapFBO);
+    glDrawElementsBaseVertex(
+        GL_TRIANGLES, item.indexCount, m_geometry.IndexType(),
+        (void*)(item.firstIndex * m_geometry.IndexSize()), item.baseVertex);
+    ++drawCalls;
+  }
+}
 
-      if (!shadowMap.textureId) glGenTextures(1, &shadowMap.textureId);
+void MyDrawController::SetupLights(const std::string& onlyLight) {
+  if (drawSkybox) {
+    glActiveTexture(GL_TEXTURE0 + ETextureSlot::SkyBox);
+    currShader->set(uSkybox, ETextureSlot::SkyBox);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, m_resources.skyboxTextID);
+  }
 
-      GLint oldFBO = 0;
-      glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &oldFBO);
+  // shadow passes need only the light being rendered
+  if (onlyLight != "") {
+    const int i = m_lights.Find(onlyLight);
+    assert(i != -1);
+
+    if (m_lights.Type(i) == aiLightSource_POINT) {
+      const SShadowMap& sm = m_shadowMaps[onlyLight];
+      currShader->set(uLightPos, glm::vec3(m_lights.Transform(i)[3]));
+      for (int f = 0; f < sm.transforms.size(); ++f)
+        currShader->set(uShadowMatrices[f], sm.transforms[f]);
+      currShader->set(uFarPlane, kTMPFarPlane);
+      currShader->set(uCubeLayer, sm.slot.layer);
+    }
+    return;
+  }
 
-      glBindTexture(GL_TEXTURE_2D, shadowMap.textureId);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH,
-                   SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-      float borderColor[] = {1.0f, 1.0f, 1.0f, 1.0f};
-      glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
+  // light parameters and atlas slots come from the Lights block uploaded once
+  // per frame, here only shadow maps are bound
+  for (int t = 0; t < CShadowAtlas::kTiers; ++t) {
+    glActiveTexture(GL_TEXTURE0 + ETextureSlot::OmniShadowAtlas + t);
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY,
+                  drawShadows ? m_shadowAtlas.Texture(t) : 0);
+  }
 
-      glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
-                             shadowMap.textureId, 0);
+  for (size_t i = 0; i < m_lights.Count(); ++i) {
+    if (m_lights.Type(i) != aiLightSource_DIRECTIONAL) continue;
 
-      glBindTexture(GL_TEXTURE_2D, 0);
-      glDrawBuffer(GL_NONE);
-      glReadBuffer(GL_NONE);
+    auto it = drawShadows ? m_shadowMaps.find(m_lights.Name(i))
+                          : m_shadowMaps.end();
+    const GLuint shadowTexture =
+        it != m_shadowMaps.end() ? it->second.textureId : 0;
 
-      glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-      glClear(GL_DEPTH_BUFFER_BIT);
+    glActiveTexture(GL_TEXTURE0 + ETextureSlot::DirShadowMap);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowTexture);
 
-      const glm::vec3 center(
-          0.0f, 0.0f, 0.0f);  // = currCam.Position + 5.0f * currCam.Front;
-      const glm::vec3 pos =
-          center + 19.0f * glm::vec3(t[2]);  // + 1 * currCam.Front;
-
-      Camera lightCam;
-      lightCam.Position = pos;
-      lightCam.Front = center - pos;
-      lightCam.Up = glm::vec3(0.0f, 0.0f, 1.0f);
-      lightCam.IsPerspective = false;
+    if (shadowTexture) {
+      const std::vector<glm::mat4>& cascades = it->second.transforms;
+      for (size_t c = 0; c < cascades.size(); ++c)
+        currShader->set(uCascadeMatrices[c], cascades[c]);
+      currShader->set(uCascadesCount, int(cascades.size()));
+    }
+  }
+}
 
-      glCullFace(GL_FRONT);
-      RecursiveRender(*m_pScene, m_pScene->mRootNode, lightCam, shadowMapShader,
-                      light.mName.C_Str());
-      glCullFace(GL_BACK);
+static const GLsizei kShadowMapSize = 1024;
+
+// Light views of the directional shadow cascades. The camera range is split
+// by the practical scheme, lambda blending logarithmic and uniform splits.
+// Each cascade holds the bounding sphere of its slice, so its size does not
+// change as the camera turns, and moves in whole texels of the light view so
+// the shadow edges do not swim.
+static std::vector<Camera> DirShadowCascades(const Camera& cam,
+                                             const glm::vec3& lightDir,
+                                             const SAABB& scene, int count,
+                                             float lambda) {
+  const glm::vec3 up = std::abs(lightDir.z) > 0.99f
+                           ? glm::vec3(0.0f, 1.0f, 0.0f)
+                           : glm::vec3(0.0f, 0.0f, 1.0f);
+  const glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), lightDir, up);
+  const glm::mat4 lightToWorld = glm::inverse(lightView);
+  const glm::mat4 camView = cam.GetViewMatrix();
+  const float n = cam.NearPlane;
+  const float f = cam.FarPlane;
+
+  std::vector<Camera> cascades(count);
+  float sliceNear = n;
+  for (int c = 0; c < count; ++c) {
+    const float p = float(c + 1) / count;
+    const float sliceFar = lambda * n * std::pow(f / n, p) +
+                           (1.0f - lambda) * (n + (f - n) * p);
+    const glm::mat4 sliceToWorld = glm::inverse(
+        glm::perspective(glm::radians(float(cam.FOV)), cam.Width / cam.Height,
+                         sliceNear, sliceFar) *
+        camView);
+    sliceNear = sliceFar;
+
+    glm::vec3 corners[8];
+    glm::vec3 center(0.0f);
+    for (int k = 0; k < 8; ++k) {
+      const glm::vec4 corner =
+          sliceToWorld * glm::vec4(k & 1 ? 1.0f : -1.0f, k & 2 ? 1.0f : -1.0f,
+                                   k & 4 ? 1.0f : -1.0f, 1.0f);
+      corners[k] = glm::vec3(corner) / corner.w;
+      center += corners[k] / 8.0f;
+    }
+    float radius = 0.0f;
+    for (const glm::vec3& corner : corners)
+      radius = std::max(radius, glm::length(corner - center));
+    radius = std::ceil(radius * 16.0f) / 16.0f;
+
+    const float texel = 2.0f * radius / kShadowMapSize;
+    glm::vec4 lightCenter = lightView * glm::vec4(center, 1.0f);
+    lightCenter.x = std::floor(lightCenter.x / texel) * texel;
+    lightCenter.y = std::floor(lightCenter.y / texel) * texel;
+    center = glm::vec3(lightToWorld * lightCenter);
+
+    // casters between the light and the slice, as far as the scene goes
+    float back = radius;
+    if (scene.min.x <= scene.max.x)
+      for (int k = 0; k < 8; ++k) {
+        const glm::vec3 corner(k & 1 ? scene.max.x : scene.min.x,
+                               k & 2 ? scene.max.y : scene.min.y,
+                               k & 4 ? scene.max.z : scene.min.z);
+        back = std::max(back, glm::dot(center - corner, lightDir));
+      }
 
-      glDeleteFramebuffers(1, &depthMapFBO);
-      glBindFramebuffer(GL_FRAMEBUFFER, oldFBO);
-      glViewport(0, 0, currCam.Width, currCam.Height);
+    Camera& lightCam = cascades[c];
+    lightCam.Position = center - back * lightDir;
+    lightCam.Front = lightDir;
+    lightCam.Up = up;
+    lightCam.IsPerspective = false;
+    lightCam.OrthoHalfSize = radius;
+    lightCam.NearPlane = 0.0f;
+    lightCam.FarPlane = back + radius;
+  }
+  return cascades;
+}
 
-      if (debugShadowMaps)
-        DrawRect2d(currCam.Width - 215, 10, 200, 200, shadowMap.textureId,
-                   false, true, -1.0f);
+// view-projections of the cube faces of a point light
+static std::vector<glm::mat4> PointShadowTransforms(const glm::vec3& lightPos) {
+  const float aspect = 1.0f;
+  const float near = 0.01f;
+  const glm::mat4 shadowProj =
+      glm::perspective(glm::radians(90.0f), aspect, near, kTMPFarPlane);
 
-      shadowMap.frustum = lightCam;
-    } else {
-      GLint oldFBO = 0;
-      glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &oldFBO);
-
-      GLuint depthCubemapFBO;
-      glGenFramebuffers(1, &depthCubemapFBO);
-
-      if (0 == shadowMap.textureId) glGenTextures(1, &shadowMap.textureId);
-
-      const float SHADOW_WIDTH = 1024.0f;
-      const float SHADOW_HEIGHT = 1024.0f;
-
-      glBindTexture(GL_TEXTURE_CUBE_MAP, shadowMap.textureId);
-      for (int i = 0; i < 6; ++i)
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT,
-                     SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT,
-                     GL_FLOAT, NULL);
-
-      glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-      glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-      glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-      glBindFramebuffer(GL_FRAMEBUFFER, depthCubemapFBO);
-      glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-                           shadowMap.textureId, 0);
-
-      glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-      glDrawBuffer(GL_NONE);
-      glReadBuffer(GL_NONE);
-
-      const float aspect = (float)SHADOW_WIDTH / (float)SHADOW_HEIGHT;
-      const float near = 0.01f;
-      const glm::mat4 shadowProj =
-          glm::perspective(glm::radians(90.0f), aspect, near, kTMPFarPlane);
-      const glm::vec3& lightPos = glm::vec3(t[3]);
-
-      shadowMap.transforms.clear();
-      std::vector<glm::mat4> shadowTransforms;
-      shadowMap.transforms.push_back(
-          shadowProj * glm::lookAt(lightPos,
+  std::vector<glm::mat4> transforms;
+  transforms.push_back(shadowProj *
+                       glm::lookAt(lightPos,
                                    lightPos + glm::vec3(1.0, 0.0, 0.0),
                                    glm::vec3(0.0, -1.0, 0.0)));
-      shadowMap.transforms.push_back(
-          shadowProj * glm::lookAt(lightPos,
+  transforms.push_back(shadowProj *
+                       glm::lookAt(lightPos,
                                    lightPos + glm::vec3(-1.0, 0.0, 0.0),
                                    glm::vec3(0.0, -1.0, 0.0)));
-      shadowMap.transforms.push_back(
-          shadowProj * glm::lookAt(lightPos,
+  transforms.push_back(shadowProj *
+                       glm::lookAt(lightPos,
                                    lightPos + glm::vec3(0.0, 1.0, 0.0),
                                    glm::vec3(0.0, 1.0, 1.0)));
-      shadowMap.transforms.push_back(
-          shadowProj * glm::lookAt(lightPos,
+  transforms.push_back(shadowProj *
+                       glm::lookAt(lightPos,
                                    lightPos + glm::vec3(0.0, -1.0, 0.0),
                                    glm::vec3(0.0, 0.0, -1.0)));
-      shadowMap.transforms.push_back(
-          shadowProj * glm::lookAt(lightPos,
+  transforms.push_back(shadowProj *
+                       glm::lookAt(lightPos,
                                    lightPos + glm::vec3(0.0, 0.0, 1.0),
                                    glm::vec3(0.0, -1.0, 0.0)));
-      shadowMap.transforms.push_back(
-          shadowProj * glm::lookAt(lightPos,
+  transforms.push_back(shadowProj *
+                       glm::lookAt(lightPos,
                                    lightPos + glm::vec3(0.0, 0.0, -1.0),
                                    glm::vec3(0.0, -1.0, 0.0)));
+  return transforms;
+}
 
-      glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-      glClear(GL_DEPTH_BUFFER_BIT);
+void MyDrawController::BuildShadowMaps() {
+  ++m_shadowFrame;
+
+  const Camera& currCam = GetCam();
+  const int cascadesCount =
+      std::min(std::max(shadowCascades, 1), kMaxShadowCascades);
+  SAABB scene;
+  for (const SDrawItem& item : m_renderQueue.Items())
+    scene.Extend(item.bounds);
+
+  if (!m_shadowAtlas.IsCreated()) {
+    m_shadowAtlas.Create();
+    shadowAtlasBytes = m_shadowAtlas.Bytes();
+  }
+  PlacePointShadows(currCam);
+
+  // the cascades follow the camera, only those whose view changed or whose
+  // casters moved are rendered again. So are the cube faces when rendered
+  // one by one.
+  std::vector<std::vector<Camera>> cascades(m_lights.Count());
+  std::vector<std::vector<int>> layers(m_lights.Count());
+  std::vector<size_t> stale;
+  for (size_t i = 0; i < m_lights.Count(); ++i) {
+    SShadowMap& shadowMap = m_shadowMaps[m_lights.Name(i)];
+    if (shadowMap.lightTransform != m_lights.Transform(i))
+      shadowMap.valid = false;
+
+    if (m_lights.Type(i) == aiLightSource_DIRECTIONAL) {
+      const glm::vec3 lightDir =
+          -glm::normalize(glm::vec3(m_lights.Transform(i)[2]));
+      cascades[i] = DirShadowCascades(currCam, lightDir, scene, cascadesCount,
+                                      cascadeSplitLambda);
+      if (shadowMap.transforms.size() > cascades[i].size())
+        shadowMap.transforms.resize(cascades[i].size());
+      for (int c = 0; c < cascadesCount; ++c)
+        if (!shadowMap.valid || c >= int(shadowMap.transforms.size()) ||
+            (shadowMap.staleLayers & (1u << c)) ||
+            shadowMap.transforms[c] != cascades[i][c].GetProjMatrix() *
+                                           cascades[i][c].GetViewMatrix())
+          layers[i].push_back(c);
+    } else if (shadowMap.slot.tier >= 0) {
+      const bool all = !shadowMap.valid ||
+                       (!omniShadowPerFace && shadowMap.staleLayers);
+      for (int f = 0; f < kMaxShadowCubeFaces; ++f)
+        if (all || (shadowMap.staleLayers & (1u << f))) layers[i].push_back(f);
+    }
+    if (!layers[i].empty()) stale.push_back(i);
+  }
 
-      Camera emptyCam;
-      RecursiveRender(*m_pScene, m_pScene->mRootNode, emptyCam,
-                      shadowCubeMapShader, light.mName.C_Str());
+  // a moving light stays stale, the longest waiting goes first so several of
+  // them share the budget
+  std::stable_sort(stale.begin(), stale.end(), [this](size_t a, size_t b) {
+    return m_shadowMaps[m_lights.Name(a)].renderedFrame <
+           m_shadowMaps[m_lights.Name(b)].renderedFrame;
+  });
 
-      glDeleteFramebuffers(1, &depthCubemapFBO);
+  GLint oldFBO = 0;
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &oldFBO);
 
-      glBindFramebuffer(GL_FRAMEBUFFER, oldFBO);
-      glViewport(0, 0, currCam.Width, currCam.Height);
+  int faces = 0;
+  shadowMapsUpdated = 0;
+  for (size_t i : stale) {
+    const bool dir = m_lights.Type(i) == aiLightSource_DIRECTIONAL;
+    const int cost = int(layers[i].size());
+    // one map a frame at least, a small budget would starve the cubes
+    if (faces && faces + cost > shadowFacesPerFrame) break;
+    faces += cost;
+
+    if (dir)
+      RenderDirShadowMap(i, cascades[i], layers[i]);
+    else
+      RenderPointShadowMap(i, layers[i]);
+
+    SShadowMap& shadowMap = m_shadowMaps[m_lights.Name(i)];
+    shadowMap.lightTransform = m_lights.Transform(i);
+    shadowMap.valid = true;
+    shadowMap.staleLayers = 0;
+    shadowMap.renderedFrame = m_shadowFrame;
+    ++shadowMapsUpdated;
+  }
+
+  if (shadowMapsUpdated) {
+    glBindFramebuffer(GL_FRAMEBUFFER, oldFBO);
+    glViewport(0, 0, currCam.Width, currCam.Height);
+  }
+
+  // a 2D view per cascade, the rect shader samples sampler2D
+  if (debugShadowMaps && gl3wIsSupported(4, 3))
+    for (size_t i = 0; i < m_lights.Count(); ++i) {
+      const SShadowMap& shadowMap = m_shadowMaps[m_lights.Name(i)];
+      if (m_lights.Type(i) != aiLightSource_DIRECTIONAL ||
+          !shadowMap.textureId)
+        continue;
+      for (size_t c = 0; c < shadowMap.transforms.size(); ++c) {
+        GLuint view = 0;
+        glGenTextures(1, &view);
+        glTextureView(view, GL_TEXTURE_2D, shadowMap.textureId,
+                      GL_DEPTH_COMPONENT32F, 0, 1, GLuint(c), 1);
+        DrawRect2d(currCam.Width - 215 - 210 * c, 10, 200, 200, view, false,
+                   true, -1.0f);
+        glDeleteTextures(1, &view);
+      }
+    }
+}
+
+void MyDrawController::RenderDirShadowMap(size_t light,
+                                          const std::vector<Camera>& cascades,
+                                          const std::vector<int>& layers) {
+  const std::string& lightName = m_lights.Name(light);
+  SShadowMap& shadowMap = m_shadowMaps[lightName];
+
+  // storage and framebuffer live as long as the map, a layer per cascade
+  if (!shadowMap.textureId) {
+    glGenTextures(1, &shadowMap.textureId);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadowMap.textureId);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT32F,
+                   kShadowMapSize, kShadowMapSize, kMaxShadowCascades);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S,
+                    GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T,
+                    GL_CLAMP_TO_BORDER);
+    float borderColor[] = {1.0f, 1.0f, 1.0f, 1.0f};
+    glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR,
+                     borderColor);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenFramebuffers(1, &shadowMap.FBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowMap.FBO);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              shadowMap.textureId, 0, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, shadowMap.FBO);
+  glViewport(0, 0, kShadowMapSize, kShadowMapSize);
+  shadowMap.transforms.resize(cascades.size(), glm::mat4(0.0f));
+
+  glCullFace(GL_FRONT);
+  for (int c : layers) {
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              shadowMap.textureId, 0, c);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    RenderQueue(cascades[c], shadowMapShader, lightName);
+    shadowMap.transforms[c] =
+        cascades[c].GetProjMatrix() * cascades[c].GetViewMatrix();
+  }
+  glCullFace(GL_BACK);
+}
+
+// triangles of the queue's last submission, at the LODs it picked
+static unsigned int SubmittedTriangles(const CRenderQueue& queue) {
+  unsigned int triangles = 0;
+  for (uint32_t i : queue.Sorted())
+    triangles += queue.Items()[i].indexCount / 3;
+  return triangles;
+}
+
+void MyDrawController::RenderPointShadowMap(size_t light,
+                                            const std::vector<int>& faces) {
+  const std::string& lightName = m_lights.Name(light);
+  SShadowMap& shadowMap = m_shadowMaps[lightName];
+
+  const glm::vec3 lightPos = glm::vec3(m_lights.Transform(light)[3]);
+  shadowMap.transforms = PointShadowTransforms(lightPos);
+
+  // transforms come from shadowMatrices, camera only drives depth sorting
+  Camera lightCam;
+  lightCam.Position = lightPos;
+  lightCam.FarPlane = kTMPFarPlane;
+
+  const auto it =
+      std::find(pointLightNames.begin(), pointLightNames.end(), lightName);
+  SOmniShadowStats unlisted;
+  if (it != pointLightNames.end())
+    omniShadowStats.resize(pointLightNames.size());
+  SOmniShadowStats& stats = it != pointLightNames.end()
+                                ? omniShadowStats[it - pointLightNames.begin()]
+                                : unlisted;
+  stats.size = CShadowAtlas::TierSize(shadowMap.slot.tier);
+
+  if (omniShadowPerFace) {
+    // all six faces together give the geometry shader's cost too, point
+    // shadow passes share their LODs, so the casters of every face are the
+    // ones it would emit
+    const bool wholeCube = faces.size() == size_t(kMaxShadowCubeFaces);
+    std::vector<bool> cast(wholeCube ? m_renderQueue.Items().size() : 0);
+    unsigned int casters = 0;
+    for (int f : faces) {
+      m_shadowAtlas.BindFace(shadowMap.slot, f);
+      glClear(GL_DEPTH_BUFFER_BIT);
+      RenderQueue(lightCam, shadowCubeFaceShader, lightName, f);
+      stats.faces[f] = SubmittedTriangles(m_renderQueue);
+      if (!wholeCube) continue;
+      for (uint32_t i : m_renderQueue.Sorted()) {
+        if (cast[i]) continue;
+        cast[i] = true;
+        casters += m_renderQueue.Items()[i].indexCount / 3;
+      }
     }
+    if (wholeCube) stats.amplified = kMaxShadowCubeFaces * casters;
+  } else {
+    // a layered clear would wipe the whole tier, the cube is cleared face by
+    // face before the geometry shader sends every triangle to all six
+    for (int f = 0; f < kMaxShadowCubeFaces; ++f) {
+      m_shadowAtlas.BindFace(shadowMap.slot, f);
+      glClear(GL_DEPTH_BUFFER_BIT);
+    }
+    m_shadowAtlas.BindLayered(shadowMap.slot);
+    RenderQueue(lightCam, shadowCubeMapShader, lightName);
+    // the geometry shader emits each kept triangle to all six faces
+    stats.amplified = kMaxShadowCubeFaces * SubmittedTriangles(m_renderQueue);
+  }
+}
+
+void MyDrawController::PlacePointShadows(const Camera& cam) {
+  SFrustum view;
+  view.FromMatrix(cam.GetProjMatrix() * cam.GetViewMatrix());
+
+  // the projected size of the light's reach, 1 with the camera inside it.
+  // Lights out of view only cast into it and rank far below.
+  std::vector<size_t> lights;
+  std::vector<float> importance;
+  std::vector<SShadowAtlasSlot> slots;
+  for (size_t i = 0; i < m_lights.Count(); ++i) {
+    if (m_lights.Type(i) != aiLightSource_POINT) continue;
+    const glm::vec3 pos = glm::vec3(m_lights.Transform(i)[3]);
+    const float range = std::min(m_lights.Range(i), kTMPFarPlane);
+    const float distance = glm::length(pos - cam.Position);
+    SAABB reach;
+    reach.Extend(pos - glm::vec3(range));
+    reach.Extend(pos + glm::vec3(range));
+
+    float score = range / std::max(distance, range);
+    if (!view.Intersects(reach)) score *= 0.1f;
+    lights.push_back(i);
+    importance.push_back(score);
+    slots.push_back(m_shadowMaps[m_lights.Name(i)].slot);
+  }
+
+  for (size_t moved : CShadowAtlas::Assign(importance, slots)) {
+    const size_t i = lights[moved];
+    SShadowMap& shadowMap = m_shadowMaps[m_lights.Name(i)];
+    shadowMap.slot = slots[moved];
+    shadowMap.valid = false;
+    m_lights.SetShadow(i, shadowMap.slot.tier, shadowMap.slot.layer);
+  }
+}
+
+void MyDrawController::InvalidateShadowMaps(const std::vector<SAABB>& moved) {
+  for (auto& it : m_shadowMaps) {
+    SShadowMap& shadowMap = it.second;
+    if (!shadowMap.valid) continue;
+
+    // the volumes the map was rendered with, cube faces or cascades
+    std::vector<SFrustum> volumes(shadowMap.transforms.size());
+    for (size_t f = 0; f < volumes.size(); ++f)
+      volumes[f].FromMatrix(shadowMap.transforms[f]);
+
+    for (size_t f = 0; f < volumes.size(); ++f)
+      for (const SAABB& box : moved)
+        if (volumes[f].Intersects(box)) {
+          shadowMap.staleLayers |= 1u << f;
+          break;
+        }
   }
 }
 
 void MyDrawController::RenderInternalForward(
-    const aiScene& scene, const aiNode* nd, const Camera& cam,
-    std::shared_ptr<CShader>& overrideProgram,
+    const Camera& cam, std::shared_ptr<CShader>& overrideProgram,
     const std::string& shadowMapForLight) {
-  RecursiveRender(scene, nd, cam, overrideProgram, shadowMapForLight);
+  RenderQueue(cam, overrideProgram, shadowMapForLight);
 }
 
 static void GenGBuffer(SGBuffer& gBuffer, const Camera& cam) {
@@ -1314,21 +1908,21 @@ void MyDrawController::PerformSSAO(const SSSAO& ssao, const SGBuffer& gBuffer,
     glClear(GL_COLOR_BUFFER_BIT);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, gBuffer.pos);
-    ssaoShader->setInt("gPosition", 0);
+    ssaoShader->set(uGPosition, 0);
 
     glActiveTexture(GL_TEXTURE0 + 1);
     glBindTexture(GL_TEXTURE_2D, gBuffer.normal);
-    ssaoShader->setInt("gNormal", 1);
+    ssaoShader->set(uGNormal, 1);
 
     glActiveTexture(GL_TEXTURE0 + 2);
     glBindTexture(GL_TEXTURE_2D, ssao.noiseTxt);
-    ssaoShader->setInt("noiseTxt", 2);
+    ssaoShader->set(uNoiseTexture, 2);
 
     for (unsigned int i = 0; i < 64; ++i)
-      ssaoShader->setVec3("samples[" + std::to_string(i) + "]", ssao.kernel[i]);
+      ssaoShader->set(uSSAOSamples[i], ssao.kernel[i]);
 
-    ssaoShader->setMat4("viewMat", cam.GetViewMatrix());
-    ssaoShader->setMat4("vpMat", cam.GetProjMatrix() * cam.GetViewMatrix());
+    ssaoShader->set(uViewMat, cam.GetViewMatrix());
+    ssaoShader->set(uVPMat, cam.GetProjMatrix() * cam.GetViewMatrix());
 
     RenderFsQuad();
   }
@@ -1339,7 +1933,7 @@ void MyDrawController::PerformSSAO(const SSSAO& ssao, const SGBuffer& gBuffer,
     blurShader->use();
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, ssao.pass1Txt);
-    blurShader->setInt("inTexture", 0);
+    blurShader->set(uBlurInTexture, 0);
 
     RenderFsQuad();
   }
@@ -1348,8 +1942,7 @@ void MyDrawController::PerformSSAO(const SSSAO& ssao, const SGBuffer& gBuffer,
 }
 
 void MyDrawController::RenderInternalDeferred(
-    const aiScene& scene, const aiNode* nd, const Camera& cam,
-    std::shared_ptr<CShader>& overrideProgram,
+    const Camera& cam, std::shared_ptr<CShader>& overrideProgram,
     const std::string& shadowMapForLight) {
   GenGBuffer(m_resources.GBuffer, cam);
   InitSSAO(m_resources.ssao, cam);
@@ -1365,9 +1958,20 @@ void MyDrawController::RenderInternalDeferred(
   glEnable(GL_CULL_FACE);
   glCullFace(GL_BACK);
 
-  // geometry path
-  RenderInternalForward(*m_pScene, m_pScene->mRootNode, cam,
-                        deferredGeomPathShader, "");
+  // geometry path, timed to compare culling modes and material programs
+  const unsigned int hiZMode =
+      hiZOcclusion && multiDrawIndirect ? kCameraPassHiZ : 0;
+  const unsigned int permutedMode =
+      shaderPermutations ? kCameraPassPermuted : 0;
+  m_geometryPassTimer.Begin();
+  RenderInternalForward(cam, deferredGeomPathShader, "");
+  m_geometryPassTimer.End(hiZMode | permutedMode, m_frame);
+
+  // each comparison holds the other toggle as it is now
+  geometryPassMs = m_geometryPassTimer.Ms(permutedMode);
+  geometryPassHiZMs = m_geometryPassTimer.Ms(kCameraPassHiZ | permutedMode);
+  subroutinesPassMs = m_geometryPassTimer.Ms(hiZMode);
+  permutationsPassMs = m_geometryPassTimer.Ms(hiZMode | kCameraPassPermuted);
 
   glBindFramebuffer(GL_FRAMEBUFFER, oldFBO);
 
@@ -1378,36 +1982,60 @@ void MyDrawController::RenderInternalDeferred(
                     (int)cam.Height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
   glBindFramebuffer(GL_FRAMEBUFFER, oldFBO);
 
-  if (isSSAO) PerformSSAO(m_resources.ssao, m_resources.GBuffer, cam);
+  if (m_ssaoReady) PerformSSAO(m_resources.ssao, m_resources.GBuffer, cam);
+
+  // light path, timed like the geometry path to compare the full-screen
+  // and the tiled pass
+  const bool tiled = tiledLighting && tiledLightPathShader;
+  m_lightPassTimer.Begin();
+  if (tiled)
+    TiledLightPath(cam, oldFBO);
+  else
+    LightPath(cam);
+  m_lightPassTimer.End(tiled ? 1 : 0, m_frame);
+  lightPassMs = m_lightPassTimer.Ms(0);
+  tiledLightPassMs = m_lightPassTimer.Ms(1);
+
+  if (debugGBuffer) {
+    glDisable(GL_DEPTH_TEST);
+    DrawRect2d(cam.Width - 315, 730, 300, 200, m_resources.GBuffer.pos, false,
+               false, -1.0f);
+    DrawRect2d(cam.Width - 315, 515, 300, 200, m_resources.GBuffer.normal,
+               false, false, -1.0f);
+    DrawRect2d(cam.Width - 315, 300, 300, 200, m_resources.GBuffer.albedoSpec,
+               false, false, -1.0f);
+    // DrawRect2d(cam.Width - 315, 75, 300, 200, m_resources.GBuffer.albedoSpec,
+    //           false, true, -1.0f);
+    DrawRect2d(cam.Width - 315, 75, 300, 200, m_resources.ssao.colorTxt, false,
+               true, -1.0f);
+    glEnable(GL_DEPTH_TEST);
+  }
+}
 
-  // light path
+void MyDrawController::LightPath(const Camera& cam) {
   deferredLightPathShader->use();
   currShader = deferredLightPathShader;
   SetupLights("");
 
-  deferredLightPathShader->setVec3("camPos", cam.Position);
+  deferredLightPathShader->set(uCamPos, cam.Position);
 
-  CShader::TSubroutineTypeToInstance data;
+  SSubroutineSelection data;
   if (drawShadows)
-    data.push_back(std::pair<std::string, std::string>("shadowMapSelection",
-                                                       "globalShadowMap"));
+    data.select(suShadowMap, sGlobalShadowMap);
   else
-    data.push_back(std::pair<std::string, std::string>("shadowMapSelection",
-                                                       "emptyShadowMap"));
+    data.select(suShadowMap, sEmptyShadowMap);
 
-  if (isSSAO) {
-    data.push_back(std::pair<std::string, std::string>(
-        "AmbiantOclusionSelection", "SSAO"));
+  if (m_ssaoReady) {
+    data.select(suAmbientOcclusion, sSSAO);
   } else {
-    data.push_back(std::pair<std::string, std::string>(
-        "AmbiantOclusionSelection", "empty"));
+    data.select(suAmbientOcclusion, sEmptyAmbientOcclusion);
   }
 
-  currShader->setSubroutine(GL_FRAGMENT_SHADER, data);
+  currShader->setSubroutines(GL_FRAGMENT_SHADER, data);
 
   glActiveTexture(GL_TEXTURE0 + ETextureSlot::SSAO);
-  if (isSSAO) {
-    currShader->setInt("SSAOTxt", ETextureSlot::SSAO);
+  if (m_ssaoReady) {
+    currShader->set(uSSAOTexture, ETextureSlot::SSAO);
     glBindTexture(GL_TEXTURE_2D, m_resources.ssao.colorTxt);
   } else {
     glBindTexture(GL_TEXTURE_2D, 0);
@@ -1415,19 +2043,19 @@ void MyDrawController::RenderInternalDeferred(
 
   {
     glActiveTexture(GL_TEXTURE0 + 1);
-    deferredLightPathShader->setInt("gPosition", 1);
+    deferredLightPathShader->set(uGPosition, 1);
     glBindTexture(GL_TEXTURE_2D, m_resources.GBuffer.pos);
 
     glActiveTexture(GL_TEXTURE0 + 2);
-    deferredLightPathShader->setInt("gNormal", 2);
+    deferredLightPathShader->set(uGNormal, 2);
     glBindTexture(GL_TEXTURE_2D, m_resources.GBuffer.normal);
 
     glActiveTexture(GL_TEXTURE0 + 3);
-    deferredLightPathShader->setInt("gAlbedoSpec", 3);
+    deferredLightPathShader->set(uGAlbedoSpec, 3);
     glBindTexture(GL_TEXTURE_2D, m_resources.GBuffer.albedoSpec);
 
     glActiveTexture(GL_TEXTURE0 + 4);
-    deferredLightPathShader->setInt("gDepth", 4);
+    deferredLightPathShader->set(uGDepth, 4);
     glBindTexture(GL_TEXTURE_2D, m_resources.GBuffer.depth);
 
     glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
@@ -1435,50 +2063,148 @@ void MyDrawController::RenderInternalDeferred(
     RenderFsQuad();
     glEnable(GL_DEPTH_TEST);
   }
+}
 
-  if (debugGBuffer) {
-    glDisable(GL_DEPTH_TEST);
-    DrawRect2d(cam.Width - 315, 730, 300, 200, m_resources.GBuffer.pos, false,
-               false, -1.0f);
-    DrawRect2d(cam.Width - 315, 515, 300, 200, m_resources.GBuffer.normal,
-               false, false, -1.0f);
-    DrawRect2d(cam.Width - 315, 300, 300, 200, m_resources.GBuffer.albedoSpec,
-               false, false, -1.0f);
-    // DrawRect2d(cam.Width - 315, 75, 300, 200, m_resources.GBuffer.albedoSpec,
-    //           false, true, -1.0f);
-    DrawRect2d(cam.Width - 315, 75, 300, 200, m_resources.ssao.colorTxt, false,
-               true, -1.0f);
-    glEnable(GL_DEPTH_TEST);
-  }
+// the output image of the tiled light path, regenerated on window resize
+static void GenTiledLighting(STiledLighting& tiled, const Camera& cam) {
+  const int w = (int)cam.Width;
+  const int h = (int)cam.Height;
+  if (tiled.FBO && tiled.width == w && tiled.height == h) return;
+
+  if (tiled.colorTxt) glDeleteTextures(1, &tiled.colorTxt);
+  if (!tiled.FBO) glGenFramebuffers(1, &tiled.FBO);
+
+  // immutable storage, as image load/store wants
+  glGenTextures(1, &tiled.colorTxt);
+  glBindTexture(GL_TEXTURE_2D, tiled.colorTxt);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA16F, w, h);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  // only ever read from, by the blit
+  GLint oldFBO = 0;
+  glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &oldFBO);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, tiled.FBO);
+  glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                         GL_TEXTURE_2D, tiled.colorTxt, 0);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, oldFBO);
+
+  tiled.width = w;
+  tiled.height = h;
+}
+
+void MyDrawController::TiledLightPath(const Camera& cam, GLint targetFBO) {
+  STiledLighting& tiled = m_resources.tiledLighting;
+  GenTiledLighting(tiled, cam);
+
+  tiledLightPathShader->use();
+  currShader = tiledLightPathShader;
+  SetupLights("");
+
+  // point lights come from the PointLights block, uploaded with the Lights
+  // block, and are culled per tile by the shader
+  currShader->set(uCamPos, cam.Position);
+  currShader->set(uView, cam.GetViewMatrix());
+  currShader->set(uProj, cam.GetProjMatrix());
+  currShader->set(uPointLightsCount, (int)m_lights.PointLightsCount());
+  currShader->set(uTiledShadows, drawShadows);
+  currShader->set(uTiledSSAO, m_ssaoReady);
+  currShader->set(uClearColor, clearColor);
+
+  glActiveTexture(GL_TEXTURE0 + ETextureSlot::SSAO);
+  currShader->set(uSSAOTexture, ETextureSlot::SSAO);
+  glBindTexture(GL_TEXTURE_2D, m_ssaoReady ? m_resources.ssao.colorTxt : 0);
+
+  glActiveTexture(GL_TEXTURE0 + 1);
+  currShader->set(uGPosition, 1);
+  glBindTexture(GL_TEXTURE_2D, m_resources.GBuffer.pos);
+
+  glActiveTexture(GL_TEXTURE0 + 2);
+  currShader->set(uGNormal, 2);
+  glBindTexture(GL_TEXTURE_2D, m_resources.GBuffer.normal);
+
+  glActiveTexture(GL_TEXTURE0 + 3);
+  currShader->set(uGAlbedoSpec, 3);
+  glBindTexture(GL_TEXTURE_2D, m_resources.GBuffer.albedoSpec);
+
+  glActiveTexture(GL_TEXTURE0 + 4);
+  currShader->set(uGDepth, 4);
+  glBindTexture(GL_TEXTURE_2D, m_resources.GBuffer.depth);
+
+  glBindImageTexture(0, tiled.colorTxt, 0, GL_FALSE, 0, GL_WRITE_ONLY,
+                     GL_RGBA16F);
+  currShader->set(uOutColor, 0);
+  glDispatchCompute((tiled.width + kLightTileSize - 1) / kLightTileSize,
+                    (tiled.height + kLightTileSize - 1) / kLightTileSize, 1);
+  glMemoryBarrier(GL_FRAMEBUFFER_BARRIER_BIT);
+
+  // background pixels were written with the clear color, so the whole image
+  // replaces the frame
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, tiled.FBO);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, targetFBO);
+  glBlitFramebuffer(0, 0, tiled.width, tiled.height, 0, 0, tiled.width,
+                    tiled.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_FRAMEBUFFER, targetFBO);
 }
 
 void MyDrawController::Render(const Camera& cam) {
+  ++m_frame;
+  drawCalls = drawCommands = 0;
+  vertexFetchBytes = vertexFetchSavedBytes = 0;
+  drawTriangles = 0;
+  cullStats.fill(SCullStats());
+  AcquireOptionalPrograms();
+  m_textures.Update(size_t(textureUploadBudgetMB * 1024 * 1024));
+  streamingTextures = m_textures.Pending();
+  if (!streamingTextures && !m_texturesPacked) PackMaterialTextures();
+
   if (deferredShading) {
     if (isMSAA) isMSAA = false;
 
     if (isWireMode) isWireMode = false;
   }
 
-  if (MyDrawController::isIBL) {
+  if (m_iblReady) {
     if (!m_resources.envProbe.cubeMap)
       IBL_PrecomputeEnvProbe(cam, m_resources.envProbe);
   }
 
   glPolygonMode(GL_FRONT_AND_BACK, isWireMode ? GL_LINE : GL_FILL);
 
+  // only subtrees below nodes touched through SetLocal() are recomputed
+  if (m_transforms.Update() && m_renderQueue.Refit(m_transforms)) {
+    m_multiDraw.UpdateDraws(m_renderQueue.Items());
+    m_occlusion.UpdateBounds(m_renderQueue.Items());
+    InvalidateShadowMaps(m_renderQueue.Moved());
+  }
+  m_lights.Update(m_transforms, isAmbient, isDiffuse, isSpecular,
+                  kTMPFarPlane);
+
   if (drawShadows)
     BuildShadowMaps();
   else
     ReleaseShadowMaps();
 
+  // a pyramid left over from frames without the occlusion pass is stale
+  if (!hiZOcclusion || !multiDrawIndirect || !deferredShading) {
+    m_occlusion.Invalidate();
+    occludedMeshes = 0;
+  }
+
   if (deferredShading)
-    RenderInternalDeferred(*m_pScene, m_pScene->mRootNode, cam, nullShader, "");
-  else
-    RenderInternalForward(*m_pScene, m_pScene->mRootNode, cam, nullShader, "");
+    RenderInternalDeferred(cam, nullShader, "");
+  else {
+    // timed like the G-buffer pass to compare material paths
+    m_forwardPassTimer.Begin();
+    RenderInternalForward(cam, nullShader, "");
+    m_forwardPassTimer.End(shaderPermutations ? kCameraPassPermuted : 0,
+                           m_frame);
+    subroutinesPassMs = m_forwardPassTimer.Ms(0);
+    permutationsPassMs = m_forwardPassTimer.Ms(kCameraPassPermuted);
+  }
 
-  if (drawNormals)
-    RenderInternalForward(*m_pScene, m_pScene->mRootNode, cam, normalShader,
-                          "");
+  if (m_normalsReady) RenderInternalForward(cam, normalShader, "");
 
   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
@@ -1486,39 +2212,71 @@ void MyDrawController::Render(const Camera& cam) {
 
   if (drawSkybox)
     RenderSkyBox(cam);
-  else if (debugShadowMaps)
+  else if (m_debugCubeShadowMapReady)
     DebugCubeShadowMap();
 
   if (drawGradientReference) DrawGradientReference();
 }
 
-void MyDrawController::RenderLightModels(const Camera& cam) {
-  glBindVertexArray(m_resources.cubeVAOID);
-  lightModelShader->use();
-
-  for (int i = 0; i < m_pScene->mNumLights; ++i) {
-    const aiLight& light = *m_pScene->mLights[i];
-
-    aiNode* pLightNode = m_pScene->mRootNode->FindNode(light.mName.data);
-    assert(pLightNode);
+void MyDrawController::AcquireOptionalPrograms() {
+  m_pbrReady = isPBR && m_shaders.Acquire({&pbrPointShader});
+  m_iblReady = isIBL && m_shaders.Acquire({&pbrIBLShader, &equirectShader,
+                                           &irradianceShader, &prefilterShader,
+                                           &brdfShader});
+  m_ssaoReady = isSSAO && m_shaders.Acquire({&ssaoShader, &blurShader});
+  m_normalsReady = drawNormals && m_shaders.Acquire({&normalShader});
+  m_debugCubeShadowMapReady =
+      debugShadowMaps && m_shaders.Acquire({&debugShadowCubeMapShader});
+}
 
-    aiMatrix4x4 m = pLightNode->mTransformation;
-    glm::mat4 t = aiMatrix4x4ToGlm(&m);
+void MyDrawController::PackMaterialTextures() {
+  m_texturesPacked = true;
+  if (!CTextureArrays::IsSupported()) return;
 
-    glm::mat4 scale = glm::scale(glm::mat4(1.0f), glm::vec3(0.3f, 0.3f, 0.3f));
-    glm::mat4 mvp_matrix =
-        cam.GetProjMatrix() * cam.GetViewMatrix() * t * scale;
+  // the per-file textures are copied out and dropped, only the material
+  // table referenced them
+  const std::vector<GLuint> packed = m_materials.PackTextures(m_textureArrays);
+  glDeleteTextures(GLsizei(packed.size()), packed.data());
+  m_resources.texturePathToID.clear();
+  m_renderQueue.SetMaterialRanks(m_materials.SortRanks());
 
-    aiColor3D tmp = light.mColorDiffuse;
-    lightModelShader->setVec3("lightColor", tmp[0], tmp[1], tmp[2]);
-    // printf("%.1f %.1f %.1f\n", tmp[0], tmp[1], tmp[2] );
+  textureArrays = m_textureArrays.Count();
+  std::cout << "Texture arrays: " << packed.size() << " textures in "
+            << textureArrays << " arrays" << std::endl;
+}
 
-    lightModelShader->setMat4("MVP", mvp_matrix);
+void MyDrawController::RenderLightModels(const Camera& cam) {
+  glBindVertexArray(m_resources.cubeVAOID);
+  lightModelShader->use();
 
-    GLint size = 0;
-    glGetBufferParameteriv(GL_ELEMENT_ARRAY_BUFFER, GL_BUFFER_SIZE, &size);
-    glDrawElements(GL_TRIANGLES, size, GL_UNSIGNED_INT, 0);
+  const glm::mat4 viewProj = cam.GetProjMatrix() * cam.GetViewMatrix();
+  const glm::mat4 scale =
+      glm::scale(glm::mat4(1.0f), glm::vec3(0.3f, 0.3f, 0.3f));
+  m_lightModelMVPs.clear();
+  m_lightModelColors.clear();
+  for (size_t i = 0; i < m_lights.Count(); ++i) {
+    m_lightModelMVPs.push_back(viewProj * m_lights.Transform(i) * scale);
+    m_lightModelColors.push_back(m_lights.Diffuse(i));
   }
+  if (m_lightModelMVPs.empty()) return;
+
+  m_lightModels.Upload(m_lightModelMVPs);
+  m_lightModels.Bind(vInstanceModel, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, m_resources.lightColorsID);
+  glBufferData(GL_ARRAY_BUFFER, m_lightModelColors.size() * sizeof(glm::vec3),
+               m_lightModelColors.data(), GL_STREAM_DRAW);
+  glVertexAttribPointer(vLightColor, 3, GL_FLOAT, GL_FALSE, 0, 0);
+  glVertexAttribDivisor(vLightColor, 1);
+  glEnableVertexAttribArray(vLightColor);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  glDrawElementsInstanced(GL_TRIANGLES, cubeIndiciesCount, GL_UNSIGNED_INT, 0,
+                          (GLsizei)m_lightModelMVPs.size());
+  ++drawCalls;
+
+  glDisableVertexAttribArray(vLightColor);
+  for (GLuint c = 0; c < 4; ++c)
+    glDisableVertexAttribArray(vInstanceModel + c);
 }
 
 void MyDrawController::RenderSkyBox(const Camera& cam) {
@@ -1527,7 +2285,7 @@ void MyDrawController::RenderSkyBox(const Camera& cam) {
   glBindVertexArray(m_resources.cubeVAOID);
 
   glActiveTexture(GL_TEXTURE0 + ETextureSlot::SkyBox);
-  skyboxShader->setInt("skybox", ETextureSlot::SkyBox);
+  skyboxShader->set(uSkybox, ETextureSlot::SkyBox);
 
   if (m_resources.envProbe.cubeMap) {
     glBindTexture(GL_TEXTURE_CUBE_MAP, m_resources.envProbe.cubeMap);
@@ -1541,7 +2299,7 @@ void MyDrawController::RenderSkyBox(const Camera& cam) {
   glm::mat4 view = glm::mat4(glm::mat3(
       cam.GetViewMatrix()));  // remove translation from the view matrix
   glm::mat4 mvp_matrix = cam.GetProjMatrix() * view * rot;
-  skyboxShader->setMat4("MVP", mvp_matrix);
+  skyboxShader->set(uMVP, mvp_matrix);
 
   GLint size = 0;
   glGetBufferParameteriv(GL_ELEMENT_ARRAY_BUFFER, GL_BUFFER_SIZE, &size);
@@ -1600,20 +2358,20 @@ static void DrawRect2d(float x, float y, float w, float h,
 
   rect2dShader->use();
   if (textureId) {
-    rect2dShader->setBool("useColor", false);
+    rect2dShader->set(uUseColor, false);
     glActiveTexture(GL_TEXTURE0);
-    rect2dShader->setInt("in_texture", 0);
+    rect2dShader->set(uInTexture, 0);
     glBindTexture(GL_TEXTURE_2D, textureId);
   } else {
-    rect2dShader->setVec3("color", color);
-    rect2dShader->setBool("useColor", true);
+    rect2dShader->set(uColor, color);
+    rect2dShader->set(uUseColor, true);
   }
 
-  rect2dShader->setBool("bOneColorChannel", bOneColorChannel);
+  rect2dShader->set(uOneColorChannel, bOneColorChannel);
 
-  rect2dShader->setBool("doGammaCorrection", doGammaCorrection);
+  rect2dShader->set(uDoGammaCorrection, doGammaCorrection);
 
-  rect2dShader->setFloat("HDR_exposure", HDRexposure);
+  rect2dShader->set(uHDRExposure, HDRexposure);
 
   glBindVertexArray(quadVAO);
   glDrawArrays(GL_TRIANGLES, 0, sizeof(quadVertices));
@@ -1664,7 +2422,7 @@ void MyDrawController::DebugCubeShadowMap() {
 
   auto it = m_shadowMaps.find(debugOnmiShadowLightName.c_str());
 
-  if (it == m_shadowMaps.end()) return;
+  if (it == m_shadowMaps.end() || it->second.slot.tier < 0) return;
 
   SShadowMap& shadowMap = it->second;
 
@@ -1673,8 +2431,10 @@ void MyDrawController::DebugCubeShadowMap() {
   glBindVertexArray(m_resources.cubeVAOID);
 
   glActiveTexture(GL_TEXTURE0 + ETextureSlot::SkyBox);
-  debugShadowCubeMapShader->setInt("in_texture", ETextureSlot::SkyBox);
-  glBindTexture(GL_TEXTURE_CUBE_MAP, shadowMap.textureId);
+  debugShadowCubeMapShader->set(uInTexture, ETextureSlot::SkyBox);
+  debugShadowCubeMapShader->set(uCubeLayer, shadowMap.slot.layer);
+  glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY,
+                m_shadowAtlas.Texture(shadowMap.slot.tier));
 
   // glm::mat4 rot = glm::rotate(glm::mat4(1.0f), (float)M_PI / 2.0f,
   // glm::vec3(-1, 0, 0));
@@ -1682,13 +2442,13 @@ void MyDrawController::DebugCubeShadowMap() {
   glm::mat4 view = glm::mat4(glm::mat3(
       m_cam.GetViewMatrix()));  // remove translation from the view matrix
   glm::mat4 mvp_matrix = m_cam.GetProjMatrix() * view;  //* rot;
-  debugShadowCubeMapShader->setMat4("MVP", mvp_matrix);
-  debugShadowCubeMapShader->setFloat("farPlane", kTMPFarPlane);
+  debugShadowCubeMapShader->set(uMVP, mvp_matrix);
+  debugShadowCubeMapShader->set(uFarPlane, kTMPFarPlane);
 
   GLint size = 0;
   glGetBufferParameteriv(GL_ELEMENT_ARRAY_BUFFER, GL_BUFFER_SIZE, &size);
   glDrawElements(GL_TRIANGLES, size, GL_UNSIGNED_INT, 0);
-  glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+  glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0);
   glDepthFunc(GL_LESS);
 }
 
@@ -1722,8 +2482,8 @@ static GLuint EquirectImageToCubeMap(GLuint image, const Camera& cam) {
 
   // convert HDR equirectangular environment map to cubemap equivalent
   equirectShader->use();
-  equirectShader->setInt("equirectangularMap", 0);
-  equirectShader->setMat4("projection", IBLCaptureProjection);
+  equirectShader->set(uEquirectangularMap, 0);
+  equirectShader->set(uProjection, IBLCaptureProjection);
   glActiveTexture(GL_TEXTURE0);
   glBindTexture(GL_TEXTURE_2D, image);
 
@@ -1732,7 +2492,7 @@ static GLuint EquirectImageToCubeMap(GLuint image, const Camera& cam) {
 
   glDisable(GL_CULL_FACE);
   for (unsigned int i = 0; i < 6; ++i) {
-    equirectShader->setMat4("view", IBLCaptureViews[i]);
+    equirectShader->set(uView, IBLCaptureViews[i]);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
                            GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, envCubemap, 0);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -1775,8 +2535,8 @@ static GLuint IrradianceMapFromCubeMap(GLuint cubeMap, const Camera& cam) {
   glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, 32, 32);
 
   irradianceShader->use();
-  irradianceShader->setInt("environmentMap", 0);
-  irradianceShader->setMat4("projection", IBLCaptureProjection);
+  irradianceShader->set(uEnvironmentMap, 0);
+  irradianceShader->set(uProjection, IBLCaptureProjection);
   glActiveTexture(GL_TEXTURE0);
   glBindTexture(GL_TEXTURE_CUBE_MAP, cubeMap);
 
@@ -1785,7 +2545,7 @@ static GLuint IrradianceMapFromCubeMap(GLuint cubeMap, const Camera& cam) {
   glDisable(GL_CULL_FACE);
 
   for (unsigned int i = 0; i < 6; ++i) {
-    irradianceShader->setMat4("view", IBLCaptureViews[i]);
+    irradianceShader->set(uView, IBLCaptureViews[i]);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
                            GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, irradianceMap,
                            0);
@@ -1831,8 +2591,8 @@ static GLuint PrefilterMap(GLuint cubeMap, const Camera& cam) {
   // create a prefilter (cube)map.
   // ----------------------------------------------------------------------------------------------------
   prefilterShader->use();
-  prefilterShader->setInt("environmentMap", 0);
-  prefilterShader->setMat4("projection", IBLCaptureProjection);
+  prefilterShader->set(uEnvironmentMap, 0);
+  prefilterShader->set(uProjection, IBLCaptureProjection);
   glActiveTexture(GL_TEXTURE0);
   glBindTexture(GL_TEXTURE_CUBE_MAP, cubeMap);
 
@@ -1849,9 +2609,9 @@ static GLuint PrefilterMap(GLuint cubeMap, const Camera& cam) {
     glViewport(0, 0, mipWidth, mipHeight);
 
     float roughness = (float)mip / (float)(maxMipLevels - 1);
-    prefilterShader->setFloat("roughness", roughness);
+    prefilterShader->set(uRoughness, roughness);
     for (unsigned int i = 0; i < 6; ++i) {
-      prefilterShader->setMat4("view", IBLCaptureViews[i]);
+      prefilterShader->set(uView, IBLCaptureViews[i]);
       glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
                              GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, prefilterMap,
                              mip);
@@ -1,7 +1,20 @@
 #pragma once
 
 #include "camera.h"
+#include "geometry_arena.h"
+#include "gpu_timer.h"
+#include "hiz_occlusion.h"
+#include "instance_buffer.h"
 #include "input_handler.h"
+#include "light_system.h"
+#include "material.h"
+#include "multi_draw.h"
+#include "render_queue.h"
+#include "shader_manager.h"
+#include "shader_permutations.h"
+#include "shadow_atlas.h"
+#include "texture_arrays.h"
+#include "texture_streamer.h"
 
 #include <assimp/cimport.h>
 #include <assimp/postprocess.h>
@@ -15,7 +28,14 @@
 #include <string>
 
 class CShader;
-constexpr const int kMaxMeshesCount = 400;
+
+// render queue passes with separate culling statistics
+enum ECullPass {
+  kCullPassCamera,
+  kCullPassDirShadow,
+  kCullPassPointShadow,
+  kCullPassesCount
+};
 
 struct SGBuffer {
   GLuint FBO{0};
@@ -25,6 +45,14 @@ struct SGBuffer {
   GLuint depth{0};  // redundant in general, pos buffer can be reused
 };
 
+// output of the tiled light path, blitted to the frame after the dispatch
+struct STiledLighting {
+  GLuint FBO{0};
+  GLuint colorTxt{0};
+  int width{0};
+  int height{0};
+};
+
 struct SSSAO {
   GLuint pass1FBO{0};
   GLuint pass1Txt{0};
@@ -44,16 +72,6 @@ struct SEnvProbe {
 };
 
 struct SResourceHandlers {
-  using TArr = std::array<GLuint, kMaxMeshesCount>;
-  TArr VAOs;
-  TArr vertIDs;
-  TArr elemIDs;
-  TArr normIDs;
-  TArr uvIDs;
-  TArr texturesIDs;
-  TArr tangentsIDs;
-  TArr bitangentsIDs;
-
   std::map<std::string, GLuint> texturePathToID;
 
   GLuint skyboxTextID;
@@ -61,12 +79,14 @@ struct SResourceHandlers {
   GLuint cubeVertID;
   GLuint cubeElemID;
   GLuint cubeVAOID;
+  GLuint lightColorsID;
 
   // full-screen quad
   GLuint fsQuadVAOID;
   GLuint fsQuadVBOID;
 
   SGBuffer GBuffer;
+  STiledLighting tiledLighting;
   SSSAO ssao;
 
   SEnvProbe envProbe;
@@ -107,6 +127,37 @@ class MyDrawController {
 
   static bool drawShadows;
   static bool debugShadowMaps;
+  // shadow maps are kept until a light or a caster in their volume moves.
+  // Stale maps are refreshed stalest first within this many rendered faces or
+  // cascades a frame.
+  static int shadowFacesPerFrame;
+  // directional light cascades, and the blend of logarithmic (1) and uniform
+  // (0) splits of the camera range between them
+  static int shadowCascades;
+  static float cascadeSplitLambda;
+  // omni shadows culled and rendered a cube face at a time, only the faces
+  // whose casters moved, instead of the geometry shader writing all six
+  static bool omniShadowPerFace;
+  // triangles a whole cube of each point light costs with the geometry
+  // shader, which emits every caster to all faces, and with per face culling.
+  // Parallel to pointLightNames, counted from the passes which draw the map:
+  // amplified by the geometry shader path or a per face render of all six
+  // faces, the faces by per face renders as each was last drawn.
+  struct SOmniShadowStats {
+    unsigned int amplified{0};
+    unsigned int faces[6]{};  // a count per cube face
+    int size{0};  // of the atlas cube
+
+    unsigned int PerFace() const {
+      unsigned int triangles = 0;
+      for (unsigned int f : faces) triangles += f;
+      return triangles;
+    }
+  };
+  static std::vector<SOmniShadowStats> omniShadowStats;
+  // memory of the point light shadow atlas, 0 while shadows are off
+  static size_t shadowAtlasBytes;
+  static unsigned int shadowMapsUpdated;
   static std::string debugOnmiShadowLightName;
   static std::vector<std::string> pointLightNames;
 
@@ -117,6 +168,68 @@ class MyDrawController {
   static float HDR_exposure;
   static bool deferredShading;
   static bool debugGBuffer;
+  // deferred light path in a compute shader culling the point lights per
+  // screen tile, needs GL 4.3. The full-screen pass lights only the first
+  // kMaxPointLights.
+  static bool tiledLighting;
+  static unsigned int pointLights;
+  // light path GPU time, last measured full-screen and tiled
+  static float lightPassMs;
+  static float tiledLightPassMs;
+
+  static bool multiDrawIndirect;
+  // scene draws of the last Render(): API calls and meshes they submitted
+  static unsigned int drawCalls;
+  static unsigned int drawCommands;
+
+  // items kept and rejected by frustum culling in the last Render()
+  struct SCullStats {
+    unsigned int visible{0};
+    unsigned int culled{0};
+  };
+  static std::array<SCullStats, kCullPassesCount> cullStats;
+
+  // arena vertex layout, read on Load()
+  static bool compactVertices;
+  // vertex and index bytes read by the scene draws of the last Render(),
+  // counting every vertex and index once, and the saving of the compact
+  // layout over the full one
+  static size_t vertexFetchBytes;
+  static size_t vertexFetchSavedBytes;
+
+  // LODs are picked per draw from their projected error in pixels. Shadow
+  // passes measure it from the main view with a larger budget.
+  static bool lodSelection;
+  static float lodPixelError;
+  static float lodHysteresis;
+  static float shadowLodErrorScale;
+  static unsigned int drawTriangles;
+
+  // draws adjacent items of the same mesh as one instanced call when the
+  // multi draw path is off
+  static bool instancing;
+
+  // material programs compiled per feature mask instead of selecting
+  // subroutines, and the GPU time of the current camera pass (forward or
+  // G-buffer) measured with each
+  static bool shaderPermutations;
+  static float subroutinesPassMs;
+  static float permutationsPassMs;
+
+  // scene textures decode in the background and upload at most this much a
+  // frame, materials show placeholders meanwhile
+  static float textureUploadBudgetMB;
+  static unsigned int streamingTextures;
+  // once streamed, material textures share GL_TEXTURE_2D_ARRAY pools
+  static unsigned int textureArrays;
+
+  // occlusion culling of the deferred geometry pass, needs multi draw
+  static bool hiZOcclusion;
+  static unsigned int occludedMeshes;
+  // G-buffer pass GPU time without and with Hi-Z, both under the current
+  // shader permutations toggle
+  static float geometryPassMs;
+  static float geometryPassHiZMs;
 
   static glm::vec4 clearColor;
 
@@ -133,16 +246,14 @@ class MyDrawController {
   void InitLightModel();
   void InitFsQuad();
   void RenderFsQuad();
-  void RecursiveRender(const aiScene& scene, const aiNode* nd,
-                       const Camera& cam,
-                       std::shared_ptr<CShader>& overrideProgram,
-                       const std::string& shadowMapForLight);
-  void RenderInternalForward(const aiScene& scene, const aiNode* nd,
-                             const Camera& cam,
+  // submits the sorted render queue with a single program. Omni shadow passes
+  // given a cube face cull and draw for that face alone.
+  void RenderQueue(const Camera& cam, std::shared_ptr<CShader>& overrideProgram,
+                   const std::string& shadowMapForLight, int cubeFace = -1);
+  void RenderInternalForward(const Camera& cam,
                              std::shared_ptr<CShader>& overrideProgram,
                              const std::string& shadowMapForLight);
-  void RenderInternalDeferred(const aiScene& scene, const aiNode* nd,
-                              const Camera& cam,
+  void RenderInternalDeferred(const Camera& cam,
                               std::shared_ptr<CShader>& overrideProgram,
                               const std::string& shadowMapForLight);
   void RenderSkyBox(const Camera& cam);
@@ -150,18 +261,36 @@ class MyDrawController {
 
   void PerformSSAO(const SSSAO& ssao, const SGBuffer& gBuffer,
                    const Camera& cam);
-  // returns true on success
-  bool BindTexture(const aiMaterial& mat, aiTextureType type, int indx);
+  // shades the G-buffer into the draw framebuffer
+  void LightPath(const Camera& cam);
+  void TiledLightPath(const Camera& cam, GLint targetFBO);
   bool BindPBRTexture(ECustomPBRTextureType type, const std::string& path);
+  // binds shadow maps for lit passes, per light uniforms for shadow passes
   void SetupLights(const std::string& onlyLight);
-  void LoadMeshesData();
-  void SetupMaterial(const aiMesh& mesh,
-                     std::shared_ptr<CShader>& overrideProgram);
-  void SetupProgramTransforms(const Camera& cam, const glm::mat4& model,
-                              const glm::mat4& view, const glm::mat4& proj);
+  void SelectProgram(std::shared_ptr<CShader>& overrideProgram);
+  // the program's subroutines are selected unless it is a permutation
+  void SetupMaterial(unsigned int matIndx, EMaterialProgram program);
+  // null while the material's mask is still compiling
+  std::shared_ptr<CShader> MaterialPermutation(EMaterialProgram program,
+                                               unsigned int matIndx);
+  void SetupProgramTransforms(const Camera& cam, const glm::mat4& view,
+                              const glm::mat4& proj);
   void BuildShadowMaps();
+  // renders the listed layers of the cascades
+  void RenderDirShadowMap(size_t light, const std::vector<Camera>& cascades,
+                          const std::vector<int>& layers);
+  void RenderPointShadowMap(size_t light, const std::vector<int>& faces);
+  // hands the atlas cubes to the point lights by their importance for the
+  // view, lights moved to another cube get their map invalidated
+  void PlacePointShadows(const Camera& cam);
+  // marks the faces or cascades whose volume holds any of the boxes
+  void InvalidateShadowMaps(const std::vector<SAABB>& moved);
   void ReleaseShadowMaps();
   void DebugCubeShadowMap();
+  // polls the background programs of the enabled optional features
+  void AcquireOptionalPrograms();
+  // moves the material textures into arrays once none is streaming
+  void PackMaterialTextures();
 
   // draw gradient to debug gamma correction
   void DrawGradientReference();
@@ -170,14 +299,59 @@ class MyDrawController {
 
  private:
   struct SShadowMap {
-    Camera frustum;
+    // cascades of a directional light, point lights render into the atlas
     GLuint textureId{0};
+    GLuint FBO{0};
+    SShadowAtlasSlot slot;
+    // view-projections of the cube faces or the cascades as rendered
     std::vector<glm::mat4> transforms;
+    // the light as the map was last rendered from
+    glm::mat4 lightTransform{1.0f};
+    bool valid{false};
+    // bits of the transforms whose casters moved since
+    unsigned int staleLayers{0};
+    unsigned int renderedFrame{0};
   };
 
   std::map<std::string, SShadowMap> m_shadowMaps;
+  CShadowAtlas m_shadowAtlas;
+  unsigned int m_shadowFrame{0};
+  unsigned int m_frame{0};
 
  private:
+  CGeometryArena m_geometry;
+  CTransformHierarchy m_transforms;
+  CRenderQueue m_renderQueue;
+  std::array<std::vector<uint8_t>, kCullPassesCount> m_itemLods;
+  CMultiDraw m_multiDraw;
+  CInstanceBuffer m_instances;
+  std::vector<glm::mat4> m_instanceMatrices;
+  // per light model MVP and colour, all lights in one instanced draw
+  CInstanceBuffer m_lightModels;
+  std::vector<glm::mat4> m_lightModelMVPs;
+  std::vector<glm::vec3> m_lightModelColors;
+  CHiZOcclusion m_occlusion;
+  // modes of the camera passes, a timer per path. Hi-Z is deferred only.
+  enum ECameraPassMode { kCameraPassHiZ = 1, kCameraPassPermuted = 2 };
+  CGpuModeTimer m_geometryPassTimer;
+  CGpuModeTimer m_forwardPassTimer;
+  CGpuModeTimer m_lightPassTimer;  // mode 1 when tiled
+  CLightSystem m_lights;
+  CMaterialTable m_materials;
+  CTextureStreamer m_textures;
+  CTextureArrays m_textureArrays;
+  bool m_texturesPacked{false};
+  std::array<CShaderPermutations, kMaterialProgramsCount> m_permutations;
+  CShaderManager m_shaders;
+  // an enabled feature is drawn once its programs are, until then it is off
+  bool m_pbrReady{false};
+  bool m_iblReady{false};
+  bool m_ssaoReady{false};
+  bool m_normalsReady{false};
+  bool m_debugCubeShadowMapReady{false};
+  // material textures per unit, reset at the start of each queue submission
+  std::array<GLuint, kMaterialTexturesCount> m_boundMaterialTextures;
+
   Camera m_cam;
   CInputHandler m_inputHandler;
 
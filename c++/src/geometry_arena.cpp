@@ -0,0 +1,321 @@
+#include "geometry_arena.h"
+#include "mesh_optimizer.h"
+#include "mesh_simplifier.h"
+
+#include <assimp/scene.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <thread>
+
+// 16 bit indices address this many vertices per mesh
+static const size_t kShortIndexVertices = 1 << 16;
+
+// every LOD aims at half the triangles of the previous one. The chain ends
+// at small meshes, and where the simplifier gets stuck on locked borders.
+static const size_t kMinLodTriangles = 64;
+static const float kMinLodReduction = 0.8f;
+
+static glm::vec3 ToVec3(const aiVector3D& v) {
+  return glm::vec3(v[0], v[1], v[2]);
+}
+
+static int16_t PackSnorm16(float v) {
+  return (int16_t)std::round(glm::clamp(v, -1.0f, 1.0f) * 32767.0f);
+}
+
+// maps the unit sphere onto the [-1, 1] square: project onto the octahedron,
+// then fold the lower hemisphere over the diagonals
+static void OctEncode(const glm::vec3& n, int16_t out[2]) {
+  const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+  float x = l1 > 0.0f ? n.x / l1 : 0.0f;
+  float y = l1 > 0.0f ? n.y / l1 : 0.0f;
+  if (n.z < 0.0f) {
+    const float fx = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+    const float fy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    x = fx;
+    y = fy;
+  }
+  out[0] = PackSnorm16(x);
+  out[1] = PackSnorm16(y);
+}
+
+static SCompactVertex Compress(const SVertex& v) {
+  SCompactVertex c;
+  c.pos = v.pos;
+  OctEncode(v.normal, c.normal);
+  c.uv[0] = glm::packHalf1x16(v.uv.x);
+  c.uv[1] = glm::packHalf1x16(v.uv.y);
+
+  const float sign =
+      glm::dot(glm::cross(v.normal, v.tangent), v.bitangent) < 0.0f ? -1.0f
+                                                                     : 1.0f;
+  c.tangent = glm::packSnorm3x10_1x2(glm::vec4(v.tangent, sign));
+  return c;
+}
+
+void CGeometryArena::Build(const aiScene& scene, bool compact) {
+  Release();
+
+  size_t verticesCount = 0;
+  size_t indicesCount = 0;
+  for (unsigned int i = 0; i < scene.mNumMeshes; ++i) {
+    verticesCount += scene.mMeshes[i]->mNumVertices;
+    indicesCount += scene.mMeshes[i]->mNumFaces * 3;
+  }
+  m_verticesCount = verticesCount;
+  m_indicesCount = indicesCount;
+
+  std::vector<SVertex> vertices(verticesCount, SVertex());
+  std::vector<SMeshIndices> meshes(scene.mNumMeshes);
+  m_ranges.resize(scene.mNumMeshes);
+
+  size_t vertexOffset = 0;
+  for (unsigned int i = 0; i < scene.mNumMeshes; ++i) {
+    const aiMesh* pMesh = scene.mMeshes[i];
+    assert(pMesh);
+
+    SMeshRange& range = m_ranges[i];
+    range.baseVertex = vertexOffset;
+    range.vertexCount = pMesh->mNumVertices;
+
+    const bool hasUV =
+        pMesh->mTextureCoords[0] && pMesh->mNumUVComponents[0] != 0;
+    assert(!hasUV || pMesh->mNumUVComponents[0] == 2);
+    assert(!pMesh->mTangents || pMesh->mBitangents);
+
+    SVertex* out = &vertices[vertexOffset];
+    for (unsigned int v = 0; v < pMesh->mNumVertices; ++v) {
+      out[v].pos = ToVec3(pMesh->mVertices[v]);
+      range.bounds.Extend(out[v].pos);
+      out[v].normal = ToVec3(pMesh->mNormals[v]);
+      if (hasUV)
+        out[v].uv = glm::vec2(pMesh->mTextureCoords[0][v][0],
+                              pMesh->mTextureCoords[0][v][1]);
+      if (pMesh->mTangents) {
+        out[v].tangent = ToVec3(pMesh->mTangents[v]);
+        out[v].bitangent = ToVec3(pMesh->mBitangents[v]);
+      }
+    }
+
+    std::vector<GLuint>& local = meshes[i].lods[0];
+    local.reserve(pMesh->mNumFaces * 3);
+    for (unsigned int f = 0; f < pMesh->mNumFaces; ++f) {
+      assert(pMesh->mFaces[f].mNumIndices == 3);
+      local.push_back(pMesh->mFaces[f].mIndices[0]);
+      local.push_back(pMesh->mFaces[f].mIndices[1]);
+      local.push_back(pMesh->mFaces[f].mIndices[2]);
+    }
+
+    if (!pMesh->mNumVertices)
+      range.bounds.min = range.bounds.max = glm::vec3(0.0f);
+    vertexOffset += pMesh->mNumVertices;
+  }
+
+  ProcessMeshes(vertices, meshes);
+
+  std::vector<GLuint> indices;
+  indices.reserve(indicesCount * 2);
+  for (unsigned int i = 0; i < scene.mNumMeshes; ++i) {
+    SMeshRange& range = m_ranges[i];
+    std::vector<bool> referenced;
+    for (unsigned int l = 0; l < range.lodsCount; ++l) {
+      const std::vector<GLuint>& lod = meshes[i].lods[l];
+      range.lods[l].firstIndex = indices.size();
+      range.lods[l].indexCount = lod.size();
+      indices.insert(indices.end(), lod.begin(), lod.end());
+
+      referenced.assign(range.vertexCount, false);
+      for (GLuint index : lod) {
+        range.lods[l].vertexCount += !referenced[index];
+        referenced[index] = true;
+      }
+    }
+    range.firstIndex = range.lods[0].firstIndex;
+    range.indexCount = range.lods[0].indexCount;
+  }
+  m_indicesCount = indices.size();
+
+  bool shortIndices = compact;
+  for (const SMeshRange& range : m_ranges)
+    shortIndices &= range.vertexCount < kShortIndexVertices;
+
+  m_compact = compact;
+  m_indexType = shortIndices ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+  m_indexSize = shortIndices ? sizeof(GLushort) : sizeof(GLuint);
+  m_vertexSize = compact ? sizeof(SCompactVertex) : sizeof(SVertex);
+
+  std::vector<GLushort> shorts;
+  if (shortIndices) shorts.assign(indices.begin(), indices.end());
+  const void* indexData =
+      shortIndices ? (const void*)shorts.data() : (const void*)indices.data();
+
+  if (compact) {
+    std::vector<SCompactVertex> packed(vertices.size());
+    for (size_t v = 0; v < vertices.size(); ++v)
+      packed[v] = Compress(vertices[v]);
+    Upload(packed.data(), indexData);
+  } else
+    Upload(vertices.data(), indexData);
+}
+
+void CGeometryArena::Restore(const std::vector<SMeshRange>& ranges,
+                             bool compact, GLenum indexType,
+                             size_t verticesCount, const void* vertices,
+                             size_t indicesCount, const void* indices) {
+  Release();
+
+  m_ranges = ranges;
+  m_verticesCount = verticesCount;
+  m_indicesCount = indicesCount;
+  m_compact = compact;
+  m_indexType = indexType;
+  m_indexSize =
+      indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+  m_vertexSize = compact ? sizeof(SCompactVertex) : sizeof(SVertex);
+  Upload(vertices, indices);
+}
+
+void CGeometryArena::ReadBack(std::vector<uint8_t>& vertices,
+                              std::vector<uint8_t>& indices) const {
+  vertices.resize(m_verticesCount * m_vertexSize);
+  indices.resize(m_indicesCount * m_indexSize);
+  // the copy target needs no VAO, unlike the element array one
+  glBindBuffer(GL_COPY_READ_BUFFER, m_VBO);
+  glGetBufferSubData(GL_COPY_READ_BUFFER, 0, vertices.size(), vertices.data());
+  glBindBuffer(GL_COPY_READ_BUFFER, m_EBO);
+  glGetBufferSubData(GL_COPY_READ_BUFFER, 0, indices.size(), indices.data());
+  glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
+void CGeometryArena::Upload(const void* vertices, const void* indices) {
+  glGenVertexArrays(1, &m_VAO);
+  glGenBuffers(1, &m_VBO);
+  glGenBuffers(1, &m_EBO);
+
+  glBindVertexArray(m_VAO);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_VBO);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_EBO);
+
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_indicesCount * m_indexSize, indices,
+               GL_STATIC_DRAW);
+  glBufferData(GL_ARRAY_BUFFER, m_verticesCount * m_vertexSize, vertices,
+               GL_STATIC_DRAW);
+
+  if (m_compact) {
+    const GLsizei stride = sizeof(SCompactVertex);
+    glVertexAttribPointer(vPosition, 3, GL_FLOAT, GL_FALSE, stride,
+                          (void*)offsetof(SCompactVertex, pos));
+    glEnableVertexAttribArray(vPosition);
+    glVertexAttribPointer(vNormals, 2, GL_SHORT, GL_TRUE, stride,
+                          (void*)offsetof(SCompactVertex, normal));
+    glEnableVertexAttribArray(vNormals);
+    glVertexAttribPointer(uvTextCoords, 2, GL_HALF_FLOAT, GL_FALSE, stride,
+                          (void*)offsetof(SCompactVertex, uv));
+    glEnableVertexAttribArray(uvTextCoords);
+    glVertexAttribPointer(vTangents, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride,
+                          (void*)offsetof(SCompactVertex, tangent));
+    glEnableVertexAttribArray(vTangents);
+
+    glBindVertexArray(0);
+    return;
+  }
+
+  const GLsizei stride = sizeof(SVertex);
+  glVertexAttribPointer(vPosition, 3, GL_FLOAT, GL_FALSE, stride,
+                        (void*)offsetof(SVertex, pos));
+  glEnableVertexAttribArray(vPosition);
+  glVertexAttribPointer(vNormals, 3, GL_FLOAT, GL_FALSE, stride,
+                        (void*)offsetof(SVertex, normal));
+  glEnableVertexAttribArray(vNormals);
+  glVertexAttribPointer(uvTextCoords, 2, GL_FLOAT, GL_FALSE, stride,
+                        (void*)offsetof(SVertex, uv));
+  glEnableVertexAttribArray(uvTextCoords);
+  glVertexAttribPointer(vTangents, 3, GL_FLOAT, GL_FALSE, stride,
+                        (void*)offsetof(SVertex, tangent));
+  glEnableVertexAttribArray(vTangents);
+  glVertexAttribPointer(vBitangents, 3, GL_FLOAT, GL_FALSE, stride,
+                        (void*)offsetof(SVertex, bitangent));
+  glEnableVertexAttribArray(vBitangents);
+
+  glBindVertexArray(0);
+}
+
+void CGeometryArena::ProcessMeshes(std::vector<SVertex>& vertices,
+                                   std::vector<SMeshIndices>& meshes) {
+  const unsigned int meshesCount = meshes.size();
+  std::vector<SVertexCacheStats> before(meshesCount);
+  std::vector<SVertexCacheStats> after(meshesCount);
+
+  // meshes are independent, workers take the next one until none is left
+  std::atomic<unsigned int> next(0);
+  auto worker = [&]() {
+    for (unsigned int i; (i = next++) < meshesCount;) {
+      SMeshRange& range = m_ranges[i];
+      SVertex* meshVertices = &vertices[range.baseVertex];
+      std::array<std::vector<GLuint>, kMaxMeshLods>& lods = meshes[i].lods;
+
+      before[i] = MeasureVertexCache(lods[0], range.vertexCount);
+      OptimizeMesh(meshVertices, range.vertexCount, lods[0]);
+      after[i] = MeasureVertexCache(lods[0], range.vertexCount);
+
+      // every level is simplified from the full mesh, so errors do not add up
+      range.lodsCount = 1;
+      for (unsigned int l = 1; l < kMaxMeshLods; ++l) {
+        const size_t prevCount = lods[l - 1].size();
+        if (prevCount / 3 < kMinLodTriangles) break;
+
+        const float error =
+            SimplifyMesh(meshVertices, range.vertexCount, lods[0],
+                         (lods[0].size() >> l) / 3 * 3, lods[l]);
+        if (lods[l].size() > prevCount * kMinLodReduction) break;
+
+        OptimizeTriangleOrder(meshVertices, range.vertexCount, lods[l]);
+        range.lods[l].error = error;
+        range.lodsCount = l + 1;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads(
+      std::min(std::max(std::thread::hardware_concurrency(), 1u),
+               std::max(meshesCount, 1u)) -
+      1);
+  for (std::thread& t : threads) t = std::thread(worker);
+  worker();
+  for (std::thread& t : threads) t.join();
+
+  for (unsigned int i = 0; i < meshesCount; ++i) {
+    printf("mesh %u: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, LOD triangles", i,
+           before[i].acmr, after[i].acmr, before[i].atvr, after[i].atvr);
+    for (unsigned int l = 0; l < m_ranges[i].lodsCount; ++l)
+      printf(" %zu", meshes[i].lods[l].size() / 3);
+    printf("\n");
+  }
+}
+
+void CGeometryArena::Release() {
+  if (m_VAO) glDeleteVertexArrays(1, &m_VAO);
+  if (m_VBO) glDeleteBuffers(1, &m_VBO);
+  if (m_EBO) glDeleteBuffers(1, &m_EBO);
+  m_VAO = m_VBO = m_EBO = 0;
+
+  m_ranges.clear();
+  m_verticesCount = m_indicesCount = 0;
+}
+
+size_t CGeometryArena::Bytes() const {
+  return m_verticesCount * m_vertexSize + m_indicesCount * m_indexSize;
+}
+
+size_t CGeometryArena::FullBytes() const {
+  return m_verticesCount * sizeof(SVertex) + m_indicesCount * sizeof(GLuint);
+}
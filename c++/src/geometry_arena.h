@@ -0,0 +1,134 @@
+#pragma once
+
+#include "culling.h"
+
+#include <GL/gl3w.h>
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+struct aiScene;
+
+enum Attrib_IDs {
+  vPosition = 0,
+  vNormals = 1,
+  uvTextCoords = 2,
+  vTangents = 3,
+  vBitangents = 4,
+  vDrawId = 5,  // per-draw index of the multi draw path, see CMultiDraw
+  vInstanceModel = 6,  // 6..9, world matrix of instanced draws
+  // per-instance colour of the light models, which have no normals
+  vLightColor = vNormals
+};
+
+// interleaved vertex of the arena. Attributes missing in a mesh are zeroed.
+struct SVertex {
+  glm::vec3 pos;
+  glm::vec3 normal;
+  glm::vec2 uv;
+  glm::vec3 tangent;
+  glm::vec3 bitangent;
+};
+
+// compact vertex of the arena, decoded by shaders built with
+// COMPACT_VERTICES. The bitangent is rebuilt as cross(normal, tangent) * w.
+struct SCompactVertex {
+  glm::vec3 pos;
+  int16_t normal[2];  // octahedral, snorm
+  uint16_t uv[2];     // half float
+  uint32_t tangent;   // snorm 10-10-10, bitangent sign in the 2 bit w
+};
+
+static_assert(sizeof(SCompactVertex) == 24, "unexpected compact padding");
+
+// full mesh plus up to three simplified versions
+constexpr const unsigned int kMaxMeshLods = 4;
+
+// index range of one level of detail. All levels of a mesh share its
+// vertices.
+struct SMeshLod {
+  GLuint firstIndex{0};
+  GLsizei indexCount{0};
+  GLsizei vertexCount{0};  // of the mesh's vertices referenced by the level
+  // object space distance from the level's surface to the farthest vertex
+  // of the full mesh it dropped, see SimplifyMesh()
+  float error{0.0f};
+};
+
+// where a mesh lives in the arena. Indices are mesh local, baseVertex is
+// added by glDrawElementsBaseVertex. firstIndex and indexCount are those of
+// lods[0].
+struct SMeshRange {
+  GLuint firstIndex{0};
+  GLsizei indexCount{0};
+  GLint baseVertex{0};
+  GLsizei vertexCount{0};
+  std::array<SMeshLod, kMaxMeshLods> lods;
+  unsigned int lodsCount{1};
+  SAABB bounds;  // model space, zero for an empty mesh
+};
+
+// Every mesh of the scene packed into one vertex and one index buffer behind
+// a single VAO.
+//
+// With compact set vertices are stored as SCompactVertex, and indices are 16
+// bit when every mesh fits, since they are mesh local. The index type is
+// shared by the whole arena because a multi draw call takes only one.
+class CGeometryArena {
+ public:
+  void Build(const aiScene& scene, bool compact);
+  // takes buffers already in the final layout, as Build() leaves them, e.g.
+  // from the scene cache
+  void Restore(const std::vector<SMeshRange>& ranges, bool compact,
+               GLenum indexType, size_t verticesCount, const void* vertices,
+               size_t indicesCount, const void* indices);
+  void Release();
+
+  // copies the buffers back, for the scene cache
+  void ReadBack(std::vector<uint8_t>& vertices,
+                std::vector<uint8_t>& indices) const;
+
+  GLuint VAO() const { return m_VAO; }
+  // indexed by mesh id
+  const std::vector<SMeshRange>& Ranges() const { return m_ranges; }
+
+  bool Compact() const { return m_compact; }
+  GLenum IndexType() const { return m_indexType; }
+  size_t IndexSize() const { return m_indexSize; }
+  size_t VertexSize() const { return m_vertexSize; }
+
+  // buffer sizes in bytes, Full*() as they would be in the SVertex layout
+  // with 32 bit indices
+  size_t Bytes() const;
+  size_t FullBytes() const;
+
+ private:
+  // index lists of one mesh while the arena is built
+  struct SMeshIndices {
+    std::array<std::vector<GLuint>, kMaxMeshLods> lods;
+  };
+
+  // reorders every mesh for the vertex caches and simplifies it into its LOD
+  // chain, meshes in parallel
+  void ProcessMeshes(std::vector<SVertex>& vertices,
+                     std::vector<SMeshIndices>& meshes);
+  // creates the buffers and the VAO for the layout the members describe
+  void Upload(const void* vertices, const void* indices);
+
+  std::vector<SMeshRange> m_ranges;
+  size_t m_verticesCount{0};
+  size_t m_indicesCount{0};
+
+  bool m_compact{false};
+  GLenum m_indexType{GL_UNSIGNED_INT};
+  size_t m_indexSize{sizeof(GLuint)};
+  size_t m_vertexSize{sizeof(SVertex)};
+
+  GLuint m_VAO{0};
+  GLuint m_VBO{0};
+  GLuint m_EBO{0};
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+// GL_TIME_ELAPSED around a block of commands. Two queries alternate so the
+// result read back is one frame old and never stalls the pipeline.
+class CGpuTimer {
+ public:
+  void Begin() {
+    if (!m_queries[0]) glGenQueries(2, m_queries);
+    glBeginQuery(GL_TIME_ELAPSED, m_queries[m_frame % 2]);
+  }
+
+  // true when the result of the previous frame was read
+  bool End() {
+    glEndQuery(GL_TIME_ELAPSED);
+
+    const GLuint prev = m_queries[(m_frame + 1) % 2];
+    GLint available = 0;
+    if (m_frame)
+      glGetQueryObjectiv(prev, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available) {
+      GLuint64 ns = 0;
+      glGetQueryObjectui64v(prev, GL_QUERY_RESULT, &ns);
+      m_lastMs = ns / 1000000.0f;
+    }
+    ++m_frame;
+    return available != 0;
+  }
+
+  float LastMs() const { return m_lastMs; }
+
+ private:
+  GLuint m_queries[2] = {0, 0};
+  unsigned int m_frame{0};
+  float m_lastMs{0.0f};
+};
+
+// A pass timed under a few render modes for A/B comparisons, e.g. a bit per
+// toggle. A reading is kept under its mode only when the frame before ran
+// the pass in the same mode, so the frame of a switch and a pass resumed
+// after frames without it don't credit a stale query to the wrong mode.
+class CGpuModeTimer {
+ public:
+  static const unsigned int kModes = 4;
+
+  void Begin() { m_timer.Begin(); }
+
+  void End(unsigned int mode, unsigned int frame) {
+    const bool read = m_timer.End();
+    if (read && m_frame + 1 == frame && m_mode == mode)
+      m_ms[mode] = m_timer.LastMs();
+    m_mode = mode;
+    m_frame = frame;
+  }
+
+  float Ms(unsigned int mode) const { return m_ms[mode]; }
+
+ private:
+  CGpuTimer m_timer;
+  unsigned int m_mode{0};
+  unsigned int m_frame{~0u};
+  float m_ms[kModes]{};
+};
@@ -0,0 +1,185 @@
+#include "hiz_occlusion.h"
+#include "shader.h"
+
+#include <algorithm>
+#include <cmath>
+
+static const TUniform<int> uSrcDepth("srcDepth");
+static const TUniform<int> uSrcLevel("srcLevel");
+static const TUniform<bool> uCopyLevel("copyLevel");
+static const TUniform<int> uDstLevel("dstLevel");
+
+static const TUniform<int> uCommandsCount("commandsCount");
+static const TUniform<int> uPhase("phase");
+static const TUniform<glm::mat4> uViewProj("viewProj");
+static const TUniform<bool> uHiZValid("hiZValid");
+static const TUniform<int> uHiZ("hiZ");
+static const TUniform<glm::vec2> uHiZSize("hiZSize");
+static const TUniform<int> uHiZLevels("hiZLevels");
+
+static const int kBuildGroupSize = 8;
+static const int kCullGroupSize = 64;
+
+void CHiZOcclusion::Init(const std::shared_ptr<CShader>& buildProgram,
+                         const std::shared_ptr<CShader>& cullProgram,
+                         GLint textureUnit) {
+  m_buildProgram = buildProgram;
+  m_cullProgram = cullProgram;
+  m_textureUnit = textureUnit;
+
+  m_buildProgram->use();
+  m_buildProgram->set(uSrcDepth, textureUnit);
+  m_buildProgram->set(uDstLevel, 0);
+
+  m_cullProgram->bindStorageBlock("Commands", kCommandsStorageBinding);
+  m_cullProgram->bindStorageBlock("Bounds", kBoundsStorageBinding);
+  m_cullProgram->bindStorageBlock("Rejected", kRejectedStorageBinding);
+  m_cullProgram->bindStorageBlock("OcclusionStats",
+                                  kOcclusionStatsStorageBinding);
+  m_cullProgram->use();
+  m_cullProgram->set(uHiZ, textureUnit);
+}
+
+void CHiZOcclusion::Build(const std::vector<SDrawItem>& items) {
+  Release();
+
+  m_boxes.resize(items.size());
+  glGenBuffers(1, &m_boundsBuffer);
+  UpdateBounds(items);
+
+  glGenBuffers(1, &m_rejectedBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_rejectedBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, items.size() * sizeof(GLuint),
+               nullptr, GL_DYNAMIC_DRAW);
+
+  const GLuint zero = 0;
+  glGenBuffers(2, m_statsBuffers);
+  for (GLuint buffer : m_statsBuffers) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), &zero,
+                 GL_DYNAMIC_READ);
+  }
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void CHiZOcclusion::Release() {
+  if (m_pyramid) glDeleteTextures(1, &m_pyramid);
+  if (m_boundsBuffer) glDeleteBuffers(1, &m_boundsBuffer);
+  if (m_rejectedBuffer) glDeleteBuffers(1, &m_rejectedBuffer);
+  if (m_statsBuffers[0]) glDeleteBuffers(2, m_statsBuffers);
+  m_pyramid = m_boundsBuffer = m_rejectedBuffer = 0;
+  m_statsBuffers[0] = m_statsBuffers[1] = 0;
+
+  m_width = m_height = m_levels = 0;
+  m_valid = false;
+  m_boxes.clear();
+}
+
+void CHiZOcclusion::UpdateBounds(const std::vector<SDrawItem>& items) {
+  if (!m_boundsBuffer) return;
+
+  for (size_t i = 0; i < items.size(); ++i) {
+    m_boxes[i].min = glm::vec4(items[i].bounds.min, 1.0f);
+    m_boxes[i].max = glm::vec4(items[i].bounds.max, 1.0f);
+  }
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_boundsBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, m_boxes.size() * sizeof(SBoxStd430),
+               m_boxes.data(), GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void CHiZOcclusion::CullPrevious(GLuint commandBuffer, size_t commandsCount) {
+  // phase 1 opens a frame: collect last frame's counter, which had a whole
+  // frame to land, and reset the one this frame writes
+  ++m_frame;
+  const GLuint statsBuffer = m_statsBuffers[m_frame % 2];
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_statsBuffers[(m_frame + 1) % 2]);
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &m_occluded);
+  const GLuint zero = 0;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, statsBuffer);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &zero);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  Dispatch(1, m_viewProj, commandBuffer, commandsCount);
+}
+
+void CHiZOcclusion::CullDisoccluded(GLuint depthTexture, int width,
+                                   int height, const glm::mat4& viewProj,
+                                   GLuint commandBuffer,
+                                   size_t commandsCount) {
+  BuildPyramid(depthTexture, width, height);
+  m_viewProj = viewProj;
+  m_valid = true;
+
+  Dispatch(2, viewProj, commandBuffer, commandsCount);
+}
+
+void CHiZOcclusion::BuildPyramid(GLuint depthTexture, int width, int height) {
+  if (width != m_width || height != m_height) {
+    if (m_pyramid) glDeleteTextures(1, &m_pyramid);
+    m_width = width;
+    m_height = height;
+    m_levels = 1 + (int)std::floor(std::log2((float)std::max(width, height)));
+
+    glGenTextures(1, &m_pyramid);
+    glBindTexture(GL_TEXTURE_2D, m_pyramid);
+    glTexStorage2D(GL_TEXTURE_2D, m_levels, GL_R32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+
+  m_buildProgram->use();
+  glActiveTexture(GL_TEXTURE0 + m_textureUnit);
+
+  int w = width;
+  int h = height;
+  for (int level = 0; level < m_levels; ++level) {
+    // level 0 copies the depth buffer, the others reduce the level below
+    glBindTexture(GL_TEXTURE_2D, level ? m_pyramid : depthTexture);
+    m_buildProgram->set(uCopyLevel, level == 0);
+    m_buildProgram->set(uSrcLevel, std::max(level - 1, 0));
+    glBindImageTexture(0, m_pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY,
+                       GL_R32F);
+
+    glDispatchCompute((w + kBuildGroupSize - 1) / kBuildGroupSize,
+                      (h + kBuildGroupSize - 1) / kBuildGroupSize, 1);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT |
+                    GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+    w = std::max(w / 2, 1);
+    h = std::max(h / 2, 1);
+  }
+}
+
+void CHiZOcclusion::Dispatch(int phase, const glm::mat4& viewProj,
+                             GLuint commandBuffer, size_t commandsCount) {
+  if (!commandsCount) return;
+
+  m_cullProgram->use();
+  m_cullProgram->set(uCommandsCount, (int)commandsCount);
+  m_cullProgram->set(uPhase, phase);
+  m_cullProgram->set(uViewProj, viewProj);
+  m_cullProgram->set(uHiZValid, m_valid);
+  m_cullProgram->set(uHiZSize, glm::vec2(m_width, m_height));
+  m_cullProgram->set(uHiZLevels, m_levels);
+
+  glActiveTexture(GL_TEXTURE0 + m_textureUnit);
+  glBindTexture(GL_TEXTURE_2D, m_pyramid);
+
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, kCommandsStorageBinding,
+                   commandBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, kBoundsStorageBinding,
+                   m_boundsBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, kRejectedStorageBinding,
+                   m_rejectedBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, kOcclusionStatsStorageBinding,
+                   m_statsBuffers[m_frame % 2]);
+
+  glDispatchCompute((commandsCount + kCullGroupSize - 1) / kCullGroupSize, 1,
+                    1);
+  glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
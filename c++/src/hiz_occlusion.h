@@ -0,0 +1,80 @@
+#pragma once
+
+#include "render_queue.h"
+
+#include <GL/gl3w.h>
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
+
+#include <memory>
+#include <vector>
+
+class CShader;
+
+// shader storage binding points of the occlusion cull program. 0 is taken by
+// the Draws block of the multi draw path.
+constexpr const GLuint kCommandsStorageBinding = 1;
+constexpr const GLuint kBoundsStorageBinding = 2;
+constexpr const GLuint kRejectedStorageBinding = 3;
+constexpr const GLuint kOcclusionStatsStorageBinding = 4;
+
+// std430 mirror of the Box struct in the Bounds block
+struct SBoxStd430 {
+  glm::vec4 min;
+  glm::vec4 max;
+};
+
+// Two phase hierarchical Z occlusion culling of indirect commands.
+//
+// Phase 1 zeroes instanceCount of commands whose bounds are hidden behind the
+// pyramid of the previous frame, reprojected with that frame's view-proj.
+// After the survivors are drawn the pyramid is rebuilt from the fresh depth
+// and phase 2 re-enables the phase 1 rejects which turned out visible, so
+// disoccluded meshes show up in the same frame.
+class CHiZOcclusion {
+ public:
+  void Init(const std::shared_ptr<CShader>& buildProgram,
+            const std::shared_ptr<CShader>& cullProgram, GLint textureUnit);
+  void Build(const std::vector<SDrawItem>& items);
+  void Release();
+
+  // re-uploads bounds after the render queue was refitted
+  void UpdateBounds(const std::vector<SDrawItem>& items);
+  // drops the pyramid, phase 1 then keeps everything until it is rebuilt
+  void Invalidate() { m_valid = false; }
+
+  void CullPrevious(GLuint commandBuffer, size_t commandsCount);
+  void CullDisoccluded(GLuint depthTexture, int width, int height,
+                       const glm::mat4& viewProj, GLuint commandBuffer,
+                       size_t commandsCount);
+
+  // meshes rejected by both phases, read back one frame late
+  unsigned int Occluded() const { return m_occluded; }
+
+ private:
+  void BuildPyramid(GLuint depthTexture, int width, int height);
+  void Dispatch(int phase, const glm::mat4& viewProj, GLuint commandBuffer,
+                size_t commandsCount);
+
+  std::shared_ptr<CShader> m_buildProgram;
+  std::shared_ptr<CShader> m_cullProgram;
+  GLint m_textureUnit{0};
+
+  // R32F farthest depth pyramid
+  GLuint m_pyramid{0};
+  int m_width{0};
+  int m_height{0};
+  int m_levels{0};
+  bool m_valid{false};
+  glm::mat4 m_viewProj;  // of the depth in the pyramid
+
+  std::vector<SBoxStd430> m_boxes;
+  GLuint m_boundsBuffer{0};
+  GLuint m_rejectedBuffer{0};
+
+  // occluded counters, written and read on alternate frames
+  GLuint m_statsBuffers[2] = {0, 0};
+  int m_frame{0};
+  unsigned int m_occluded{0};
+};
@@ -0,0 +1,31 @@
+#include "instance_buffer.h"
+
+void CInstanceBuffer::Release() {
+  if (m_buffer) glDeleteBuffers(1, &m_buffer);
+  m_buffer = 0;
+  m_capacity = 0;
+}
+
+void CInstanceBuffer::Upload(const std::vector<glm::mat4>& matrices) {
+  if (!m_buffer) glGenBuffers(1, &m_buffer);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+  if (matrices.size() > m_capacity) m_capacity = matrices.size() * 2;
+  glBufferData(GL_ARRAY_BUFFER, m_capacity * sizeof(glm::mat4), nullptr,
+               GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, matrices.size() * sizeof(glm::mat4),
+                  matrices.data());
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void CInstanceBuffer::Bind(GLuint location, size_t first) const {
+  glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+  for (GLuint c = 0; c < 4; ++c) {
+    const size_t offset = (first * 4 + c) * sizeof(glm::vec4);
+    glVertexAttribPointer(location + c, 4, GL_FLOAT, GL_FALSE,
+                          sizeof(glm::mat4), (void*)offset);
+    glVertexAttribDivisor(location + c, 1);
+    glEnableVertexAttribArray(location + c);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
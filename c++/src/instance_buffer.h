@@ -0,0 +1,26 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <glm/mat4x4.hpp>
+
+#include <vector>
+
+// Per-instance world matrices of a pass, streamed into a vertex buffer and
+// read through a mat4 attribute with divisor 1. Batches share one upload
+// and select their slice by re-pointing the attribute.
+class CInstanceBuffer {
+ public:
+  void Release();
+
+  // replaces the content, orphaning the storage in use by earlier draws
+  void Upload(const std::vector<glm::mat4>& matrices);
+
+  // points the four columns at location..location + 3 of the bound VAO at
+  // matrix first of the last Upload()
+  void Bind(GLuint location, size_t first) const;
+
+ private:
+  GLuint m_buffer{0};
+  size_t m_capacity{0};
+};
@@ -0,0 +1,200 @@
+#include "light_system.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+static glm::vec3 ToVec3(const aiColor3D& c) {
+  return glm::vec3(c[0], c[1], c[2]);
+}
+
+// solves constant + linear * d + quadratic * d^2 = 256 / 5, where a light
+// at full intensity drops below 5 of 256 levels. 0 when it starts below.
+static float AttenuationRange(const glm::vec3& attenuation) {
+  const float c = attenuation[0] - 256.0f / 5.0f;
+  const float l = attenuation[1];
+  const float q = attenuation[2];
+  if (c >= 0.0f) return 0.0f;
+  if (q > 0.0f)
+    return std::max(
+        (-l + std::sqrt(l * l - 4.0f * q * c)) / (2.0f * q), 0.0f);
+  if (l > 0.0f) return -c / l;
+  return FLT_MAX;
+}
+
+void CLightSystem::Build(const aiScene& scene,
+                         const CTransformHierarchy& hierarchy) {
+  Release();
+
+  int pointLightsCount = 0;
+  int dirLightsCount = 0;
+
+  for (unsigned int i = 0; i < scene.mNumLights; ++i) {
+    const aiLight& light = *scene.mLights[i];
+    assert(light.mType == aiLightSource_POINT ||
+           light.mType == aiLightSource_DIRECTIONAL);
+
+    int slot = 0;
+    if (light.mType == aiLightSource_POINT) {
+      slot = pointLightsCount++;
+    } else {
+      assert(dirLightsCount < kMaxDirLights &&
+             "more than one dir light is not supported now due to one dir "
+             "shadowmap.");
+      slot = dirLightsCount++;
+    }
+
+    const int lightNode = hierarchy.Find(light.mName.C_Str());
+    assert(lightNode >= 0);
+
+    m_names.push_back(light.mName.C_Str());
+    m_types.push_back(light.mType);
+    m_nodes.push_back(lightNode);
+    m_slots.push_back(slot);
+    m_attenuation.push_back(glm::vec3(light.mAttenuationConstant,
+                                      light.mAttenuationLinear,
+                                      light.mAttenuationQuadratic));
+    m_ranges.push_back(AttenuationRange(m_attenuation.back()));
+    m_ambient.push_back(ToVec3(light.mColorAmbient));
+    m_diffuse.push_back(ToVec3(light.mColorDiffuse));
+    m_specular.push_back(ToVec3(light.mColorSpecular));
+    m_transforms.push_back(glm::mat4(1.0f));
+  }
+
+  if (pointLightsCount > kMaxPointLights)
+    std::cout << "[WARNING] " << pointLightsCount << " point lights, only the "
+              << "tiled light path shades more than " << kMaxPointLights
+              << std::endl;
+
+  memset(&m_block, 0, sizeof(m_block));
+  m_block.nPointLights = std::min(pointLightsCount, kMaxPointLights);
+  m_block.nDirLights = dirLightsCount;
+  for (glm::ivec4& shadow : m_block.pointShadows)
+    shadow = glm::ivec4(-1, -1, 0, 0);
+
+  SPointLightStd430 pointLight;
+  memset(&pointLight, 0, sizeof(pointLight));
+  pointLight.shadow = glm::ivec4(-1, -1, 0, 0);
+  m_pointLights.assign(pointLightsCount, pointLight);
+
+  glGenBuffers(1, &m_UBO);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_UBO);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(m_block), nullptr, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+  // an empty scene still gets an element, a zero sized buffer can't be bound
+  if (gl3wIsSupported(4, 3)) {
+    glGenBuffers(1, &m_SSBO);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_SSBO);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 std::max(m_pointLights.size(), size_t(1)) *
+                     sizeof(SPointLightStd430),
+                 nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+}
+
+void CLightSystem::Release() {
+  if (m_UBO) glDeleteBuffers(1, &m_UBO);
+  m_UBO = 0;
+  if (m_SSBO) glDeleteBuffers(1, &m_SSBO);
+  m_SSBO = 0;
+  m_pointLights.clear();
+
+  m_names.clear();
+  m_types.clear();
+  m_nodes.clear();
+  m_slots.clear();
+  m_attenuation.clear();
+  m_ranges.clear();
+  m_ambient.clear();
+  m_diffuse.clear();
+  m_specular.clear();
+  m_transforms.clear();
+}
+
+void CLightSystem::Update(const CTransformHierarchy& hierarchy, bool ambient,
+                          bool diffuse, bool specular, float farPlane) {
+  if (!m_UBO) return;
+
+  const glm::vec3 zero(0.0f);
+  for (size_t i = 0; i < m_names.size(); ++i) {
+    const glm::mat4& t = m_transforms[i] = hierarchy.World(m_nodes[i]);
+
+    // ambient from the scene is ignored, a constant term looks better
+    const glm::vec3 amb = ambient ? glm::vec3(0.2f) : zero;
+    const glm::vec3 diff = diffuse ? m_diffuse[i] : zero;
+    const glm::vec3 spec = specular ? m_specular[i] : zero;
+
+    if (m_types[i] == aiLightSource_POINT) {
+      SPointLightStd430& p = m_pointLights[m_slots[i]];
+      SPointLightStd140& l = p.light;
+      l.pos = glm::vec3(t[3]);
+      l.constant = m_attenuation[i][0];
+      l.linear = m_attenuation[i][1];
+      l.quadratic = m_attenuation[i][2];
+      l.farPlane = farPlane;
+      l.ambient = amb;
+      l.diffuse = diff;
+      l.specular = spec;
+      p.range = std::min(m_ranges[i], farPlane);
+      if (m_slots[i] < kMaxPointLights) m_block.pointLights[m_slots[i]] = l;
+    } else {
+      SDirLightStd140& l = m_block.dirLights[m_slots[i]];
+      l.dir = glm::vec3(t[2]);
+      l.ambient = amb;
+      l.diffuse = diff;
+      l.specular = spec;
+    }
+  }
+
+  glBindBuffer(GL_UNIFORM_BUFFER, m_UBO);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(m_block), &m_block);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  glBindBufferBase(GL_UNIFORM_BUFFER, kLightsBlockBinding, m_UBO);
+
+  if (!m_SSBO) return;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_SSBO);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                  m_pointLights.size() * sizeof(SPointLightStd430),
+                  m_pointLights.data());
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, kPointLightsStorageBinding,
+                   m_SSBO);
+}
+
+void CLightSystem::SetShadow(size_t i, int tier, int layer) {
+  const int slot = m_slots[i];
+  glm::ivec4& shadow = m_pointLights[slot].shadow;
+  if (shadow.x == tier && shadow.y == layer) return;
+  shadow = glm::ivec4(tier, layer, 0, 0);
+
+  if (m_SSBO) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_SSBO);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                    slot * sizeof(SPointLightStd430) +
+                        offsetof(SPointLightStd430, shadow),
+                    sizeof(glm::ivec4), &shadow);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+  if (slot >= kMaxPointLights) return;
+  m_block.pointShadows[slot] = shadow;
+  if (!m_UBO) return;
+  glBindBuffer(GL_UNIFORM_BUFFER, m_UBO);
+  glBufferSubData(GL_UNIFORM_BUFFER,
+                  offsetof(SLightsBlockStd140, pointShadows) +
+                      slot * sizeof(glm::ivec4),
+                  sizeof(glm::ivec4), &shadow);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+int CLightSystem::Find(const std::string& name) const {
+  for (size_t i = 0; i < m_names.size(); ++i)
+    if (m_names[i] == name) return (int)i;
+  return -1;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include "transform_hierarchy.h"
+
+#include <assimp/scene.h>
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+#include <string>
+#include <vector>
+
+// sizes of the arrays in the Lights uniform block. Must match NR_POINT_LIGHTS
+// and NR_DIR_LIGHTS in every shader declaring the block.
+constexpr const int kMaxPointLights = 32;
+constexpr const int kMaxDirLights = 1;
+
+// uniform buffer binding point shared by every program using the Lights block
+constexpr const GLuint kLightsBlockBinding = 0;
+// shader storage binding of the PointLights block, next to the multi draw and
+// Hi-Z ones
+constexpr const GLuint kPointLightsStorageBinding = 5;
+
+// std140 mirrors of the Lights block. Every vec3 is followed by a scalar so
+// the C++ and GLSL layouts match without explicit padding rules.
+struct SPointLightStd140 {
+  glm::vec3 pos;
+  float constant;
+  glm::vec3 ambient;
+  float linear;
+  glm::vec3 diffuse;
+  float quadratic;
+  glm::vec3 specular;
+  float farPlane;
+};
+
+struct SDirLightStd140 {
+  glm::vec3 dir;
+  float pad0;
+  glm::vec3 ambient;
+  float pad1;
+  glm::vec3 diffuse;
+  float pad2;
+  glm::vec3 specular;
+  float pad3;
+};
+
+struct SLightsBlockStd140 {
+  SPointLightStd140 pointLights[kMaxPointLights];
+  SDirLightStd140 dirLights[kMaxDirLights];
+  int nPointLights;
+  int nDirLights;
+  int pad[2];
+  // shadow atlas tier and layer of each point light, tier -1 without shadow
+  glm::ivec4 pointShadows[kMaxPointLights];
+};
+
+// std430 element of the PointLights storage block, which holds every point
+// light of the scene while the Lights block stops at kMaxPointLights
+struct SPointLightStd430 {
+  SPointLightStd140 light;
+  glm::ivec4 shadow;
+  float range;  // capped by the far plane
+  float pad[3];
+};
+
+static_assert(sizeof(SPointLightStd140) == 64, "std140 layout mismatch");
+static_assert(sizeof(SDirLightStd140) == 64, "std140 layout mismatch");
+static_assert(sizeof(SLightsBlockStd140) % 16 == 0, "std140 layout mismatch");
+static_assert(sizeof(SPointLightStd430) == 96, "std430 layout mismatch");
+
+// Scene lights in SoA form. Light nodes are resolved once at Build(), the
+// Lights block and, with GL 4.3, the PointLights storage block are packed and
+// uploaded once per frame in Update().
+class CLightSystem {
+ public:
+  void Build(const aiScene& scene, const CTransformHierarchy& hierarchy);
+  void Release();
+
+  // refreshes world transforms of the light nodes, packs and uploads the
+  // block
+  void Update(const CTransformHierarchy& hierarchy, bool ambient, bool diffuse,
+              bool specular, float farPlane);
+
+  size_t Count() const { return m_names.size(); }
+  const std::string& Name(size_t i) const { return m_names[i]; }
+  aiLightSourceType Type(size_t i) const { return m_types[i]; }
+  // index in pointLights[] or dirLights[], depending on the type. Point
+  // lights from kMaxPointLights on are only in the storage block.
+  int Slot(size_t i) const { return m_slots[i]; }
+  const glm::mat4& Transform(size_t i) const { return m_transforms[i]; }
+  const glm::vec3& Diffuse(size_t i) const { return m_diffuse[i]; }
+  // distance at which the attenuation leaves a point light negligible
+  float Range(size_t i) const { return m_ranges[i]; }
+
+  // where the point light's shadow cube lives, uploaded right away
+  void SetShadow(size_t i, int tier, int layer);
+
+  // returns -1 if there is no light with this name
+  int Find(const std::string& name) const;
+
+  size_t PointLightsCount() const { return m_pointLights.size(); }
+
+ private:
+  std::vector<std::string> m_names;
+  std::vector<aiLightSourceType> m_types;
+  std::vector<int> m_nodes;  // index in the transform hierarchy
+  std::vector<int> m_slots;
+  std::vector<glm::vec3> m_attenuation;  // constant, linear, quadratic
+  std::vector<float> m_ranges;
+  std::vector<glm::vec3> m_ambient;
+  std::vector<glm::vec3> m_diffuse;
+  std::vector<glm::vec3> m_specular;
+  std::vector<glm::mat4> m_transforms;
+
+  SLightsBlockStd140 m_block;
+  GLuint m_UBO{0};
+  std::vector<SPointLightStd430> m_pointLights;
+  GLuint m_SSBO{0};
+};
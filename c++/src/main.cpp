@@ -1,5 +1,7 @@
 #include "draw.h"
 #include "shader.h"
+#include "scene_cache.h"
+#include "texture_cache.h"
 
 #include <imgui.h>
 #include <imgui_internal.h>
@@ -14,6 +16,7 @@
 #include <assimp/scene.h>
 
 #include <chrono>
+#include <cstring>
 #include <ctime>
 #include <iostream>
 #include <ratio>
@@ -330,6 +333,23 @@ void DrawUI(MyDrawController& mdc, const std::vector<float>& fpss) {
     ImGui::PopItemWidth();
   }
 
+  ImGui::SliderInt("shadow faces/frame",
+                   &MyDrawController::shadowFacesPerFrame, 1, 60);
+  ImGui::SliderInt("cascades", &MyDrawController::shadowCascades, 2, 4);
+  ImGui::SliderFloat("cascade split log/linear",
+                     &MyDrawController::cascadeSplitLambda, 0.0f, 1.0f);
+  ImGui::Text("Shadow maps updated: %u", MyDrawController::shadowMapsUpdated);
+  ImGui::Checkbox("omni shadows per face",
+                  &MyDrawController::omniShadowPerFace);
+  ImGui::Text("Shadow atlas: %d cubes, %.1f MB", CShadowAtlas::Capacity(),
+              MyDrawController::shadowAtlasBytes / (1024.0f * 1024.0f));
+  for (size_t i = 0; i < MyDrawController::omniShadowStats.size(); ++i)
+    ImGui::Text("%s: %d^2, %u triangles amplified, %u per face",
+                MyDrawController::pointLightNames[i].c_str(),
+                MyDrawController::omniShadowStats[i].size,
+                MyDrawController::omniShadowStats[i].amplified,
+                MyDrawController::omniShadowStats[i].PerFace());
+
   if (!MyDrawController::drawShadows) {
     ImGui::PopItemFlag();
     ImGui::PopStyleVar();
@@ -434,6 +454,62 @@ void DrawUI(MyDrawController& mdc, const std::vector<float>& fpss) {
 
   ImGui::PlotLines("Frame ms", fpss.data(), fpss.size(), 0, nullptr, 0.0f,
                    0.010, ImVec2(0, 80));
+  // counted over the previous Render(), should stay at 0 after warm up
+  ImGui::Text("Uniform lookups: %u", CUniformRegistry::Lookups());
+  ImGui::Text("Draw calls: %u, meshes: %u", MyDrawController::drawCalls,
+              MyDrawController::drawCommands);
+  ImGui::Text("Triangles: %u", MyDrawController::drawTriangles);
+  ImGui::Checkbox("LOD selection", &MyDrawController::lodSelection);
+  if (MyDrawController::lodSelection) {
+    ImGui::SliderFloat("LOD pixel error", &MyDrawController::lodPixelError,
+                       0.25f, 16.0f);
+    ImGui::SliderFloat("LOD hysteresis", &MyDrawController::lodHysteresis,
+                       0.0f, 0.9f);
+    ImGui::SliderFloat("Shadow LOD error scale",
+                       &MyDrawController::shadowLodErrorScale, 1.0f, 16.0f);
+  }
+  ImGui::Text("Vertex fetch: %.2f MB, compact layout saved %.2f MB",
+              MyDrawController::vertexFetchBytes / (1024.0f * 1024.0f),
+              MyDrawController::vertexFetchSavedBytes / (1024.0f * 1024.0f));
+  static const char* cullPassNames[kCullPassesCount] = {
+      "camera", "dir shadow", "point shadows"};
+  for (int i = 0; i < kCullPassesCount; ++i)
+    ImGui::Text("Culling %s: %u visible, %u culled", cullPassNames[i],
+                MyDrawController::cullStats[i].visible,
+                MyDrawController::cullStats[i].culled);
+  ImGui::Checkbox("Instancing", &MyDrawController::instancing);
+  ImGui::Checkbox("Shader permutations", &MyDrawController::shaderPermutations);
+  ImGui::Text("Camera pass: %.2f ms with subroutines, %.2f ms permuted",
+              MyDrawController::subroutinesPassMs,
+              MyDrawController::permutationsPassMs);
+  ImGui::SliderFloat("Texture upload MB/frame",
+                     &MyDrawController::textureUploadBudgetMB, 1.0f, 64.0f);
+  ImGui::Text("Streaming textures: %u", MyDrawController::streamingTextures);
+  ImGui::Text("Texture arrays: %u", MyDrawController::textureArrays);
+  if (ImGui::Checkbox("Multi draw indirect",
+                      &MyDrawController::multiDrawIndirect) &&
+      !CMultiDraw::IsSupported())
+    MyDrawController::multiDrawIndirect = false;
+  if (MyDrawController::multiDrawIndirect &&
+      MyDrawController::deferredShading) {
+    if (ImGui::Checkbox("Hi-Z occlusion", &MyDrawController::hiZOcclusion) &&
+        !CMultiDraw::IsSupported())
+      MyDrawController::hiZOcclusion = false;
+    ImGui::Text("Occluded meshes: %u", MyDrawController::occludedMeshes);
+    ImGui::Text("Geometry pass: %.2f ms, with Hi-Z: %.2f ms",
+                MyDrawController::geometryPassMs,
+                MyDrawController::geometryPassHiZMs);
+  }
+  if (MyDrawController::deferredShading) {
+    if (ImGui::Checkbox("Tiled lighting", &MyDrawController::tiledLighting) &&
+        !CMultiDraw::IsSupported())
+      MyDrawController::tiledLighting = false;
+    ImGui::Text("Point lights: %u, full-screen pass lights up to %d",
+                MyDrawController::pointLights, kMaxPointLights);
+    ImGui::Text("Light pass: %.2f ms full-screen, %.2f ms tiled",
+                MyDrawController::lightPassMs,
+                MyDrawController::tiledLightPassMs);
+  }
   ImGui::Checkbox("Clamp 60 FPS", &MyDrawController::clamp60FPS);
 
   // 2. Show another simple window. In most cases you will use an explicit
@@ -514,7 +590,7 @@ inline void Render(MyDrawController& mdc) {
   }
 }
 
-int main(int, char**) {
+int main(int argc, char** argv) {
   using namespace std::chrono;
 
   // Setup window
@@ -536,6 +612,15 @@ int main(int, char**) {
   glDebugMessageCallback(MessageCallback, 0);
 
   MyDrawController* mdc = new MyDrawController();
+  for (int i = 1; i < argc; ++i)
+    if (!strcmp(argv[i], "--compact-vertices"))
+      MyDrawController::compactVertices = true;
+    else if (!strcmp(argv[i], "--no-program-cache"))
+      CProgramCache::Directory().clear();
+    else if (!strcmp(argv[i], "--no-texture-cache"))
+      CTextureCache::Directory().clear();
+    else if (!strcmp(argv[i], "--no-scene-cache"))
+      CSceneCache::Directory().clear();
 
   // Setup ImGui binding
   ImGui_ImplGlfwGL3_Init(window, true);
@@ -563,6 +648,7 @@ int main(int, char**) {
 
     DrawUI(*mdc, fpss);
 
+    CUniformRegistry::Lookups() = 0;
     Render(*mdc);
 
     ImGui::Render();
@@ -0,0 +1,178 @@
+#include "material.h"
+#include "texture_arrays.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+uint32_t MaterialShaderKey(const aiMaterial& mat) {
+  uint32_t key = 0;
+  if (mat.GetTextureCount(aiTextureType_DIFFUSE)) {
+    key |= kShaderKeyTextured;
+    if (mat.GetTextureCount(aiTextureType_UNKNOWN))
+      key |= kShaderKeyOpacityMask;
+  }
+  if (mat.GetTextureCount(aiTextureType_HEIGHT) ||
+      mat.GetTextureCount(aiTextureType_NORMALS))
+    key |= kShaderKeyBumpMap;
+  if (mat.GetTextureCount(aiTextureType_AMBIENT))
+    key |= kShaderKeyReflectionMap;
+  return key;
+}
+
+unsigned int MaxMaterials() {
+  GLint blockSize = 0;
+  glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &blockSize);
+  return (unsigned int)blockSize / sizeof(SMaterialStd140);
+}
+
+std::string MaterialsDefines(unsigned int materialsCount) {
+  return "#define MAX_MATERIALS " +
+         std::to_string(std::max(materialsCount, 1u)) + "\n";
+}
+
+static GLuint ResolveTexture(const aiMaterial& mat, aiTextureType type,
+                             EMaterialTexture texture,
+                             const CMaterialTable::TTextureLoader& load) {
+  if (!mat.GetTextureCount(type)) return 0;
+
+  aiString path;
+  if (mat.GetTexture(type, 0, &path)) {
+    std::cout << "Texture reading fail\n";
+    return 0;
+  }
+  return load(path.C_Str(), texture);
+}
+
+void CMaterialTable::Build(const aiScene& scene,
+                           const TTextureLoader& loadTexture) {
+  Release();
+
+  // the scene loader refuses scenes past MaxMaterials()
+  m_block.resize(std::max(scene.mNumMaterials, 1u));
+  memset(m_block.data(), 0, m_block.size() * sizeof(SMaterialStd140));
+
+  m_materials.resize(scene.mNumMaterials);
+  for (unsigned int i = 0; i < scene.mNumMaterials; ++i) {
+    const aiMaterial& mat = *scene.mMaterials[i];
+    SCompiledMaterial& out = m_materials[i];
+
+    out.shaderKey = MaterialShaderKey(mat);
+    out.blockIndex = i;
+
+    out.textures[kMaterialTextureDiffuse] =
+        ResolveTexture(mat, aiTextureType_DIFFUSE, kMaterialTextureDiffuse,
+                       loadTexture);
+    out.textures[kMaterialTextureSpecular] =
+        ResolveTexture(mat, aiTextureType_SPECULAR, kMaterialTextureSpecular,
+                       loadTexture);
+    out.textures[kMaterialTextureReflection] =
+        ResolveTexture(mat, aiTextureType_AMBIENT, kMaterialTextureReflection,
+                       loadTexture);
+    // normal map can be placed under different names. can't figure out
+    out.textures[kMaterialTextureNormals] =
+        ResolveTexture(mat, aiTextureType_NORMALS, kMaterialTextureNormals,
+                       loadTexture);
+    if (!out.textures[kMaterialTextureNormals])
+      out.textures[kMaterialTextureNormals] =
+          ResolveTexture(mat, aiTextureType_HEIGHT, kMaterialTextureNormals,
+                         loadTexture);
+    out.textures[kMaterialTextureOpacity] =
+        ResolveTexture(mat, aiTextureType_UNKNOWN, kMaterialTextureOpacity,
+                       loadTexture);
+
+    SMaterialStd140& entry = m_block[i];
+    aiColor3D col;
+    if (!mat.Get(AI_MATKEY_COLOR_AMBIENT, col))
+      entry.ambient = glm::vec3(col[0], col[1], col[2]);
+    if (!mat.Get(AI_MATKEY_COLOR_DIFFUSE, col))
+      entry.diffuse = glm::vec3(col[0], col[1], col[2]);
+    if (!mat.Get(AI_MATKEY_COLOR_SPECULAR, col))
+      entry.specular = glm::vec3(col[0], col[1], col[2]);
+    if (mat.Get(AI_MATKEY_SHININESS, entry.shininess)) entry.shininess = 16.0f;
+  }
+
+  glGenBuffers(1, &m_UBO);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_UBO);
+  glBufferData(GL_UNIFORM_BUFFER, m_block.size() * sizeof(SMaterialStd140),
+               m_block.data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  glBindBufferBase(GL_UNIFORM_BUFFER, kMaterialsBlockBinding, m_UBO);
+}
+
+void CMaterialTable::Release() {
+  if (m_UBO) glDeleteBuffers(1, &m_UBO);
+  m_UBO = 0;
+
+  m_materials.clear();
+  m_block.clear();
+  for (auto& s : m_subroutines) s.clear();
+  m_subroutineLocations.fill(0);
+}
+
+std::vector<GLuint> CMaterialTable::PackTextures(CTextureArrays& arrays) {
+  std::vector<GLuint> textures;
+  for (const SCompiledMaterial& mat : m_materials)
+    for (GLuint texture : mat.textures)
+      if (texture) textures.push_back(texture);
+  std::sort(textures.begin(), textures.end());
+  textures.erase(std::unique(textures.begin(), textures.end()),
+                 textures.end());
+
+  std::vector<STextureLayer> layers;
+  arrays.Pack(textures, layers);
+
+  for (SCompiledMaterial& mat : m_materials)
+    for (int t = 0; t < kMaterialTexturesCount; ++t) {
+      if (!mat.textures[t]) continue;
+      const size_t i =
+          std::lower_bound(textures.begin(), textures.end(), mat.textures[t]) -
+          textures.begin();
+      mat.textures[t] = layers[i].array;
+      mat.layers[t] = layers[i].layer;
+    }
+
+  for (const SCompiledMaterial& mat : m_materials) {
+    SMaterialStd140& entry = m_block[mat.blockIndex];
+    entry.layers = glm::ivec4(mat.layers[kMaterialTextureDiffuse],
+                              mat.layers[kMaterialTextureSpecular],
+                              mat.layers[kMaterialTextureReflection],
+                              mat.layers[kMaterialTextureNormals]);
+    entry.opacityLayer = mat.layers[kMaterialTextureOpacity];
+  }
+  glBindBuffer(GL_UNIFORM_BUFFER, m_UBO);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0,
+                  m_block.size() * sizeof(SMaterialStd140), m_block.data());
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+  return textures;
+}
+
+std::vector<uint32_t> CMaterialTable::SortRanks() const {
+  std::vector<uint32_t> order(m_materials.size());
+  for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+    return m_materials[a].textures < m_materials[b].textures;
+  });
+
+  std::vector<uint32_t> ranks(order.size());
+  for (uint32_t i = 0; i < order.size(); ++i) ranks[order[i]] = i;
+  return ranks;
+}
+
+void CMaterialTable::AllocateSubroutines(EMaterialProgram program,
+                                         GLsizei locationsCount) {
+  m_subroutineLocations[program] = locationsCount;
+  m_subroutines[program].assign(
+      m_materials.size() * kMaterialVariantsCount * locationsCount, 0);
+}
+
+unsigned int CMaterialTable::Variant(bool skybox, bool shadows,
+                                     bool bumpMapping, bool heightBump) {
+  unsigned int variant = 0;
+  if (skybox) variant |= kMaterialVariantSkybox;
+  if (shadows) variant |= kMaterialVariantShadows;
+  if (bumpMapping) variant |= kMaterialVariantBumpMapping;
+  if (heightBump) variant |= kMaterialVariantHeightBump;
+  return variant;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <assimp/scene.h>
+
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+class CTextureArrays;
+
+// material features which select the shading path, through subroutines or
+// program permutations. Stored in the top bits of the render queue sort key.
+enum EShaderKeyBits : uint32_t {
+  kShaderKeyTextured = 1 << 0,
+  kShaderKeyOpacityMask = 1 << 1,
+  kShaderKeyBumpMap = 1 << 2,
+  kShaderKeyReflectionMap = 1 << 3,
+};
+
+uint32_t MaterialShaderKey(const aiMaterial& mat);
+
+// most materials the Materials uniform block holds on this driver
+unsigned int MaxMaterials();
+// sizes materials[] of the Materials block to a scene, an entry per material
+std::string MaterialsDefines(unsigned int materialsCount);
+
+// uniform buffer binding point of the Materials block
+constexpr const GLuint kMaterialsBlockBinding = 1;
+
+// std140 mirror of the Material struct in the Materials block
+struct SMaterialStd140 {
+  glm::vec3 ambient;
+  float shininess;
+  glm::vec3 diffuse;
+  float pad0;
+  glm::vec3 specular;
+  int opacityLayer;
+  glm::ivec4 layers;  // diffuse, specular, reflection, normals
+};
+
+static_assert(sizeof(SMaterialStd140) == 64, "std140 layout mismatch");
+
+enum EMaterialTexture {
+  kMaterialTextureDiffuse,
+  kMaterialTextureSpecular,
+  kMaterialTextureReflection,
+  kMaterialTextureNormals,
+  kMaterialTextureOpacity,
+  kMaterialTexturesCount
+};
+
+// global render toggles which change the subroutine selection of a material
+enum EMaterialVariantBits : unsigned int {
+  kMaterialVariantSkybox = 1 << 0,
+  kMaterialVariantShadows = 1 << 1,
+  kMaterialVariantBumpMapping = 1 << 2,
+  kMaterialVariantHeightBump = 1 << 3,
+  kMaterialVariantsCount = 1 << 4,
+};
+
+// programs which consume materials
+enum EMaterialProgram {
+  kMaterialProgramForward,
+  kMaterialProgramDeferred,
+  kMaterialProgramForwardMultiDraw,
+  kMaterialProgramDeferredMultiDraw,
+  kMaterialProgramForwardInstanced,
+  kMaterialProgramDeferredInstanced,
+  kMaterialProgramsCount
+};
+
+// immutable per-material state, compiled once at scene load
+struct SCompiledMaterial {
+  uint32_t shaderKey{0};
+  // GL_TEXTURE_2D_ARRAY, 0 if absent
+  std::array<GLuint, kMaterialTexturesCount> textures;
+  std::array<int, kMaterialTexturesCount> layers = {};
+  int blockIndex{0};  // entry in the Materials block
+};
+
+class CMaterialTable {
+ public:
+  // the slot lets the loader pick a fitting placeholder
+  using TTextureLoader =
+      std::function<GLuint(const char* path, EMaterialTexture texture)>;
+
+  // resolves textures and uploads plain colors to the Materials block
+  void Build(const aiScene& scene, const TTextureLoader& loadTexture);
+  void Release();
+
+  // moves the textures of every material into shared arrays and points the
+  // Materials block at their layers. Returns the textures it replaced, the
+  // caller still owns them.
+  std::vector<GLuint> PackTextures(CTextureArrays& arrays);
+
+  // position of every material ordered by texture arrays, materials binding
+  // the same arrays come out adjacent
+  std::vector<uint32_t> SortRanks() const;
+  // draws of both can go in one call: same arrays and same shading path
+  bool SameState(unsigned int a, unsigned int b) const {
+    return m_materials[a].shaderKey == m_materials[b].shaderKey &&
+           m_materials[a].textures == m_materials[b].textures;
+  }
+
+  // reserves subroutine index arrays of a program, filled by the caller
+  void AllocateSubroutines(EMaterialProgram program, GLsizei locationsCount);
+
+  size_t Count() const { return m_materials.size(); }
+  const SCompiledMaterial& Get(unsigned int matIndx) const {
+    return m_materials[matIndx];
+  }
+
+  // fragment stage index array ready for glUniformSubroutinesuiv
+  GLuint* Subroutines(EMaterialProgram program, unsigned int matIndx,
+                      unsigned int variant) {
+    return &m_subroutines[program][Offset(program, matIndx, variant)];
+  }
+  const GLuint* Subroutines(EMaterialProgram program, unsigned int matIndx,
+                            unsigned int variant) const {
+    return &m_subroutines[program][Offset(program, matIndx, variant)];
+  }
+
+  static unsigned int Variant(bool skybox, bool shadows, bool bumpMapping,
+                              bool heightBump);
+
+ private:
+  size_t Offset(EMaterialProgram program, unsigned int matIndx,
+                unsigned int variant) const {
+    return (matIndx * kMaterialVariantsCount + variant) *
+           m_subroutineLocations[program];
+  }
+
+  std::vector<SCompiledMaterial> m_materials;
+  std::vector<SMaterialStd140> m_block;
+  std::array<std::vector<GLuint>, kMaterialProgramsCount> m_subroutines;
+  std::array<GLsizei, kMaterialProgramsCount> m_subroutineLocations = {};
+
+  GLuint m_UBO{0};
+};
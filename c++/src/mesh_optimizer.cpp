@@ -0,0 +1,262 @@
+#include "mesh_optimizer.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <numeric>
+
+// a cluster may end where its ACMR comes this close to the ACMR of the
+// whole dead end to dead end run, the cache is cold at a cut anyway
+static const float kOverdrawThreshold = 1.05f;
+
+namespace {
+
+// FIFO post-transform cache, a vertex hits while fewer than
+// kVertexCacheSize misses happened since it was loaded
+class CVertexCache {
+ public:
+  explicit CVertexCache(size_t verticesCount)
+      : m_stamps(verticesCount, 0), m_time(kVertexCacheSize + 1) {}
+
+  // returns whether v missed
+  bool Access(GLuint v) {
+    if (m_time - m_stamps[v] < kVertexCacheSize) return false;
+    m_stamps[v] = m_time++;
+    return true;
+  }
+
+  unsigned int Misses(const GLuint* tri) {
+    return Access(tri[0]) + Access(tri[1]) + Access(tri[2]);
+  }
+
+  void Flush() { m_time += kVertexCacheSize; }
+
+ private:
+  std::vector<unsigned int> m_stamps;
+  unsigned int m_time;
+};
+
+}  // namespace
+
+SVertexCacheStats MeasureVertexCache(const std::vector<GLuint>& indices,
+                                     size_t verticesCount) {
+  SVertexCacheStats stats;
+  if (indices.empty() || !verticesCount) return stats;
+
+  CVertexCache cache(verticesCount);
+  unsigned int misses = 0;
+  for (size_t i = 0; i < indices.size(); i += 3)
+    misses += cache.Misses(&indices[i]);
+
+  stats.acmr = misses / (indices.size() / 3.0f);
+  stats.atvr = misses / (float)verticesCount;
+  return stats;
+}
+
+// next vertex with live triangles: the most recent dead end, else the first
+// one by index
+static int SkipDeadEnd(const std::vector<int>& live,
+                       std::vector<GLuint>& deadEnds, size_t& cursor) {
+  while (!deadEnds.empty()) {
+    const GLuint v = deadEnds.back();
+    deadEnds.pop_back();
+    if (live[v] > 0) return v;
+  }
+  for (; cursor < live.size(); ++cursor)
+    if (live[cursor] > 0) return cursor;
+  return -1;
+}
+
+// Tipsify triangle order. clusterStarts receives the positions in the order
+// where the fanning had to jump to an unrelated vertex.
+static std::vector<GLuint> Tipsify(const std::vector<GLuint>& indices,
+                                   size_t verticesCount,
+                                   std::vector<size_t>& clusterStarts) {
+  const size_t trianglesCount = indices.size() / 3;
+
+  // vertex -> triangles adjacency, flattened
+  std::vector<int> live(verticesCount, 0);
+  for (GLuint v : indices) ++live[v];
+  std::vector<size_t> offsets(verticesCount + 1, 0);
+  std::partial_sum(live.begin(), live.end(), offsets.begin() + 1);
+  std::vector<GLuint> adjacency(indices.size());
+  {
+    std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < indices.size(); ++i)
+      adjacency[fill[indices[i]]++] = i / 3;
+  }
+
+  std::vector<unsigned int> stamps(verticesCount, 0);
+  unsigned int time = kVertexCacheSize + 1;
+  std::vector<char> emitted(trianglesCount, 0);
+  std::vector<GLuint> deadEnds;
+  std::vector<GLuint> candidates;
+  size_t cursor = 0;
+
+  std::vector<GLuint> order;
+  order.reserve(trianglesCount);
+
+  int fan = SkipDeadEnd(live, deadEnds, cursor);
+  bool jumped = true;
+  while (fan >= 0) {
+    if (jumped) clusterStarts.push_back(order.size());
+
+    candidates.clear();
+    for (size_t a = offsets[fan]; a < offsets[fan + 1]; ++a) {
+      const GLuint t = adjacency[a];
+      if (emitted[t]) continue;
+      emitted[t] = 1;
+      order.push_back(t);
+
+      for (int c = 0; c < 3; ++c) {
+        const GLuint v = indices[t * 3 + c];
+        deadEnds.push_back(v);
+        candidates.push_back(v);
+        --live[v];
+        if (time - stamps[v] > kVertexCacheSize) stamps[v] = time++;
+      }
+    }
+
+    // prefer the candidate which stays in the cache while its remaining
+    // triangles are emitted, the oldest of them
+    int next = -1;
+    int best = -1;
+    for (GLuint v : candidates) {
+      if (live[v] <= 0) continue;
+      int priority = 0;
+      if (time - stamps[v] + 2 * live[v] <= kVertexCacheSize)
+        priority = time - stamps[v];
+      if (priority > best) {
+        best = priority;
+        next = v;
+      }
+    }
+
+    jumped = next < 0;
+    fan = jumped ? SkipDeadEnd(live, deadEnds, cursor) : next;
+  }
+
+  return order;
+}
+
+// splits every Tipsify cluster where its running ACMR, starting from a cold
+// cache, drops to the ACMR of the whole cluster
+static std::vector<size_t> SoftClusters(const std::vector<GLuint>& indices,
+                                        size_t verticesCount,
+                                        const std::vector<GLuint>& order,
+                                        const std::vector<size_t>& hard) {
+  std::vector<size_t> starts;
+  CVertexCache cache(verticesCount);
+
+  for (size_t c = 0; c < hard.size(); ++c) {
+    const size_t first = hard[c];
+    const size_t last = c + 1 < hard.size() ? hard[c + 1] : order.size();
+
+    cache.Flush();
+    unsigned int misses = 0;
+    for (size_t i = first; i < last; ++i)
+      misses += cache.Misses(&indices[order[i] * 3]);
+    const float acmr = misses / (float)(last - first);
+
+    cache.Flush();
+    starts.push_back(first);
+    misses = 0;
+    unsigned int triangles = 0;
+    for (size_t i = first; i + 1 < last; ++i) {
+      misses += cache.Misses(&indices[order[i] * 3]);
+      ++triangles;
+      if (misses <= kOverdrawThreshold * acmr * triangles) {
+        starts.push_back(i + 1);
+        cache.Flush();
+        misses = triangles = 0;
+      }
+    }
+  }
+
+  return starts;
+}
+
+void OptimizeTriangleOrder(const SVertex* vertices, size_t verticesCount,
+                           std::vector<GLuint>& indices) {
+  if (indices.empty()) return;
+
+  std::vector<size_t> hard;
+  const std::vector<GLuint> order = Tipsify(indices, verticesCount, hard);
+  const std::vector<size_t> starts =
+      SoftClusters(indices, verticesCount, order, hard);
+
+  // occlusion potential: clusters far out along their own normal tend to
+  // cover the rest of the mesh, so they go first
+  struct SCluster {
+    size_t first;
+    size_t last;
+    float potential;
+  };
+  std::vector<SCluster> clusters(starts.size());
+  std::vector<glm::vec3> centroids(starts.size(), glm::vec3(0.0f));
+  std::vector<glm::vec3> normals(starts.size(), glm::vec3(0.0f));
+  glm::vec3 meshCentroid(0.0f);
+  float meshArea = 0.0f;
+
+  for (size_t c = 0; c < starts.size(); ++c) {
+    SCluster& cluster = clusters[c];
+    cluster.first = starts[c];
+    cluster.last = c + 1 < starts.size() ? starts[c + 1] : order.size();
+
+    float area = 0.0f;
+    for (size_t i = cluster.first; i < cluster.last; ++i) {
+      const GLuint* tri = &indices[order[i] * 3];
+      const glm::vec3& a = vertices[tri[0]].pos;
+      const glm::vec3& b = vertices[tri[1]].pos;
+      const glm::vec3& d = vertices[tri[2]].pos;
+      const glm::vec3 n = glm::cross(b - a, d - a);
+      const float triArea = glm::length(n);
+      centroids[c] += (a + b + d) * (triArea / 3.0f);
+      normals[c] += n;
+      area += triArea;
+    }
+
+    meshCentroid += centroids[c];
+    meshArea += area;
+    if (area > 0.0f) centroids[c] /= area;
+  }
+  if (meshArea > 0.0f) meshCentroid /= meshArea;
+
+  for (size_t c = 0; c < clusters.size(); ++c) {
+    const float len = glm::length(normals[c]);
+    clusters[c].potential =
+        len > 0.0f ? glm::dot(centroids[c] - meshCentroid, normals[c] / len)
+                   : 0.0f;
+  }
+  std::stable_sort(clusters.begin(), clusters.end(),
+                   [](const SCluster& a, const SCluster& b) {
+                     return a.potential > b.potential;
+                   });
+
+  std::vector<GLuint> reordered;
+  reordered.reserve(indices.size());
+  for (const SCluster& cluster : clusters)
+    for (size_t i = cluster.first; i < cluster.last; ++i)
+      reordered.insert(reordered.end(), &indices[order[i] * 3],
+                       &indices[order[i] * 3] + 3);
+  indices.swap(reordered);
+}
+
+void OptimizeMesh(SVertex* vertices, size_t verticesCount,
+                  std::vector<GLuint>& indices) {
+  OptimizeTriangleOrder(vertices, verticesCount, indices);
+
+  // vertex fetch: number vertices by first use, unreferenced ones go last
+  const GLuint kUnused = ~0u;
+  std::vector<GLuint> remap(verticesCount, kUnused);
+  GLuint used = 0;
+  for (GLuint& v : indices) {
+    if (remap[v] == kUnused) remap[v] = used++;
+    v = remap[v];
+  }
+  for (GLuint& r : remap)
+    if (r == kUnused) r = used++;
+
+  std::vector<SVertex> original(vertices, vertices + verticesCount);
+  for (size_t v = 0; v < verticesCount; ++v) vertices[remap[v]] = original[v];
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "geometry_arena.h"
+
+#include <GL/gl3w.h>
+
+#include <vector>
+
+// post-transform cache the orders are tuned for and measured against
+constexpr const unsigned int kVertexCacheSize = 16;
+
+struct SVertexCacheStats {
+  float acmr{0.0f};  // cache misses per triangle
+  float atvr{0.0f};  // cache misses per vertex
+};
+
+// FIFO cache simulation of a mesh local triangle list
+SVertexCacheStats MeasureVertexCache(const std::vector<GLuint>& indices,
+                                     size_t verticesCount);
+
+// Load time reordering of one mesh, after Sander et al. "Fast Triangle
+// Reordering for Vertex Locality and Reduced Overdraw":
+// - Tipsify orders triangles for the post-transform cache
+// - the result is cut into clusters at its dead ends, and where the cache
+//   is cold anyway, and clusters facing away from the mesh center go first
+// - vertices are renumbered in order of first use for the pre-transform
+//   fetch
+// Indices are mesh local, the vertex slice is permuted in place.
+void OptimizeMesh(SVertex* vertices, size_t verticesCount,
+                  std::vector<GLuint>& indices);
+
+// the triangle steps of OptimizeMesh() alone, for index lists sharing
+// vertices already placed, like LODs
+void OptimizeTriangleOrder(const SVertex* vertices, size_t verticesCount,
+                           std::vector<GLuint>& indices);
@@ -0,0 +1,383 @@
+#include "mesh_simplifier.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+
+namespace {
+
+// symmetric 4x4 matrix, sum of squared distances to a set of planes
+struct SQuadric {
+  double xx{0}, xy{0}, xz{0}, xw{0};
+  double yy{0}, yz{0}, yw{0};
+  double zz{0}, zw{0};
+  double ww{0};
+
+  void AddPlane(const glm::vec3& n, float d) {
+    xx += n.x * n.x;
+    xy += n.x * n.y;
+    xz += n.x * n.z;
+    xw += n.x * d;
+    yy += n.y * n.y;
+    yz += n.y * n.z;
+    yw += n.y * d;
+    zz += n.z * n.z;
+    zw += n.z * d;
+    ww += (double)d * d;
+  }
+
+  SQuadric& operator+=(const SQuadric& q) {
+    xx += q.xx;
+    xy += q.xy;
+    xz += q.xz;
+    xw += q.xw;
+    yy += q.yy;
+    yz += q.yz;
+    yw += q.yw;
+    zz += q.zz;
+    zw += q.zw;
+    ww += q.ww;
+    return *this;
+  }
+
+  double Eval(const glm::vec3& p) const {
+    const double x = p.x, y = p.y, z = p.z;
+    return xx * x * x + 2 * xy * x * y + 2 * xz * x * z + 2 * xw * x +
+           yy * y * y + 2 * yz * y * z + 2 * yw * y + zz * z * z +
+           2 * zw * z + ww;
+  }
+};
+
+struct SCollapse {
+  double cost;
+  GLuint from;
+  GLuint to;
+};
+
+// triangles bucketed by the cells of a uniform grid their bounds overlap,
+// for closest triangle queries
+struct STriangleGrid {
+  glm::vec3 origin;
+  float cellSize{1.0f};
+  int cells[3]{1, 1, 1};
+  std::vector<uint64_t> entries;  // cell << 32 | triangle, sorted
+
+  uint64_t Key(const int cell[3]) const {
+    return (uint64_t)((cell[2] * cells[1] + cell[1]) * cells[0] + cell[0])
+           << 32;
+  }
+  int Cell(const glm::vec3& p, int axis) const {
+    const int c = (int)std::floor((p[axis] - origin[axis]) / cellSize);
+    return std::min(std::max(c, 0), cells[axis] - 1);
+  }
+};
+
+}  // namespace
+
+// share of the cheapest collapse candidates one pass may apply, the rest
+// wait for costs updated by the merged quadrics
+static const size_t kPassCandidatesDivisor = 3;
+
+static glm::vec3 TriangleNormal(const glm::vec3& a, const glm::vec3& b,
+                                const glm::vec3& c) {
+  return glm::cross(b - a, c - a);
+}
+
+// closest point of a triangle, Ericson's Real-Time Collision Detection 5.1.5
+static float PointTriangleDistance(const glm::vec3& p, const glm::vec3& a,
+                                   const glm::vec3& b, const glm::vec3& c) {
+  const glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+  const float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+  if (d1 <= 0.0f && d2 <= 0.0f) return glm::length(ap);
+
+  const glm::vec3 bp = p - b;
+  const float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+  if (d3 >= 0.0f && d4 <= d3) return glm::length(bp);
+
+  const float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+    return glm::length(ap - ab * (d1 / (d1 - d3)));
+
+  const glm::vec3 cp = p - c;
+  const float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+  if (d6 >= 0.0f && d5 <= d6) return glm::length(cp);
+
+  const float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+    return glm::length(ap - ac * (d2 / (d2 - d6)));
+
+  const float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+    return glm::length(bp - (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6))));
+
+  const float denom = va + vb + vc;
+  if (denom <= 0.0f) return glm::length(ap);  // degenerate
+  return glm::length(ap - ab * (vb / denom) - ac * (vc / denom));
+}
+
+// cells per axis of a STriangleGrid at most, bounds the key range
+static const int kMaxGridCells = 1024;
+// cells per axis the largest triangle may span, bounds the entries
+static const int kMaxTriangleCells = 16;
+
+static void BuildTriangleGrid(const SVertex* vertices,
+                              const std::vector<GLuint>& indices,
+                              STriangleGrid& grid) {
+  // a cell about the size of a triangle
+  glm::vec3 lo(HUGE_VALF), hi(-HUGE_VALF);
+  double extents = 0.0;
+  float largestExtent = 0.0f;
+  for (size_t i = 0; i < indices.size(); ++i) {
+    const glm::vec3& p = vertices[indices[i]].pos;
+    for (int axis = 0; axis < 3; ++axis) {
+      lo[axis] = std::min(lo[axis], p[axis]);
+      hi[axis] = std::max(hi[axis], p[axis]);
+    }
+    if (i % 3 == 2) {
+      float extent = 0.0f;
+      for (int axis = 0; axis < 3; ++axis)
+        for (int c = 1; c < 3; ++c)
+          extent = std::max(
+              extent, std::abs(vertices[indices[i - c]].pos[axis] - p[axis]));
+      extents += extent;
+      largestExtent = std::max(largestExtent, extent);
+    }
+  }
+  float largest = 0.0f;
+  for (int axis = 0; axis < 3; ++axis)
+    largest = std::max(largest, hi[axis] - lo[axis]);
+
+  grid.origin = lo;
+  grid.cellSize = std::max({(float)(extents * 3 / indices.size()),
+                            largestExtent / kMaxTriangleCells,
+                            largest / kMaxGridCells, 1e-6f});
+  for (int axis = 0; axis < 3; ++axis)
+    grid.cells[axis] = std::min(
+        (int)((hi[axis] - lo[axis]) / grid.cellSize) + 1, kMaxGridCells);
+
+  grid.entries.clear();
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    int from[3], to[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      from[axis] = to[axis] = grid.Cell(vertices[indices[i]].pos, axis);
+      for (int c = 1; c < 3; ++c) {
+        const int cell = grid.Cell(vertices[indices[i + c]].pos, axis);
+        from[axis] = std::min(from[axis], cell);
+        to[axis] = std::max(to[axis], cell);
+      }
+    }
+    int cell[3];
+    for (cell[2] = from[2]; cell[2] <= to[2]; ++cell[2])
+      for (cell[1] = from[1]; cell[1] <= to[1]; ++cell[1])
+        for (cell[0] = from[0]; cell[0] <= to[0]; ++cell[0])
+          grid.entries.push_back(grid.Key(cell) | (i / 3));
+  }
+  std::sort(grid.entries.begin(), grid.entries.end());
+}
+
+// distance to the closest triangle of the grid. Searches shells of cells
+// around the point, a shell r cells out is at least r - 1 cells away.
+static float ClosestTriangleDistance(const SVertex* vertices,
+                                     const std::vector<GLuint>& indices,
+                                     const STriangleGrid& grid,
+                                     const glm::vec3& p) {
+  const int center[3] = {grid.Cell(p, 0), grid.Cell(p, 1), grid.Cell(p, 2)};
+  const int maxShell =
+      std::max({grid.cells[0], grid.cells[1], grid.cells[2]});
+
+  float distance = HUGE_VALF;
+  for (int r = 0; r <= maxShell && distance > (r - 1) * grid.cellSize; ++r) {
+    int d[3];
+    for (d[2] = -r; d[2] <= r; ++d[2])
+      for (d[1] = -r; d[1] <= r; ++d[1]) {
+        // inside the shell only its two x faces
+        const bool face = std::abs(d[1]) == r || std::abs(d[2]) == r;
+        for (d[0] = -r; d[0] <= r; d[0] += face || !r ? 1 : 2 * r) {
+          int cell[3];
+          bool inside = true;
+          for (int axis = 0; axis < 3; ++axis) {
+            cell[axis] = center[axis] + d[axis];
+            inside &= cell[axis] >= 0 && cell[axis] < grid.cells[axis];
+          }
+          if (!inside) continue;
+
+          const uint64_t key = grid.Key(cell);
+          for (auto it = std::lower_bound(grid.entries.begin(),
+                                          grid.entries.end(), key);
+               it != grid.entries.end() && (*it & ~0xFFFFFFFFull) == key;
+               ++it) {
+            const GLuint* tri = &indices[(*it & 0xFFFFFFFFu) * 3];
+            distance = std::min(
+                distance, PointTriangleDistance(p, vertices[tri[0]].pos,
+                                                vertices[tri[1]].pos,
+                                                vertices[tri[2]].pos));
+          }
+        }
+      }
+  }
+  return distance;
+}
+
+// whether moving from onto to turns any surviving triangle around from over
+static bool Flips(const SVertex* vertices, const std::vector<GLuint>& indices,
+                  const std::vector<size_t>& offsets,
+                  const std::vector<GLuint>& adjacency, GLuint from,
+                  GLuint to) {
+  for (size_t a = offsets[from]; a < offsets[from + 1]; ++a) {
+    const GLuint* tri = &indices[adjacency[a] * 3];
+    if (tri[0] == to || tri[1] == to || tri[2] == to) continue;
+
+    glm::vec3 p[3];
+    for (int c = 0; c < 3; ++c) p[c] = vertices[tri[c]].pos;
+    const glm::vec3 before = TriangleNormal(p[0], p[1], p[2]);
+    for (int c = 0; c < 3; ++c)
+      if (tri[c] == from) p[c] = vertices[to].pos;
+    const glm::vec3 after = TriangleNormal(p[0], p[1], p[2]);
+
+    if (glm::dot(before, after) <= 0.0f) return true;
+  }
+  return false;
+}
+
+float SimplifyMesh(const SVertex* vertices, size_t verticesCount,
+                   const std::vector<GLuint>& indices, size_t targetIndexCount,
+                   std::vector<GLuint>& result) {
+  result = indices;
+
+  std::vector<SQuadric> quadrics(verticesCount);
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    const glm::vec3& a = vertices[indices[i]].pos;
+    const glm::vec3 n = TriangleNormal(a, vertices[indices[i + 1]].pos,
+                                       vertices[indices[i + 2]].pos);
+    const float len = glm::length(n);
+    if (len <= 0.0f) continue;
+
+    const glm::vec3 unit = n / len;
+    for (int c = 0; c < 3; ++c)
+      quadrics[indices[i + c]].AddPlane(unit, -glm::dot(unit, a));
+  }
+
+  // the surviving vertex every vertex was collapsed onto, itself if kept
+  std::vector<GLuint> owners(verticesCount);
+  std::iota(owners.begin(), owners.end(), 0);
+
+  std::vector<uint64_t> edges;
+  std::vector<uint8_t> locked;
+  std::vector<SCollapse> collapses;
+  std::vector<size_t> offsets;
+  std::vector<GLuint> adjacency;
+  std::vector<uint8_t> touched;
+  std::vector<GLuint> remap;
+
+  while (result.size() > targetIndexCount) {
+    const size_t trianglesCount = result.size() / 3;
+
+    // undirected edges, an edge used by a single triangle is open
+    edges.clear();
+    for (size_t t = 0; t < trianglesCount; ++t)
+      for (int c = 0; c < 3; ++c) {
+        const uint64_t a = result[t * 3 + c];
+        const uint64_t b = result[t * 3 + (c + 1) % 3];
+        edges.push_back(a < b ? (a << 32) | b : (b << 32) | a);
+      }
+    std::sort(edges.begin(), edges.end());
+
+    locked.assign(verticesCount, 0);
+    for (size_t i = 0, j; i < edges.size(); i = j) {
+      for (j = i + 1; j < edges.size() && edges[j] == edges[i];) ++j;
+      if (j - i == 1) locked[edges[i] >> 32] = locked[edges[i] & ~0u] = 1;
+    }
+
+    collapses.clear();
+    for (size_t i = 0, j; i < edges.size(); i = j) {
+      for (j = i + 1; j < edges.size() && edges[j] == edges[i];) ++j;
+      const GLuint a = edges[i] >> 32;
+      const GLuint b = edges[i] & ~0u;
+      if (a == b) continue;
+
+      SQuadric q = quadrics[a];
+      q += quadrics[b];
+      SCollapse best = {HUGE_VAL, 0, 0};
+      if (!locked[a]) best = {q.Eval(vertices[b].pos), a, b};
+      if (!locked[b]) {
+        const double cost = q.Eval(vertices[a].pos);
+        if (cost < best.cost) best = {cost, b, a};
+      }
+      if (best.cost != HUGE_VAL) collapses.push_back(best);
+    }
+    if (collapses.empty()) break;
+
+    const size_t passCandidates =
+        std::max<size_t>(collapses.size() / kPassCandidatesDivisor, 1);
+    std::partial_sort(collapses.begin(), collapses.begin() + passCandidates,
+                      collapses.end(),
+                      [](const SCollapse& a, const SCollapse& b) {
+                        return a.cost < b.cost;
+                      });
+
+    // vertex -> triangles adjacency, flattened
+    offsets.assign(verticesCount + 1, 0);
+    for (GLuint v : result) ++offsets[v + 1];
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    adjacency.resize(result.size());
+    {
+      std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+      for (size_t i = 0; i < result.size(); ++i)
+        adjacency[fill[result[i]]++] = i / 3;
+    }
+
+    // collapses in one pass must not share a triangle, so flip tests and
+    // removed triangle counts stay exact
+    touched.assign(verticesCount, 0);
+    remap.resize(verticesCount);
+    std::iota(remap.begin(), remap.end(), 0);
+    const size_t needed = trianglesCount - targetIndexCount / 3;
+    size_t removed = 0;
+    for (size_t i = 0; i < passCandidates && removed < needed; ++i) {
+      const SCollapse& col = collapses[i];
+      if (touched[col.from] || touched[col.to]) continue;
+      if (Flips(vertices, result, offsets, adjacency, col.from, col.to))
+        continue;
+
+      for (size_t a = offsets[col.from]; a < offsets[col.from + 1]; ++a) {
+        const GLuint* tri = &result[adjacency[a] * 3];
+        if (tri[0] == col.to || tri[1] == col.to || tri[2] == col.to)
+          ++removed;
+        touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+      }
+
+      remap[col.from] = col.to;
+      quadrics[col.to] += quadrics[col.from];
+    }
+    if (!removed) break;
+
+    // collapses of a pass don't chain, one lookup follows them
+    for (GLuint& owner : owners) owner = remap[owner];
+
+    size_t out = 0;
+    for (size_t i = 0; i < result.size(); i += 3) {
+      const GLuint a = remap[result[i]];
+      const GLuint b = remap[result[i + 1]];
+      const GLuint c = remap[result[i + 2]];
+      if (a == b || b == c || a == c) continue;
+      result[out++] = a;
+      result[out++] = b;
+      result[out++] = c;
+    }
+    result.resize(out);
+  }
+
+  // largest distance of a removed vertex to the simplified surface
+  float error = 0.0f;
+  if (result.empty()) return error;
+  STriangleGrid grid;
+  BuildTriangleGrid(vertices, result, grid);
+  for (GLuint v = 0; v < verticesCount; ++v)
+    if (owners[v] != v)
+      error = std::max(error, ClosestTriangleDistance(vertices, result, grid,
+                                                      vertices[v].pos));
+  return error;
+}
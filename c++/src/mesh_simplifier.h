@@ -0,0 +1,19 @@
+#pragma once
+
+#include "geometry_arena.h"
+
+#include <GL/gl3w.h>
+
+#include <vector>
+
+// Quadric error metric simplification (Garland and Heckbert) of a mesh local
+// triangle list down to about targetIndexCount indices.
+//
+// Edges collapse onto one of their existing vertices, so the result indexes
+// the same vertices and a LOD only costs an index range in the arena.
+// Vertices on open edges, UV and normal seams included, never move. Returns
+// the object space error: the largest distance of a removed vertex to the
+// simplified surface.
+float SimplifyMesh(const SVertex* vertices, size_t verticesCount,
+                   const std::vector<GLuint>& indices, size_t targetIndexCount,
+                   std::vector<GLuint>& result);
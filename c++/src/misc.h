@@ -1,8 +1,33 @@
 #pragma once
 
+#include <assimp/scene.h>
+
 #include <glm/mat4x4.hpp>
 
 extern glm::mat4 IBLCaptureProjection;
 extern glm::mat4 IBLCaptureViews[6];
 
 void renderQuad();
+
+inline glm::mat4 aiMatrix4x4ToGlm(const aiMatrix4x4* from) {
+  glm::mat4 to;
+
+  to[0][0] = (float)from->a1;
+  to[0][1] = (float)from->b1;
+  to[0][2] = (float)from->c1;
+  to[0][3] = (float)from->d1;
+  to[1][0] = (float)from->a2;
+  to[1][1] = (float)from->b2;
+  to[1][2] = (float)from->c2;
+  to[1][3] = (float)from->d2;
+  to[2][0] = (float)from->a3;
+  to[2][1] = (float)from->b3;
+  to[2][2] = (float)from->c3;
+  to[2][3] = (float)from->d3;
+  to[3][0] = (float)from->a4;
+  to[3][1] = (float)from->b4;
+  to[3][2] = (float)from->c4;
+  to[3][3] = (float)from->d4;
+
+  return to;
+}
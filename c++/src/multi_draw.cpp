@@ -0,0 +1,102 @@
+#include "multi_draw.h"
+#include "geometry_arena.h"
+
+#include <cassert>
+
+bool CMultiDraw::IsSupported() { return gl3wIsSupported(4, 3); }
+
+void CMultiDraw::Build(const std::vector<SDrawItem>& items,
+                       const std::vector<int>& materialBlockIndex,
+                       GLuint VAO, GLenum indexType) {
+  Release();
+  m_indexType = indexType;
+
+  const size_t n = items.size();
+  m_commands.resize(n);
+
+  m_draws.resize(n);
+  std::vector<GLuint> drawIds(n);
+  for (size_t i = 0; i < n; ++i) {
+    m_draws[i].model = items[i].model;
+    m_draws[i].materialIndex = materialBlockIndex[items[i].materialId];
+    drawIds[i] = i;
+  }
+
+  glGenBuffers(1, &m_drawsBuffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_drawsBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, n * sizeof(SDrawStd430),
+               m_draws.data(), GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+  glGenBuffers(1, &m_commandBuffer);
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+  glBufferData(GL_DRAW_INDIRECT_BUFFER,
+               n * sizeof(SDrawElementsIndirectCommand), nullptr,
+               GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+  // identity stream, instance i of a command reads baseInstance + i
+  glGenBuffers(1, &m_drawIdBuffer);
+  glBindVertexArray(VAO);
+  glBindBuffer(GL_ARRAY_BUFFER, m_drawIdBuffer);
+  glBufferData(GL_ARRAY_BUFFER, n * sizeof(GLuint), drawIds.data(),
+               GL_STATIC_DRAW);
+  glVertexAttribIPointer(vDrawId, 1, GL_UNSIGNED_INT, 0, 0);
+  glVertexAttribDivisor(vDrawId, 1);
+  glEnableVertexAttribArray(vDrawId);
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void CMultiDraw::Release() {
+  if (m_commandBuffer) glDeleteBuffers(1, &m_commandBuffer);
+  if (m_drawsBuffer) glDeleteBuffers(1, &m_drawsBuffer);
+  if (m_drawIdBuffer) glDeleteBuffers(1, &m_drawIdBuffer);
+  m_commandBuffer = m_drawsBuffer = m_drawIdBuffer = 0;
+
+  m_commands.clear();
+  m_draws.clear();
+}
+
+void CMultiDraw::UpdateDraws(const std::vector<SDrawItem>& items) {
+  if (!m_drawsBuffer) return;
+
+  for (size_t i = 0; i < items.size(); ++i) m_draws[i].model = items[i].model;
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_drawsBuffer);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                  m_draws.size() * sizeof(SDrawStd430), m_draws.data());
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void CMultiDraw::Upload(const std::vector<SDrawItem>& items,
+                        const std::vector<uint32_t>& order) {
+  assert(order.size() <= m_commands.size());
+
+  for (size_t k = 0; k < order.size(); ++k) {
+    const SDrawItem& item = items[order[k]];
+    SDrawElementsIndirectCommand& cmd = m_commands[k];
+    cmd.count = item.indexCount;
+    cmd.instanceCount = 1;
+    cmd.firstIndex = item.firstIndex;
+    cmd.baseVertex = item.baseVertex;
+    cmd.baseInstance = order[k];
+  }
+
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+  glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0,
+                  order.size() * sizeof(SDrawElementsIndirectCommand),
+                  m_commands.data());
+}
+
+void CMultiDraw::Bind() const {
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, kDrawsStorageBinding,
+                   m_drawsBuffer);
+}
+
+void CMultiDraw::Draw(size_t first, size_t count) const {
+  glMultiDrawElementsIndirect(
+      GL_TRIANGLES, m_indexType,
+      (void*)(first * sizeof(SDrawElementsIndirectCommand)), count, 0);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "render_queue.h"
+
+#include <GL/gl3w.h>
+
+#include <glm/mat4x4.hpp>
+
+#include <vector>
+
+// shader storage binding point of the Draws block
+constexpr const GLuint kDrawsStorageBinding = 0;
+
+// layout defined by glMultiDrawElementsIndirect
+struct SDrawElementsIndirectCommand {
+  GLuint count;
+  GLuint instanceCount;
+  GLuint firstIndex;
+  GLint baseVertex;
+  GLuint baseInstance;
+};
+
+// std430 mirror of the Draw struct in the Draws block
+struct SDrawStd430 {
+  glm::mat4 model;
+  int materialIndex;
+  int pad[3];
+};
+
+static_assert(sizeof(SDrawStd430) == 80, "std430 layout mismatch");
+
+// Indirect submission of the render queue. Per-draw data lives in the Draws
+// storage block indexed by render queue item, so it does not depend on the
+// sort order and is only re-uploaded when items move. The command buffer is
+// rewritten per pass.
+//
+// gl_DrawID restarts at every glMultiDrawElementsIndirect call and needs GL
+// 4.6, so shaders get the item index from an instanced vDrawId attribute
+// instead: command k carries baseInstance = item index, and vDrawId reads an
+// identity stream with divisor 1.
+class CMultiDraw {
+ public:
+  static bool IsSupported();
+
+  // materialBlockIndex maps a scene material id to its Materials block entry
+  void Build(const std::vector<SDrawItem>& items,
+             const std::vector<int>& materialBlockIndex, GLuint VAO,
+             GLenum indexType);
+  void Release();
+
+  // re-uploads model matrices after the render queue was refitted
+  void UpdateDraws(const std::vector<SDrawItem>& items);
+
+  // writes commands for items in the given order and uploads them
+  void Upload(const std::vector<SDrawItem>& items,
+              const std::vector<uint32_t>& order);
+
+  // binds the command buffer and the Draws block, needs the arena VAO bound
+  void Bind() const;
+  // draws commands [first, first + count) of the last Upload()
+  void Draw(size_t first, size_t count) const;
+
+  GLuint CommandBuffer() const { return m_commandBuffer; }
+
+ private:
+  std::vector<SDrawElementsIndirectCommand> m_commands;
+  std::vector<SDrawStd430> m_draws;
+
+  GLenum m_indexType{GL_UNSIGNED_INT};
+
+  GLuint m_commandBuffer{0};
+  GLuint m_drawsBuffer{0};
+  GLuint m_drawIdBuffer{0};
+};
@@ -0,0 +1,232 @@
+#include "render_queue.h"
+
+#include <assimp/scene.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cassert>
+
+void CRenderQueue::Build(const aiScene& scene,
+                         const CTransformHierarchy& hierarchy,
+                         const std::vector<SMeshRange>& ranges) {
+  Clear();
+
+  m_meshBounds.resize(scene.mNumMeshes);
+  for (unsigned int i = 0; i < scene.mNumMeshes; ++i)
+    m_meshBounds[i] = ranges[i].bounds;
+
+  for (size_t n = 0; n < hierarchy.Count(); ++n) {
+    const aiNode* nd = hierarchy.Node(n);
+    for (unsigned int i = 0; i < nd->mNumMeshes; ++i) {
+      const unsigned int meshId = nd->mMeshes[i];
+      const aiMesh* pMesh = scene.mMeshes[meshId];
+      assert(pMesh);
+
+      SDrawItem item;
+      item.firstIndex = ranges[meshId].firstIndex;
+      item.indexCount = ranges[meshId].indexCount;
+      item.baseVertex = ranges[meshId].baseVertex;
+      item.meshId = meshId;
+      item.node = n;
+      item.materialId = pMesh->mMaterialIndex;
+      item.shaderKey =
+          MaterialShaderKey(*scene.mMaterials[pMesh->mMaterialIndex]);
+      item.model = hierarchy.World(n);
+      item.bounds = m_meshBounds[meshId].Transformed(item.model);
+      m_items.push_back(item);
+    }
+  }
+
+  m_itemBounds.resize(m_items.size());
+  for (size_t i = 0; i < m_items.size(); ++i)
+    m_itemBounds[i] = m_items[i].bounds;
+  m_bvh.Build(m_itemBounds);
+
+  m_itemChanged.assign(m_items.size(), 0);
+  m_visibleMask.resize(m_items.size());
+  m_depths.resize(m_items.size());
+  m_meshDepths.resize(scene.mNumMeshes);
+
+  std::vector<unsigned int> instances(scene.mNumMeshes, 0);
+  for (const SDrawItem& item : m_items) ++instances[item.meshId];
+  for (unsigned int count : instances)
+    if (count > 1) {
+      ++m_sharedMeshes;
+      m_sharedItems += count;
+    }
+  m_entries.resize(m_items.size());
+  m_scratch.resize(m_items.size());
+  m_sorted.resize(m_items.size());
+  for (uint32_t i = 0; i < m_items.size(); ++i) m_sorted[i] = i;
+}
+
+void CRenderQueue::Clear() {
+  m_items.clear();
+  m_meshBounds.clear();
+  m_itemBounds.clear();
+  m_itemChanged.clear();
+  m_moved.clear();
+  m_bvh.Clear();
+  m_visibleMask.clear();
+  m_depths.clear();
+  m_meshDepths.clear();
+  m_sharedMeshes = m_sharedItems = 0;
+  m_materialRanks.clear();
+  m_entries.clear();
+  m_scratch.clear();
+  m_sorted.clear();
+}
+
+bool CRenderQueue::Refit(const CTransformHierarchy& hierarchy) {
+  bool any = false;
+  m_moved.clear();
+  for (size_t i = 0; i < m_items.size(); ++i) {
+    SDrawItem& item = m_items[i];
+    m_itemChanged[i] = hierarchy.Changed(item.node);
+    if (!m_itemChanged[i]) continue;
+
+    m_moved.push_back(item.bounds);
+    item.model = hierarchy.World(item.node);
+    item.bounds = m_itemBounds[i] =
+        m_meshBounds[item.meshId].Transformed(item.model);
+    m_moved.push_back(item.bounds);
+    any = true;
+  }
+
+  if (any) m_bvh.Refit(m_itemBounds, m_itemChanged);
+  return any;
+}
+
+void CRenderQueue::Cull(const SFrustum* frustums, int frustumsCount) {
+  std::fill(m_visibleMask.begin(), m_visibleMask.end(), 0);
+  for (int f = 0; f < frustumsCount; ++f)
+    m_bvh.Cull(frustums[f], m_visibleMask);
+
+  m_sorted.clear();
+  for (uint32_t i = 0; i < m_items.size(); ++i)
+    if (m_visibleMask[i]) m_sorted.push_back(i);
+}
+
+void CRenderQueue::CullOutside(const glm::vec3& center, float radius) {
+  size_t kept = 0;
+  for (uint32_t i : m_sorted) {
+    const SAABB& bounds = m_items[i].bounds;
+    const glm::vec3 outside = glm::max(
+        glm::abs(center - bounds.Center()) - bounds.Extents(), glm::vec3(0.0f));
+    if (glm::dot(outside, outside) <= radius * radius) m_sorted[kept++] = i;
+  }
+  m_sorted.resize(kept);
+}
+
+void CRenderQueue::SelectLods(const std::vector<SMeshRange>& ranges,
+                              const SLodSelection& selection,
+                              std::vector<uint8_t>& lods) {
+  if (lods.size() != m_items.size()) lods.assign(m_items.size(), 0);
+
+  for (uint32_t i : m_sorted) {
+    SDrawItem& item = m_items[i];
+    const SMeshRange& range = ranges[item.meshId];
+
+    // errors are in model space, scale them by the largest model axis and
+    // project from the nearest point of the bounds
+    const float scale =
+        std::max(std::max(glm::length(glm::vec3(item.model[0])),
+                          glm::length(glm::vec3(item.model[1]))),
+                 glm::length(glm::vec3(item.model[2])));
+    const glm::vec3 outside =
+        glm::max(glm::abs(selection.eye - item.bounds.Center()) -
+                     item.bounds.Extents(),
+                 glm::vec3(0.0f));
+    const float distance = glm::length(outside);
+
+    unsigned int lod = 0;
+    if (distance > 0.0f) {
+      const float pixelsPerError = selection.pixelsPerUnit * scale / distance;
+      for (unsigned int l = range.lodsCount - 1; l > 0; --l) {
+        float budget = selection.maxPixelError;
+        if (l > lods[i]) budget *= 1.0f - selection.hysteresis;
+        if (range.lods[l].error * pixelsPerError < budget) {
+          lod = l;
+          break;
+        }
+      }
+    }
+
+    lods[i] = lod;
+    item.firstIndex = range.lods[lod].firstIndex;
+    item.indexCount = range.lods[lod].indexCount;
+  }
+}
+
+// key layout, most significant first:
+//   [63..56] shader key, [55..40] material rank, [39..16] depth,
+//   [15..0] mesh id when instances are grouped
+static const int kDepthBits = 24;
+
+void CRenderQueue::Sort(const glm::vec3& eye, float farPlane,
+                        ERenderQueueSort mode, bool groupInstances) {
+  // m_sorted holds the visible set on entry
+  const size_t n = m_sorted.size();
+  if (!n) return;
+
+  const float depthScale = float((1 << kDepthBits) - 1) / farPlane;
+
+  for (uint32_t i = 0; i < n; ++i) {
+    const SDrawItem& item = m_items[m_sorted[i]];
+    m_depths[i] = std::min(glm::length(item.bounds.Center() - eye), farPlane);
+  }
+
+  // instances of a mesh take the depth of the nearest one, so they end up
+  // next to each other and draw as one batch
+  if (groupInstances) {
+    std::fill(m_meshDepths.begin(), m_meshDepths.end(), farPlane);
+    for (uint32_t i = 0; i < n; ++i) {
+      float& depth = m_meshDepths[m_items[m_sorted[i]].meshId];
+      depth = std::min(depth, m_depths[i]);
+    }
+  }
+
+  for (uint32_t i = 0; i < n; ++i) {
+    const SDrawItem& item = m_items[m_sorted[i]];
+    const float d = groupInstances ? m_meshDepths[item.meshId] : m_depths[i];
+    uint64_t key = uint64_t(d * depthScale) << 16;
+    if (groupInstances) key |= item.meshId & 0xFFFF;
+
+    if (mode == kSortByState) {
+      key |= uint64_t(item.shaderKey & 0xFF) << 56;
+      const uint32_t material = m_materialRanks.empty()
+                                    ? item.materialId
+                                    : m_materialRanks[item.materialId];
+      key |= uint64_t(material & 0xFFFF) << 40;
+    }
+
+    m_entries[i].key = key;
+    m_entries[i].item = m_sorted[i];
+  }
+
+  // LSD radix sort, 8 bits per pass. Passes where every key shares the same
+  // digit are skipped, so depth-only sorts cost 3 passes.
+  SSortEntry* src = m_entries.data();
+  SSortEntry* dst = m_scratch.data();
+  for (int shift = groupInstances ? 0 : 16; shift < 64; shift += 8) {
+    size_t histogram[256] = {0};
+    for (size_t i = 0; i < n; ++i) ++histogram[(src[i].key >> shift) & 0xFF];
+
+    if (histogram[(src[0].key >> shift) & 0xFF] == n) continue;
+
+    size_t offset = 0;
+    for (int b = 0; b < 256; ++b) {
+      const size_t cnt = histogram[b];
+      histogram[b] = offset;
+      offset += cnt;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+      dst[histogram[(src[i].key >> shift) & 0xFF]++] = src[i];
+
+    std::swap(src, dst);
+  }
+
+  for (size_t i = 0; i < n; ++i) m_sorted[i] = src[i].item;
+}
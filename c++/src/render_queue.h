@@ -0,0 +1,116 @@
+#pragma once
+
+#include "culling.h"
+#include "geometry_arena.h"
+#include "transform_hierarchy.h"
+#include "material.h"
+
+#include <GL/gl3w.h>
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+
+#include <cstdint>
+#include <vector>
+
+struct aiScene;
+
+// one mesh instance, flattened out of the aiNode hierarchy at load time
+struct SDrawItem {
+  GLuint firstIndex{0};
+  GLsizei indexCount{0};
+  GLint baseVertex{0};
+  unsigned int meshId{0};
+  unsigned int node{0};  // index in the transform hierarchy
+  unsigned int materialId{0};
+  uint32_t shaderKey{0};
+  glm::mat4 model;  // world matrix of the node
+  SAABB bounds;     // world space
+};
+
+enum ERenderQueueSort {
+  // program, then material rank, then front-to-back depth
+  kSortByState,
+  // front-to-back depth only, for passes which ignore materials (shadows)
+  kSortByDepth,
+};
+
+// screen space error budget for picking LODs
+struct SLodSelection {
+  glm::vec3 eye;
+  // pixels covered by one world unit at distance one
+  float pixelsPerUnit{0.0f};
+  // 0 keeps every item at full detail
+  float maxPixelError{0.0f};
+  // switching to a coarser LOD needs an error this fraction below the
+  // budget, so items on the threshold do not flicker
+  float hysteresis{0.0f};
+};
+
+class CRenderQueue {
+ public:
+  // ranges are indexed by mesh id
+  void Build(const aiScene& scene, const CTransformHierarchy& hierarchy,
+             const std::vector<SMeshRange>& ranges);
+  void Clear();
+
+  // picks up world matrices changed by the last hierarchy Update() and
+  // refits the culling bounds. Returns false if no item moved.
+  bool Refit(const CTransformHierarchy& hierarchy);
+  // world bounds of the items the last Refit() moved, before and after the
+  // move, for invalidating what was rendered from them
+  const std::vector<SAABB>& Moved() const { return m_moved; }
+
+  // keeps items intersecting any of the frustums, Sort() only sees those
+  void Cull(const SFrustum* frustums, int frustumsCount);
+  // drops the kept items whose bounds lie wholly outside the sphere
+  void CullOutside(const glm::vec3& center, float radius);
+
+  // order of materials in state sorts, indexed by material id. Empty sorts by
+  // id.
+  void SetMaterialRanks(const std::vector<uint32_t>& ranks) {
+    m_materialRanks = ranks;
+  }
+
+  // recomputes sort keys relative to eye and radix sorts the visible items.
+  // groupInstances keeps items of the same mesh adjacent, at the depth of
+  // the nearest of them.
+  void Sort(const glm::vec3& eye, float farPlane, ERenderQueueSort mode,
+            bool groupInstances);
+
+  // points the visible items at the coarsest LOD of their mesh within the
+  // budget. lods holds the picks per item between calls for the hysteresis,
+  // passes with different budgets should keep their own.
+  void SelectLods(const std::vector<SMeshRange>& ranges,
+                  const SLodSelection& selection, std::vector<uint8_t>& lods);
+
+  const std::vector<SDrawItem>& Items() const { return m_items; }
+  // visible item indices in the order of the last Sort()
+  const std::vector<uint32_t>& Sorted() const { return m_sorted; }
+
+  // meshes referenced by more than one node, and the items they make
+  unsigned int SharedMeshes() const { return m_sharedMeshes; }
+  unsigned int SharedItems() const { return m_sharedItems; }
+
+ private:
+  struct SSortEntry {
+    uint64_t key;
+    uint32_t item;
+  };
+
+  std::vector<SDrawItem> m_items;
+  std::vector<SAABB> m_meshBounds;  // model space, indexed by mesh id
+  std::vector<SAABB> m_itemBounds;
+  std::vector<uint8_t> m_itemChanged;
+  std::vector<SAABB> m_moved;
+  CBVH m_bvh;
+  std::vector<uint8_t> m_visibleMask;
+  std::vector<float> m_depths;      // of the visible items, in Sort()
+  std::vector<float> m_meshDepths;  // nearest visible instance per mesh
+  unsigned int m_sharedMeshes{0};
+  unsigned int m_sharedItems{0};
+  std::vector<uint32_t> m_materialRanks;
+  std::vector<SSortEntry> m_entries;
+  std::vector<SSortEntry> m_scratch;
+  std::vector<uint32_t> m_sorted;
+};
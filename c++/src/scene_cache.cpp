@@ -0,0 +1,345 @@
+#include "scene_cache.h"
+#include "geometry_arena.h"
+
+#include <assimp/material.h>
+#include <assimp/scene.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// bumped when the layout of the file or of the arena changes, or what it
+// stores is computed differently
+static const uint32_t kSceneCacheVersion = 3;
+static const uint32_t kSceneCacheMagic = 0x4e435345;  // "ESCN"
+
+// every block starts aligned to this
+static const size_t kBlockAlignment = 16;
+
+struct SSceneCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t sourceSize;
+  int64_t sourceTime;
+  uint32_t compact;
+  uint32_t indexType;
+  // layouts copied as they are
+  uint32_t rangeSize;
+  uint32_t lightSize;
+
+  uint64_t meshesCount;
+  uint64_t verticesCount;
+  uint64_t indicesCount;
+
+  uint64_t rangesOffset;
+  uint64_t sceneOffset;
+  uint64_t sceneBytes;
+  uint64_t verticesOffset;
+  uint64_t verticesBytes;
+  uint64_t indicesOffset;
+  uint64_t indicesBytes;
+};
+
+struct SSceneWriter {
+  std::vector<uint8_t> bytes;
+
+  void Put(const void* data, size_t size) {
+    const uint8_t* begin = (const uint8_t*)data;
+    bytes.insert(bytes.end(), begin, begin + size);
+  }
+  template <typename T>
+  void Put(const T& value) {
+    Put(&value, sizeof(value));
+  }
+  void PutString(const aiString& str) {
+    Put(uint32_t(str.length));
+    Put(str.data, str.length);
+  }
+};
+
+struct SSceneReader {
+  const uint8_t* at;
+
+  const uint8_t* Skip(size_t size) {
+    const uint8_t* res = at;
+    at += size;
+    return res;
+  }
+  template <typename T>
+  T Get() {
+    T value;
+    memcpy(&value, Skip(sizeof(value)), sizeof(value));
+    return value;
+  }
+  void GetString(aiString& str) {
+    const uint32_t length = Get<uint32_t>();
+    str.Set(std::string((const char*)Skip(length), length));
+  }
+};
+
+static bool SourceStat(const std::string& path, uint64_t& size,
+                       int64_t& time) {
+  struct stat st;
+  if (stat(path.c_str(), &st)) return false;
+  size = uint64_t(st.st_size);
+  time = int64_t(st.st_mtime);
+  return true;
+}
+
+static std::string Path(const std::string& sourcePath, bool compact) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : sourcePath) hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+
+  char name[40];
+  snprintf(name, sizeof(name), "/%016llx%s.scene", (unsigned long long)hash,
+           compact ? "c" : "");
+  return CSceneCache::Directory() + name;
+}
+
+static size_t Align(size_t offset) {
+  return (offset + kBlockAlignment - 1) / kBlockAlignment * kBlockAlignment;
+}
+
+static void WriteNodes(const aiNode* node, int parent, int& count,
+                       SSceneWriter& out) {
+  const int index = count++;
+  out.Put(int32_t(parent));
+  out.PutString(node->mName);
+  out.Put(node->mTransformation);
+  out.Put(node->mNumMeshes);
+  out.Put(node->mMeshes, node->mNumMeshes * sizeof(unsigned int));
+  for (unsigned int c = 0; c < node->mNumChildren; ++c)
+    WriteNodes(node->mChildren[c], index, count, out);
+}
+
+std::string& CSceneCache::Directory() {
+  static std::string dir = "scene_cache";
+  return dir;
+}
+
+bool CSceneCache::Open(const std::string& sourcePath, bool compact) {
+  Close();
+  uint64_t sourceSize = 0;
+  int64_t sourceTime = 0;
+  if (Directory().empty() || !SourceStat(sourcePath, sourceSize, sourceTime))
+    return false;
+
+  const int fd = open(Path(sourcePath, compact).c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (!fstat(fd, &st) && size_t(st.st_size) >= sizeof(SSceneCacheHeader))
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  m_map = (const uint8_t*)map;
+  m_size = st.st_size;
+
+  const SSceneCacheHeader& header = *(const SSceneCacheHeader*)m_map;
+  const bool valid =
+      header.magic == kSceneCacheMagic &&
+      header.version == kSceneCacheVersion &&
+      header.sourceSize == sourceSize && header.sourceTime == sourceTime &&
+      header.compact == uint32_t(compact) &&
+      header.rangeSize == sizeof(SMeshRange) &&
+      header.lightSize == sizeof(aiLight) &&
+      header.rangesOffset + header.meshesCount * sizeof(SMeshRange) <=
+          m_size &&
+      header.sceneOffset + header.sceneBytes <= m_size &&
+      header.verticesOffset + header.verticesBytes <= m_size &&
+      header.indicesOffset + header.indicesBytes <= m_size;
+  if (!valid) Close();
+  return valid;
+}
+
+void CSceneCache::Close() {
+  if (m_map) munmap((void*)m_map, m_size);
+  m_map = nullptr;
+  m_size = 0;
+}
+
+aiScene* CSceneCache::CreateScene() const {
+  const SSceneCacheHeader& header = *(const SSceneCacheHeader*)m_map;
+  SSceneReader in{m_map + header.sceneOffset};
+  aiScene* scene = new aiScene();
+  scene->mFlags = in.Get<unsigned int>();
+
+  const int nodesCount = in.Get<int32_t>();
+  std::vector<aiNode*> nodes(nodesCount);
+  std::vector<int> parents(nodesCount);
+  std::vector<unsigned int> childrenCounts(nodesCount, 0);
+  for (int n = 0; n < nodesCount; ++n) {
+    aiNode* node = nodes[n] = new aiNode();
+    parents[n] = in.Get<int32_t>();
+    in.GetString(node->mName);
+    node->mTransformation = in.Get<aiMatrix4x4>();
+    node->mNumMeshes = in.Get<unsigned int>();
+    node->mMeshes = new unsigned int[node->mNumMeshes];
+    memcpy(node->mMeshes, in.Skip(node->mNumMeshes * sizeof(unsigned int)),
+           node->mNumMeshes * sizeof(unsigned int));
+    if (parents[n] >= 0) ++childrenCounts[parents[n]];
+  }
+  // parents come first, children are appended in their original order
+  for (int n = 0; n < nodesCount; ++n)
+    if (childrenCounts[n]) nodes[n]->mChildren = new aiNode*[childrenCounts[n]];
+  for (int n = 0; n < nodesCount; ++n) {
+    if (parents[n] < 0) continue;
+    aiNode* parent = nodes[parents[n]];
+    parent->mChildren[parent->mNumChildren++] = nodes[n];
+    nodes[n]->mParent = parent;
+  }
+  scene->mRootNode = nodesCount ? nodes[0] : nullptr;
+
+  scene->mNumMeshes = in.Get<unsigned int>();
+  scene->mMeshes = new aiMesh*[scene->mNumMeshes];
+  for (unsigned int i = 0; i < scene->mNumMeshes; ++i) {
+    aiMesh* mesh = scene->mMeshes[i] = new aiMesh();
+    in.GetString(mesh->mName);
+    mesh->mPrimitiveTypes = in.Get<unsigned int>();
+    mesh->mMaterialIndex = in.Get<unsigned int>();
+    mesh->mNumVertices = in.Get<unsigned int>();
+    mesh->mNumFaces = in.Get<unsigned int>();
+  }
+
+  scene->mNumMaterials = in.Get<unsigned int>();
+  scene->mMaterials = new aiMaterial*[scene->mNumMaterials];
+  for (unsigned int i = 0; i < scene->mNumMaterials; ++i) {
+    aiMaterial* mat = scene->mMaterials[i] = new aiMaterial();
+    const unsigned int propertiesCount = in.Get<unsigned int>();
+    for (unsigned int p = 0; p < propertiesCount; ++p) {
+      aiString key;
+      in.GetString(key);
+      const unsigned int semantic = in.Get<unsigned int>();
+      const unsigned int index = in.Get<unsigned int>();
+      const aiPropertyTypeInfo type = (aiPropertyTypeInfo)in.Get<uint32_t>();
+      const unsigned int length = in.Get<unsigned int>();
+      mat->AddBinaryProperty(in.Skip(length), length, key.C_Str(), semantic,
+                             index, type);
+    }
+  }
+
+  scene->mNumLights = in.Get<unsigned int>();
+  scene->mLights = new aiLight*[scene->mNumLights];
+  for (unsigned int i = 0; i < scene->mNumLights; ++i) {
+    scene->mLights[i] = new aiLight();
+    memcpy((void*)scene->mLights[i], in.Skip(sizeof(aiLight)), sizeof(aiLight));
+  }
+  return scene;
+}
+
+void CSceneCache::RestoreGeometry(CGeometryArena& arena) const {
+  const SSceneCacheHeader& header = *(const SSceneCacheHeader*)m_map;
+  const SMeshRange* ranges = (const SMeshRange*)(m_map + header.rangesOffset);
+  arena.Restore(std::vector<SMeshRange>(ranges, ranges + header.meshesCount),
+                header.compact, header.indexType, header.verticesCount,
+                m_map + header.verticesOffset, header.indicesCount,
+                m_map + header.indicesOffset);
+}
+
+void CSceneCache::Write(const std::string& sourcePath, bool compact,
+                        const aiScene& scene, const CGeometryArena& arena) {
+  SSceneCacheHeader header = {};
+  if (Directory().empty() ||
+      !SourceStat(sourcePath, header.sourceSize, header.sourceTime))
+    return;
+
+  SSceneWriter blob;
+  blob.Put(scene.mFlags);
+
+  SSceneWriter nodes;
+  int nodesCount = 0;
+  if (scene.mRootNode) WriteNodes(scene.mRootNode, -1, nodesCount, nodes);
+  blob.Put(int32_t(nodesCount));
+  blob.Put(nodes.bytes.data(), nodes.bytes.size());
+
+  blob.Put(scene.mNumMeshes);
+  for (unsigned int i = 0; i < scene.mNumMeshes; ++i) {
+    const aiMesh& mesh = *scene.mMeshes[i];
+    blob.PutString(mesh.mName);
+    blob.Put(mesh.mPrimitiveTypes);
+    blob.Put(mesh.mMaterialIndex);
+    blob.Put(mesh.mNumVertices);
+    blob.Put(mesh.mNumFaces);
+  }
+
+  blob.Put(scene.mNumMaterials);
+  for (unsigned int i = 0; i < scene.mNumMaterials; ++i) {
+    const aiMaterial& mat = *scene.mMaterials[i];
+    blob.Put(mat.mNumProperties);
+    for (unsigned int p = 0; p < mat.mNumProperties; ++p) {
+      const aiMaterialProperty& prop = *mat.mProperties[p];
+      blob.PutString(prop.mKey);
+      blob.Put(prop.mSemantic);
+      blob.Put(prop.mIndex);
+      blob.Put(uint32_t(prop.mType));
+      blob.Put(prop.mDataLength);
+      blob.Put(prop.mData, prop.mDataLength);
+    }
+  }
+
+  blob.Put(scene.mNumLights);
+  for (unsigned int i = 0; i < scene.mNumLights; ++i)
+    blob.Put(scene.mLights[i], sizeof(aiLight));
+
+  std::vector<uint8_t> vertices, indices;
+  arena.ReadBack(vertices, indices);
+  const std::vector<SMeshRange>& ranges = arena.Ranges();
+
+  header.magic = kSceneCacheMagic;
+  header.version = kSceneCacheVersion;
+  header.compact = compact;
+  header.indexType = arena.IndexType();
+  header.rangeSize = sizeof(SMeshRange);
+  header.lightSize = sizeof(aiLight);
+  header.meshesCount = ranges.size();
+  header.verticesCount = vertices.size() / arena.VertexSize();
+  header.indicesCount = indices.size() / arena.IndexSize();
+  header.rangesOffset = Align(sizeof(header));
+  header.sceneOffset =
+      Align(header.rangesOffset + ranges.size() * sizeof(SMeshRange));
+  header.sceneBytes = blob.bytes.size();
+  header.verticesOffset = Align(header.sceneOffset + header.sceneBytes);
+  header.verticesBytes = vertices.size();
+  header.indicesOffset = Align(header.verticesOffset + header.verticesBytes);
+  header.indicesBytes = indices.size();
+
+  mkdir(Directory().c_str(), 0755);
+  // written aside and renamed, an interrupted write leaves no partial file
+  const std::string path = Path(sourcePath, compact);
+  const std::string tmpPath = path + ".tmp";
+  FILE* f = fopen(tmpPath.c_str(), "wb");
+  if (!f) {
+    std::cout << "ERROR: can't write scene cache to " << Directory()
+              << std::endl;
+    return;
+  }
+  // a failed write would leave zero filled holes which pass the size checks
+  // of Open(), such a file is dropped instead of renamed
+  bool written = true;
+  auto writeAt = [f, &written](uint64_t offset, const void* data,
+                               size_t size) {
+    written = written && fseek(f, long(offset), SEEK_SET) == 0 &&
+              fwrite(data, 1, size, f) == size;
+  };
+  writeAt(0, &header, sizeof(header));
+  writeAt(header.rangesOffset, ranges.data(),
+          ranges.size() * sizeof(SMeshRange));
+  writeAt(header.sceneOffset, blob.bytes.data(), blob.bytes.size());
+  writeAt(header.verticesOffset, vertices.data(), vertices.size());
+  writeAt(header.indicesOffset, indices.data(), indices.size());
+  written = !ferror(f) && written;
+  written = fclose(f) == 0 && written;
+  if (!written) {
+    std::cout << "ERROR: failed writing scene cache " << tmpPath << std::endl;
+    remove(tmpPath.c_str());
+    return;
+  }
+  rename(tmpPath.c_str(), path.c_str());
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct aiScene;
+class CGeometryArena;
+
+// Engine side copy of an imported scene, written after the first import and
+// memory mapped on the next starts instead of running assimp. Like a VBM
+// file it is a header followed by blocks at fixed offsets:
+// - the mesh ranges of the arena
+// - nodes flattened parent-before-child, meshes without vertex data,
+//   material properties and lights
+// - the arena vertex and index buffers in their final GPU layout, LODs and
+//   compaction applied
+// A file is valid for the size and modification time of its source and the
+// vertex layout it was written with.
+class CSceneCache {
+ public:
+  // where files go, empty disables the cache
+  static std::string& Directory();
+
+  ~CSceneCache() { Close(); }
+
+  bool Open(const std::string& sourcePath, bool compact);
+  void Close();
+  bool IsOpen() const { return m_map != nullptr; }
+
+  // owned by the caller. Meshes have counts and materials but no vertices,
+  // the geometry goes to the arena.
+  aiScene* CreateScene() const;
+  // the buffers are filled straight from the mapping
+  void RestoreGeometry(CGeometryArena& arena) const;
+
+  // arena built from scene
+  static void Write(const std::string& sourcePath, bool compact,
+                    const aiScene& scene, const CGeometryArena& arena);
+
+ private:
+  const uint8_t* m_map{nullptr};
+  size_t m_size{0};
+};
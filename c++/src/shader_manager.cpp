@@ -0,0 +1,67 @@
+#include "shader_manager.h"
+#include "shader.h"
+
+#include <algorithm>
+#include <cassert>
+
+std::shared_ptr<CShader> CShaderManager::Submit(const char* vertexPath,
+                                                const char* fragmentPath,
+                                                const char* geometryPath,
+                                                const std::string& defines) {
+  m_submitted.push_back(std::make_shared<CShader>(
+      vertexPath, fragmentPath, geometryPath, defines.c_str(), true));
+  return m_submitted.back();
+}
+
+std::shared_ptr<CShader> CShaderManager::SubmitCompute(
+    const char* computePath, const std::string& defines) {
+  m_submitted.push_back(std::make_shared<CShader>(
+      GL_COMPUTE_SHADER, computePath, defines.c_str(), true));
+  return m_submitted.back();
+}
+
+void CShaderManager::FinishAll() {
+  for (const std::shared_ptr<CShader>& program : m_submitted)
+    program->finish();
+  m_submitted.clear();
+}
+
+void CShaderManager::Defer(std::shared_ptr<CShader>& target,
+                           const char* vertexPath, const char* fragmentPath,
+                           const char* geometryPath, const std::string& defines,
+                           const TSetup& setup) {
+  target = nullptr;
+  m_deferred.push_back({&target, vertexPath, fragmentPath, geometryPath,
+                        defines, setup, nullptr});
+}
+
+bool CShaderManager::Acquire(
+    std::initializer_list<std::shared_ptr<CShader>*> targets) {
+  // every target is visited, so a feature's programs compile side by side
+  bool ready = true;
+  for (std::shared_ptr<CShader>* target : targets) {
+    auto it = std::find_if(
+        m_deferred.begin(), m_deferred.end(),
+        [target](const SDeferred& d) { return d.target == target; });
+    assert(it != m_deferred.end() && "program was not deferred");
+    ready = Acquire(*it) && ready;
+  }
+  return ready;
+}
+
+bool CShaderManager::Acquire(SDeferred& deferred) {
+  if (*deferred.target) return true;
+
+  if (!deferred.program) {
+    deferred.program =
+        std::make_shared<CShader>(deferred.vertexPath, deferred.fragmentPath,
+                                  deferred.geometryPath,
+                                  deferred.defines.c_str(), true);
+    return false;
+  }
+  if (!deferred.program->finishIfReady()) return false;
+
+  if (deferred.setup) deferred.setup(*deferred.program);
+  *deferred.target = std::move(deferred.program);
+  return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+
+class CShader;
+
+// Builds programs without blocking on each one.
+// - Submit() only queues compile and link, FinishAll() checks every queued
+//   program once all of them are in flight, so the driver can overlap them.
+// - Defer() describes a program of an optional feature. Nothing is compiled
+//   until the feature first asks for it with Acquire(), which then polls the
+//   driver every frame and hands the program out when it is done.
+class CShaderManager {
+ public:
+  // runs once a program is finished, e.g. to bind its blocks
+  using TSetup = std::function<void(const CShader&)>;
+
+  std::shared_ptr<CShader> Submit(const char* vertexPath,
+                                  const char* fragmentPath,
+                                  const char* geometryPath = nullptr,
+                                  const std::string& defines = "");
+  std::shared_ptr<CShader> SubmitCompute(const char* computePath,
+                                         const std::string& defines = "");
+  void FinishAll();
+
+  // target stays null until Acquire() returns true for it. Paths have to
+  // outlive the manager.
+  void Defer(std::shared_ptr<CShader>& target, const char* vertexPath,
+             const char* fragmentPath, const char* geometryPath = nullptr,
+             const std::string& defines = "", const TSetup& setup = nullptr);
+
+  // submits the deferred programs which are not yet, finishes the ones the
+  // driver is done with. True when all of them are usable, never blocks
+  // where the driver can report completion.
+  bool Acquire(std::initializer_list<std::shared_ptr<CShader>*> targets);
+
+ private:
+  struct SDeferred {
+    std::shared_ptr<CShader>* target;
+    const char* vertexPath;
+    const char* fragmentPath;
+    const char* geometryPath;
+    std::string defines;
+    TSetup setup;
+    std::shared_ptr<CShader> program;  // submitted, not finished yet
+  };
+
+  bool Acquire(SDeferred& deferred);
+
+  std::vector<std::shared_ptr<CShader>> m_submitted;
+  std::vector<SDeferred> m_deferred;
+};
@@ -0,0 +1,71 @@
+#include "shader_permutations.h"
+#include "shader.h"
+
+// indexed by the bit position in EShaderFeatureBits
+static const char* kShaderFeatureNames[kShaderFeaturesCount] = {
+    "BASE_COLOR_TEXTURE", "BASE_COLOR_PARALLAX", "OPACITY_MASK",
+    "NORMAL_MAP",         "NORMAL_FROM_HEIGHT",  "REFLECTION_TEXTURE",
+    "REFLECTION_COLOR",   "SHADOW_MAPS"};
+
+std::string ShaderFeatureDefines(uint32_t features) {
+  std::string defines = "#define PERMUTATIONS\n";
+  for (int i = 0; i < kShaderFeaturesCount; ++i)
+    if (features & (1u << i))
+      defines += std::string("#define ") + kShaderFeatureNames[i] + "\n";
+  return defines;
+}
+
+void CShaderPermutations::Init(const char* vertexPath,
+                               const char* fragmentPath,
+                               const std::string& defines,
+                               const TSetup& setup) {
+  Release();
+  m_vertexPath = vertexPath;
+  m_fragmentPath = fragmentPath;
+  m_defines = defines;
+  m_setup = setup;
+}
+
+void CShaderPermutations::Release() {
+  m_programs.clear();
+  m_vertexPath = m_fragmentPath = nullptr;
+  m_defines.clear();
+  m_setup = nullptr;
+}
+
+void CShaderPermutations::Prepare(uint32_t features) {
+  std::shared_ptr<CShader>& program = m_programs[features];
+  if (program) return;
+  const std::string defines = m_defines + ShaderFeatureDefines(features);
+  program = std::make_shared<CShader>(m_vertexPath, m_fragmentPath, nullptr,
+                                      defines.c_str(), true);
+}
+
+const std::shared_ptr<CShader>& CShaderPermutations::Get(uint32_t features) {
+  std::shared_ptr<CShader>& program = m_programs[features];
+  if (!program) {
+    const std::string defines = m_defines + ShaderFeatureDefines(features);
+    program = std::make_shared<CShader>(m_vertexPath, m_fragmentPath, nullptr,
+                                        defines.c_str());
+    if (m_setup) m_setup(*program);
+  } else if (program->pending()) {
+    program->finish();
+    if (m_setup) m_setup(*program);
+  }
+  return program;
+}
+
+std::shared_ptr<CShader> CShaderPermutations::Acquire(uint32_t features) {
+  auto it = m_programs.find(features);
+  if (it == m_programs.end()) {
+    Prepare(features);
+    return nullptr;
+  }
+
+  const std::shared_ptr<CShader>& program = it->second;
+  if (program->pending()) {
+    if (!program->finishIfReady()) return nullptr;
+    if (m_setup) m_setup(*program);
+  }
+  return program;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+class CShader;
+
+// material features a program permutation is compiled for, one #define each
+// (see ShaderFeatureDefines()). They mirror the subroutine selections of
+// main.frag and deferredGeomPath.frag.
+enum EShaderFeatureBits : uint32_t {
+  kShaderFeatureBaseColorTexture = 1 << 0,
+  kShaderFeatureBaseColorParallax = 1 << 1,
+  kShaderFeatureOpacityMask = 1 << 2,
+  kShaderFeatureNormalMap = 1 << 3,
+  kShaderFeatureNormalFromHeight = 1 << 4,
+  kShaderFeatureReflectionTexture = 1 << 5,
+  kShaderFeatureReflectionColor = 1 << 6,
+  kShaderFeatureShadowMaps = 1 << 7,
+};
+
+constexpr const int kShaderFeaturesCount = 8;
+
+// "#define PERMUTATIONS\n" followed by a #define per set feature
+std::string ShaderFeatureDefines(uint32_t features);
+
+// Variants of one vertex/fragment program, compiled on the first request of
+// a feature mask and cached by it until Release().
+class CShaderPermutations {
+ public:
+  // binds blocks and sets the constant uniforms of a freshly linked variant
+  using TSetup = std::function<void(const CShader&)>;
+
+  // defines are shared by every variant, e.g. "#define MULTI_DRAW\n"
+  void Init(const char* vertexPath, const char* fragmentPath,
+            const std::string& defines, const TSetup& setup);
+  void Release();
+
+  bool Initialized() const { return m_vertexPath != nullptr; }
+  // submits the variant without waiting for it, Get() finishes it
+  void Prepare(uint32_t features);
+  const std::shared_ptr<CShader>& Get(uint32_t features);
+  // never blocks: submits a new mask, finishes it once the driver is done
+  // and returns null until then
+  std::shared_ptr<CShader> Acquire(uint32_t features);
+  size_t Count() const { return m_programs.size(); }
+
+ private:
+  const char* m_vertexPath{nullptr};
+  const char* m_fragmentPath{nullptr};
+  std::string m_defines;
+  TSetup m_setup;
+  std::unordered_map<uint32_t, std::shared_ptr<CShader>> m_programs;
+};
@@ -1,12 +1,13 @@
-#version 330 core
+#version 400 core
 out vec4 FragColor;
 
 in vec3 TexCoords;
 uniform float farPlane;
 
-uniform samplerCube in_texture;
+uniform samplerCubeArray in_texture;
+uniform int cubeLayer;
 
 void main()
 {    
-    FragColor = vec4(vec3(texture(in_texture, TexCoords).r), 1.0f);
+    FragColor = vec4(vec3(texture(in_texture, vec4(TexCoords, cubeLayer)).r), 1.0f);
 }
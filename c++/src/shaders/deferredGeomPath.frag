@@ -7,7 +7,6 @@ layout (location = 2) out vec4 gAlbedoSpec;
 in vec3 Normal;
 in vec3 FragPos;
 in vec2 TexCoords;
-in vec4 FragPosLightSpace;
 in mat3 TBN;
 
 in vec3 TangentCamPos;
@@ -18,62 +17,110 @@ uniform vec3 camPos;
 struct Material
 {
 	vec3 ambient;
+	float shininess;
 	vec3 diffuse;
 	vec3 specular;
-	float shininess;
+	int opacityLayer;
+	// diffuse, specular, reflection, normals
+	ivec4 layers;
+};
+
+// sized to the scene by the loader, see MaterialsDefines()
+#ifndef MAX_MATERIALS
+#define MAX_MATERIALS 256
+#endif
+
+// std140 layout is mirrored by SMaterialStd140 in material.h
+layout (std140) uniform Materials
+{
+	Material materials[MAX_MATERIALS];
 };
-uniform Material material;
+#ifdef MULTI_DRAW
+flat in int MaterialIndex;
+#define materialIndex MaterialIndex
+#else
+uniform int materialIndex;
+#endif
 
 struct Texture
 {
-	sampler2D diff;
-	sampler2D spec;
-	sampler2D reflection;
-	sampler2D norm;
-	sampler2D opacity;
+	sampler2DArray diff;
+	sampler2DArray spec;
+	sampler2DArray reflection;
+	sampler2DArray norm;
+	sampler2DArray opacity;
 };
 uniform Texture inTexture;
 
+// material textures are layers of arrays shared by every texture of the same
+// size and format, the Materials block holds the layers
+vec3 diffUV(vec2 uv) { return vec3(uv, materials[materialIndex].layers.x); }
+vec3 specUV(vec2 uv) { return vec3(uv, materials[materialIndex].layers.y); }
+vec3 reflectionUV(vec2 uv) { return vec3(uv, materials[materialIndex].layers.z); }
+vec3 normUV(vec2 uv) { return vec3(uv, materials[materialIndex].layers.w); }
+vec3 opacityUV(vec2 uv) { return vec3(uv, materials[materialIndex].opacityLayer); }
+
 uniform samplerCube skybox;
 uniform mat4 rotfix;
 
 uniform mat4 model;
 
+// PERMUTATIONS compiles a program per material feature mask: each selection
+// below becomes a direct call picked by the feature #defines (see
+// EShaderFeatureBits in shader_permutations.h) instead of a subroutine
+#ifdef PERMUTATIONS
+#define SUBROUTINE(type)
+#else
+#define SUBROUTINE(type) subroutine (type)
+#endif
+
 // ---------------------- subroutines ------------------------
 
+#ifdef PERMUTATIONS
+#if defined(NORMAL_FROM_HEIGHT)
+#define getNormalSelection getNormalFromHeight
+#elif defined(NORMAL_MAP)
+#define getNormalSelection getNormalBumped
+#else
+#define getNormalSelection getNormalSimple
+#endif
+#else
 subroutine vec3 getNormal(vec2 uv);
+subroutine uniform getNormal getNormalSelection;
+#endif
 
-subroutine (getNormal) vec3 getNormalSimple(vec2 uv)
+SUBROUTINE(getNormal) vec3 getNormalSimple(vec2 uv)
 {
 	return normalize(Normal);
 }
 
-subroutine (getNormal) vec3 getNormalBumped(vec2 uv)
+SUBROUTINE(getNormal) vec3 getNormalBumped(vec2 uv)
 {
-	//TODO: bad for performance, but less code
-	vec3 n = normalize(texture(inTexture.norm, uv).rgb);
-	n = normalize(n * 2.0 - 1.0);
+	// z is rebuilt, compressed normal maps keep x and y only
+	vec3 n;
+	n.xy = texture(inTexture.norm, normUV(uv)).rg * 2.0 - 1.0;
+	n.z = sqrt(max(1.0 - dot(n.xy, n.xy), 0.0));
 	n = normalize(TBN * n);
 	return n;
 }
 
-subroutine (getNormal) vec3 getNormalFromHeight(vec2 uv)
+SUBROUTINE(getNormal) vec3 getNormalFromHeight(vec2 uv)
 {
 	const vec2 size = vec2(1.0,0.0);
 	const ivec3 off = ivec3(-1,0,1);
 
-	vec4 wave = texture(inTexture.norm, uv);
+	vec4 wave = texture(inTexture.norm, normUV(uv));
 	float s11 = wave.x;
 #if 0
-	float s01 = textureOffset(inTexture.norm, uv, off.xy).x;
-	float s21 = textureOffset(inTexture.norm, uv, off.zy).x;
-	float s10 = textureOffset(inTexture.norm, uv, off.yx).x;
-	float s12 = textureOffset(inTexture.norm, uv, off.yz).x;
+	float s01 = textureOffset(inTexture.norm, normUV(uv), off.xy).x;
+	float s21 = textureOffset(inTexture.norm, normUV(uv), off.zy).x;
+	float s10 = textureOffset(inTexture.norm, normUV(uv), off.yx).x;
+	float s12 = textureOffset(inTexture.norm, normUV(uv), off.yz).x;
 #else
-	float s01 = 1-textureOffset(inTexture.norm, uv, off.xy).x;
-	float s21 = 1-textureOffset(inTexture.norm, uv, off.zy).x;
-	float s10 = 1-textureOffset(inTexture.norm, uv, off.yx).x;
-	float s12 = 1-textureOffset(inTexture.norm, uv, off.yz).x;
+	float s01 = 1-textureOffset(inTexture.norm, normUV(uv), off.xy).x;
+	float s21 = 1-textureOffset(inTexture.norm, normUV(uv), off.zy).x;
+	float s10 = 1-textureOffset(inTexture.norm, normUV(uv), off.yx).x;
+	float s12 = 1-textureOffset(inTexture.norm, normUV(uv), off.yz).x;
 #endif
 
 	float scale = 0.3;
@@ -86,23 +133,22 @@ subroutine (getNormal) vec3 getNormalFromHeight(vec2 uv)
 	return n;
 }
 
-subroutine uniform getNormal getNormalSelection;
 // -----------------------------------------------------------
 
 vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
 { 
-    float height =  texture(inTexture.norm, texCoords).r;    
+    float height =  texture(inTexture.norm, normUV(texCoords)).r;    
 		height = 1.0 - height;
     vec2 p = viewDir.xy / viewDir.z * (height * 0.001);
     return texCoords - p;    
 } 
 
 
-vec4 getHeightBumped(sampler2D tex, vec2 uv)
+vec4 getHeightBumped(sampler2DArray tex, int layer, vec2 uv)
 {
 	vec3 viewDir   = normalize(TangentCamPos - TangentFragPos);
   vec2 texCoords = ParallaxMapping(uv,  viewDir);
-	return texture(tex, texCoords);
+	return texture(tex, vec3(texCoords, layer));
 }
 
 // -----------------------------------------------------------
@@ -114,99 +160,133 @@ struct Color
 	float shininess;
 };
 
+#ifdef PERMUTATIONS
+#if defined(BASE_COLOR_PARALLAX)
+#define baseColorSelection textHeightColor
+#elif defined(BASE_COLOR_TEXTURE)
+#define baseColorSelection textColor
+#else
+#define baseColorSelection plainColor
+#endif
+#else
 subroutine Color baseColor(vec2 uv);
+subroutine uniform baseColor baseColorSelection;
+#endif
 
-subroutine (baseColor) Color plainColor(vec2 uv)
+SUBROUTINE(baseColor) Color plainColor(vec2 uv)
 {
 	Color c;
-	c.ambient = vec4(material.diffuse, 1.0);
-	c.diffuse = vec4(material.diffuse, 1.0);
-	c.specular = vec4(material.specular, 1.0);
-	c.shininess = material.shininess;
+	c.ambient = vec4(materials[materialIndex].diffuse, 1.0);
+	c.diffuse = vec4(materials[materialIndex].diffuse, 1.0);
+	c.specular = vec4(materials[materialIndex].specular, 1.0);
+	c.shininess = materials[materialIndex].shininess;
 	return c;
 }
 
-subroutine (baseColor) Color textColor(vec2 uv)
+SUBROUTINE(baseColor) Color textColor(vec2 uv)
 {
 	Color c;
-	c.diffuse = texture(inTexture.diff, uv);
+	c.diffuse = texture(inTexture.diff, diffUV(uv));
 	c.ambient = c.diffuse;
-	c.specular = texture(inTexture.spec, uv);
+	c.specular = texture(inTexture.spec, specUV(uv));
 	c.shininess = 16;
 	return c;
 }
 
-subroutine (baseColor) Color textHeightColor(vec2 uv)
+SUBROUTINE(baseColor) Color textHeightColor(vec2 uv)
 {
 	Color c;
-	c.diffuse  = getHeightBumped(inTexture.diff, uv);
+	c.diffuse  = getHeightBumped(inTexture.diff, materials[materialIndex].layers.x, uv);
 	c.ambient = c.diffuse;
-	c.specular = getHeightBumped(inTexture.spec, uv);
+	c.specular = getHeightBumped(inTexture.spec, materials[materialIndex].layers.y, uv);
 	c.shininess = 16;
 	return c;
 }
 
-subroutine uniform baseColor baseColorSelection;
-
 // ----------------------reflection map-------------------------------------
+#ifdef PERMUTATIONS
+#if defined(REFLECTION_TEXTURE)
+#define reflectionMapSelection reflectionTexture
+#elif defined(REFLECTION_COLOR)
+#define reflectionMapSelection reflectionColor
+#else
+#define reflectionMapSelection emptyReflectionMap
+#endif
+#else
 subroutine vec3 reflectionMap();
-subroutine (reflectionMap) vec3 emptyReflectionMap()
+subroutine uniform reflectionMap reflectionMapSelection;
+#endif
+SUBROUTINE(reflectionMap) vec3 emptyReflectionMap()
 {
 	return vec3(0.0, 0.0, 0.0);
 }
 
-subroutine (reflectionMap) vec3 reflectionTexture()
+SUBROUTINE(reflectionMap) vec3 reflectionTexture()
 {
 	return vec3(0.0, 0.0, 0.0);
 }
 
-subroutine (reflectionMap) vec3 reflectionColor()
+SUBROUTINE(reflectionMap) vec3 reflectionColor()
 {
 	return vec3(0.0, 0.0, 0.0);
 }
 
-subroutine uniform reflectionMap reflectionMapSelection;
-
 
 // ----------------------shadow map-------------------------------------
+#ifdef PERMUTATIONS
+#if defined(SHADOW_MAPS)
+#define shadowMapSelection globalShadowMap
+#else
+#define shadowMapSelection emptyShadowMap
+#endif
+#else
 subroutine float shadowMap();
+subroutine uniform shadowMap shadowMapSelection;
+#endif
 
-subroutine (shadowMap) float emptyShadowMap()
+SUBROUTINE(shadowMap) float emptyShadowMap()
 {
 	return 0.0f;
 }
 
-subroutine (shadowMap) float globalShadowMap()
+SUBROUTINE(shadowMap) float globalShadowMap()
 {
 	return 0.0f;
 }
 
-subroutine uniform shadowMap shadowMapSelection;
-
 // ---------------------- opacity ------------------------
 
+#ifdef PERMUTATIONS
+#if defined(OPACITY_MASK)
+#define opacitySelection maskOpacity
+#else
+#define opacitySelection emptyOpacity
+#endif
+#else
 subroutine float getOpacity(vec2 uv);
+subroutine uniform getOpacity opacitySelection;
+#endif
 
-subroutine (getOpacity) float emptyOpacity(vec2 uv)
+SUBROUTINE(getOpacity) float emptyOpacity(vec2 uv)
 {
 	return 1.0;
 }
 
-subroutine (getOpacity) float maskOpacity(vec2 uv)
+SUBROUTINE(getOpacity) float maskOpacity(vec2 uv)
 {
-	return texture(inTexture.opacity, uv).r;
+	return texture(inTexture.opacity, opacityUV(uv)).r;
 }
 
-subroutine uniform getOpacity opacitySelection;
-
 // -----------------------------------------------------------
 
 void main()
 {
 	float opacity = opacitySelection(TexCoords);
 
+#if !defined(PERMUTATIONS) || defined(OPACITY_MASK)
 	if (opacity < 0.03)
 		discard;
+#endif
 
   vec3 norm = getNormalSelection(TexCoords);
 	Color baseColor = baseColorSelection(TexCoords);
@@ -6,36 +6,55 @@ in vec2 TexCoords;
 struct PointLight
 {
 	vec3 pos;
-
-	vec3 ambient;
-	vec3 diffuse;
-	vec3 specular;
-
 	float constant;
+	vec3 ambient;
 	float linear;
+	vec3 diffuse;
 	float quadratic;
-	
-	samplerCube shadowMapTexture;
+	vec3 specular;
 	float farPlane;
 };
 
-#define NR_POINT_LIGHTS 6
-uniform PointLight pointLights[NR_POINT_LIGHTS];
-uniform int nPointLights;
-
 struct DirLight
 {
 	vec3 dir;
-
 	vec3 ambient;
 	vec3 diffuse;
 	vec3 specular;
-	sampler2D shadowMapTexture;
 };
 
+#define NR_POINT_LIGHTS 32
 #define NR_DIR_LIGHTS 1
-uniform DirLight dirLights[NR_DIR_LIGHTS];
-uniform int nDirLights;
+
+// std140 layout is mirrored by SLightsBlockStd140 in light_system.h
+layout (std140) uniform Lights
+{
+	PointLight pointLights[NR_POINT_LIGHTS];
+	DirLight dirLights[NR_DIR_LIGHTS];
+	int nPointLights;
+	int nDirLights;
+	// shadow atlas tier and layer, tier -1 without shadow
+	ivec4 pointShadows[NR_POINT_LIGHTS];
+};
+
+// point light shadow cubes, a cube map array per resolution tier
+uniform samplerCubeArray pointShadowAtlas0;
+uniform samplerCubeArray pointShadowAtlas1;
+uniform samplerCubeArray pointShadowAtlas2;
+
+float atlasDepth(ivec4 slot, vec3 dir)
+{
+	vec4 coord = vec4(dir, slot.y);
+	if (slot.x == 0)
+		return texture(pointShadowAtlas0, coord).r;
+	if (slot.x == 1)
+		return texture(pointShadowAtlas1, coord).r;
+	return texture(pointShadowAtlas2, coord).r;
+}
+#define MAX_CASCADES 4
+uniform sampler2DArray dirShadowMap;
+uniform mat4 cascadeMatrices[MAX_CASCADES];
+uniform int cascadesCount;
 
 uniform vec3 camPos;
 
@@ -45,8 +64,6 @@ uniform sampler2D gAlbedoSpec;
 uniform sampler2D gDepth;
 uniform sampler2D SSAOTxt;
 
-uniform mat4 lightSpaceMatrix;
-
 out vec4 fColor;
 
 struct Color
@@ -57,50 +74,51 @@ struct Color
 	float shininess;
 };
 
+// ----------------------cascade selection-----------------------------
+// the first, finest cascade holding the fragment, PCF within its layer
+float cascadeShadow(vec3 fragPos)
+{
+	for (int c = 0; c < cascadesCount; ++c)
+	{
+		vec4 fragPosLightSpace = cascadeMatrices[c] * vec4(fragPos, 1.0);
+		// transform to [0,1] range
+		vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w * 0.5 + 0.5;
+		if (any(lessThan(projCoords, vec3(0.0))) || any(greaterThan(projCoords, vec3(1.0))))
+			continue;
+
+		// get depth of current fragment from light's perspective
+		float currentDepth = projCoords.z;
+		float bias = 0.0005;
+
+		float shadow = 0.0;
+		vec2 texelSize = 1.0 / vec2(textureSize(dirShadowMap, 0).xy);
+		for(int x = -1; x <= 1; ++x)
+		{
+				for(int y = -1; y <= 1; ++y)
+				{
+						float pcfDepth = texture(dirShadowMap, vec3(projCoords.xy + vec2(x, y) * texelSize, c)).r;
+						shadow += currentDepth - bias > pcfDepth ? 0.5 : 0.0;
+				}
+		}
+		return shadow / 9.0;
+	}
+	return 0.0;
+}
+
 // ----------------------shadow map-------------------------------------
-subroutine float shadowMap(vec3 fragPos, vec3 normal, vec4 fragPosLightSpace, DirLight light);
+subroutine float shadowMap(vec3 fragPos, vec3 normal, DirLight light);
 
-subroutine (shadowMap) float emptyShadowMap(vec3 fragPos, vec3 normal, vec4 fragPosLightSpace, DirLight light)
+subroutine (shadowMap) float emptyShadowMap(vec3 fragPos, vec3 normal, DirLight light)
 {
 	return 0.0f;
 }
 
-subroutine (shadowMap) float globalShadowMap(vec3 fragPos, vec3 normal, vec4 fragPosLightSpace, DirLight light)
+subroutine (shadowMap) float globalShadowMap(vec3 fragPos, vec3 normal, DirLight light)
 {
-	vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
-
 	float shadow = 0.0;
 
 	if (nDirLights > 0)
-	{
-		if (projCoords.z <= 1.0)
-		{
-			// transform to [0,1] range
-			projCoords = projCoords * 0.5 + 0.5;
-			// get closest depth value from light's perspective (using [0,1] range fragPosLight as coords)
-			//float closestDepth = texture(shadowMapTexture, projCoords.xy).r; 
-			
-			// get depth of current fragment from light's perspective
-			float currentDepth = projCoords.z;
-			
-			float bias = 0.0005;	
-			//float bias = max(0.05 * (1.0 - dot(normal, lightDir)), 0.005);  
-			// check whether current frag pos is in shadow
-			//
-			//float shadow = currentDepth - bias > closestDepth  ? 1.0 : 0.0;
-
-			vec2 texelSize = 1.0 / textureSize(light.shadowMapTexture, 0);
-			for(int x = -1; x <= 1; ++x)
-			{
-					for(int y = -1; y <= 1; ++y)
-					{
-							float pcfDepth = texture(light.shadowMapTexture, projCoords.xy + vec2(x, y) * texelSize).r; 
-							shadow += currentDepth - bias > pcfDepth ? 0.5 : 0.0;        
-					}    
-			}
-			shadow /= 9.0;
-		}
-	}
+		shadow = cascadeShadow(fragPos);
 
 	//calculate omnidirectional shadows
 	for (int i = 0; i < nPointLights; i++)
@@ -111,10 +129,10 @@ subroutine (shadowMap) float globalShadowMap(vec3 fragPos, vec3 normal, vec4 fra
     // now get current linear depth as the length between the fragment and light position
     float currentDepth = length(fragToLight);
 
-		if (currentDepth < pointLights[i].farPlane)
+		if (pointShadows[i].x >= 0 && currentDepth < pointLights[i].farPlane)
 		{
 			// use the light to fragment vector to sample from the depth map    
-			float closestDepth = texture(pointLights[i].shadowMapTexture, (fragToLight)).r;
+			float closestDepth = atlasDepth(pointShadows[i], fragToLight);
 			// it is currently in linear range between [0,1]. Re-transform back to original value
 			closestDepth *= pointLights[i].farPlane;
 			// now test for shadows
@@ -200,8 +218,7 @@ void main()
 		res.specular += vec4(dirLights[i].specular * spec * Specular, 1.0);
 	}
 
-	vec4 dirFragPosLightSpace = lightSpaceMatrix * vec4(FragPos, 1.0);
-	float shadow = shadowMapSelection(FragPos, Normal, dirFragPosLightSpace, dirLights[0]);
+	float shadow = shadowMapSelection(FragPos, Normal, dirLights[0]);
 	float AO = AmbiantOclusionSelection(TexCoords);
 	fColor = vec4(vec3(res.ambient + (res.diffuse + res.specular) * (1.0 - shadow) * AO), 1.0f);
 	
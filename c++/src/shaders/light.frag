@@ -1,9 +1,9 @@
 #version 400 core
 
 out vec4 fColor;
-uniform vec3 lightColor;
+flat in vec3 LightColor;
 
 void main()
 {
-	fColor = vec4(lightColor, 1.0);
+	fColor = vec4(LightColor, 1.0);
 }
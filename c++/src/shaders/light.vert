@@ -2,9 +2,14 @@
 
 layout( location = 0 ) in vec4 vPosition;
 
-uniform mat4 MVP;
+// per instance, one light model each. Location 1 is vLightColor
+layout( location = 1 ) in vec3 lightColor;
+layout( location = 6 ) in mat4 instanceMVP;
+
+flat out vec3 LightColor;
 
 void main()
 {
-	gl_Position = MVP * vPosition;
+	gl_Position = instanceMVP * vPosition;
+	LightColor = lightColor;
 }
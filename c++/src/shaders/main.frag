@@ -3,7 +3,6 @@
 in vec3 Normal;
 in vec3 FragPos;
 in vec2 TexCoords;
-in vec4 FragPosLightSpace;
 in mat3 TBN;
 
 in vec3 TangentCamPos;
@@ -12,60 +11,105 @@ in vec3 TangentFragPos;
 struct PointLight
 {
 	vec3 pos;
-
-	vec3 ambient;
-	vec3 diffuse;
-	vec3 specular;
-
 	float constant;
+	vec3 ambient;
 	float linear;
+	vec3 diffuse;
 	float quadratic;
-	
-	samplerCube shadowMapTexture;
+	vec3 specular;
 	float farPlane;
 };
 
-#define NR_POINT_LIGHTS 6
-uniform PointLight pointLights[NR_POINT_LIGHTS];
-uniform int nPointLights;
-
 struct DirLight
 {
 	vec3 dir;
-
 	vec3 ambient;
 	vec3 diffuse;
 	vec3 specular;
-	sampler2D shadowMapTexture;
 };
 
+#define NR_POINT_LIGHTS 32
 #define NR_DIR_LIGHTS 1
-uniform DirLight dirLights[NR_DIR_LIGHTS];
-uniform int nDirLights;
+
+// std140 layout is mirrored by SLightsBlockStd140 in light_system.h
+layout (std140) uniform Lights
+{
+	PointLight pointLights[NR_POINT_LIGHTS];
+	DirLight dirLights[NR_DIR_LIGHTS];
+	int nPointLights;
+	int nDirLights;
+	// shadow atlas tier and layer, tier -1 without shadow
+	ivec4 pointShadows[NR_POINT_LIGHTS];
+};
+
+// point light shadow cubes, a cube map array per resolution tier
+uniform samplerCubeArray pointShadowAtlas0;
+uniform samplerCubeArray pointShadowAtlas1;
+uniform samplerCubeArray pointShadowAtlas2;
+
+float atlasDepth(ivec4 slot, vec3 dir)
+{
+	vec4 coord = vec4(dir, slot.y);
+	if (slot.x == 0)
+		return texture(pointShadowAtlas0, coord).r;
+	if (slot.x == 1)
+		return texture(pointShadowAtlas1, coord).r;
+	return texture(pointShadowAtlas2, coord).r;
+}
+#define MAX_CASCADES 4
+uniform sampler2DArray dirShadowMap;
+uniform mat4 cascadeMatrices[MAX_CASCADES];
+uniform int cascadesCount;
 
 uniform vec3 camPos;
 
 struct Material
 {
 	vec3 ambient;
+	float shininess;
 	vec3 diffuse;
 	vec3 specular;
-	float shininess;
+	int opacityLayer;
+	// diffuse, specular, reflection, normals
+	ivec4 layers;
 };
 
-uniform Material material;
+// sized to the scene by the loader, see MaterialsDefines()
+#ifndef MAX_MATERIALS
+#define MAX_MATERIALS 256
+#endif
+
+// std140 layout is mirrored by SMaterialStd140 in material.h
+layout (std140) uniform Materials
+{
+	Material materials[MAX_MATERIALS];
+};
+#ifdef MULTI_DRAW
+flat in int MaterialIndex;
+#define materialIndex MaterialIndex
+#else
+uniform int materialIndex;
+#endif
 
 struct Texture
 {
-	sampler2D diff;
-	sampler2D spec;
-	sampler2D reflection;
-	sampler2D norm;
-	sampler2D opacity;
+	sampler2DArray diff;
+	sampler2DArray spec;
+	sampler2DArray reflection;
+	sampler2DArray norm;
+	sampler2DArray opacity;
 };
 
 uniform Texture inTexture;
 
+// material textures are layers of arrays shared by every texture of the same
+// size and format, the Materials block holds the layers
+vec3 diffUV(vec2 uv) { return vec3(uv, materials[materialIndex].layers.x); }
+vec3 specUV(vec2 uv) { return vec3(uv, materials[materialIndex].layers.y); }
+vec3 reflectionUV(vec2 uv) { return vec3(uv, materials[materialIndex].layers.z); }
+vec3 normUV(vec2 uv) { return vec3(uv, materials[materialIndex].layers.w); }
+vec3 opacityUV(vec2 uv) { return vec3(uv, materials[materialIndex].opacityLayer); }
+
 uniform samplerCube skybox;
 uniform mat4 rotfix;
 
@@ -73,41 +117,62 @@ uniform mat4 model;
 
 out vec4 fColor;
 
+// PERMUTATIONS compiles a program per material feature mask: each selection
+// below becomes a direct call picked by the feature #defines (see
+// EShaderFeatureBits in shader_permutations.h) instead of a subroutine
+#ifdef PERMUTATIONS
+#define SUBROUTINE(type)
+#else
+#define SUBROUTINE(type) subroutine (type)
+#endif
+
 // ---------------------- subroutines ------------------------
 
+#ifdef PERMUTATIONS
+#if defined(NORMAL_FROM_HEIGHT)
+#define getNormalSelection getNormalFromHeight
+#elif defined(NORMAL_MAP)
+#define getNormalSelection getNormalBumped
+#else
+#define getNormalSelection getNormalSimple
+#endif
+#else
 subroutine vec3 getNormal(vec2 uv);
+subroutine uniform getNormal getNormalSelection;
+#endif
 
-subroutine (getNormal) vec3 getNormalSimple(vec2 uv)
+SUBROUTINE(getNormal) vec3 getNormalSimple(vec2 uv)
 {
 	return normalize(Normal);
 }
 
-subroutine (getNormal) vec3 getNormalBumped(vec2 uv)
+SUBROUTINE(getNormal) vec3 getNormalBumped(vec2 uv)
 {
-	//TODO: bad for performance, but less code
-	vec3 n = normalize(texture(inTexture.norm, uv).rgb);
-	n = normalize(n * 2.0 - 1.0);
+	// z is rebuilt, compressed normal maps keep x and y only
+	vec3 n;
+	n.xy = texture(inTexture.norm, normUV(uv)).rg * 2.0 - 1.0;
+	n.z = sqrt(max(1.0 - dot(n.xy, n.xy), 0.0));
 	n = normalize(TBN * n);
 	return n;
 }
 
-subroutine (getNormal) vec3 getNormalFromHeight(vec2 uv)
+SUBROUTINE(getNormal) vec3 getNormalFromHeight(vec2 uv)
 {
 	const vec2 size = vec2(1.0,0.0);
 	const ivec3 off = ivec3(-1,0,1);
 
-	vec4 wave = texture(inTexture.norm, uv);
+	vec4 wave = texture(inTexture.norm, normUV(uv));
 	float s11 = wave.x;
 #if 0
-	float s01 = textureOffset(inTexture.norm, uv, off.xy).x;
-	float s21 = textureOffset(inTexture.norm, uv, off.zy).x;
-	float s10 = textureOffset(inTexture.norm, uv, off.yx).x;
-	float s12 = textureOffset(inTexture.norm, uv, off.yz).x;
+	float s01 = textureOffset(inTexture.norm, normUV(uv), off.xy).x;
+	float s21 = textureOffset(inTexture.norm, normUV(uv), off.zy).x;
+	float s10 = textureOffset(inTexture.norm, normUV(uv), off.yx).x;
+	float s12 = textureOffset(inTexture.norm, normUV(uv), off.yz).x;
 #else
-	float s01 = 1-textureOffset(inTexture.norm, uv, off.xy).x;
-	float s21 = 1-textureOffset(inTexture.norm, uv, off.zy).x;
-	float s10 = 1-textureOffset(inTexture.norm, uv, off.yx).x;
-	float s12 = 1-textureOffset(inTexture.norm, uv, off.yz).x;
+	float s01 = 1-textureOffset(inTexture.norm, normUV(uv), off.xy).x;
+	float s21 = 1-textureOffset(inTexture.norm, normUV(uv), off.zy).x;
+	float s10 = 1-textureOffset(inTexture.norm, normUV(uv), off.yx).x;
+	float s12 = 1-textureOffset(inTexture.norm, normUV(uv), off.yz).x;
 #endif
 
 	float scale = 0.3;
@@ -120,7 +185,6 @@ subroutine (getNormal) vec3 getNormalFromHeight(vec2 uv)
 	return n;
 }
 
-subroutine uniform getNormal getNormalSelection;
 // -----------------------------------------------------------
 /*
 vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
@@ -149,18 +213,18 @@ subroutine uniform getHeight getHeightSelection;
 
 vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
 { 
-    float height =  texture(inTexture.norm, texCoords).r;    
+    float height =  texture(inTexture.norm, normUV(texCoords)).r;    
 		height = 1.0 - height;
     vec2 p = viewDir.xy / viewDir.z * (height * 0.001);
     return texCoords - p;    
 } 
 
 
-vec4 getHeightBumped(sampler2D tex, vec2 uv)
+vec4 getHeightBumped(sampler2DArray tex, int layer, vec2 uv)
 {
 	vec3 viewDir   = normalize(TangentCamPos - TangentFragPos);
   vec2 texCoords = ParallaxMapping(uv,  viewDir);
-	return texture(tex, texCoords);
+	return texture(tex, vec3(texCoords, layer));
 }
 
 // -----------------------------------------------------------
@@ -172,126 +236,154 @@ struct Color
 	float shininess;
 };
 
+#ifdef PERMUTATIONS
+#if defined(BASE_COLOR_PARALLAX)
+#define baseColorSelection textHeightColor
+#elif defined(BASE_COLOR_TEXTURE)
+#define baseColorSelection textColor
+#else
+#define baseColorSelection plainColor
+#endif
+#else
 subroutine Color baseColor(vec2 uv);
+subroutine uniform baseColor baseColorSelection;
+#endif
 
-subroutine (baseColor) Color plainColor(vec2 uv)
+SUBROUTINE(baseColor) Color plainColor(vec2 uv)
 {
 	Color c;
-	c.ambient = vec4(material.diffuse, 1.0);
-	c.diffuse = vec4(material.diffuse, 1.0);
-	c.specular = vec4(material.specular, 1.0);
-	c.shininess = 16;//material.shininess;
+	c.ambient = vec4(materials[materialIndex].diffuse, 1.0);
+	c.diffuse = vec4(materials[materialIndex].diffuse, 1.0);
+	c.specular = vec4(materials[materialIndex].specular, 1.0);
+	c.shininess = 16;//materials[materialIndex].shininess;
 	return c;
 }
 
-subroutine (baseColor) Color textColor(vec2 uv)
+SUBROUTINE(baseColor) Color textColor(vec2 uv)
 {
 	Color c;
-	c.diffuse = texture(inTexture.diff, uv);
+	c.diffuse = texture(inTexture.diff, diffUV(uv));
 	c.ambient = c.diffuse;
-	c.specular = texture(inTexture.spec, uv);
+	c.specular = texture(inTexture.spec, specUV(uv));
 	c.shininess = 16;
 	return c;
 }
 
-subroutine (baseColor) Color textHeightColor(vec2 uv)
+SUBROUTINE(baseColor) Color textHeightColor(vec2 uv)
 {
 	Color c;
-	c.diffuse  = getHeightBumped(inTexture.diff, uv);
+	c.diffuse  = getHeightBumped(inTexture.diff, materials[materialIndex].layers.x, uv);
 	c.ambient = c.diffuse;
-	c.specular = getHeightBumped(inTexture.spec, uv);
+	c.specular = getHeightBumped(inTexture.spec, materials[materialIndex].layers.y, uv);
 	c.shininess = 16;
 	return c;
 }
 
-subroutine uniform baseColor baseColorSelection;
-
 // ----------------------reflection map-------------------------------------
+#ifdef PERMUTATIONS
+#if defined(REFLECTION_TEXTURE)
+#define reflectionMapSelection reflectionTexture
+#elif defined(REFLECTION_COLOR)
+#define reflectionMapSelection reflectionColor
+#else
+#define reflectionMapSelection emptyReflectionMap
+#endif
+#else
 subroutine vec3 reflectionMap(vec2 uv);
-subroutine (reflectionMap) vec3 emptyReflectionMap(vec2 uv)
+subroutine uniform reflectionMap reflectionMapSelection;
+#endif
+SUBROUTINE(reflectionMap) vec3 emptyReflectionMap(vec2 uv)
 {
 	return vec3(0.0, 0.0, 0.0);
 }
 
-subroutine (reflectionMap) vec3 reflectionTexture(vec2 uv)
+SUBROUTINE(reflectionMap) vec3 reflectionTexture(vec2 uv)
 {
 	vec3 I = normalize(FragPos - camPos);
 	vec3 R = reflect(I, getNormalSelection(uv));
 	R = normalize(vec3( rotfix * vec4(R, 0.0)));
 
-	return texture(inTexture.reflection, uv).rgb * texture(skybox, R).rgb;
+	return texture(inTexture.reflection, reflectionUV(uv)).rgb * texture(skybox, R).rgb;
 }
 
-subroutine (reflectionMap) vec3 reflectionColor(vec2 uv)
+SUBROUTINE(reflectionMap) vec3 reflectionColor(vec2 uv)
 {
 	vec3 I = normalize(FragPos - camPos);
 	vec3 R = reflect(I, getNormalSelection(uv));
 	R = normalize(vec3( rotfix * vec4(R, 0.0)));
 
-	return material.diffuse * texture(skybox, R).rgb;
+	return materials[materialIndex].diffuse * texture(skybox, R).rgb;
 }
 
-subroutine uniform reflectionMap reflectionMapSelection;
-
 
 // ----------------------shadow map-------------------------------------
-subroutine float shadowMap(vec4 fragPosLightSpace, vec3 normal, DirLight light);
+// ----------------------cascade selection-----------------------------
+// the first, finest cascade holding the fragment, PCF within its layer
+float cascadeShadow(vec3 fragPos)
+{
+	for (int c = 0; c < cascadesCount; ++c)
+	{
+		vec4 fragPosLightSpace = cascadeMatrices[c] * vec4(fragPos, 1.0);
+		// transform to [0,1] range
+		vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w * 0.5 + 0.5;
+		if (any(lessThan(projCoords, vec3(0.0))) || any(greaterThan(projCoords, vec3(1.0))))
+			continue;
+
+		// get depth of current fragment from light's perspective
+		float currentDepth = projCoords.z;
+		float bias = 0.0005;
+
+		float shadow = 0.0;
+		vec2 texelSize = 1.0 / vec2(textureSize(dirShadowMap, 0).xy);
+		for(int x = -1; x <= 1; ++x)
+		{
+				for(int y = -1; y <= 1; ++y)
+				{
+						float pcfDepth = texture(dirShadowMap, vec3(projCoords.xy + vec2(x, y) * texelSize, c)).r;
+						shadow += currentDepth - bias > pcfDepth ? 0.5 : 0.0;
+				}
+		}
+		return shadow / 9.0;
+	}
+	return 0.0;
+}
 
-subroutine (shadowMap) float emptyShadowMap(vec4 fragPosLightSpace, vec3 normal, DirLight light)
+#ifdef PERMUTATIONS
+#if defined(SHADOW_MAPS)
+#define shadowMapSelection globalShadowMap
+#else
+#define shadowMapSelection emptyShadowMap
+#endif
+#else
+subroutine float shadowMap(vec3 fragPos, vec3 normal, DirLight light);
+subroutine uniform shadowMap shadowMapSelection;
+#endif
+
+SUBROUTINE(shadowMap) float emptyShadowMap(vec3 fragPos, vec3 normal, DirLight light)
 {
 	return 0.0f;
 }
 
-subroutine (shadowMap) float globalShadowMap(vec4 fragPosLightSpace, vec3 normal, DirLight light)
+SUBROUTINE(shadowMap) float globalShadowMap(vec3 fragPos, vec3 normal, DirLight light)
 {
-	vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
-
 	float shadow = 0.0;
 
 	if (nDirLights > 0)
-	{
-		if (projCoords.z <= 1.0)
-		{
-			// transform to [0,1] range
-			projCoords = projCoords * 0.5 + 0.5;
-			// get closest depth value from light's perspective (using [0,1] range fragPosLight as coords)
-			//float closestDepth = texture(shadowMapTexture, projCoords.xy).r; 
-			
-			// get depth of current fragment from light's perspective
-			float currentDepth = projCoords.z;
-			
-			float bias = 0.0005;	
-			//float bias = max(0.05 * (1.0 - dot(normal, lightDir)), 0.005);  
-			// check whether current frag pos is in shadow
-			//
-			//float shadow = currentDepth - bias > closestDepth  ? 1.0 : 0.0;
-
-			vec2 texelSize = 1.0 / textureSize(light.shadowMapTexture, 0);
-			for(int x = -1; x <= 1; ++x)
-			{
-					for(int y = -1; y <= 1; ++y)
-					{
-							float pcfDepth = texture(light.shadowMapTexture, projCoords.xy + vec2(x, y) * texelSize).r; 
-							shadow += currentDepth - bias > pcfDepth ? 0.5 : 0.0;        
-					}    
-			}
-			shadow /= 9.0;
-		}
-	}
+		shadow = cascadeShadow(fragPos);
 
 	//calculate omnidirectional shadows
 	for (int i = 0; i < nPointLights; i++)
 	{
     // get vector between fragment position and light position
-    vec3 fragToLight = FragPos - pointLights[i].pos;
+    vec3 fragToLight = fragPos - pointLights[i].pos;
 
     // now get current linear depth as the length between the fragment and light position
     float currentDepth = length(fragToLight);
 
-		if (currentDepth < pointLights[i].farPlane)
+		if (pointShadows[i].x >= 0 && currentDepth < pointLights[i].farPlane)
 		{
 			// use the light to fragment vector to sample from the depth map    
-			float closestDepth = texture(pointLights[i].shadowMapTexture, (fragToLight)).r;
+			float closestDepth = atlasDepth(pointShadows[i], fragToLight);
 			// it is currently in linear range between [0,1]. Re-transform back to original value
 			closestDepth *= pointLights[i].farPlane;
 			// now test for shadows
@@ -303,23 +395,28 @@ subroutine (shadowMap) float globalShadowMap(vec4 fragPosLightSpace, vec3 normal
 	return shadow;
 }
 
-subroutine uniform shadowMap shadowMapSelection;
-
 // ---------------------- opacity ------------------------
+#ifdef PERMUTATIONS
+#if defined(OPACITY_MASK)
+#define opacitySelection maskOpacity
+#else
+#define opacitySelection emptyOpacity
+#endif
+#else
 subroutine float getOpacity(vec2 uv);
+subroutine uniform getOpacity opacitySelection;
+#endif
 
-subroutine (getOpacity) float emptyOpacity(vec2 uv)
+SUBROUTINE(getOpacity) float emptyOpacity(vec2 uv)
 {
 	return 1.0;
 }
 
-subroutine (getOpacity) float maskOpacity(vec2 uv)
+SUBROUTINE(getOpacity) float maskOpacity(vec2 uv)
 {
-	return texture(inTexture.opacity, uv).r;
+	return texture(inTexture.opacity, opacityUV(uv)).r;
 }
 
-subroutine uniform getOpacity opacitySelection;
-
 // -----------------------------------------------------------
 
 Color CalcPointLight(Color baseColor, PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
@@ -374,8 +471,10 @@ void main()
 
 	float opacity = opacitySelection(TexCoords);
 
+#if !defined(PERMUTATIONS) || defined(OPACITY_MASK)
 	if (opacity < 0.03)
 	    discard;
+#endif
 
   vec3 norm = getNormalSelection(TexCoords);
 	vec3 viewDir = normalize(camPos - FragPos);
@@ -400,7 +499,7 @@ void main()
 
 	res.diffuse += vec4(reflectionMapSelection(TexCoords), 0.0); 
 
-	float shadow = shadowMapSelection(FragPosLightSpace, norm, dirLights[0]);
+	float shadow = shadowMapSelection(FragPos, norm, dirLights[0]);
 	//shadow = 0.0f;
 
 	fColor = vec4(vec3(res.ambient + (res.diffuse + res.specular) * (1.0 - shadow)), 1.0f);
@@ -1,21 +1,56 @@
 #version 400 core
+#ifdef MULTI_DRAW
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
 
 layout( location = 0 ) in vec4 vPosition;
+#ifdef COMPACT_VERTICES
+// octahedral normal, tangent with the bitangent sign in w, see SCompactVertex
+layout( location = 1 ) in vec2 vNormalOct;
+layout( location = 2 ) in vec2 vTexCoord;
+layout( location = 3 ) in vec4 vTangentSign;
+
+vec3 OctDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
+#else
 layout( location = 1 ) in vec3 vNormal;
 layout( location = 2 ) in vec2 vTexCoord;
 layout( location = 3 ) in vec3 vTangent;
 layout( location = 4 ) in vec3 vBitangent;
+#endif
 
+#ifdef MULTI_DRAW
+// per-draw data of the multi draw path, indexed by render queue item
+struct Draw
+{
+	mat4 model;
+	int materialIndex;
+};
+layout(std430) buffer Draws
+{
+	Draw draws[];
+};
+layout( location = 5 ) in uint vDrawId;
+flat out int MaterialIndex;
+#define model draws[vDrawId].model
+#elif defined(INSTANCED)
+layout( location = 6 ) in mat4 instanceModel;
+#define model instanceModel
+#else
 uniform mat4 model;
+#endif
 uniform mat4 view;
 uniform mat4 proj;
-uniform mat4 lightSpaceMatrix;
 uniform vec3 camPos;
 
 out vec3 Normal;
 out vec3 FragPos;
 out vec2 TexCoords;
-out vec4 FragPosLightSpace;
 out mat3 TBN;
 
 out vec3 TangentCamPos;
@@ -23,11 +58,18 @@ out vec3 TangentFragPos;
 
 void main()
 {
+#ifdef COMPACT_VERTICES
+	vec3 vNormal = OctDecode(vNormalOct);
+	vec3 vTangent = vTangentSign.xyz;
+	vec3 vBitangent = cross(vNormal, vTangent) * vTangentSign.w;
+#endif
+#ifdef MULTI_DRAW
+	MaterialIndex = draws[vDrawId].materialIndex;
+#endif
 	//Normal = normalize(vec3(model * vec4(vNormal, 0.0)));
 	Normal = vec3(model * vec4(vNormal, 0.0));
 	FragPos = vec3(model * vPosition);
 	TexCoords = vTexCoord;
-	FragPosLightSpace = lightSpaceMatrix * vec4(FragPos, 1.0);
 
   vec3 T = normalize(vec3(model * vec4(vTangent,   0.0)));
 	vec3 B = normalize(vec3(model * vec4(vBitangent, 0.0)));
@@ -1,6 +1,19 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
+#ifdef COMPACT_VERTICES
+// octahedral normal, see SCompactVertex
+layout (location = 1) in vec2 aNormalOct;
+
+vec3 OctDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+#else
 layout (location = 1) in vec3 aNormal;
+#endif
 
 out VS_OUT 
 {
@@ -13,6 +26,9 @@ uniform mat4 model;
 
 void main()
 {
+#ifdef COMPACT_VERTICES
+    vec3 aNormal = OctDecode(aNormalOct);
+#endif
     gl_Position = proj* view * model * vec4(aPos, 1.0); 
     mat3 normalMatrix = mat3(transpose(inverse(view * model)));
     vs_out.normal = normalize(vec3(proj* vec4(normalMatrix * aNormal, 0.0)));
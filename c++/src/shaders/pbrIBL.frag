@@ -15,6 +15,41 @@ uniform samplerCube irradianceMap;
 uniform samplerCube prefilterMap;
 uniform sampler2D brdfLUT;
 
+// lights
+struct PointLight
+{
+	vec3 pos;
+	float constant;
+	vec3 ambient;
+	float linear;
+	vec3 diffuse;
+	float quadratic;
+	vec3 specular;
+	float farPlane;
+};
+
+struct DirLight
+{
+	vec3 dir;
+	vec3 ambient;
+	vec3 diffuse;
+	vec3 specular;
+};
+
+#define NR_POINT_LIGHTS 32
+#define NR_DIR_LIGHTS 1
+
+// std140 layout is mirrored by SLightsBlockStd140 in light_system.h
+layout (std140) uniform Lights
+{
+	PointLight pointLights[NR_POINT_LIGHTS];
+	DirLight dirLights[NR_DIR_LIGHTS];
+	int nPointLights;
+	int nDirLights;
+	// shadow atlas tier and layer, tier -1 without shadow
+	ivec4 pointShadows[NR_POINT_LIGHTS];
+};
+
 uniform vec3 camPos;
 
 uniform mat4 rotfix;//messed up with corrdinate systems
@@ -27,7 +62,10 @@ const float PI = 3.14159265359;
 // technique somewhere later in the normal mapping tutorial.
 vec3 getNormalFromMap()
 {
-    vec3 tangentNormal = texture(normalMap, TexCoords).xyz * 2.0 - 1.0;
+    // z is rebuilt, compressed normal maps keep x and y only
+    vec3 tangentNormal;
+    tangentNormal.xy = texture(normalMap, TexCoords).xy * 2.0 - 1.0;
+    tangentNormal.z = sqrt(max(1.0 - dot(tangentNormal.xy, tangentNormal.xy), 0.0));
 
     vec3 Q1  = dFdx(WorldPos);
     vec3 Q2  = dFdy(WorldPos);
@@ -106,6 +144,28 @@ void main()
 
     // reflectance equation
     vec3 Lo = vec3(0.0);
+    for (int i = 0; i < nPointLights; i++)
+    {
+        // calculate per-light radiance
+        vec3 L = normalize(pointLights[i].pos - WorldPos);
+        vec3 H = normalize(V + L);
+        float distance = length(pointLights[i].pos - WorldPos);
+        float attenuation = 1.0 / (distance * distance);
+        vec3 radiance = pointLights[i].diffuse * attenuation;
+
+        // Cook-Torrance BRDF
+        float NDF = DistributionGGX(N, H, roughness);
+        float G   = GeometrySmith(N, V, L, roughness);
+        vec3 F    = fresnelSchlick(max(dot(H, V), 0.0), F0);
+
+        vec3 nominator    = NDF * G * F;
+        float denominator = 4 * max(dot(N, V), 0.0) * max(dot(N, L), 0.0) + 0.001;
+        vec3 specular = nominator / denominator;
+
+        vec3 kD = (vec3(1.0) - F) * (1.0 - metallic);
+        float NdotL = max(dot(N, L), 0.0);
+        Lo += (kD * albedo / PI + specular) * radiance * NdotL;
+    }
 
     vec3 kS = fresnelSchlick(max(dot(N, V), 0.0), F0);
     vec3 kD = 1.0 - kS;
@@ -17,22 +17,36 @@ uniform vec3 lightColors[4];
 struct PointLight
 {
 	vec3 pos;
-
-	vec3 ambient;
-	vec3 diffuse;
-	vec3 specular;
-
 	float constant;
+	vec3 ambient;
 	float linear;
+	vec3 diffuse;
 	float quadratic;
-	
-	samplerCube shadowMapTexture;
+	vec3 specular;
 	float farPlane;
 };
 
-#define NR_POINT_LIGHTS 2
-uniform PointLight pointLights[NR_POINT_LIGHTS];
-uniform int nPointLights;
+struct DirLight
+{
+	vec3 dir;
+	vec3 ambient;
+	vec3 diffuse;
+	vec3 specular;
+};
+
+#define NR_POINT_LIGHTS 32
+#define NR_DIR_LIGHTS 1
+
+// std140 layout is mirrored by SLightsBlockStd140 in light_system.h
+layout (std140) uniform Lights
+{
+	PointLight pointLights[NR_POINT_LIGHTS];
+	DirLight dirLights[NR_DIR_LIGHTS];
+	int nPointLights;
+	int nDirLights;
+	// shadow atlas tier and layer, tier -1 without shadow
+	ivec4 pointShadows[NR_POINT_LIGHTS];
+};
 
 uniform vec3 camPos;
 
@@ -44,7 +58,10 @@ const float PI = 3.14159265359;
 // technique somewhere later in the normal mapping tutorial.
 vec3 getNormalFromMap()
 {
-    vec3 tangentNormal = texture(normalMap, TexCoords).xyz * 2.0 - 1.0;
+    // z is rebuilt, compressed normal maps keep x and y only
+    vec3 tangentNormal;
+    tangentNormal.xy = texture(normalMap, TexCoords).xy * 2.0 - 1.0;
+    tangentNormal.z = sqrt(max(1.0 - dot(tangentNormal.xy, tangentNormal.xy), 0.0));
 
     vec3 Q1  = dFdx(WorldPos);
     vec3 Q2  = dFdy(WorldPos);
@@ -1,6 +1,19 @@
 #version 330 core
 layout (location = 0) in vec3 vPosition;
+#ifdef COMPACT_VERTICES
+// octahedral normal, see SCompactVertex
+layout (location = 1) in vec2 vNormalOct;
+
+vec3 OctDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+#else
 layout (location = 1) in vec3 vNormal;
+#endif
 layout (location = 2) in vec2 vTexCoord;
 
 out vec2 TexCoords;
@@ -13,6 +26,9 @@ uniform mat4 proj;
 
 void main()
 {
+#ifdef COMPACT_VERTICES
+    vec3 vNormal = OctDecode(vNormalOct);
+#endif
     TexCoords = vTexCoord;
     WorldPos = vec3(model * vec4(vPosition, 1.0));
     Normal = mat3(model) * vNormal;   
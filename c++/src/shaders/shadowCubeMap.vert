@@ -1,11 +1,43 @@
 #version 330 core
+#ifdef MULTI_DRAW
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
 layout (location = 0) in vec3 aPos;
 
+#ifdef MULTI_DRAW
+// per-draw data of the multi draw path, indexed by render queue item
+struct Draw
+{
+	mat4 model;
+	int materialIndex;
+};
+layout(std430) buffer Draws
+{
+	Draw draws[];
+};
+layout( location = 5 ) in uint vDrawId;
+#define model draws[vDrawId].model
+#elif defined(INSTANCED)
+layout( location = 6 ) in mat4 instanceModel;
+#define model instanceModel
+#else
 uniform mat4 model;
+#endif
+
+#ifdef SINGLE_FACE
+// one cube face a pass, no geometry shader
+uniform mat4 faceMatrix;
+out vec4 FragPos;
+#endif
 
 void main()
 {
+#ifdef SINGLE_FACE
+	FragPos = model * vec4(aPos, 1.0);
+	gl_Position = faceMatrix * FragPos;
+#else
 	gl_Position = model * vec4(aPos, 1.0); 
+#endif
 }
 
 
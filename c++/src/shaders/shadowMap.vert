@@ -1,7 +1,28 @@
 #version 330 core
+#ifdef MULTI_DRAW
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
 layout (location = 0) in vec3 aPos;
 
+#ifdef MULTI_DRAW
+// per-draw data of the multi draw path, indexed by render queue item
+struct Draw
+{
+	mat4 model;
+	int materialIndex;
+};
+layout(std430) buffer Draws
+{
+	Draw draws[];
+};
+layout( location = 5 ) in uint vDrawId;
+#define model draws[vDrawId].model
+#elif defined(INSTANCED)
+layout( location = 6 ) in mat4 instanceModel;
+#define model instanceModel
+#else
 uniform mat4 model;
+#endif
 uniform mat4 view;
 uniform mat4 proj;
 
@@ -0,0 +1,131 @@
+#include "shadow_atlas.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+static const int kTierCapacities[CShadowAtlas::kTiers] = {2, 6, 24};
+// a placed light keeps its tier until another one is this much more
+// important, compounded per tier between them
+static const float kHysteresis = 0.25f;
+
+int CShadowAtlas::TierCapacity(int tier) { return kTierCapacities[tier]; }
+
+int CShadowAtlas::Capacity() {
+  return std::accumulate(kTierCapacities, kTierCapacities + kTiers, 0);
+}
+
+void CShadowAtlas::Create() {
+  GLint oldFBO = 0;
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &oldFBO);
+
+  glGenTextures(kTiers, m_textures);
+  for (int t = 0; t < kTiers; ++t) {
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, m_textures[t]);
+    glTexStorage3D(GL_TEXTURE_CUBE_MAP_ARRAY, 1, GL_DEPTH_COMPONENT32F,
+                   TierSize(t), TierSize(t), 6 * kTierCapacities[t]);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER,
+                    GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER,
+                    GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S,
+                    GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T,
+                    GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_R,
+                    GL_CLAMP_TO_EDGE);
+  }
+  glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0);
+
+  glGenFramebuffers(1, &m_FBO);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_FBO);
+  glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_textures[0],
+                            0, 0);
+  glDrawBuffer(GL_NONE);
+  glReadBuffer(GL_NONE);
+  glBindFramebuffer(GL_FRAMEBUFFER, oldFBO);
+}
+
+void CShadowAtlas::Release() {
+  if (m_FBO) {
+    glDeleteTextures(kTiers, m_textures);
+    glDeleteFramebuffers(1, &m_FBO);
+  }
+  std::fill(m_textures, m_textures + kTiers, 0);
+  m_FBO = 0;
+}
+
+std::vector<size_t> CShadowAtlas::Assign(const std::vector<float>& importance,
+                                         std::vector<SShadowAtlasSlot>& slots) {
+  const size_t count = importance.size();
+  std::vector<float> score(importance);
+  for (size_t i = 0; i < count; ++i)
+    if (slots[i].tier >= 0)
+      score[i] *=
+          std::pow(1.0f + kHysteresis, float(kTiers - 1 - slots[i].tier));
+
+  std::vector<size_t> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&](size_t a, size_t b) { return score[a] > score[b]; });
+
+  // the most important lights fill the finest tier first
+  std::vector<int> wanted(count, -1);
+  int tier = 0;
+  int used = 0;
+  for (size_t i : order) {
+    while (tier < kTiers && used == kTierCapacities[tier]) {
+      ++tier;
+      used = 0;
+    }
+    if (tier == kTiers) break;
+    wanted[i] = tier;
+    ++used;
+  }
+
+  // lights staying in their tier keep their cube and its contents
+  std::vector<std::vector<bool>> taken(kTiers);
+  for (int t = 0; t < kTiers; ++t) taken[t].assign(kTierCapacities[t], false);
+  for (size_t i = 0; i < count; ++i)
+    if (wanted[i] >= 0 && wanted[i] == slots[i].tier)
+      taken[slots[i].tier][slots[i].layer] = true;
+
+  std::vector<size_t> moved;
+  for (size_t i = 0; i < count; ++i) {
+    if (wanted[i] == slots[i].tier) continue;
+    SShadowAtlasSlot slot;
+    slot.tier = wanted[i];
+    if (slot.tier >= 0) {
+      std::vector<bool>& free = taken[slot.tier];
+      slot.layer =
+          int(std::find(free.begin(), free.end(), false) - free.begin());
+      free[slot.layer] = true;
+    }
+    slots[i] = slot;
+    moved.push_back(i);
+  }
+  return moved;
+}
+
+void CShadowAtlas::BindFace(const SShadowAtlasSlot& slot, int face) const {
+  glBindFramebuffer(GL_FRAMEBUFFER, m_FBO);
+  glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                            m_textures[slot.tier], 0, 6 * slot.layer + face);
+  glViewport(0, 0, TierSize(slot.tier), TierSize(slot.tier));
+}
+
+void CShadowAtlas::BindLayered(const SShadowAtlasSlot& slot) const {
+  glBindFramebuffer(GL_FRAMEBUFFER, m_FBO);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                       m_textures[slot.tier], 0);
+  glViewport(0, 0, TierSize(slot.tier), TierSize(slot.tier));
+}
+
+size_t CShadowAtlas::Bytes() const {
+  if (!m_FBO) return 0;
+  size_t bytes = 0;
+  for (int t = 0; t < kTiers; ++t)
+    bytes += size_t(TierSize(t)) * TierSize(t) * 6 * kTierCapacities[t] *
+             sizeof(float);
+  return bytes;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <cstddef>
+#include <vector>
+
+// a cube of the atlas, tier -1 for a light left without shadow
+struct SShadowAtlasSlot {
+  int tier{-1};
+  int layer{-1};
+
+  bool operator!=(const SShadowAtlasSlot& o) const {
+    return tier != o.tier || layer != o.layer;
+  }
+};
+
+// Point light shadow cubes in a few GL_TEXTURE_CUBE_MAP_ARRAY tiers of
+// halving resolution and growing capacity. The memory is fixed at Create(),
+// lights compete for the cubes by importance instead of owning a texture
+// and a texture unit each.
+class CShadowAtlas {
+ public:
+  static const int kTiers = 3;
+
+  // cubes at 1024, 512 and 256 texels a side
+  static GLsizei TierSize(int tier) { return 1024 >> tier; }
+  static int TierCapacity(int tier);
+  static int Capacity();
+
+  void Create();
+  void Release();
+  bool IsCreated() const { return m_FBO != 0; }
+
+  // slots is parallel to importance and holds the current placements, which
+  // are kept unless another light is more important by the hysteresis.
+  // Returns the indices of the lights which moved.
+  static std::vector<size_t> Assign(const std::vector<float>& importance,
+                                    std::vector<SShadowAtlasSlot>& slots);
+
+  // binds the framebuffer with one face of the cube attached, or all the
+  // layers of its tier for a geometry shader picking gl_Layer
+  void BindFace(const SShadowAtlasSlot& slot, int face) const;
+  void BindLayered(const SShadowAtlasSlot& slot) const;
+
+  GLuint Texture(int tier) const { return m_textures[tier]; }
+  size_t Bytes() const;
+
+ private:
+  GLuint m_textures[kTiers]{};
+  GLuint m_FBO{0};
+};
@@ -0,0 +1,91 @@
+#include "texture_arrays.h"
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+struct STextureKind {
+  GLint format;
+  GLint width;
+  GLint height;
+  GLint levels;
+
+  bool operator<(const STextureKind& o) const {
+    return std::tie(format, width, height, levels) <
+           std::tie(o.format, o.width, o.height, o.levels);
+  }
+};
+
+static STextureKind QueryKind(GLuint texture) {
+  STextureKind kind;
+  glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+  glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_INTERNAL_FORMAT,
+                           &kind.format);
+  glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_WIDTH,
+                           &kind.width);
+  glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_HEIGHT,
+                           &kind.height);
+
+  // streamed textures carry a full chain, placeholders are 1x1
+  GLint maxLevel = 0;
+  glGetTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, &maxLevel);
+  GLint chain = 1;
+  while (std::max(kind.width, kind.height) >> chain) ++chain;
+  kind.levels = std::min(chain, maxLevel + 1);
+  return kind;
+}
+
+bool CTextureArrays::IsSupported() { return gl3wIsSupported(4, 3); }
+
+void CTextureArrays::Pack(const std::vector<GLuint>& textures,
+                          std::vector<STextureLayer>& out) {
+  GLint maxLayers = 0;
+  glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+
+  std::map<GLuint, size_t> first;
+  std::map<STextureKind, std::vector<size_t>> kinds;
+  out.assign(textures.size(), STextureLayer());
+  for (size_t i = 0; i < textures.size(); ++i)
+    if (first.emplace(textures[i], i).second)
+      kinds[QueryKind(textures[i])].push_back(i);
+
+  for (const auto& it : kinds) {
+    const STextureKind& kind = it.first;
+    const std::vector<size_t>& members = it.second;
+    // a kind with more textures than an array holds takes several arrays
+    for (size_t begin = 0; begin < members.size(); begin += maxLayers) {
+      const size_t count = std::min(members.size() - begin, size_t(maxLayers));
+      GLuint array = 0;
+      glGenTextures(1, &array);
+      glBindTexture(GL_TEXTURE_2D_ARRAY, array);
+      glTexStorage3D(GL_TEXTURE_2D_ARRAY, kind.levels, kind.format, kind.width,
+                     kind.height, GLsizei(count));
+      glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+      glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+      glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+                      kind.levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      m_arrays.push_back(array);
+
+      for (size_t l = 0; l < count; ++l) {
+        const size_t i = members[begin + l];
+        for (GLint level = 0; level < kind.levels; ++level)
+          glCopyImageSubData(textures[i], GL_TEXTURE_2D_ARRAY, level, 0, 0, 0,
+                             array, GL_TEXTURE_2D_ARRAY, level, 0, 0, GLint(l),
+                             std::max(1, kind.width >> level),
+                             std::max(1, kind.height >> level), 1);
+        out[i] = {array, int(l)};
+      }
+    }
+  }
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+  for (size_t i = 0; i < textures.size(); ++i)
+    out[i] = out[first[textures[i]]];
+}
+
+void CTextureArrays::Release() {
+  if (!m_arrays.empty())
+    glDeleteTextures(GLsizei(m_arrays.size()), m_arrays.data());
+  m_arrays.clear();
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <vector>
+
+// a texture as one layer of an array texture
+struct STextureLayer {
+  GLuint array{0};
+  int layer{0};
+};
+
+// Pools of GL_TEXTURE_2D_ARRAY, one per size, format and mip count. Single
+// layer array textures are copied into the pool of their kind, so draws
+// switching between them need no rebinding, only another layer index.
+class CTextureArrays {
+ public:
+  // needs glCopyImageSubData
+  static bool IsSupported();
+
+  // out is parallel to textures, a texture listed twice gets one layer. The
+  // sources are left alone.
+  void Pack(const std::vector<GLuint>& textures,
+            std::vector<STextureLayer>& out);
+  void Release();
+
+  size_t Count() const { return m_arrays.size(); }
+
+ private:
+  std::vector<GLuint> m_arrays;
+};
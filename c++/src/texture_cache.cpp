@@ -0,0 +1,163 @@
+#include "texture_cache.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+// bumped when the encoder output changes
+static const uint32_t kTextureCacheVersion = 1;
+
+static const uint8_t kKTXIdentifier[12] = {0xAB, 'K',  'T',  'X', ' ',  '1',
+                                           '1',  0xBB, '\r', '\n', 0x1A, '\n'};
+
+// the 13 words following the identifier
+struct SKTXHeader {
+  uint32_t endianness;
+  uint32_t glType;
+  uint32_t glTypeSize;
+  uint32_t glFormat;
+  uint32_t glInternalFormat;
+  uint32_t glBaseInternalFormat;
+  uint32_t pixelWidth;
+  uint32_t pixelHeight;
+  uint32_t pixelDepth;
+  uint32_t numberOfArrayElements;
+  uint32_t numberOfFaces;
+  uint32_t numberOfMipmapLevels;
+  uint32_t bytesOfKeyValueData;
+};
+
+static_assert(sizeof(SKTXHeader) == 52, "KTX header layout mismatch");
+
+static GLenum BaseFormat(GLenum format) {
+  switch (format) {
+    case kCompressedRGBBC1:
+      return GL_RGB;
+    case kCompressedRGBABC3:
+      return GL_RGBA;
+    case GL_COMPRESSED_RG_RGTC2:
+      return GL_RG;
+    default:
+      return 0;
+  }
+}
+
+static std::string Path(uint64_t key) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.ktx", (unsigned long long)key);
+  return CTextureCache::Directory() + name;
+}
+
+std::string& CTextureCache::Directory() {
+  static std::string dir = "texture_cache";
+  return dir;
+}
+
+bool CTextureCache::Enabled() {
+  static const bool supported = []() {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; ++i)
+      if (!strcmp((const char*)glGetStringi(GL_EXTENSIONS, i),
+                  "GL_EXT_texture_compression_s3tc"))
+        return true;
+    return false;
+  }();
+  return supported && !Directory().empty();
+}
+
+uint64_t CTextureCache::Key(const std::vector<uint8_t>& source,
+                            ETextureCodec codec) {
+  uint64_t hash = 14695981039346656037ull;
+  auto mix = [&hash](const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; ++i)
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+  };
+  mix(&kTextureCacheVersion, sizeof(kTextureCacheVersion));
+  mix(&codec, sizeof(codec));
+  mix(source.data(), source.size());
+  return hash;
+}
+
+bool CTextureCache::Load(uint64_t key, SCompressedTexture& out) {
+  FILE* f = fopen(Path(key).c_str(), "rb");
+  if (!f) return false;
+
+  uint8_t identifier[sizeof(kKTXIdentifier)];
+  SKTXHeader header;
+  bool read = fread(identifier, sizeof(identifier), 1, f) == 1 &&
+              fread(&header, sizeof(header), 1, f) == 1 &&
+              !memcmp(identifier, kKTXIdentifier, sizeof(identifier)) &&
+              header.endianness == 0x04030201 &&
+              BaseFormat(header.glInternalFormat) &&
+              header.numberOfMipmapLevels && !header.bytesOfKeyValueData;
+
+  if (read) {
+    out.format = header.glInternalFormat;
+    out.width = int(header.pixelWidth);
+    out.height = int(header.pixelHeight);
+    out.levels.clear();
+    out.data.clear();
+    for (uint32_t l = 0; l < header.numberOfMipmapLevels && read; ++l) {
+      const int w = std::max(1, out.width >> l);
+      const int h = std::max(1, out.height >> l);
+      uint32_t size = 0;
+      read = fread(&size, sizeof(size), 1, f) == 1 &&
+             size == CompressedLevelSize(out.format, w, h);
+      if (!read) break;
+
+      // block sizes are multiples of 8, levels need no padding
+      const size_t offset = out.data.size();
+      out.data.resize(offset + size);
+      read = fread(out.data.data() + offset, 1, size, f) == size;
+      out.levels.push_back({offset, size});
+    }
+  }
+  fclose(f);
+  return read;
+}
+
+void CTextureCache::Store(uint64_t key, const SCompressedTexture& texture) {
+  mkdir(Directory().c_str(), 0755);
+  // written aside and renamed, a worker never sees a partial file
+  const std::string path = Path(key);
+  const std::string tmpPath = path + ".tmp";
+  FILE* f = fopen(tmpPath.c_str(), "wb");
+  if (!f) {
+    std::cout << "ERROR: can't write texture cache to " << Directory()
+              << std::endl;
+    return;
+  }
+
+  SKTXHeader header = {};
+  header.endianness = 0x04030201;
+  header.glTypeSize = 1;
+  header.glInternalFormat = texture.format;
+  header.glBaseInternalFormat = BaseFormat(texture.format);
+  header.pixelWidth = uint32_t(texture.width);
+  header.pixelHeight = uint32_t(texture.height);
+  header.numberOfFaces = 1;
+  header.numberOfMipmapLevels = uint32_t(texture.levels.size());
+  fwrite(kKTXIdentifier, sizeof(kKTXIdentifier), 1, f);
+  fwrite(&header, sizeof(header), 1, f);
+  for (const SCompressedTexture::SLevel& level : texture.levels) {
+    const uint32_t size = uint32_t(level.size);
+    fwrite(&size, sizeof(size), 1, f);
+    fwrite(texture.data.data() + level.offset, 1, level.size, f);
+  }
+
+  // a file with a failed write is dropped instead of renamed into place
+  bool written = !ferror(f);
+  written = fclose(f) == 0 && written;
+  if (!written) {
+    std::cout << "ERROR: failed writing texture cache " << tmpPath
+              << std::endl;
+    remove(tmpPath.c_str());
+    return;
+  }
+  rename(tmpPath.c_str(), path.c_str());
+}
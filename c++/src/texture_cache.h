@@ -0,0 +1,26 @@
+#pragma once
+
+#include "texture_compression.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Block compressed textures on disk as KTX 1.1 files, one per source image
+// and codec. The name is a hash of the source file, an edited image misses
+// and is compressed again.
+class CTextureCache {
+ public:
+  // where files go, empty disables the cache
+  static std::string& Directory();
+
+  // queries the GL, call it from the render thread
+  static bool Enabled();
+
+  // FNV-1a of the source bytes and the codec
+  static uint64_t Key(const std::vector<uint8_t>& source, ETextureCodec codec);
+
+  // false if there is no valid file
+  static bool Load(uint64_t key, SCompressedTexture& out);
+  static void Store(uint64_t key, const SCompressedTexture& texture);
+};
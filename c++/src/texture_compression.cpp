@@ -0,0 +1,222 @@
+#include "texture_compression.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+static size_t BlockBytes(GLenum format) {
+  return format == kCompressedRGBBC1 ? 8 : 16;
+}
+
+size_t CompressedLevelSize(GLenum format, int width, int height) {
+  return size_t((width + 3) / 4) * ((height + 3) / 4) * BlockBytes(format);
+}
+
+// 4x4 texels at x, y, the edge texels repeat past the image border
+static void FetchBlock(const uint8_t* rgba, int width, int height, int x,
+                       int y, uint8_t block[16][4]) {
+  for (int j = 0; j < 4; ++j)
+    for (int i = 0; i < 4; ++i) {
+      const int sx = std::min(x + i, width - 1);
+      const int sy = std::min(y + j, height - 1);
+      memcpy(block[j * 4 + i], rgba + (size_t(sy) * width + sx) * 4, 4);
+    }
+}
+
+static uint16_t To565(const float color[3]) {
+  auto quantize = [](float c, int max) {
+    return std::min(max, std::max(0, int(c * max / 255.0f + 0.5f)));
+  };
+  return uint16_t((quantize(color[0], 31) << 11) |
+                  (quantize(color[1], 63) << 5) | quantize(color[2], 31));
+}
+
+static void From565(uint16_t c, float out[3]) {
+  const int r = (c >> 11) & 31;
+  const int g = (c >> 5) & 63;
+  const int b = c & 31;
+  out[0] = float((r << 3) | (r >> 2));
+  out[1] = float((g << 2) | (g >> 4));
+  out[2] = float((b << 3) | (b >> 2));
+}
+
+static void EncodeBC1(const uint8_t block[16][4], uint8_t* out) {
+  float mean[3] = {0.0f, 0.0f, 0.0f};
+  for (int t = 0; t < 16; ++t)
+    for (int c = 0; c < 3; ++c) mean[c] += block[t][c] / 16.0f;
+
+  // xx, xy, xz, yy, yz, zz
+  float cov[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+  for (int t = 0; t < 16; ++t) {
+    const float d[3] = {block[t][0] - mean[0], block[t][1] - mean[1],
+                        block[t][2] - mean[2]};
+    cov[0] += d[0] * d[0];
+    cov[1] += d[0] * d[1];
+    cov[2] += d[0] * d[2];
+    cov[3] += d[1] * d[1];
+    cov[4] += d[1] * d[2];
+    cov[5] += d[2] * d[2];
+  }
+
+  // power iteration for the principal axis
+  float axis[3] = {1.0f, 1.0f, 1.0f};
+  for (int i = 0; i < 8; ++i) {
+    const float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+    const float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+    const float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+    const float len =
+        std::max(std::fabs(x), std::max(std::fabs(y), std::fabs(z)));
+    if (len < 1e-6f) break;
+    axis[0] = x / len;
+    axis[1] = y / len;
+    axis[2] = z / len;
+  }
+  const float axisLen2 =
+      axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+  float lo = FLT_MAX, hi = -FLT_MAX;
+  for (int t = 0; t < 16; ++t) {
+    const float p = ((block[t][0] - mean[0]) * axis[0] +
+                     (block[t][1] - mean[1]) * axis[1] +
+                     (block[t][2] - mean[2]) * axis[2]) /
+                    axisLen2;
+    lo = std::min(lo, p);
+    hi = std::max(hi, p);
+  }
+
+  float end0[3], end1[3];
+  for (int c = 0; c < 3; ++c) {
+    end0[c] = mean[c] + axis[c] * hi;
+    end1[c] = mean[c] + axis[c] * lo;
+  }
+  uint16_t c0 = To565(end0);
+  uint16_t c1 = To565(end1);
+  // c0 > c1 selects the four color mode
+  if (c0 < c1) std::swap(c0, c1);
+
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    float palette[4][3];
+    From565(c0, palette[0]);
+    From565(c1, palette[1]);
+    for (int c = 0; c < 3; ++c) {
+      palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+      palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+    }
+    for (int t = 0; t < 16; ++t) {
+      uint32_t best = 0;
+      float bestDist = FLT_MAX;
+      for (uint32_t p = 0; p < 4; ++p) {
+        float dist = 0.0f;
+        for (int c = 0; c < 3; ++c) {
+          const float d = block[t][c] - palette[p][c];
+          dist += d * d;
+        }
+        if (dist < bestDist) {
+          bestDist = dist;
+          best = p;
+        }
+      }
+      indices |= best << (2 * t);
+    }
+  }
+
+  out[0] = uint8_t(c0);
+  out[1] = uint8_t(c0 >> 8);
+  out[2] = uint8_t(c1);
+  out[3] = uint8_t(c1 >> 8);
+  for (int i = 0; i < 4; ++i) out[4 + i] = uint8_t(indices >> (8 * i));
+}
+
+// one channel in the eight value mode, max and min as endpoints
+static void EncodeBC4(const uint8_t block[16][4], int channel, uint8_t* out) {
+  uint8_t lo = 255, hi = 0;
+  for (int t = 0; t < 16; ++t) {
+    lo = std::min(lo, block[t][channel]);
+    hi = std::max(hi, block[t][channel]);
+  }
+  out[0] = hi;
+  out[1] = lo;
+
+  uint64_t indices = 0;
+  if (hi > lo) {
+    for (int t = 0; t < 16; ++t) {
+      // steps from hi to lo, the palette keeps the endpoints in front
+      const int step = int((hi - block[t][channel]) * 7.0f / (hi - lo) + 0.5f);
+      const uint64_t index = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+      indices |= index << (3 * t);
+    }
+  }
+  for (int i = 0; i < 6; ++i) out[2 + i] = uint8_t(indices >> (8 * i));
+}
+
+// 2x2 box filter, an odd last row or column is dropped
+static std::vector<uint8_t> Downsample(const std::vector<uint8_t>& src,
+                                       int& width, int& height) {
+  const int w = std::max(1, width / 2);
+  const int h = std::max(1, height / 2);
+  std::vector<uint8_t> dst(size_t(w) * h * 4);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x) {
+      const int x0 = std::min(2 * x, width - 1);
+      const int x1 = std::min(2 * x + 1, width - 1);
+      const int y0 = std::min(2 * y, height - 1);
+      const int y1 = std::min(2 * y + 1, height - 1);
+      for (int c = 0; c < 4; ++c) {
+        const int sum = src[(size_t(y0) * width + x0) * 4 + c] +
+                        src[(size_t(y0) * width + x1) * 4 + c] +
+                        src[(size_t(y1) * width + x0) * 4 + c] +
+                        src[(size_t(y1) * width + x1) * 4 + c];
+        dst[(size_t(y) * w + x) * 4 + c] = uint8_t((sum + 2) / 4);
+      }
+    }
+  width = w;
+  height = h;
+  return dst;
+}
+
+void CompressTexture(const uint8_t* rgba, int width, int height,
+                     ETextureCodec codec, SCompressedTexture& out) {
+  const size_t texels = size_t(width) * height;
+  bool alpha = false;
+  if (codec == kTextureCodecColor)
+    for (size_t i = 0; i < texels && !alpha; ++i)
+      alpha = rgba[i * 4 + 3] != 255;
+
+  out.format = codec == kTextureCodecNormal
+                   ? GL_COMPRESSED_RG_RGTC2
+                   : alpha ? kCompressedRGBABC3 : kCompressedRGBBC1;
+  out.width = width;
+  out.height = height;
+  out.levels.clear();
+  out.data.clear();
+
+  std::vector<uint8_t> level(rgba, rgba + texels * 4);
+  int w = width, h = height;
+  for (;;) {
+    const size_t offset = out.data.size();
+    const size_t size = CompressedLevelSize(out.format, w, h);
+    out.data.resize(offset + size);
+    out.levels.push_back({offset, size});
+
+    uint8_t* dst = out.data.data() + offset;
+    uint8_t block[16][4];
+    for (int y = 0; y < h; y += 4)
+      for (int x = 0; x < w; x += 4, dst += BlockBytes(out.format)) {
+        FetchBlock(level.data(), w, h, x, y, block);
+        if (out.format == kCompressedRGBBC1) {
+          EncodeBC1(block, dst);
+        } else if (out.format == kCompressedRGBABC3) {
+          EncodeBC4(block, 3, dst);
+          EncodeBC1(block, dst + 8);
+        } else {
+          EncodeBC4(block, 0, dst);
+          EncodeBC4(block, 1, dst + 8);
+        }
+      }
+
+    if (w == 1 && h == 1) break;
+    level = Downsample(level, w, h);
+  }
+}
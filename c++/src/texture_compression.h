@@ -0,0 +1,39 @@
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <cstdint>
+#include <vector>
+
+// S3TC formats of EXT_texture_compression_s3tc, not in the core headers. BC5
+// is core as GL_COMPRESSED_RG_RGTC2.
+constexpr const GLenum kCompressedRGBBC1 = 0x83F0;
+constexpr const GLenum kCompressedRGBABC3 = 0x83F3;
+
+// how a texture is block compressed
+enum ETextureCodec {
+  kTextureCodecColor,   // BC1, BC3 when some texel is not opaque
+  kTextureCodecNormal,  // BC5 of x and y, z is rebuilt in the shaders
+};
+
+// a block compressed texture with its full mip chain, levels back to back
+struct SCompressedTexture {
+  struct SLevel {
+    size_t offset;
+    size_t size;
+  };
+
+  GLenum format{0};
+  int width{0};
+  int height{0};
+  std::vector<SLevel> levels;
+  std::vector<uint8_t> data;
+};
+
+size_t CompressedLevelSize(GLenum format, int width, int height);
+
+// Box filters an RGBA8 image down to 1x1 and compresses every level. The
+// block endpoints are the extremes along the principal axis of the block
+// colors (BC1) or the channel range (BC3 alpha, BC5).
+void CompressTexture(const uint8_t* rgba, int width, int height,
+                     ETextureCodec codec, SCompressedTexture& out);
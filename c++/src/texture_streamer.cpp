@@ -0,0 +1,297 @@
+#include "texture_streamer.h"
+#include "texture_cache.h"
+
+#include "stb_image.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+static GLenum ComponentsFormat(int components) {
+  switch (components) {
+    case 1:
+      return GL_RED;
+    case 2:
+      return GL_RG;
+    case 3:
+      return GL_RGB;
+    default:
+      return GL_RGBA;
+  }
+}
+
+// sized, so the textures can be copied into immutable arrays
+static GLint ComponentsInternalFormat(int components) {
+  switch (components) {
+    case 1:
+      return GL_R8;
+    case 2:
+      return GL_RG8;
+    case 3:
+      return GL_RGB8;
+    default:
+      return GL_RGBA8;
+  }
+}
+
+// level of a 2D texture or of a single layer array
+static void TexImage(GLenum target, GLint level, GLint internalFormat,
+                     GLsizei width, GLsizei height, GLenum format,
+                     const void* pixels) {
+  if (target == GL_TEXTURE_2D_ARRAY)
+    glTexImage3D(target, level, internalFormat, width, height, 1, 0, format,
+                 GL_UNSIGNED_BYTE, pixels);
+  else
+    glTexImage2D(target, level, internalFormat, width, height, 0, format,
+                 GL_UNSIGNED_BYTE, pixels);
+}
+
+static void CompressedTexImage(GLenum target, GLint level, GLenum format,
+                               GLsizei width, GLsizei height, GLsizei size,
+                               const void* data) {
+  if (target == GL_TEXTURE_2D_ARRAY)
+    glCompressedTexImage3D(target, level, format, width, height, 1, 0, size,
+                           data);
+  else
+    glCompressedTexImage2D(target, level, format, width, height, 0, size,
+                           data);
+}
+
+static bool ReadFile(const std::string& path, std::vector<uint8_t>& out) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+  fseek(f, 0, SEEK_END);
+  const long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  out.resize(size > 0 ? size : 0);
+  const bool read = size > 0 && fread(out.data(), 1, size, f) == (size_t)size;
+  fclose(f);
+  return read;
+}
+
+size_t CTextureStreamer::SDecoded::UploadBytes() const {
+  if (compressed.format) return compressed.data.size();
+  return size_t(width) * height * components;
+}
+
+size_t CTextureStreamer::SDecoded::ResidentBytes() const {
+  if (compressed.format) return compressed.data.size();
+  return UploadBytes() * 4 / 3;
+}
+
+void CTextureStreamer::Init() {
+  // stb_image keeps the flip flag in a global which every decode reads. It
+  // is written here once, before any worker runs, and never again: all
+  // loaders of the renderer flip.
+  stbi_set_flip_vertically_on_load(true);
+
+  m_stop = false;
+  m_useCache = CTextureCache::Enabled();
+  const unsigned int hardware = std::thread::hardware_concurrency();
+  const unsigned int workers =
+      std::min(4u, std::max(1u, hardware > 1 ? hardware - 1 : 1u));
+  for (unsigned int i = 0; i < workers; ++i)
+    m_workers.emplace_back(&CTextureStreamer::Work, this);
+
+  for (SUploadBuffer& slot : m_ring) glGenBuffers(1, &slot.buffer);
+}
+
+void CTextureStreamer::Release() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (std::thread& worker : m_workers) worker.join();
+  m_workers.clear();
+
+  m_requests.clear();
+  for (SDecoded& image : m_decoded) stbi_image_free(image.data);
+  m_decoded.clear();
+  m_pending = 0;
+
+  for (SUploadBuffer& slot : m_ring) {
+    if (slot.fence) glDeleteSync(slot.fence);
+    if (slot.buffer) glDeleteBuffers(1, &slot.buffer);
+    slot = SUploadBuffer();
+  }
+}
+
+GLuint CTextureStreamer::Request(const std::string& path,
+                                 const TTexel& placeholder,
+                                 ETextureCodec codec, GLenum target) {
+  GLuint texture = 0;
+  glGenTextures(1, &texture);
+  glBindTexture(target, texture);
+  TexImage(target, 0, GL_RGBA8, 1, 1, GL_RGBA, placeholder.data());
+  glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  // complete with the single level until the file replaces it
+  glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, 0);
+  glBindTexture(target, 0);
+
+  if (!m_pending) {
+    m_firstRequest = std::chrono::steady_clock::now();
+    m_streamedCount = m_cachedCount = m_residentBytes = 0;
+    m_decodeMs = 0.0f;
+  }
+  ++m_pending;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_requests.push_back({texture, target, path, codec});
+  }
+  m_wake.notify_one();
+  return texture;
+}
+
+void CTextureStreamer::Work() {
+  for (;;) {
+    SRequest request;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [this] { return m_stop || !m_requests.empty(); });
+      if (m_stop) return;
+      request = std::move(m_requests.front());
+      m_requests.pop_front();
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    SDecoded image;
+    image.texture = request.texture;
+    image.target = request.target;
+    image.path = request.path;
+    Decode(request, image);
+    image.decodeMs = std::chrono::duration<float, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_decoded.push_back(std::move(image));
+  }
+}
+
+void CTextureStreamer::Decode(const SRequest& request, SDecoded& image) const {
+  std::vector<uint8_t> source;
+  if (!ReadFile(request.path, source)) return;
+
+  uint64_t key = 0;
+  if (m_useCache) {
+    key = CTextureCache::Key(source, request.codec);
+    if (CTextureCache::Load(key, image.compressed)) {
+      image.cached = true;
+      return;
+    }
+  }
+
+  // blocks are compressed from RGBA, the plain path keeps the file channels
+  image.data = stbi_load_from_memory(source.data(), int(source.size()),
+                                     &image.width, &image.height,
+                                     &image.components, m_useCache ? 4 : 0);
+  if (!image.data || !m_useCache) return;
+
+  CompressTexture(image.data, image.width, image.height, request.codec,
+                  image.compressed);
+  CTextureCache::Store(key, image.compressed);
+  stbi_image_free(image.data);
+  image.data = nullptr;
+}
+
+void CTextureStreamer::Update(size_t budgetBytes) {
+  m_uploadedBytes = 0;
+  while (m_pending) {
+    SDecoded image;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_decoded.empty()) break;
+      image = std::move(m_decoded.front());
+      m_decoded.pop_front();
+    }
+
+    const size_t bytes = image.UploadBytes();
+    const bool overBudget =
+        m_uploadedBytes && m_uploadedBytes + bytes > budgetBytes;
+    if (overBudget || (!image.Failed() && !Upload(image))) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_decoded.push_front(std::move(image));
+      break;
+    }
+
+    m_decodeMs += image.decodeMs;
+    if (image.Failed()) {
+      std::cout << "Texture failed to load at path: " << image.path
+                << std::endl;
+    } else {
+      stbi_image_free(image.data);
+      m_uploadedBytes += bytes;
+      m_residentBytes += image.ResidentBytes();
+      ++m_streamedCount;
+      if (image.cached) ++m_cachedCount;
+    }
+
+    if (!--m_pending) {
+      const float ms = std::chrono::duration<float, std::milli>(
+                           std::chrono::steady_clock::now() - m_firstRequest)
+                           .count();
+      std::cout << "Textures: " << m_streamedCount << " streamed in " << ms
+                << " ms, " << m_cachedCount << " from cache, decode "
+                << m_decodeMs << " ms, resident "
+                << m_residentBytes / (1024 * 1024) << " MB" << std::endl;
+    }
+  }
+}
+
+bool CTextureStreamer::Upload(const SDecoded& image) {
+  SUploadBuffer& slot = m_ring[m_ringNext];
+  if (slot.fence) {
+    if (glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED) return false;
+    glDeleteSync(slot.fence);
+    slot.fence = nullptr;
+  }
+
+  const size_t bytes = image.UploadBytes();
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+  if (slot.capacity < bytes) {
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+    slot.capacity = bytes;
+  }
+  void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+                               GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  memcpy(dst,
+         image.compressed.format ? image.compressed.data.data() : image.data,
+         bytes);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+  const GLenum target = image.target;
+  glBindTexture(target, image.texture);
+  if (image.compressed.format) {
+    // the mip chain comes filtered from the cache
+    const SCompressedTexture& texture = image.compressed;
+    for (size_t l = 0; l < texture.levels.size(); ++l)
+      CompressedTexImage(target, GLint(l), texture.format,
+                         std::max(1, texture.width >> l),
+                         std::max(1, texture.height >> l),
+                         GLsizei(texture.levels[l].size),
+                         (void*)texture.levels[l].offset);
+    glTexParameteri(target, GL_TEXTURE_MAX_LEVEL,
+                    GLint(texture.levels.size()) - 1);
+  } else {
+    // rows of 1 and 3 component images are tightly packed
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    TexImage(target, 0, ComponentsInternalFormat(image.components),
+             image.width, image.height, ComponentsFormat(image.components),
+             nullptr);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    // back to the default, the whole chain
+    glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, 1000);
+    glGenerateMipmap(target);
+  }
+  glBindTexture(target, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  m_ringNext = (m_ringNext + 1) % kTextureUploadBuffersCount;
+  return true;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "texture_compression.h"
+
+#include <GL/gl3w.h>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 1x1 RGBA content a streamed texture holds until its file is resident
+using TTexel = std::array<GLubyte, 4>;
+
+// pixel unpack buffers uploads rotate through
+constexpr const int kTextureUploadBuffersCount = 3;
+
+// Loads 2D textures off the render thread.
+// - Request() hands out the texture name at once, filled with a placeholder
+// - a worker pool decodes the files with stb_image, or restores them block
+//   compressed with their mip chains from CTextureCache and fills it on a
+//   miss
+// - Update() copies decoded images into a ring of pixel unpack buffers and
+//   respecifies the textures from them, within a byte budget per frame. A
+//   buffer is reused once the fence of its last copy has signaled.
+// Texture names never change, so whoever holds one keeps it. A texture is
+// GL_TEXTURE_2D or a single layer GL_TEXTURE_2D_ARRAY, as requested.
+class CTextureStreamer {
+ public:
+  // the cache is used when CTextureCache::Enabled()
+  void Init();
+  // joins the workers, the textures stay alive
+  void Release();
+
+  GLuint Request(const std::string& path, const TTexel& placeholder,
+                 ETextureCodec codec, GLenum target = GL_TEXTURE_2D);
+  // render thread, once a frame. An image larger than the budget still goes
+  // alone in a frame of its own.
+  void Update(size_t budgetBytes);
+
+  // requested textures not resident yet
+  size_t Pending() const { return m_pending; }
+  size_t UploadedBytes() const { return m_uploadedBytes; }
+
+ private:
+  struct SRequest {
+    GLuint texture;
+    GLenum target;
+    std::string path;
+    ETextureCodec codec;
+  };
+
+  struct SDecoded {
+    GLuint texture{0};
+    GLenum target{GL_TEXTURE_2D};
+    std::string path;
+    int width{0};
+    int height{0};
+    int components{0};
+    unsigned char* data{nullptr};  // plain path only
+    SCompressedTexture compressed;  // cache path only
+    bool cached{false};
+    float decodeMs{0.0f};
+
+    bool Failed() const { return !data && !compressed.format; }
+    size_t UploadBytes() const;
+    // the mip chain included
+    size_t ResidentBytes() const;
+  };
+
+  struct SUploadBuffer {
+    GLuint buffer{0};
+    size_t capacity{0};
+    GLsync fence{nullptr};  // last copy out of the buffer
+  };
+
+  void Work();
+  void Decode(const SRequest& request, SDecoded& image) const;
+  // false when the next buffer of the ring is still read by the GPU
+  bool Upload(const SDecoded& image);
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::deque<SRequest> m_requests;
+  std::deque<SDecoded> m_decoded;
+  bool m_stop{false};
+  bool m_useCache{false};
+
+  std::array<SUploadBuffer, kTextureUploadBuffersCount> m_ring;
+  int m_ringNext{0};
+
+  size_t m_pending{0};
+  size_t m_uploadedBytes{0};
+  size_t m_streamedCount{0};
+  size_t m_cachedCount{0};
+  size_t m_residentBytes{0};
+  float m_decodeMs{0.0f};
+  std::chrono::steady_clock::time_point m_firstRequest;
+};
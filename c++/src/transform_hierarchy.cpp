@@ -0,0 +1,66 @@
+#include "transform_hierarchy.h"
+#include "misc.h"
+
+#include <assimp/scene.h>
+
+#include <cstring>
+
+void CTransformHierarchy::Build(const aiScene& scene) {
+  Clear();
+
+  // breadth first, so every parent precedes its children
+  m_nodes.push_back(scene.mRootNode);
+  m_parents.push_back(-1);
+  for (size_t i = 0; i < m_nodes.size(); ++i) {
+    const aiNode* nd = m_nodes[i];
+    for (unsigned int c = 0; c < nd->mNumChildren; ++c) {
+      m_nodes.push_back(nd->mChildren[c]);
+      m_parents.push_back(i);
+    }
+  }
+
+  const size_t n = m_nodes.size();
+  m_local.resize(n);
+  m_world.resize(n);
+  m_dirty.assign(n, 1);
+  m_changed.assign(n, 0);
+  for (size_t i = 0; i < n; ++i)
+    m_local[i] = aiMatrix4x4ToGlm(&m_nodes[i]->mTransformation);
+
+  Update();
+}
+
+void CTransformHierarchy::Clear() {
+  m_nodes.clear();
+  m_parents.clear();
+  m_local.clear();
+  m_world.clear();
+  m_dirty.clear();
+  m_changed.clear();
+}
+
+bool CTransformHierarchy::Update() {
+  bool any = false;
+  for (size_t i = 0; i < m_nodes.size(); ++i) {
+    const int parent = m_parents[i];
+    const bool changed = m_dirty[i] || (parent >= 0 && m_changed[parent]);
+    m_changed[i] = changed;
+    if (!changed) continue;
+
+    m_world[i] = parent >= 0 ? m_world[parent] * m_local[i] : m_local[i];
+    m_dirty[i] = 0;
+    any = true;
+  }
+  return any;
+}
+
+void CTransformHierarchy::SetLocal(size_t i, const glm::mat4& local) {
+  m_local[i] = local;
+  m_dirty[i] = 1;
+}
+
+int CTransformHierarchy::Find(const char* name) const {
+  for (size_t i = 0; i < m_nodes.size(); ++i)
+    if (!strcmp(m_nodes[i]->mName.C_Str(), name)) return (int)i;
+  return -1;
+}
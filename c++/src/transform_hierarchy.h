@@ -0,0 +1,41 @@
+#pragma once
+
+#include <glm/mat4x4.hpp>
+
+#include <cstdint>
+#include <vector>
+
+struct aiNode;
+struct aiScene;
+
+// The aiNode tree flattened parent-before-child. World matrices are cached
+// and only recomputed below nodes whose local matrix changed.
+class CTransformHierarchy {
+ public:
+  void Build(const aiScene& scene);
+  void Clear();
+
+  // propagates dirty locals to world matrices, returns false if nothing
+  // changed. Changed() stays valid until the next Update().
+  bool Update();
+
+  size_t Count() const { return m_nodes.size(); }
+  const aiNode* Node(size_t i) const { return m_nodes[i]; }
+  int Parent(size_t i) const { return m_parents[i]; }
+  const glm::mat4& Local(size_t i) const { return m_local[i]; }
+  const glm::mat4& World(size_t i) const { return m_world[i]; }
+  bool Changed(size_t i) const { return m_changed[i]; }
+
+  void SetLocal(size_t i, const glm::mat4& local);
+
+  // returns -1 if there is no node with this name
+  int Find(const char* name) const;
+
+ private:
+  std::vector<const aiNode*> m_nodes;
+  std::vector<int> m_parents;  // -1 for the root
+  std::vector<glm::mat4> m_local;
+  std::vector<glm::mat4> m_world;
+  std::vector<uint8_t> m_dirty;    // local changed since the last Update()
+  std::vector<uint8_t> m_changed;  // world changed by the last Update()
+};